@@ -0,0 +1,136 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_BLOCK_HASH_MANAGER_H_
+#define OCTOMAP_WORLD_BLOCK_HASH_MANAGER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "octomap_world/block_hash_world.h"
+#include "octomap_world/map_manager_base.h"
+
+#include <octomap_msgs/GetOctomap.h>
+#include <std_srvs/Empty.h>
+#include <volumetric_msgs/LoadMap.h>
+#include <volumetric_msgs/SaveMap.h>
+#include <volumetric_msgs/SetBoxOccupancy.h>
+
+#include <pcl_conversions/pcl_conversions.h>
+
+namespace volumetric_mapping {
+
+// The ROS wrapper of BlockHashWorld, with the topics, services and parameters
+// of OctomapManager that carry over to it. Scans are inserted synchronously,
+// and maps are exchanged as octomaps, so nodes and tools that talk to an
+// octomap manager can talk to this one instead. Map deltas, tiles, the map
+// window, change detection and diagnostics are only in OctomapManager.
+class BlockHashManager : public MapManagerBase<BlockHashWorld> {
+ public:
+  typedef std::shared_ptr<BlockHashManager> Ptr;
+
+  // By default, loads the map parameters from the ROS parameter server.
+  BlockHashManager(const ros::NodeHandle& nh,
+                   const ros::NodeHandle& nh_private);
+  virtual ~BlockHashManager() {}
+
+  void publishAll();
+  void publishAllEvent(const ros::TimerEvent& e);
+
+  // Data insertion callbacks with TF frame resolution through the listener.
+  void insertDisparityImageWithTf(
+      const stereo_msgs::DisparityImageConstPtr& disparity);
+  void insertPointcloudWithTf(
+      const sensor_msgs::PointCloud2::ConstPtr& pointcloud);
+
+  // Input Octomap callback.
+  void octomapCallback(const octomap_msgs::Octomap& msg);
+
+  // Service callbacks.
+  bool resetMapCallback(std_srvs::Empty::Request& request,
+                        std_srvs::Empty::Response& response);
+  bool publishAllCallback(std_srvs::Empty::Request& request,
+                          std_srvs::Empty::Response& response);
+  bool getOctomapCallback(octomap_msgs::GetOctomap::Request& request,
+                          octomap_msgs::GetOctomap::Response& response);
+  // Only .bt files, which replace the map. A merge request fails.
+  bool loadOctomapCallback(volumetric_msgs::LoadMap::Request& request,
+                           volumetric_msgs::LoadMap::Response& response);
+  bool saveOctomapCallback(volumetric_msgs::SaveMap::Request& request,
+                           volumetric_msgs::SaveMap::Response& response);
+  bool savePointCloudCallback(volumetric_msgs::SaveMap::Request& request,
+                              volumetric_msgs::SaveMap::Response& response);
+  bool setBoxOccupancyCallback(
+      volumetric_msgs::SetBoxOccupancy::Request& request,
+      volumetric_msgs::SetBoxOccupancy::Response& response);
+
+ private:
+  void setParametersFromROS();
+  void subscribe();
+  void advertiseServices();
+  void advertisePublishers();
+
+  // Subscriptions for input sensor data.
+  ros::Subscriber disparity_sub_;
+  ros::Subscriber pointcloud_sub_;
+  ros::Subscriber octomap_sub_;
+
+  // Publish full state of the map, as octomaps.
+  ros::Publisher binary_map_pub_;
+  ros::Publisher full_map_pub_;
+
+  // Publish voxel centroids as pcl.
+  ros::Publisher nearest_obstacle_pub_;
+  ros::Publisher pcl_pub_;
+
+  // Publish markers for visualization.
+  ros::Publisher occupied_nodes_pub_;
+  ros::Publisher free_nodes_pub_;
+
+  ros::ServiceServer reset_map_service_;
+  ros::ServiceServer publish_all_service_;
+  ros::ServiceServer get_map_service_;
+  ros::ServiceServer save_map_service_;
+  ros::ServiceServer load_map_service_;
+  ros::ServiceServer save_point_cloud_service_;
+  ros::ServiceServer set_box_occupancy_service_;
+
+  double map_publish_frequency_;
+  ros::Timer map_publish_timer_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_BLOCK_HASH_MANAGER_H_
@@ -0,0 +1,283 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_BLOCK_HASH_WORLD_H_
+#define OCTOMAP_WORLD_BLOCK_HASH_WORLD_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <octomap/octomap.h>
+#include <octomap_msgs/Octomap.h>
+#include <visualization_msgs/MarkerArray.h>
+#include <volumetric_map_base/world_base.h>
+
+namespace volumetric_mapping {
+
+struct BlockHashParameters {
+  BlockHashParameters()
+      : resolution(0.15),
+        probability_hit(0.65),
+        probability_miss(0.4),
+        threshold_min(0.12),
+        threshold_max(0.97),
+        threshold_occupancy(0.7),
+        max_free_space(0.0),
+        min_height_free_space(0.0),
+        sensor_max_range(5.0),
+        treat_unknown_as_occupied(true) {}
+
+  // Same meaning and defaults as in OctomapParameters.
+  double resolution;
+  double probability_hit;
+  double probability_miss;
+  double threshold_min;
+  double threshold_max;
+  double threshold_occupancy;
+  double max_free_space;
+  double min_height_free_space;
+  double sensor_max_range;
+  bool treat_unknown_as_occupied;
+};
+
+// A WorldBase that stores the log-odds of the voxels in dense blocks of
+// kBlockSize^3 voxels, found through a hash map of their indices. Blocks are
+// allocated when first observed. Accessing a voxel costs one hash lookup
+// instead of a descent through the octree, and box and line queries walk
+// contiguous memory. Voxels are never merged, so large uniform areas take
+// more memory than in an octree.
+// Uses the same voxel grid as OctomapWorld at the same resolution, and
+// converts to and from octomap_msgs::Octomap, e.g. to exchange maps with
+// OctomapManager. Boxes cover all voxels they overlap. Speckles are not
+// filtered.
+class BlockHashWorld : public WorldBase {
+ public:
+  typedef std::shared_ptr<BlockHashWorld> Ptr;
+
+  static const int kBlockSize = 8;
+  static const int kNumBlockVoxels = kBlockSize * kBlockSize * kBlockSize;
+
+  BlockHashWorld();
+  explicit BlockHashWorld(const BlockHashParameters& params);
+  virtual ~BlockHashWorld() {}
+
+  // Clears the map.
+  void setParameters(const BlockHashParameters& params);
+  const BlockHashParameters& getParameters() const { return params_; }
+  double getResolution() const { return params_.resolution; }
+
+  void resetMap();
+  size_t getNumBlocks() const { return blocks_.size(); }
+  // Bytes used by the blocks and the hash map.
+  size_t getMemoryUsage() const;
+
+  // Sets the voxels in the box to the clamping thresholds.
+  virtual void setFree(const Eigen::Vector3d& position,
+                       const Eigen::Vector3d& bounding_box_size);
+  virtual void setOccupied(const Eigen::Vector3d& position,
+                           const Eigen::Vector3d& bounding_box_size);
+
+  // If treat_unknown_as_occupied is set, these return kOccupied instead of
+  // kUnknown.
+  virtual CellStatus getCellStatusBoundingBox(
+      const Eigen::Vector3d& point,
+      const Eigen::Vector3d& bounding_box_size) const;
+  virtual CellStatus getCellStatusPoint(const Eigen::Vector3d& point) const;
+  // Like for OctomapWorld, the voxel of the end is not checked.
+  virtual CellStatus getLineStatus(const Eigen::Vector3d& start,
+                                   const Eigen::Vector3d& end) const;
+  virtual CellStatus getLineStatusBoundingBox(
+      const Eigen::Vector3d& start, const Eigen::Vector3d& end,
+      const Eigen::Vector3d& bounding_box_size) const;
+
+  virtual void getOccupiedPointCloud(
+      pcl::PointCloud<pcl::PointXYZ>* output_cloud) const;
+  virtual void getOccupiedPointcloudInBoundingBox(
+      const Eigen::Vector3d& center, const Eigen::Vector3d& bounding_box_size,
+      pcl::PointCloud<pcl::PointXYZ>* output_cloud) const;
+
+  virtual void setRobotSize(const Eigen::Vector3d& robot_size) {
+    robot_size_ = robot_size;
+  }
+  virtual Eigen::Vector3d getRobotSize() const { return robot_size_; }
+  virtual bool checkCollisionWithRobot(const Eigen::Vector3d& robot_position);
+  virtual bool checkPathForCollisionsWithRobot(
+      const std::vector<Eigen::Vector3d>& robot_positions,
+      size_t* collision_index);
+
+  // Bounds of the allocated blocks.
+  virtual Eigen::Vector3d getMapCenter() const;
+  virtual Eigen::Vector3d getMapSize() const;
+  virtual void getMapBounds(Eigen::Vector3d* min_bound,
+                            Eigen::Vector3d* max_bound) const;
+
+  // Conversion to octomaps. Voxels outside of the key range of an octree are
+  // left out.
+  bool getOctomapBinaryMsg(octomap_msgs::Octomap* msg) const;
+  bool getOctomapFullMsg(octomap_msgs::Octomap* msg) const;
+  // Replaces the map with the octomap, and takes over its resolution. Pruned
+  // leaves are split up into voxels.
+  void setOctomapFromMsg(const octomap_msgs::Octomap& msg);
+  // The same for .bt files.
+  bool loadOctomapFromFile(const std::string& file_path);
+  bool writeOctomapToFile(const std::string& file_path) const;
+
+  // One cube list each for the occupied and the free voxels.
+  void generateMarkerArray(const std::string& tf_frame,
+                           visualization_msgs::MarkerArray* occupied_nodes,
+                           visualization_msgs::MarkerArray* free_nodes) const;
+
+ protected:
+  virtual void insertPointcloudIntoMapImpl(
+      const Transformation& T_G_sensor,
+      const pcl::PointCloud<pcl::PointXYZ>::Ptr& pointcloud_sensor);
+  virtual void insertPointcloudIntoMapWithWeightsImpl(
+      const Transformation& T_G_sensor,
+      const pcl::PointCloud<pcl::PointXYZ>::Ptr& pointcloud_sensor,
+      const std::vector<double>& weights);
+  virtual void insertPointcloud2IntoMapImpl(
+      const Transformation& T_G_sensor,
+      const sensor_msgs::PointCloud2& pointcloud_sensor);
+  virtual void insertProjectedDisparityIntoMapImpl(
+      const Transformation& sensor_to_world, const cv::Mat& projected_points);
+  virtual void insertProjectedDisparityIntoMapWithWeightsImpl(
+      const Transformation& sensor_to_world, const cv::Mat& projected_points,
+      const cv::Mat& weights);
+  virtual void insertDisparityIntoMapImpl(const Transformation& sensor_to_world,
+                                          const cv::Mat& disparity,
+                                          const Eigen::Matrix4d& Q);
+
+ private:
+  // Voxel (x, y, z) of a block is at x + kBlockSize * (y + kBlockSize * z), so
+  // rows along x are contiguous. Unknown voxels hold -infinity, which is below
+  // any occupancy threshold.
+  struct Block {
+    float log_odds[kNumBlockVoxels];
+  };
+  struct IndexHash {
+    size_t operator()(const Eigen::Vector3i& index) const {
+      return (static_cast<size_t>(index.x()) * 73856093u) ^
+             (static_cast<size_t>(index.y()) * 19349669u) ^
+             (static_cast<size_t>(index.z()) * 83492791u);
+    }
+  };
+  typedef std::unordered_map<Eigen::Vector3i, std::unique_ptr<Block>,
+                             IndexHash>
+      BlockMap;
+  // Voxel codes of a scan, with the weight of their strongest measurement.
+  typedef std::vector<std::pair<uint64_t, double> > WeightedVoxels;
+
+  Eigen::Vector3i getVoxelIndex(const Eigen::Vector3d& point) const;
+  Eigen::Vector3d getVoxelCenter(const Eigen::Vector3i& voxel) const;
+  static Eigen::Vector3i getBlockIndex(const Eigen::Vector3i& voxel);
+  static int getLinearIndex(const Eigen::Vector3i& voxel);
+  // Voxels of the box, inclusive.
+  void getVoxelRange(const Eigen::Vector3d& center,
+                     const Eigen::Vector3d& bounding_box_size,
+                     Eigen::Vector3i* min_voxel,
+                     Eigen::Vector3i* max_voxel) const;
+
+  // Codes for voxels within 2^20 voxels of the origin. Sorted codes group the
+  // voxels by block, and their lowest bits are the linear index in the block.
+  static bool isEncodable(const Eigen::Vector3i& voxel);
+  static uint64_t encodeVoxel(const Eigen::Vector3i& voxel);
+  static Eigen::Vector3i decodeBlockIndex(uint64_t code);
+
+  const Block* findBlock(const Eigen::Vector3i& block_index) const;
+  Block* getOrCreateBlock(const Eigen::Vector3i& block_index);
+  CellStatus getUnknownStatus() const;
+  bool isOccupied(float log_odds) const {
+    return log_odds >= log_odds_occupancy_;
+  }
+
+  // Calls voxel_function(voxel) for the voxels on the line from start to end,
+  // from the one of start up to but excluding the one of end, and stops early
+  // if it returns false.
+  template <typename VoxelFunction>
+  void forEachVoxelOnLine(const Eigen::Vector3d& start,
+                          const Eigen::Vector3d& end,
+                          const VoxelFunction& voxel_function) const;
+  // Calls free_voxel_function(voxel) for the voxels the ray clears, and
+  // returns whether the endpoint is within the sensor range, with the same
+  // rules as OctomapWorld::castRay().
+  template <typename VoxelFunction>
+  bool computeRayVoxels(const Eigen::Vector3d& sensor_origin,
+                        const Eigen::Vector3d& point,
+                        const VoxelFunction& free_voxel_function) const;
+  bool isFreeSpaceUpdateAllowed(const Eigen::Vector3d& sensor_origin,
+                                const Eigen::Vector3i& voxel) const;
+
+  void castRay(const Eigen::Vector3d& sensor_origin,
+               const Eigen::Vector3d& point);
+  void castWeightedRay(const Eigen::Vector3d& sensor_origin,
+                       const Eigen::Vector3d& point, double weight);
+  // Applies the voxels collected since the last call, each once. Occupied
+  // voxels are not also updated as free.
+  void updateOccupancy();
+  void updateOccupancyWithWeights();
+  void updateVoxel(uint64_t code, float log_odds_update,
+                   Eigen::Vector3i* block_index, Block** block);
+  void setLogOddsBoundingBox(const Eigen::Vector3d& position,
+                             const Eigen::Vector3d& bounding_box_size,
+                             float log_odds);
+  // Inclusive.
+  void setLogOddsVoxelRange(const Eigen::Vector3i& min_voxel,
+                            const Eigen::Vector3i& max_voxel, float log_odds);
+
+  bool checkSinglePoseCollision(const Eigen::Vector3d& robot_position) const;
+
+  // Writes the known voxels into an octree with the same parameters.
+  void writeToOctree(octomap::OcTree* octree) const;
+  void readFromOctree(const octomap::OcTree& octree);
+
+  BlockHashParameters params_;
+  // 1 / resolution, the same as in octomap.
+  double resolution_factor_;
+  float log_odds_hit_;
+  float log_odds_miss_;
+  float log_odds_min_;
+  float log_odds_max_;
+  float log_odds_occupancy_;
+
+  BlockMap blocks_;
+  Eigen::Vector3d robot_size_;
+
+  // Reused buffers for the voxels of a scan.
+  std::vector<uint64_t> free_voxels_;
+  std::vector<uint64_t> occupied_voxels_;
+  WeightedVoxels weighted_free_voxels_;
+  WeightedVoxels weighted_occupied_voxels_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_BLOCK_HASH_WORLD_H_
@@ -0,0 +1,205 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_BOUNDED_QUEUE_H_
+#define OCTOMAP_WORLD_BOUNDED_QUEUE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+
+namespace volumetric_mapping {
+
+// What to do with a new element when the queue is full.
+enum class QueueOverflowPolicy {
+  // Drop the oldest queued element to make room for the new one.
+  kDropOldest,
+  // Drop the new element.
+  kDropNewest,
+  // Merge the new element into the newest queued element. Falls back to
+  // kDropOldest if the queue has no merge function.
+  kMergeNewest
+};
+
+// Parses "drop_oldest", "drop_newest" or "merge". Returns false and leaves
+// policy untouched for anything else.
+inline bool queueOverflowPolicyFromString(const std::string& name,
+                                          QueueOverflowPolicy* policy) {
+  if (name == "drop_oldest") {
+    *policy = QueueOverflowPolicy::kDropOldest;
+  } else if (name == "drop_newest") {
+    *policy = QueueOverflowPolicy::kDropNewest;
+  } else if (name == "merge") {
+    *policy = QueueOverflowPolicy::kMergeNewest;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Thread-safe FIFO of bounded size, for handing work between pipeline stages.
+// push() never blocks; pop() blocks until there is an element or the queue is
+// shut down.
+template <typename T>
+class BoundedQueue {
+ public:
+  // Merges the second (incoming) element into the first (queued) one.
+  typedef std::function<void(T*, T*)> MergeFunction;
+
+  BoundedQueue(size_t capacity, QueueOverflowPolicy policy,
+               const MergeFunction& merge_function = MergeFunction())
+      : capacity_(capacity > 0 ? capacity : 1),
+        policy_(policy),
+        merge_function_(merge_function),
+        num_dropped_(0),
+        num_merged_(0),
+        closed_(false),
+        shutdown_(false) {}
+
+  // Returns false if the queue was full and an element had to be dropped or
+  // merged, or the queue is closed or shut down.
+  bool push(T element) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_ || shutdown_) {
+        return false;
+      }
+      if (queue_.size() >= capacity_) {
+        if (policy_ == QueueOverflowPolicy::kDropNewest) {
+          ++num_dropped_;
+          return false;
+        } else if (policy_ == QueueOverflowPolicy::kMergeNewest &&
+                   merge_function_) {
+          merge_function_(&queue_.back(), &element);
+          ++num_merged_;
+          return false;
+        }
+        queue_.pop_front();
+        ++num_dropped_;
+        queue_.push_back(std::move(element));
+        condition_.notify_one();
+        return false;
+      }
+      queue_.push_back(std::move(element));
+    }
+    condition_.notify_one();
+    return true;
+  }
+
+  // Blocks until an element is available. Returns false once the queue is
+  // shut down, or closed and empty.
+  bool pop(T* element) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_.wait(lock, [this]() {
+      return shutdown_ || closed_ || !queue_.empty();
+    });
+    if (shutdown_ || queue_.empty()) {
+      return false;
+    }
+    *element = std::move(queue_.front());
+    queue_.pop_front();
+    return true;
+  }
+
+  // Same, but gives up at the deadline. Use isShutdown() to tell a timeout
+  // from a shutdown.
+  bool pop(T* element, const std::chrono::steady_clock::time_point& deadline) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!condition_.wait_until(lock, deadline, [this]() {
+          return shutdown_ || closed_ || !queue_.empty();
+        })) {
+      return false;
+    }
+    if (shutdown_ || queue_.empty()) {
+      return false;
+    }
+    *element = std::move(queue_.front());
+    queue_.pop_front();
+    return true;
+  }
+
+  // All following push() calls fail, but the queued elements can still be
+  // popped, e.g. to finish the queued work before stopping.
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    condition_.notify_all();
+  }
+
+  // Wakes up all waiting consumers; all following push() and pop() calls
+  // fail.
+  void shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutdown_ = true;
+      queue_.clear();
+    }
+    condition_.notify_all();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+  }
+  size_t capacity() const { return capacity_; }
+  bool isShutdown() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return shutdown_;
+  }
+  size_t getNumDropped() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_dropped_;
+  }
+  size_t getNumMerged() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_merged_;
+  }
+
+ private:
+  const size_t capacity_;
+  const QueueOverflowPolicy policy_;
+  const MergeFunction merge_function_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<T> queue_;
+  size_t num_dropped_;
+  size_t num_merged_;
+  bool closed_;
+  bool shutdown_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_BOUNDED_QUEUE_H_
@@ -0,0 +1,102 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_CHANGE_JOURNAL_H_
+#define OCTOMAP_WORLD_CHANGE_JOURNAL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <octomap/octomap.h>
+
+namespace volumetric_mapping {
+
+// Append-only log of the leaf changes of a map, shared by any number of
+// readers. Every change gets the next version, and is kept in a ring of
+// capacity records, each a Morton code (see KeyBatch::mortonEncode()) with
+// the new state in the top bit. Readers ask for the changes since a version,
+// or keep a named cursor in the journal, so reading does not take the changes
+// away from anyone else. Readers that fall more than capacity changes behind,
+// or that are behind when the journal is invalidated, are told that changes
+// were lost and have to read the whole map again.
+class ChangeJournal {
+ public:
+  struct Change {
+    octomap::OcTreeKey key;
+    // New state of the leaf, free if false.
+    bool occupied;
+  };
+
+  // A capacity of 0 keeps no changes, and all readers lose them.
+  explicit ChangeJournal(size_t capacity = 0);
+
+  // Drops all changes, but keeps the versions and the cursors.
+  void setCapacity(size_t capacity);
+  size_t getCapacity() const { return capacity_; }
+
+  void append(const octomap::OcTreeKey& key, bool occupied);
+  // Marks all changes so far as lost, e.g. after the map was replaced.
+  void invalidate();
+
+  // Version the next change gets, so the changes so far are the ones below.
+  uint64_t getVersion() const { return next_version_; }
+  // Oldest version still in the journal.
+  uint64_t getOldestVersion() const { return oldest_version_; }
+  // Approximate bytes of the records and the consumer cursors.
+  size_t getMemoryUsage() const;
+
+  // Appends the changes from the version on, oldest first, and sets
+  // next_version to the version to continue from. Returns false if some of
+  // them are no longer in the journal (or the version is newer than the
+  // journal), in which case the changes from the oldest version on are
+  // appended.
+  bool getChangesSince(uint64_t version, std::vector<Change>* changes,
+                       uint64_t* next_version) const;
+  // Same as above, from the cursor of the consumer, which moves to the
+  // current version. New consumers start at version 0.
+  bool getChangesForConsumer(const std::string& consumer,
+                             std::vector<Change>* changes);
+  void removeConsumer(const std::string& consumer);
+
+ private:
+  size_t capacity_;
+  // Ring of the records from oldest_version_ to next_version_, the one of a
+  // version at version % capacity_. Grows up to capacity_ as needed.
+  std::vector<uint64_t> records_;
+  uint64_t oldest_version_;
+  uint64_t next_version_;
+  std::unordered_map<std::string, uint64_t> consumer_versions_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_CHANGE_JOURNAL_H_
@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_ESDF_LAYER_H_
+#define OCTOMAP_WORLD_ESDF_LAYER_H_
+
+#include <cstdint>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+#include <octomap/octomap.h>
+
+namespace volumetric_mapping {
+
+// Euclidean distance field over the leaf voxels of an octree, kept next to
+// the tree and updated incrementally as voxels become occupied or free
+// (dynamic brushfire, Lau et al., "Efficient grid-based spatial
+// representations for robot navigation in dynamic environments", 2013).
+// Every voxel within max_distance of an obstacle stores its closest obstacle
+// voxel; voxels further away are not stored, so the field is sparse around
+// the obstacles. Distances are between voxel centers, and unknown space is
+// not treated as an obstacle.
+class EsdfLayer {
+ public:
+  EsdfLayer(double resolution, double max_distance);
+
+  double getResolution() const { return resolution_; }
+  double getMaxDistance() const { return max_distance_; }
+
+  // Removes all obstacles.
+  void clear();
+
+  // Queues a change of the occupancy of a voxel. The distances are only
+  // valid again after update().
+  void setOccupied(const octomap::OcTreeKey& key);
+  void setFree(const octomap::OcTreeKey& key);
+  bool isOccupied(const octomap::OcTreeKey& key) const;
+  // Queues the voxels on the surface of the inclusive key box as occupied.
+  // Distances outside of an occupied box only depend on its surface, so big
+  // obstacles don't need to be filled.
+  void setOccupiedBoxSurface(const octomap::OcTreeKey& min_key,
+                             const octomap::OcTreeKey& max_key);
+  // Queues all occupied voxels in the inclusive key box as free.
+  void setBoxFree(const octomap::OcTreeKey& min_key,
+                  const octomap::OcTreeKey& max_key);
+
+  // Propagates all queued changes.
+  void update();
+
+  // Distance from the voxel at the key to the closest obstacle, in meters.
+  // Returns max_distance if there is none within max_distance.
+  double getDistance(const octomap::OcTreeKey& key) const;
+  // Distance as above, and its gradient from central differences of the
+  // neighboring voxels.
+  double getDistanceAndGradient(const octomap::OcTreeKey& key,
+                                Eigen::Vector3d* gradient) const;
+  // Returns false if there is no obstacle within max_distance.
+  bool getClosestObstacle(const octomap::OcTreeKey& key,
+                          octomap::OcTreeKey* obstacle_key) const;
+
+  size_t getNumObstacles() const { return num_obstacles_; }
+  size_t getNumVoxels() const { return voxels_.size(); }
+  // Approximate bytes of the voxels and the update buffers.
+  size_t getMemoryUsage() const;
+
+ private:
+  struct Voxel {
+    Voxel()
+        : distance_sq(kInfiniteDistance),
+          has_obstacle(false),
+          is_obstacle(false),
+          raise(false) {}
+    // Closest obstacle, only valid if has_obstacle.
+    octomap::OcTreeKey obstacle;
+    // Squared distance to the obstacle in voxels.
+    int32_t distance_sq;
+    bool has_obstacle;
+    // Whether this voxel itself is occupied.
+    bool is_obstacle;
+    // Whether the voxel was cleared and still has to raise its neighbors.
+    bool raise;
+  };
+  typedef std::unordered_map<octomap::OcTreeKey, Voxel,
+                             octomap::OcTreeKey::KeyHash> VoxelMap;
+
+  // Open list entries, ordered by increasing distance.
+  typedef std::pair<int32_t, octomap::OcTreeKey> QueueEntry;
+  struct QueueEntryGreater {
+    bool operator()(const QueueEntry& a, const QueueEntry& b) const {
+      return a.first > b.first;
+    }
+  };
+
+  static const int32_t kInfiniteDistance;
+
+  static int32_t squaredKeyDistance(const octomap::OcTreeKey& a,
+                                    const octomap::OcTreeKey& b);
+  // All 26 neighbors of the key that are inside of the key range.
+  static void getNeighbors(const octomap::OcTreeKey& key,
+                           std::vector<octomap::OcTreeKey>* neighbors);
+
+  void processRaise(const octomap::OcTreeKey& key);
+  void processLower(const octomap::OcTreeKey& key, const Voxel& voxel);
+  double squaredDistanceToMeters(int32_t distance_sq) const;
+
+  double resolution_;
+  double max_distance_;
+  int32_t max_distance_sq_;
+
+  VoxelMap voxels_;
+  size_t num_obstacles_;
+  std::priority_queue<QueueEntry, std::vector<QueueEntry>, QueueEntryGreater>
+      open_;
+  // Voxels that lost their obstacle during the current update, erased at the
+  // end if no other obstacle reached them.
+  std::vector<octomap::OcTreeKey> cleared_keys_;
+  std::vector<octomap::OcTreeKey> neighbors_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_ESDF_LAYER_H_
@@ -0,0 +1,178 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_INFLATION_LAYER_H_
+#define OCTOMAP_WORLD_INFLATION_LAYER_H_
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace volumetric_mapping {
+
+// Inflation of the obstacles of an octree by a box, computed as a separable
+// dilation over a sparse grid of voxel blocks. A block is the subtree
+// kBlockLevels above the leaves, addressed by the Morton code of its voxels
+// shifted by 3 * kBlockLevels, and holds one bit per voxel. The map reads
+// blocks from the tree on demand, so uniform subtrees are filled into the
+// masks without visiting their voxels.
+// The layer remembers which voxels it set occupied, so they don't inflate
+// any further and are freed again once their obstacles are gone. After the
+// first update, the map reports the blocks it changed and only the blocks
+// within the inflation radius of those are updated again.
+class InflationLayer {
+ public:
+  static const unsigned int kBlockLevels = 4;
+  static const int kBlockSize = 1 << kBlockLevels;
+  // Number of blocks along each axis of the key range.
+  static const int kNumBlocks = 1 << (16 - kBlockLevels);
+
+  // One bit per voxel of a block, bit z of rows[x][y] is the voxel at the
+  // local coordinates x, y, z.
+  struct Mask {
+    Mask() { clear(); }
+    void clear();
+    void fill();
+    bool empty() const;
+    bool full() const;
+    bool get(int x, int y, int z) const {
+      return (rows[x][y] >> z) & 1;
+    }
+    // Sets all voxels between the local coordinates, inclusive.
+    void setBox(const Eigen::Vector3i& min, const Eigen::Vector3i& max);
+    Mask& operator|=(const Mask& rhs);
+    Mask& operator&=(const Mask& rhs);
+    Mask operator~() const;
+
+    uint16_t rows[kBlockSize][kBlockSize];
+  };
+
+  // What the map knows about the voxels of a block.
+  struct BlockState {
+    Mask occupied;
+    Mask free;
+    // Voxels outside of the map bounds, which are inflated into when they
+    // are unknown.
+    Mask outside_bounds;
+  };
+  typedef std::function<void(uint64_t block_code, BlockState* state)>
+      BlockReader;
+
+  // Voxels the map has to change, as leaf codes and as block codes of whole
+  // blocks. Voxels that are not inflated any more go back to free or unknown,
+  // whatever they were before.
+  struct Result {
+    std::vector<uint64_t> occupied_codes;
+    std::vector<uint64_t> free_codes;
+    std::vector<uint64_t> unknown_codes;
+    std::vector<uint64_t> occupied_blocks;
+    std::vector<uint64_t> free_blocks;
+    std::vector<uint64_t> unknown_blocks;
+  };
+
+  InflationLayer();
+
+  // Forgets the inflated voxels, the next update covers the whole map.
+  void clear();
+
+  // Marks the blocks of changed leaves, or of a node with the given number of
+  // levels below it.
+  void markChanged(const std::vector<uint64_t>& codes);
+  void markChanged(uint64_t min_code, unsigned int levels);
+  // Forgets the changes, for instance the ones of applying a result.
+  void clearChanged();
+
+  // Radius of the inflation in voxels along each axis.
+  const Eigen::Vector3i& getRadius() const { return radius_; }
+  // Whether all obstacles have to be looked at, because it's the first
+  // update, the settings changed or too much of the map changed at once.
+  bool needsFullUpdate(const Eigen::Vector3i& radius,
+                       bool unknown_as_occupied) const;
+  // Blocks changed since the last update.
+  void getChangedBlocks(std::vector<uint64_t>* blocks) const;
+
+  // Updates the inflation of all blocks within the radius of the given
+  // blocks. For a full update, the blocks are the ones with obstacles, and
+  // the blocks with inflated voxels are added. With unknown_as_occupied,
+  // unknown voxels inside of the map bounds are obstacles as well.
+  void update(const Eigen::Vector3i& radius, bool unknown_as_occupied,
+              const std::vector<uint64_t>& blocks,
+              const BlockReader& read_block, Result* result);
+
+  size_t getNumInflatedVoxels() const;
+  // Approximate bytes of the inflated blocks and the changed block set.
+  size_t getMemoryUsage() const;
+
+  static Eigen::Vector3i getBlockIndex(uint64_t block_code);
+  static uint64_t getBlockCode(const Eigen::Vector3i& block_index);
+
+ private:
+  typedef std::unordered_map<uint64_t, Mask> MaskMap;
+
+  // Voxels set occupied by the inflation, and which of them were unknown.
+  struct InflatedBlock {
+    Mask voxels;
+    Mask unknown;
+  };
+  typedef std::unordered_map<uint64_t, InflatedBlock> InflatedBlockMap;
+
+  // Appends the voxels of the mask to the codes, or the block if it is full.
+  static void appendVoxels(uint64_t block_code, const Mask& mask,
+                           std::vector<uint64_t>* codes,
+                           std::vector<uint64_t>* whole_blocks);
+
+  // One step of the dilation along an axis: every voxel of the blocks is
+  // ORed into the voxels step away in both directions. Blocks that are not
+  // in the region are neither read nor written.
+  static void dilateStep(const MaskMap& input, int axis, int step,
+                         const std::unordered_set<uint64_t>& region,
+                         MaskMap* output);
+  // ORs the mask, moved by shift voxels along the axis, into the output.
+  // Only voxels that stay within the block are moved.
+  static void orShifted(const Mask& mask, int axis, int shift, Mask* output);
+  // Adds all blocks within the block radius of the blocks to the region.
+  static void expandRegion(const std::unordered_set<uint64_t>& blocks,
+                           const Eigen::Vector3i& block_radius,
+                           std::unordered_set<uint64_t>* region);
+
+  Eigen::Vector3i radius_;
+  bool unknown_as_occupied_;
+  bool full_update_needed_;
+  InflatedBlockMap inflated_;
+  std::unordered_set<uint64_t> changed_blocks_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_INFLATION_LAYER_H_
@@ -0,0 +1,167 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_INSTRUMENTATION_H_
+#define OCTOMAP_WORLD_INSTRUMENTATION_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace volumetric_mapping {
+
+// Timed sections of the insertion, query and publishing paths.
+enum class Timer {
+  kRayCasting,
+  kUpdateOccupancy,
+  kBoxQuery,
+  kCollisionCheck,
+  kVisibility,
+  kInflation,
+  kGenerateMarkers,
+  kSerialization,
+  kTfLookup,
+  kPublishAll,
+  kNumTimers
+};
+
+// Totals, and current values like the queue depth.
+enum class Counter {
+  kScansInserted,
+  kRaysCast,
+  kKeysTouched,
+  kScansDropped,
+  kQueueDepth,
+  kNumTreeNodes,
+  kNumCounters
+};
+
+// Timing statistics and counters, recorded without locks from any thread.
+// Each thread times into one of kNumShards shards, so threads running the same
+// section (e.g. the box queries of the collision and visibility threads) don't
+// share cache lines, and the statistics merge the shards when read.
+// Percentiles are over the latest kNumSamples / kNumShards samples of each
+// shard, the count, mean and maximum over all of them since the last reset.
+class Instrumentation {
+ public:
+  static const size_t kNumShards = 8;
+  static const size_t kNumSamples = 1024;
+  static const size_t kNumSamplesPerShard = kNumSamples / kNumShards;
+  static const size_t kNumTimers = static_cast<size_t>(Timer::kNumTimers);
+  static const size_t kNumCounters =
+      static_cast<size_t>(Counter::kNumCounters);
+
+  struct TimerStatistics {
+    uint64_t num_samples;
+    double total_seconds;
+    double mean_seconds;
+    double p50_seconds;
+    double p90_seconds;
+    double p99_seconds;
+    double max_seconds;
+  };
+
+  Instrumentation();
+
+  void addTime(Timer timer, int64_t nanoseconds);
+  void addCount(Counter counter, int64_t count);
+  void setCount(Counter counter, int64_t value);
+
+  void getTimerStatistics(Timer timer, TimerStatistics* statistics) const;
+  int64_t getCount(Counter counter) const;
+  void reset();
+
+  static const char* getName(Timer timer);
+  static const char* getName(Counter counter);
+
+ private:
+  struct TimerData {
+    std::atomic<uint64_t> num_samples;
+    std::atomic<int64_t> total_ns;
+    std::atomic<int64_t> max_ns;
+    std::atomic<int64_t> samples_ns[kNumSamplesPerShard];
+  };
+
+  // Indexed by shard, then timer. The samples keep the counts, totals and
+  // maxima of different shards and timers on separate cache lines.
+  TimerData timers_[kNumShards][kNumTimers];
+  std::atomic<int64_t> counters_[kNumCounters];
+};
+
+// Adds the time from construction to destruction to a timer, if there is an
+// instrumentation.
+class ScopedTimer {
+ public:
+  ScopedTimer(Instrumentation* instrumentation, Timer timer)
+      : instrumentation_(instrumentation),
+        timer_(timer),
+        start_(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    if (instrumentation_ != NULL) {
+      instrumentation_->addTime(
+          timer_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start_)
+                      .count());
+    }
+  }
+
+ private:
+  Instrumentation* instrumentation_;
+  const Timer timer_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace volumetric_mapping
+
+// The timers and counters of the hot paths compile to nothing unless
+// OCTOMAP_WORLD_ENABLE_INSTRUMENTATION is defined. The arguments are not
+// evaluated then.
+#define OCTOMAP_WORLD_CONCATENATE_IMPL(a, b) a##b
+#define OCTOMAP_WORLD_CONCATENATE(a, b) OCTOMAP_WORLD_CONCATENATE_IMPL(a, b)
+
+#ifdef OCTOMAP_WORLD_ENABLE_INSTRUMENTATION
+#define OCTOMAP_WORLD_TIMER(instrumentation, timer)                      \
+  ::volumetric_mapping::ScopedTimer OCTOMAP_WORLD_CONCATENATE(          \
+      scoped_timer_, __LINE__)((instrumentation),                       \
+                               ::volumetric_mapping::Timer::timer)
+#define OCTOMAP_WORLD_ADD_COUNT(instrumentation, counter, count) \
+  (instrumentation)->addCount(::volumetric_mapping::Counter::counter, (count))
+#define OCTOMAP_WORLD_SET_COUNT(instrumentation, counter, value) \
+  (instrumentation)->setCount(::volumetric_mapping::Counter::counter, (value))
+#else
+#define OCTOMAP_WORLD_TIMER(instrumentation, timer) \
+  static_cast<void>(sizeof(instrumentation))
+#define OCTOMAP_WORLD_ADD_COUNT(instrumentation, counter, count) \
+  static_cast<void>(sizeof(count))
+#define OCTOMAP_WORLD_SET_COUNT(instrumentation, counter, value) \
+  static_cast<void>(sizeof(value))
+#endif
+
+#endif  // OCTOMAP_WORLD_INSTRUMENTATION_H_
@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_KEY_BATCH_H_
+#define OCTOMAP_WORLD_KEY_BATCH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <octomap/octomap.h>
+
+namespace volumetric_mapping {
+
+// Flat replacement for the pair of octomap::KeySets used to accumulate the
+// free and occupied keys of a scan. Keys are appended to contiguous buffers
+// that keep their capacity between scans, so steady-state insertion does not
+// allocate. finalize() radix-sorts the keys by Morton code, removes
+// duplicates and drops free keys that are also occupied. Since the octree
+// child index is also Morton-ordered, the final keys are in depth-first
+// order of the tree.
+class KeyBatch {
+ public:
+  KeyBatch() : finalized_(true) {}
+
+  // Removes all keys but keeps the allocated buffers.
+  void clear();
+  bool empty() const { return free_codes_.empty() && occupied_codes_.empty(); }
+
+  void addFreeKey(const octomap::OcTreeKey& key) {
+    free_codes_.push_back(mortonEncode(key));
+    finalized_ = false;
+  }
+  template <typename KeyIterator>
+  void addFreeKeys(KeyIterator begin, KeyIterator end) {
+    for (KeyIterator it = begin; it != end; ++it) {
+      free_codes_.push_back(mortonEncode(*it));
+    }
+    finalized_ = false;
+  }
+  void addOccupiedKey(const octomap::OcTreeKey& key) {
+    occupied_codes_.push_back(mortonEncode(key));
+    finalized_ = false;
+  }
+  template <typename KeyIterator>
+  void addOccupiedKeys(KeyIterator begin, KeyIterator end) {
+    for (KeyIterator it = begin; it != end; ++it) {
+      occupied_codes_.push_back(mortonEncode(*it));
+    }
+    finalized_ = false;
+  }
+  // Appends all the keys of another batch to this one.
+  void append(const KeyBatch& other);
+
+  // Sorts and deduplicates both buffers and removes all occupied keys from
+  // the free keys. Has to be called before reading back keys.
+  void finalize();
+
+  size_t numFreeKeys() const { return free_codes_.size(); }
+  size_t numOccupiedKeys() const { return occupied_codes_.size(); }
+  octomap::OcTreeKey getFreeKey(size_t index) const {
+    return mortonDecode(free_codes_[index]);
+  }
+  octomap::OcTreeKey getOccupiedKey(size_t index) const {
+    return mortonDecode(occupied_codes_[index]);
+  }
+  // Sorted Morton codes of the keys, only valid after finalize().
+  const std::vector<uint64_t>& getFreeCodes() const { return free_codes_; }
+  const std::vector<uint64_t>& getOccupiedCodes() const {
+    return occupied_codes_;
+  }
+
+  // Interleaves the bits of the three key coordinates, x in the lowest bit,
+  // which matches the child ordering of octomap::computeChildIdx().
+  static uint64_t mortonEncode(const octomap::OcTreeKey& key);
+  static octomap::OcTreeKey mortonDecode(uint64_t code);
+
+ private:
+  // LSD radix sort on the 48 bits of the Morton codes, skipping digits that
+  // are the same for all codes.
+  void radixSort(std::vector<uint64_t>* codes);
+  static void deduplicate(std::vector<uint64_t>* codes);
+
+  std::vector<uint64_t> free_codes_;
+  std::vector<uint64_t> occupied_codes_;
+  // Scratch buffer for the radix sort.
+  std::vector<uint64_t> sort_buffer_;
+  bool finalized_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_KEY_BATCH_H_
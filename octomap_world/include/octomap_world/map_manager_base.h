@@ -0,0 +1,148 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_MAP_MANAGER_BASE_H_
+#define OCTOMAP_WORLD_MAP_MANAGER_BASE_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <geometry_msgs/TransformStamped.h>
+#include <ros/ros.h>
+#include <sensor_msgs/CameraInfo.h>
+#include <tf/transform_listener.h>
+#include <volumetric_map_base/world_base.h>
+
+#include "octomap_world/instrumentation.h"
+#include "octomap_world/transform_buffer.h"
+
+namespace volumetric_mapping {
+
+// The part of the ROS wrappers that doesn't depend on the map: the frame,
+// transform and disparity parameters, transform lookups through TF or the
+// transform topic, the camera info callbacks and the map lock. World is the
+// wrapped map, OctomapWorld or BlockHashWorld.
+template <typename World>
+class MapManagerBase : public World {
+ public:
+  // Reads the parameters above from the ROS parameter server and subscribes
+  // to the camera infos, and to the transform topic if not using TF.
+  MapManagerBase(const ros::NodeHandle& nh, const ros::NodeHandle& nh_private);
+  virtual ~MapManagerBase() {}
+
+  // While other threads update the map, code that embeds the manager has to
+  // hold one of these locks while it calls the functions inherited from the
+  // world, e.g. the query lock around checkPathsForCollisionsWithRobot(). The
+  // manager's own callbacks take them already, so don't call those while
+  // holding a lock.
+  boost::shared_lock<boost::shared_mutex> lockMapForQueries() const {
+    return boost::shared_lock<boost::shared_mutex>(map_mutex_);
+  }
+  boost::unique_lock<boost::shared_mutex> lockMapForUpdates() {
+    return boost::unique_lock<boost::shared_mutex>(map_mutex_);
+  }
+
+  // Camera info callbacks.
+  void leftCameraInfoCallback(const sensor_msgs::CameraInfoPtr& left_info);
+  void rightCameraInfoCallback(const sensor_msgs::CameraInfoPtr& right_info);
+
+  void transformCallback(const geometry_msgs::TransformStamped& transform_msg);
+
+ protected:
+  bool lookupTransform(const std::string& from_frame,
+                       const std::string& to_frame, const ros::Time& timestamp,
+                       Transformation* transform);
+  bool lookupTransformTf(const std::string& from_frame,
+                         const std::string& to_frame,
+                         const ros::Time& timestamp, Transformation* transform);
+  bool lookupTransformQueue(const std::string& from_frame,
+                            const std::string& to_frame,
+                            const ros::Time& timestamp,
+                            Transformation* transform);
+
+  ros::NodeHandle nh_;
+  ros::NodeHandle nh_private_;
+
+  // Global/map coordinate frame. Will always look up TF transforms to this
+  // frame.
+  std::string world_frame_;
+  std::string robot_frame_;
+  // Whether to use TF transform resolution (true) or fixed transforms from
+  // parameters and transform topics (false).
+  bool use_tf_transforms_;
+  bool latch_topics_;
+
+  // Only calculate Q matrix for disparity once.
+  bool Q_initialized_;
+  Eigen::Matrix4d Q_;
+  Eigen::Vector2d full_image_size_;
+
+  // TF lookups are timed here if set.
+  Instrumentation* tf_lookup_instrumentation_;
+
+  // Guards the map: map updates take it exclusively, queries shared. See
+  // lockMapForQueries().
+  mutable boost::shared_mutex map_mutex_;
+
+ private:
+  void setParametersFromROS();
+  bool setQFromParams(std::vector<double>* Q_vec);
+  void calculateQ();
+
+  tf::TransformListener tf_listener_;
+
+  int64_t timestamp_tolerance_ns_;
+  // B is the body frame of the robot, C is the camera/sensor frame creating
+  // the pointclouds, and D is the 'dynamic' frame; i.e., incoming messages
+  // are assumed to be T_G_D.
+  Transformation T_B_C_;
+  Transformation T_B_D_;
+
+  ros::Subscriber left_info_sub_;
+  ros::Subscriber right_info_sub_;
+  // Only used if use_tf_transforms_ set to false.
+  ros::Subscriber transform_sub_;
+
+  // Keep state of the cameras.
+  sensor_msgs::CameraInfoPtr left_info_;
+  sensor_msgs::CameraInfoPtr right_info_;
+
+  // Transform buffer, used only when use_tf_transforms is false. Transforms
+  // can be looked up from other threads without blocking the transform
+  // callback.
+  int transform_buffer_size_;
+  std::unique_ptr<TransformBuffer> transform_buffer_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_MAP_MANAGER_BASE_H_
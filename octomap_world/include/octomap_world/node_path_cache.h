@@ -0,0 +1,113 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_NODE_PATH_CACHE_H_
+#define OCTOMAP_WORLD_NODE_PATH_CACHE_H_
+
+#include <algorithm>
+#include <vector>
+
+#include <octomap/octomap.h>
+
+#include "octomap_world/pooled_octree.h"
+
+namespace volumetric_mapping {
+
+// Drop-in for OcTree::search(key) at the leaf level when the keys are
+// searched in spatial order, e.g. along a ray. The nodes on the path to the
+// last key are kept, and the next search starts from the deepest node both
+// keys share instead of from the root. Neighboring keys usually only differ
+// in the last few levels.
+// The cache holds raw node pointers, so the tree must not be modified while
+// it is in use.
+class NodePathCache {
+ public:
+  explicit NodePathCache(const PooledOcTree& tree)
+      : tree_(tree),
+        tree_depth_(tree.getTreeDepth()),
+        path_(tree_depth_ + 1, NULL),
+        path_depth_(0),
+        valid_(false) {}
+
+  // Same result as tree.search(key).
+  const PooledOcTreeNode* search(const octomap::OcTreeKey& key) {
+    unsigned int depth = 0;
+    if (valid_) {
+      // Nodes at depth d + 1 are only shared if the keys agree on all bits
+      // from the top down to bit (tree_depth - 1 - d).
+      const unsigned int diff = (key[0] ^ last_key_[0]) |
+                                (key[1] ^ last_key_[1]) |
+                                (key[2] ^ last_key_[2]);
+      unsigned int common_depth = tree_depth_;
+      for (unsigned int bit = 0; (diff >> bit) != 0; ++bit) {
+        common_depth = tree_depth_ - 1 - bit;
+      }
+      depth = std::min(common_depth, path_depth_);
+    } else {
+      path_[0] = tree_.getRoot();
+      valid_ = true;
+    }
+    last_key_ = key;
+
+    const PooledOcTreeNode* node = path_[depth];
+    if (node == NULL) {
+      path_depth_ = 0;
+      return NULL;
+    }
+    while (depth < tree_depth_ && tree_.nodeHasChildren(node)) {
+      const unsigned int bit = tree_depth_ - 1 - depth;
+      const unsigned int child_index = ((key[0] >> bit) & 1) |
+                                       (((key[1] >> bit) & 1) << 1) |
+                                       (((key[2] >> bit) & 1) << 2);
+      if (!tree_.nodeChildExists(node, child_index)) {
+        path_depth_ = depth;
+        return NULL;
+      }
+      node = tree_.getNodeChild(node, child_index);
+      path_[++depth] = node;
+    }
+    path_depth_ = depth;
+    return node;
+  }
+
+ private:
+  const PooledOcTree& tree_;
+  const unsigned int tree_depth_;
+
+  octomap::OcTreeKey last_key_;
+  // path_[d] is the node at depth d on the way to last_key_, for all
+  // d <= path_depth_.
+  std::vector<const PooledOcTreeNode*> path_;
+  unsigned int path_depth_;
+  bool valid_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_NODE_PATH_CACHE_H_
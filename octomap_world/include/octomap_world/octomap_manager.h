@@ -30,16 +30,28 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef OCTOMAP_WORLD_OCTOMAP_MANAGER_H_
 #define OCTOMAP_WORLD_OCTOMAP_MANAGER_H_
 
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "octomap_world/bounded_queue.h"
+#include "octomap_world/map_manager_base.h"
 #include "octomap_world/octomap_world.h"
 
 #include <octomap_msgs/GetOctomap.h>
 #include <std_srvs/Empty.h>
-#include <tf/transform_listener.h>
 #include <volumetric_msgs/GetChangedPoints.h>
 #include <volumetric_msgs/LoadMap.h>
+#include <volumetric_msgs/OctomapDelta.h>
 #include <volumetric_msgs/SaveMap.h>
 #include <volumetric_msgs/SetBoxOccupancy.h>
 #include <volumetric_msgs/SetDisplayBounds.h>
@@ -49,16 +61,29 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 namespace volumetric_mapping {
 
 // An inherited class from OctomapWorld, which also handles the connection to
-// ROS via publishers, subscribers, service calls, etc.
-class OctomapManager : public OctomapWorld {
+// ROS via publishers, subscribers, service calls, etc. Frames, transforms and
+// the map lock are handled by MapManagerBase.
+class OctomapManager : public MapManagerBase<OctomapWorld> {
  public:
   typedef std::shared_ptr<OctomapManager> Ptr;
 
   // By default, loads octomap parameters from the ROS parameter server.
   OctomapManager(const ros::NodeHandle& nh, const ros::NodeHandle& nh_private);
+  // Stops and joins the insertion threads, if running.
+  virtual ~OctomapManager();
+
+  // With async_insertion, and while a map loads in the background, other
+  // threads update the map, see lockMapForQueries().
 
   void publishAll();
   void publishAllEvent(const ros::TimerEvent& e);
+  // Publishes the timings and counters of getInstrumentation() as
+  // diagnostics, one status per timer and one for the counters.
+  void publishDiagnostics();
+  void publishDiagnosticsEvent(const ros::TimerEvent& e);
+  // Moves the map window (if any) to the robot and enforces the memory budget.
+  // Also loads the tiles of an open tiled map around the robot.
+  void mapWindowEvent(const ros::TimerEvent& e);
 
   // Data insertion callbacks with TF frame resolution through the listener.
   void insertDisparityImageWithTf(
@@ -68,10 +93,9 @@ class OctomapManager : public OctomapWorld {
 
   // Input Octomap callback.
   void octomapCallback(const octomap_msgs::Octomap& msg);
-
-  // Camera info callbacks.
-  void leftCameraInfoCallback(const sensor_msgs::CameraInfoPtr& left_info);
-  void rightCameraInfoCallback(const sensor_msgs::CameraInfoPtr& right_info);
+  // Applies a map delta, if it follows the last one applied. After a gap,
+  // waits for the next keyframe.
+  void octomapDeltaCallback(const volumetric_msgs::OctomapDeltaConstPtr& msg);
 
   // Service callbacks.
   bool resetMapCallback(std_srvs::Empty::Request& request,
@@ -99,61 +123,97 @@ class OctomapManager : public OctomapWorld {
       volumetric_msgs::GetChangedPoints::Request& request,
       volumetric_msgs::GetChangedPoints::Response& response);
 
-  void transformCallback(const geometry_msgs::TransformStamped& transform_msg);
-
  private:
+  // A sensor message waiting for preprocessing. Exactly one of pointcloud and
+  // disparity is set. The disparity projection parameters are captured when
+  // the message arrives.
+  struct SensorMessage {
+    sensor_msgs::PointCloud2::ConstPtr pointcloud;
+    stereo_msgs::DisparityImageConstPtr disparity;
+    Eigen::Matrix4d Q;
+    Eigen::Vector2d full_image_size;
+  };
+  // A scan in the world frame, ready to be integrated. Weights are empty if
+  // no point weighing is set.
+  struct PreprocessedScan {
+    Eigen::Vector3d sensor_position;
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_world;
+    std::vector<double> weights;
+  };
+  // Scans that are integrated together; overflowing scans are merged into
+  // the newest batch when the queue policy is "merge".
+  typedef std::vector<PreprocessedScan> ScanBatch;
+
   // Sets up subscriptions based on ROS node parameters.
   void setParametersFromROS();
   void subscribe();
   void advertiseServices();
   void advertisePublishers();
+  // With incremental visualization, the marker topics only carry the changed
+  // blocks, so new subscribers get all current markers when they connect.
+  void occupiedNodesConnectCallback(const ros::SingleSubscriberPublisher& pub);
+  void freeNodesConnectCallback(const ros::SingleSubscriberPublisher& pub);
+  // New receivers of map deltas need a keyframe.
+  void mapDeltaConnectCallback(const ros::SingleSubscriberPublisher& pub);
+  void publishMapDelta();
+
+  // Asynchronous insertion pipeline: the subscriber callbacks only enqueue
+  // messages, the preprocessing thread resolves transforms and brings the
+  // points into the world frame, and the integration thread updates the map.
+  void startInsertionThreads();
+  void stopInsertionThreads();
+  void enqueueSensorMessage(const SensorMessage& message);
+  void preprocessingLoop();
+  void updateQueueCounters();
+  void integrationLoop();
+  bool preprocessPointcloud(const sensor_msgs::PointCloud2& pointcloud,
+                            PreprocessedScan* scan);
+  bool preprocessDisparity(const SensorMessage& message,
+                           PreprocessedScan* scan);
+  // Inserts the scan on its own, with the map lock held.
+  void insertPreprocessedScan(const PreprocessedScan& scan);
+
+  // While a .bt file is read to replace the map, scans are held back instead
+  // of going into the map that is about to be replaced, up to
+  // kMaxScansHeldDuringLoad of them. Returns false if no such load is running,
+  // in which case the scan has to be inserted as usual.
+  bool holdScanDuringLoad(const PreprocessedScan& scan);
+  // Stops holding scans and inserts the held ones, with the map lock held.
+  void insertHeldScans();
+
+  // Background saving: the service callbacks copy what they save while
+  // holding the map lock, and the saving thread writes the copies to disk.
+  // Stopping finishes the queued saves first.
+  void startSavingThread();
+  void stopSavingThread();
+  // Runs the save right away unless saving in the background. Returns false
+  // if the save failed or could not be queued.
+  bool runSave(const std::function<bool()>& save);
+  void savingLoop();
+
+  // Loads a .bt, .tiles, .pcd or .ply file as the map, or merges a .bt file
+  // into it. Pointclouds are read and converted to keys in chunks of
+  // load_chunk_size_ points, which are inserted one at a time under the map
+  // lock, so the map can be queried for the parts loaded so far.
+  bool loadMap(const std::string& file_path, bool merge);
+  bool loadPointCloudFile(const std::string& file_path);
+  // Loads on loading_thread_ and publishes the map once done. Returns false
+  // if a map is still being loaded.
+  bool startLoadingThread(const std::string& file_path, bool merge);
+  // Stops loading after the current chunk.
+  void stopLoadingThread();
 
-  bool setQFromParams(std::vector<double>* Q_vec);
-  void calculateQ();
-  bool lookupTransform(const std::string& from_frame,
-                       const std::string& to_frame, const ros::Time& timestamp,
-                       Transformation* transform);
-  bool lookupTransformTf(const std::string& from_frame,
-                         const std::string& to_frame,
-                         const ros::Time& timestamp, Transformation* transform);
-  bool lookupTransformQueue(const std::string& from_frame,
-                            const std::string& to_frame,
-                            const ros::Time& timestamp,
-                            Transformation* transform);
-
-  ros::NodeHandle nh_;
-  ros::NodeHandle nh_private_;
-
-  tf::TransformListener tf_listener_;
-
-  // Global/map coordinate frame. Will always look up TF transforms to this
-  // frame.
-  std::string world_frame_;
-  std::string robot_frame_;
-  // Whether to use TF transform resolution (true) or fixed transforms from
-  // parameters and transform topics (false).
-  bool use_tf_transforms_;
-  int64_t timestamp_tolerance_ns_;
-  // B is the body frame of the robot, C is the camera/sensor frame creating
-  // the pointclouds, and D is the 'dynamic' frame; i.e., incoming messages
-  // are assumed to be T_G_D.
-  Transformation T_B_C_;
-  Transformation T_B_D_;
-
-  bool latch_topics_;
   // Subscriptions for input sensor data.
   ros::Subscriber disparity_sub_;
-  ros::Subscriber left_info_sub_;
-  ros::Subscriber right_info_sub_;
   ros::Subscriber pointcloud_sub_;
   ros::Subscriber octomap_sub_;
-
-  // Only used if use_tf_transforms_ set to false.
-  ros::Subscriber transform_sub_;
+  ros::Subscriber octomap_delta_sub_;
 
   // Publish full state of octomap.
   ros::Publisher binary_map_pub_;
   ros::Publisher full_map_pub_;
+  // Map deltas, published with the other map topics.
+  ros::Publisher map_delta_pub_;
 
   // Publish voxel centroids as pcl.
   ros::Publisher nearest_obstacle_pub_;
@@ -163,6 +223,9 @@ class OctomapManager : public OctomapWorld {
   ros::Publisher occupied_nodes_pub_;
   ros::Publisher free_nodes_pub_;
 
+  // Publish timing statistics.
+  ros::Publisher diagnostics_pub_;
+
   // Services!
   ros::ServiceServer reset_map_service_;
   ros::ServiceServer publish_all_service_;
@@ -176,19 +239,57 @@ class OctomapManager : public OctomapWorld {
   // Otherwise it just gives 0 changed points.
   ros::ServiceServer get_changed_points_service_;
 
-  // Keep state of the cameras.
-  sensor_msgs::CameraInfoPtr left_info_;
-  sensor_msgs::CameraInfoPtr right_info_;
-
-  // Only calculate Q matrix for disparity once.
-  bool Q_initialized_;
-  Eigen::Matrix4d Q_;
-  Eigen::Vector2d full_image_size_;
   double map_publish_frequency_;
   ros::Timer map_publish_timer_;
-
-  // Transform queue, used only when use_tf_transforms is false.
-  std::deque<geometry_msgs::TransformStamped> transform_queue_;
+  double map_window_update_frequency_;
+  ros::Timer map_window_timer_;
+  double diagnostics_publish_frequency_;
+  ros::Timer diagnostics_timer_;
+  // Tree depth of the published markers and cloud when not incremental, 0
+  // for the leaves.
+  int visualization_depth_;
+
+  bool async_insertion_;
+  int insertion_queue_size_;
+  std::string insertion_queue_policy_;
+  std::unique_ptr<BoundedQueue<SensorMessage> > message_queue_;
+  std::unique_ptr<BoundedQueue<ScanBatch> > scan_queue_;
+  // Scan merging: the integration thread collects up to scan_batch_size_
+  // scans, or as many as arrive within scan_batch_max_latency_ms_ of the
+  // first one, and updates the map once for all of them. Off for a size of 1.
+  // Voxels are updated once per batch rather than once per scan that saw
+  // them, with occupied winning over free (see addPointcloudToScanBatch()).
+  int scan_batch_size_;
+  double scan_batch_max_latency_ms_;
+  std::thread preprocessing_thread_;
+  std::thread integration_thread_;
+
+  bool save_in_background_;
+  std::unique_ptr<BoundedQueue<std::function<bool()> > > save_queue_;
+  std::thread saving_thread_;
+
+  bool load_map_in_background_;
+  int load_chunk_size_;
+  std::thread loading_thread_;
+  std::atomic<bool> loading_;
+  std::atomic<bool> stop_loading_;
+  // Scans held back while a map is read, see holdScanDuringLoad(). The map
+  // lock is taken before held_scans_mutex_ where both are needed.
+  static const size_t kMaxScansHeldDuringLoad = 100;
+  std::atomic<bool> holding_scans_;
+  std::mutex held_scans_mutex_;
+  std::deque<PreprocessedScan> held_scans_;
+
+  // Publishing map deltas.
+  bool publish_map_deltas_;
+  int map_delta_keyframe_interval_;
+  uint32_t map_delta_sequence_;
+  int num_map_deltas_since_keyframe_;
+  std::atomic<bool> map_delta_keyframe_requested_;
+  // Receiving map deltas. Larger deltas are dropped before decompressing.
+  double map_delta_max_size_mb_;
+  bool has_map_delta_keyframe_;
+  uint32_t next_map_delta_sequence_;
 };
 
 }  // namespace volumetric_mapping
@@ -30,7 +30,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef OCTOMAP_WORLD_OCTOMAP_WORLD_H_
 #define OCTOMAP_WORLD_OCTOMAP_WORLD_H_
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <octomap/octomap.h>
 #include <octomap_msgs/Octomap.h>
@@ -38,6 +44,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <visualization_msgs/MarkerArray.h>
 #include <volumetric_map_base/world_base.h>
 
+#include "octomap_world/change_journal.h"
+#include "octomap_world/esdf_layer.h"
+#include "octomap_world/inflation_layer.h"
+#include "octomap_world/instrumentation.h"
+#include "octomap_world/key_batch.h"
+#include "octomap_world/node_path_cache.h"
+#include "octomap_world/pooled_octree.h"
+#include "octomap_world/tiled_map_storage.h"
+
 namespace volumetric_mapping {
 
 // Different behaviours for setting log_odds_value in a bounding box
@@ -51,6 +66,11 @@ enum BoundHandling {
   kIgnorePartialBoxes
 };
 
+// Weight of the strongest measurement of a key within one scan, used for
+// weighted insertion.
+typedef std::unordered_map<octomap::OcTreeKey, double,
+                           octomap::OcTreeKey::KeyHash> KeyWeightMap;
+
 struct OctomapParameters {
   OctomapParameters()
       : resolution(0.15),
@@ -66,7 +86,25 @@ struct OctomapParameters {
         visualize_min_z(-std::numeric_limits<double>::max()),
         visualize_max_z(std::numeric_limits<double>::max()),
         treat_unknown_as_occupied(true),
-        change_detection_enabled(false) {
+        change_detection_enabled(false),
+        change_journal_capacity(1000000),
+        num_insertion_threads(1),
+        use_sorted_key_batches(false),
+        downsample_endpoints(false),
+        weight_by_hit_count(false),
+        disparity_stride(1),
+        num_collision_check_threads(1),
+        use_esdf(false),
+        esdf_max_distance(2.0),
+        num_visibility_threads(1),
+        num_export_threads(1),
+        num_load_threads(1),
+        incremental_visualization(false),
+        visualization_block_size(2.0),
+        map_window_size(Eigen::Vector3d::Zero()),
+        memory_budget_mb(0.0),
+        map_tile_size(10.0),
+        tile_load_distance(10.0) {
     // Set reasonable defaults here...
   }
 
@@ -106,6 +144,86 @@ struct OctomapParameters {
 
   // Whether to track changes -- must be set to true to use getChangedPoints().
   bool change_detection_enabled;
+  // Number of changes the change journal keeps for its readers, 8 bytes each.
+  int change_journal_capacity;
+
+  // Number of threads to use for ray casting during pointcloud insertion. 1
+  // (or less) uses the serial path; more threads split the cloud into chunks,
+  // each cast with its own key ray and key sets and merged in chunk order, so
+  // the resulting map is the same as with the serial path.
+  int num_insertion_threads;
+
+  // Accumulate the keys of a scan in flat, reused buffers that are sorted and
+  // deduplicated before the update (see KeyBatch) instead of in hash sets.
+  // Only consecutive points hitting the same voxel skip their ray cast, so the
+  // free space can differ slightly from the default path.
+  bool use_sorted_key_batches;
+
+  // Bucket the points of a pointcloud by endpoint voxel before casting, and
+  // cast a single ray to the centroid of each bucket. Doesn't apply to
+  // weighted insertion.
+  bool downsample_endpoints;
+  // With downsample_endpoints, scale the hit update of each endpoint voxel by
+  // the number of points that fell into it (free space is still updated once
+  // per scan). Not used by the sorted key batch path and for scan merging.
+  bool weight_by_hit_count;
+
+  // Only use every n-th row and column of disparity images, for cheaper
+  // insertion at lower resolution. Not used for weighted insertion.
+  int disparity_stride;
+
+  // Number of threads that checkPathsForCollisionsWithRobot() spreads the
+  // paths over. 1 (or less) checks them on the calling thread.
+  int num_collision_check_threads;
+
+  // Maintain a Euclidean distance field (see EsdfLayer) next to the octree,
+  // updated from the keys touched by every map update. Distances saturate at
+  // esdf_max_distance, and robot boxes that fit within it are checked against
+  // the field before the tree.
+  bool use_esdf;
+  double esdf_max_distance;
+
+  // Number of threads that getVisibilityBatch() spreads the voxels over. 1
+  // (or less) checks them on the calling thread.
+  int num_visibility_threads;
+
+  // Number of threads that getOccupiedPointCloud(), getAllBoxes() and
+  // generateMarkerArray() split the tree over. Each thread walks whole
+  // subtrees into its own buffers, which are concatenated in subtree order, so
+  // the output is the same as with 1 (or less), which walks the tree on the
+  // calling thread.
+  int num_export_threads;
+
+  // Number of threads that computeOccupiedKeys() spreads the points of a
+  // cloud loaded as a map over. 1 (or less) uses the calling thread.
+  int num_load_threads;
+
+  // Build the visualization (markers and occupied cloud) incrementally with
+  // generateMarkerArrayIncremental() instead of walking the whole tree every
+  // time. The map is split into cubes of visualization_block_size (rounded
+  // down to a power of two times the resolution), and only the cubes touched
+  // by map updates are regenerated.
+  bool incremental_visualization;
+  double visualization_block_size;
+
+  // Bounded-memory mode, see updateMapWindow(). Subtrees entirely outside of
+  // a box of map_window_size around the robot are evicted (disabled if any
+  // side is not positive), and if the map still uses more than
+  // memory_budget_mb megabytes (disabled if not positive, see
+  // getMemoryUsage()), the window shrinks until it fits. Evicted subtrees are
+  // written to map_eviction_directory as .bt files, if set, and can be merged
+  // back with mergeOctomapFromFile().
+  Eigen::Vector3d map_window_size;
+  double memory_budget_mb;
+  std::string map_eviction_directory;
+
+  // Tiled maps, see openTiledMap(). New tiled maps are split into tiles of
+  // map_tile_size meters, rounded down to a power of two times the
+  // resolution. Tiles are loaded within tile_load_distance of the robot, and
+  // within sensor_max_range of the sensor (or tile_load_distance if the range
+  // is not limited) before inserting.
+  double map_tile_size;
+  double tile_load_distance;
 };
 
 // A wrapper around octomap that allows insertion from various ROS message
@@ -132,10 +250,39 @@ class OctomapWorld : public WorldBase {
   void resetMap();
   void prune();
   // Creates an octomap if one is not yet created or if the resolution of the
-  // current varies from the parameters requested.
+  // current varies from the parameters requested. Only a new tree or a new
+  // occupancy threshold count as a replaced map for change detection and the
+  // derived layers.
   void setOctomapParameters(const OctomapParameters& params);
   void getOctomapParameters(OctomapParameters* params) const;
 
+  // Insert a pointcloud that is already in the world frame, as seen from the
+  // given sensor position. The cloud must not contain NaNs. This is what
+  // pointcloud insertion does after transforming, for callers that do the
+  // transformation (e.g. in a separate thread) themselves.
+  void insertPointcloudInWorldFrame(
+      const Eigen::Vector3d& sensor_position,
+      const pcl::PointCloud<pcl::PointXYZ>& cloud_world);
+  // Same with one weight per point; NaN points are skipped.
+  void insertPointcloudInWorldFrameWithWeights(
+      const Eigen::Vector3d& sensor_position,
+      const pcl::PointCloud<pcl::PointXYZ>& cloud_world,
+      const std::vector<double>& weights);
+
+  // Scan merging: casts the rays of a world-frame pointcloud (without NaNs)
+  // from its own sensor position, but only collects the keys. The map is not
+  // touched until integrateScanBatch() applies all collected scans in a single
+  // update, with one inner occupancy pass.
+  // The batch keeps each key once, so a voxel that several scans of the batch
+  // observe is updated once instead of once per scan, and a voxel that one
+  // scan sees free and another occupied only gets the occupied update.
+  void addPointcloudToScanBatch(
+      const Eigen::Vector3d& sensor_position,
+      const pcl::PointCloud<pcl::PointXYZ>& cloud_world);
+  void integrateScanBatch();
+  // Safe to call without holding the lock of the map updates.
+  size_t getNumScansInBatch() const { return num_scans_in_batch_; }
+
   // Virtual functions for manually manipulating map probabilities.
   virtual void setFree(
       const Eigen::Vector3d& position, const Eigen::Vector3d& bounding_box_size,
@@ -169,11 +316,52 @@ class OctomapWorld : public WorldBase {
   virtual CellStatus getVisibility(const Eigen::Vector3d& view_point,
                                    const Eigen::Vector3d& voxel_to_test,
                                    bool stop_at_unknown_cell) const;
+  // Number of voxels of a getVisibilityBatch() query that are visible (not
+  // kOccupied, or kUnknown when stopping at unknown cells), by their own
+  // state.
+  struct VisibilityCounts {
+    VisibilityCounts() : num_unknown(0), num_free(0), num_occupied(0) {}
+    size_t num_unknown;
+    size_t num_free;
+    size_t num_occupied;
+  };
+  // getVisibility() of many voxels from one view point, e.g. the candidate
+  // view of a next-best-view planner, on params_.num_visibility_threads
+  // threads. Each thread reuses its own KeyRay and follows the rays with a
+  // NodePathCache instead of searching every key from the root. Both outputs
+  // are optional; visibility is filled in the order of voxels_to_test.
+  void getVisibilityBatch(const Eigen::Vector3d& view_point,
+                          const std::vector<Eigen::Vector3d>& voxels_to_test,
+                          bool stop_at_unknown_cell,
+                          std::vector<CellStatus>* visibility,
+                          VisibilityCounts* counts) const;
   virtual CellStatus getLineStatusBoundingBox(
       const Eigen::Vector3d& start, const Eigen::Vector3d& end,
       const Eigen::Vector3d& bounding_box_size) const;
   virtual void getOccupiedPointCloud(
       pcl::PointCloud<pcl::PointXYZ>* output_cloud) const;
+
+  // Multi-resolution queries for coarse planning, which stop at the nodes at
+  // the given tree depth (0 is the root, getTreeDepth() the leaves) instead of
+  // going down to the leaves. A node is occupied if any leaf below it is,
+  // unknown if any space below it is unknown, and free otherwise, so free
+  // answers hold at full resolution as well. Speckles are not filtered.
+  // Deepest depth whose nodes are at least node_size wide.
+  unsigned int getDepthForNodeSize(double node_size) const;
+  CellStatus getCellStatusPointAtDepth(const Eigen::Vector3d& point,
+                                       unsigned int depth) const;
+  // Checks all nodes at the depth that the line passes through, including
+  // the ones of start and end.
+  CellStatus getLineStatusAtDepth(const Eigen::Vector3d& start,
+                                  const Eigen::Vector3d& end,
+                                  unsigned int depth) const;
+  // Checks all nodes at the depth that intersect the box.
+  CellStatus getCellStatusBoundingBoxAtDepth(
+      const Eigen::Vector3d& point, const Eigen::Vector3d& bounding_box_size,
+      unsigned int depth) const;
+  // Centers of the occupied nodes at the depth, for coarse overviews.
+  void getOccupiedPointCloudAtDepth(
+      unsigned int depth, pcl::PointCloud<pcl::PointXYZ>* output_cloud) const;
   virtual void getOccupiedPointcloudInBoundingBox(
       const Eigen::Vector3d& center, const Eigen::Vector3d& bounding_box_size,
       pcl::PointCloud<pcl::PointXYZ>* output_cloud,
@@ -203,6 +391,15 @@ class OctomapWorld : public WorldBase {
   bool getNearestFreePoint(const Eigen::Vector3d& position,
                            Eigen::Vector3d* free_position) const;
 
+  // Distance to the closest occupied voxel (and its gradient), from the
+  // distance field. Returns false if params_.use_esdf is off or the position
+  // is outside of the map.
+  bool getEsdfDistance(const Eigen::Vector3d& position,
+                       double* distance) const;
+  bool getEsdfDistanceAndGradient(const Eigen::Vector3d& position,
+                                  double* distance,
+                                  Eigen::Vector3d* gradient) const;
+
   // Collision checking with robot model. Implemented as a box with our own
   // implementation.
   virtual void setRobotSize(const Eigen::Vector3d& robot_size);
@@ -213,6 +410,12 @@ class OctomapWorld : public WorldBase {
   virtual bool checkPathForCollisionsWithRobot(
       const std::vector<Eigen::Vector3d>& robot_positions,
       size_t* collision_index);
+  // Checks many paths at once, on params_.num_collision_check_threads
+  // threads. Every path gets the same result as from
+  // checkPathForCollisionsWithRobot().
+  virtual bool checkPathsForCollisionsWithRobot(
+      const std::vector<std::vector<Eigen::Vector3d> >& paths,
+      std::vector<size_t>* collision_indices);
 
   // Serialization and deserialization from ROS messages.
   bool getOctomapBinaryMsg(octomap_msgs::Octomap* msg) const;
@@ -222,8 +425,63 @@ class OctomapWorld : public WorldBase {
 
   // Loading and writing to disk.
   bool loadOctomapFromFile(const std::string& filename);
+  // Replaces the map with the tree, e.g. one read from a file without holding
+  // the map lock. The probabilities and thresholds stay those of the map.
+  void setOctree(std::unique_ptr<PooledOcTree> tree);
+  // Loading maps from pointclouds, where the voxels of the points become
+  // occupied with a single hit each, however many points fall into them.
+  // computeOccupiedKeys() converts the points to keys on
+  // params_.num_load_threads threads, each sorting and deduplicating its own
+  // keys, into a finalized key batch. insertOccupiedKeys() then goes through
+  // them in key (Morton) order, which shares the path from the root with the
+  // previous key instead of searching for each key, and updates the inner
+  // nodes bottom-up once for all keys. Only insertOccupiedKeys() changes the
+  // map, so a big cloud can be read in chunks that are converted while
+  // queries go on.
+  void computeOccupiedKeys(const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                           KeyBatch* key_batch) const;
+  void insertOccupiedKeys(KeyBatch* key_batch);
+  // Adds the map in the file to the unknown parts of the current map, e.g.
+  // to bring back subtrees evicted by updateMapWindow(). Known space is kept.
+  bool mergeOctomapFromFile(const std::string& filename);
+  // Opens a tiled map directory written by writeTiledMap() as the map. Only
+  // the index is read; tiles are loaded by loadTilesInBoundingBox(), and
+  // around the sensor before inserting. Until then their space is unknown.
+  bool openTiledMap(const std::string& directory);
+  // Writes the map as a tiled map directory. If it is the open tiled map,
+  // only the tiles that changed since it was opened or written are written.
+  bool writeTiledMap(const std::string& directory);
+  bool isTiledMapOpen() const { return static_cast<bool>(tiled_map_); }
+  // Loads the tiles of the open tiled map that intersect the box, into the
+  // unknown parts of the map. Returns the number of loaded tiles.
+  size_t loadTilesInBoundingBox(const Eigen::Vector3d& center,
+                                const Eigen::Vector3d& bounding_box_size);
   bool writeOctomapToFile(const std::string& filename);
 
+  // Map deltas, to stream the map as the leaves that changed. Once enabled,
+  // the leaves touched by map updates are collected until the next delta.
+  void enableMapDeltas();
+  // Writes the leaves changed since the last delta, or the whole map for a
+  // keyframe. Returns whether it wrote a keyframe, which it also does if the
+  // map changed in ways that leaves can't describe (e.g. it was replaced,
+  // evicted, or tiles were loaded). See volumetric_msgs/OctomapDelta.
+  bool serializeMapDelta(bool force_keyframe, std::string* data);
+  // Drops the collected changes; the next delta is a keyframe.
+  void resetMapDelta();
+  // Applies a delta written by serializeMapDelta(). Returns false if it is
+  // malformed or has another resolution, in which case a delta that is not a
+  // keyframe leaves the map unchanged.
+  bool applyMapDelta(bool keyframe, double resolution,
+                     const std::string& data);
+
+  // Deep copy of the octree, to serialize or write without holding up map
+  // updates. Copying is much cheaper than serializing the map.
+  std::shared_ptr<PooledOcTree> getOctreeSnapshot() const;
+
+  // Usage of the pool the octree nodes are allocated from, which all octrees
+  // in the process share.
+  NodePoolStats getNodePoolStats() const;
+
   // Writing binary octomap to stream
   bool writeOctomapToBinaryConst(std::ostream& s) const;
 
@@ -231,30 +489,97 @@ class OctomapWorld : public WorldBase {
   void generateMarkerArray(const std::string& tf_frame,
                            visualization_msgs::MarkerArray* occupied_nodes,
                            visualization_msgs::MarkerArray* free_nodes);
+  // Same, but with the nodes at the depth instead of the leaves below them.
+  // Nodes at the depth are shown occupied if any leaf below them is, and
+  // free otherwise, even if partly unknown.
+  void generateMarkerArrayAtDepth(
+      const std::string& tf_frame, unsigned int depth,
+      visualization_msgs::MarkerArray* occupied_nodes,
+      visualization_msgs::MarkerArray* free_nodes);
+  // Incremental version of generateMarkerArray() and getOccupiedPointCloud()
+  // for params_.incremental_visualization. The marker arrays only contain the
+  // markers of the blocks changed since the last call (ADD, or DELETE for the
+  // markers that disappeared), so subscribers have to accumulate them. The
+  // occupied cloud is optional and complete; it is assembled from the cached
+  // points of all blocks.
+  void generateMarkerArrayIncremental(
+      const std::string& tf_frame,
+      visualization_msgs::MarkerArray* occupied_nodes,
+      visualization_msgs::MarkerArray* free_nodes,
+      pcl::PointCloud<pcl::PointXYZ>* occupied_cloud);
+  // All markers generated by generateMarkerArrayIncremental() so far, e.g. to
+  // bring a new subscriber up to date.
+  void getIncrementalMarkerArray(
+      visualization_msgs::MarkerArray* occupied_nodes,
+      visualization_msgs::MarkerArray* free_nodes) const;
+
+  // Applies the bounded-memory mode (params_.map_window_size and
+  // params_.memory_budget_mb) around the robot position. Returns the number of
+  // evicted nodes.
+  size_t updateMapWindow(const Eigen::Vector3d& robot_position);
+  // Approximate bytes of the octree and of the layers kept next to it: the
+  // distance field, the inflation, the visualization caches and the change
+  // journal. This is what params_.memory_budget_mb bounds.
+  size_t getMemoryUsage() const;
+  // Evicts all subtrees entirely outside of the box, as whole subtrees rather
+  // than leaf by leaf, and spills them to params_.map_eviction_directory if
+  // set. Returns the number of evicted nodes.
+  size_t evictOutsideBoundingBox(const Eigen::Vector3d& center,
+                                 const Eigen::Vector3d& bounding_box_size);
 
   // Convert all unknown space into free space.
   void convertUnknownToFree();
   // Convert unknown space between min_bound and max_bound into free space.
   void convertUnknownToFree(const Eigen::Vector3d& min_bound,
                             const Eigen::Vector3d& max_bound);
-  // Inflation of all obstacles by safety_space.
+  // Inflation of all obstacles by safety_space: free voxels that intersect
+  // the box of safety_space around an occupied voxel are set occupied, and so
+  // are unknown voxels outside of the map bounds. The first call goes over
+  // the whole map, later calls with the same safety_space only over the parts
+  // that changed since. Inflated voxels whose obstacles are gone are set back
+  // to free or unknown.
   void inflateOccupied(const Eigen::Vector3d& safety_space);
 
-  // Change detection -- when this is called, this resets the change detection
-  // tracking within the map. So 2 consecutive calls will produce first the
-  // change set, then nothing.
-  // If not NULL, changed_states contains the new state of the node -- 1 is
-  // occupied, 0 is free.
+  // Change detection. The changed leaves go into a journal (see
+  // ChangeJournal) of the last params_.change_journal_capacity changes, which
+  // any number of consumers read from without taking the changes away from
+  // each other. The leaves that changed since the previous read are only
+  // looked up when the journal is read, not during map updates.
   // IMPORTANT NOTE: change_detection MUST be set to true in the parameters in
   // order for this to work!
+  //
+  // Changes since the previous call for the consumer, so 2 consecutive calls
+  // will produce first the change set, then nothing. If not NULL,
+  // changed_states contains the new state of the node -- 1 is occupied, 0 is
+  // free. Returns false if changes were lost since the previous call (the
+  // consumer fell behind by more than the journal capacity, or the map was
+  // replaced), in which case the consumer should read the whole map.
+  bool getChangedPointsForConsumer(const std::string& consumer,
+                                   std::vector<Eigen::Vector3d>* changed_points,
+                                   std::vector<bool>* changed_states);
+  // Same, for the default consumer.
   void getChangedPoints(std::vector<Eigen::Vector3d>* changed_points,
                         std::vector<bool>* changed_states);
+  // Changes from the version on, for consumers that keep their own version.
+  // Returns false if changes were lost, as above.
+  bool getChangesSince(uint64_t version,
+                       std::vector<ChangeJournal::Change>* changes,
+                       uint64_t* next_version);
+  // Version after the latest change, to get the changes from now on.
+  uint64_t getChangeVersion();
   void enableChangeDetection() { octree_->enableChangeDetection(true); }
   void disableChangeDetection() { octree_->enableChangeDetection(false); }
 
   void coordToKey(const Eigen::Vector3d& coord, octomap::OcTreeKey* key) const;
   void keyToCoord(const octomap::OcTreeKey& key, Eigen::Vector3d* coord) const;
 
+  // Timings and counters of the insertion, query and serialization paths.
+  // Only recorded if built with OCTOMAP_WORLD_ENABLE_INSTRUMENTATION.
+  const Instrumentation& getInstrumentation() const {
+    return instrumentation_;
+  }
+  void resetInstrumentation() { instrumentation_.reset(); }
+
  protected:
   // Actual implementation for inserting disparity data.
   virtual void insertProjectedDisparityIntoMapImpl(
@@ -265,9 +590,97 @@ class OctomapWorld : public WorldBase {
       const Transformation& T_G_sensor,
       const pcl::PointCloud<pcl::PointXYZ>::Ptr& pointcloud);
 
+  // Weighted versions of the above: the hit and miss log-odds of each ray are
+  // scaled by the weight of its point. Keys seen by several rays of the same
+  // scan get the largest of their weights.
+  virtual void insertProjectedDisparityIntoMapWithWeightsImpl(
+      const Transformation& sensor_to_world, const cv::Mat& projected_points,
+      const cv::Mat& weights);
+  // Streams the points out of the message buffer, without a PCL conversion.
+  virtual void insertPointcloud2IntoMapImpl(
+      const Transformation& T_G_sensor,
+      const sensor_msgs::PointCloud2& pointcloud_sensor);
+  // Reprojects and transforms the disparities in one pass, without an
+  // intermediate CV_32FC3 image.
+  virtual void insertDisparityIntoMapImpl(const Transformation& sensor_to_world,
+                                          const cv::Mat& disparity,
+                                          const Eigen::Matrix4d& Q);
+
+  // Receives world-frame points from a streaming pass over sensor data.
+  typedef std::function<void(double, double, double)> PointFunction;
+  // Inserts the points that stream_points passes to its PointFunction,
+  // casting them right away where possible. Returns false if stream_points
+  // does, i.e. when the data can't be streamed; nothing is inserted then.
+  bool insertStreamedPoints(
+      const Eigen::Vector3d& sensor_position, size_t max_num_points,
+      const std::function<bool(const PointFunction&)>& stream_points);
+  virtual void insertPointcloudIntoMapWithWeightsImpl(
+      const Transformation& T_G_sensor,
+      const pcl::PointCloud<pcl::PointXYZ>::Ptr& pointcloud,
+      const std::vector<double>& weights);
+
+  // getVisibility() with the given (reused) key ray and node path cache.
+  CellStatus getVisibility(const octomap::point3d& view_point,
+                           const octomap::point3d& voxel_to_test,
+                           bool stop_at_unknown_cell, octomap::KeyRay* key_ray,
+                           NodePathCache* node_cache) const;
+
   // Check if the node at the specified key has neighbors or not.
   bool isSpeckleNode(const octomap::OcTreeKey& key) const;
 
+  // State of a getCellStatusBoundingBox() query while descending the tree.
+  // Occupied leaves are searched in [occupied_min_key, occupied_max_key] and
+  // unknown space in [unknown_min_key, unknown_max_key], the same key boxes
+  // that leaf_bbx_iterator and getUnknownLeafCenters() cover.
+  struct BoundingBoxQuery {
+    octomap::point3d bbx_min;
+    octomap::point3d bbx_max;
+    bool has_occupied_box;
+    octomap::OcTreeKey occupied_min_key;
+    octomap::OcTreeKey occupied_max_key;
+    bool has_unknown_box;
+    octomap::OcTreeKey unknown_min_key;
+    octomap::OcTreeKey unknown_max_key;
+    // Unknown space gives the same answer as occupied space then, so the
+    // query can stop at the first unknown cell.
+    bool stop_at_unknown;
+    bool occupied_found;
+    bool unknown_found;
+  };
+  // getCellStatusBoundingBox() for a box next to a checked one, i.e. the
+  // query of a box whose occupied box had no occupied space, and whose
+  // unknown box had no unknown space if that counts as occupied. Only
+  // searches the keys of the box outside of the checked one, which gives the
+  // same result. checked can be NULL. Leaves the key boxes of the box in
+  // query, with has_occupied_box set if they were searched in the tree.
+  CellStatus getCellStatusBoundingBoxOutside(
+      const Eigen::Vector3d& point, const Eigen::Vector3d& bounding_box_size,
+      const BoundingBoxQuery* checked, BoundingBoxQuery* query) const;
+  // Returns true once the query result is known.
+  bool queryBoundingBoxRecurs(const PooledOcTreeNode* node,
+                              const octomap::OcTreeKey& key,
+                              unsigned int depth,
+                              BoundingBoxQuery* query) const;
+  // The leaf iteration that the hierarchical query replaces, still used for
+  // boxes that reach outside of the map.
+  CellStatus getCellStatusBoundingBoxByLeafIteration(
+      const octomap::point3d& bbx_min, const octomap::point3d& bbx_max) const;
+
+  // The node at the depth that contains the key, or the leaf above it. NULL
+  // if the space at the key is unknown.
+  const PooledOcTreeNode* searchAtDepth(const octomap::OcTreeKey& key,
+                                        unsigned int depth) const;
+  // Status of a node found by searchAtDepth().
+  CellStatus getStatusAtDepth(const PooledOcTreeNode* node) const;
+  // Returns true once an occupied node is found, or unknown space if that
+  // counts as occupied.
+  bool queryBoundingBoxAtDepthRecurs(const PooledOcTreeNode* node,
+                                     const octomap::OcTreeKey& key,
+                                     unsigned int depth, unsigned int max_depth,
+                                     const octomap::OcTreeKey& min_key,
+                                     const octomap::OcTreeKey& max_key,
+                                     bool* unknown_found) const;
+
   // Manually affect the probabilities of areas within a bounding box.
   void setLogOddsBoundingBox(
       const Eigen::Vector3d& position, const Eigen::Vector3d& bounding_box_size,
@@ -278,6 +691,97 @@ class OctomapWorld : public WorldBase {
       const Eigen::Vector3d& bounding_box_size, double log_odds_value,
       const BoundHandling& insertion_method = BoundHandling::kDefault);
 
+  // An inclusive range of voxel keys.
+  struct KeyBox {
+    octomap::OcTreeKey min_key;
+    octomap::OcTreeKey max_key;
+  };
+  // Sets all voxels in a set of key boxes, in one pass over the tree.
+  struct KeyBoxUpdate {
+    std::vector<KeyBox> boxes;
+    float log_odds;
+    // Only set the unknown voxels.
+    bool only_unknown;
+    bool prune;
+    // Set the nodes that are completely inside a box as a whole instead of
+    // leaf by leaf. Change detection needs the leaves.
+    bool whole_nodes;
+    // Indices of the boxes that intersect the visited node at each depth.
+    std::vector<std::vector<size_t> > boxes_at_depth;
+    // The nodes that were set, by the Morton code of their minimum key and
+    // their depth.
+    std::vector<std::pair<uint64_t, unsigned int> > changed_nodes;
+  };
+  // Keys of the voxels that a loop over [bbx_min, bbx_max] in steps of the
+  // resolution visits, clamped to the map. Returns false if there are none.
+  bool getKeyBox(const Eigen::Vector3d& bbx_min,
+                 const Eigen::Vector3d& bbx_max, KeyBox* box) const;
+  void updateKeyBoxes(KeyBoxUpdate* update);
+  void updateKeyBoxesRecurs(PooledOcTreeNode* node,
+                            const octomap::OcTreeKey& key, unsigned int depth,
+                            bool covered, KeyBoxUpdate* update);
+  // The same for a node that was just created, which has no children yet.
+  void fillNewNodeRecurs(PooledOcTreeNode* node, const octomap::OcTreeKey& key,
+                         unsigned int depth, bool covered,
+                         KeyBoxUpdate* update);
+  void setWholeNode(PooledOcTreeNode* node, const octomap::OcTreeKey& key,
+                    unsigned int depth, bool created, KeyBoxUpdate* update);
+  // Collects the boxes that intersect the node at the depth, out of those
+  // that intersect its parent. Returns false if there are none.
+  bool selectKeyBoxes(const octomap::OcTreeKey& key, unsigned int depth,
+                      KeyBoxUpdate* update, bool* covered) const;
+  // Passes nodes that were set as a whole on to the layers next to the tree.
+  void handleNodesChanged(
+      const std::vector<std::pair<uint64_t, unsigned int> >& nodes);
+  void getOccupiedPointsInKeyBoxRecurs(
+      const PooledOcTreeNode* node, const octomap::OcTreeKey& key,
+      unsigned int depth, const KeyBox& box,
+      pcl::PointCloud<pcl::PointXYZ>* output_cloud) const;
+
+  // Collects the inflation blocks with obstacles below the node, or with any
+  // known voxels if unknown space is an obstacle. Of uniform nodes bigger than
+  // a block, only the blocks within block_radius of their faces are needed.
+  void getInflationBlocksRecurs(const PooledOcTreeNode* node,
+                                const octomap::OcTreeKey& key,
+                                unsigned int depth, bool all_known,
+                                const Eigen::Vector3i& block_radius,
+                                std::vector<uint64_t>* blocks) const;
+  // Reads the voxels of an inflation block, bounds are the map bounds.
+  void readInflationBlock(uint64_t block_code, const KeyBox& bounds,
+                          InflationLayer::BlockState* state) const;
+  void fillInflationBlockRecurs(const PooledOcTreeNode* node,
+                                const Eigen::Vector3i& local_min, int size,
+                                InflationLayer::BlockState* state) const;
+  void applyInflation(const InflationLayer::Result& result);
+  void setInflationBlocks(const std::vector<uint64_t>& blocks, float log_odds);
+
+  // Root of a subtree that the exports walk on one thread.
+  struct ExportSubtree {
+    const PooledOcTreeNode* node;
+    octomap::OcTreeKey key;
+    unsigned int depth;
+  };
+  // Splits the tree into subtrees in leaf_iterator order, one level at a time
+  // until there are at least min_num_subtrees, or only nodes at max_depth and
+  // leaves are left.
+  void getExportSubtrees(unsigned int max_depth, size_t min_num_subtrees,
+                         std::vector<ExportSubtree>* subtrees) const;
+  // Calls leaf_function(node, key, depth, &(*outputs)[i]) for the leaves down
+  // to max_depth (as for leaf_iterator) of every subtree i, with the subtrees
+  // spread over params_.num_export_threads threads. Within a subtree the
+  // leaves come in leaf_iterator order, so concatenating the outputs gives the
+  // same order as iterating over the whole tree.
+  template <typename Output, typename LeafFunction>
+  void forEachLeafParallel(unsigned int max_depth,
+                           const LeafFunction& leaf_function,
+                           std::vector<Output>* outputs) const;
+  template <typename Output, typename LeafFunction>
+  void forEachLeafRecurs(const PooledOcTreeNode* node,
+                         const octomap::OcTreeKey& key, unsigned int depth,
+                         unsigned int max_depth,
+                         const LeafFunction& leaf_function,
+                         Output* output) const;
+
   void getAllBoxes(
       bool occupied_boxes,
       std::vector<std::pair<Eigen::Vector3d, double> >* box_vector) const;
@@ -302,9 +806,88 @@ class OctomapWorld : public WorldBase {
   void castRay(const octomap::point3d& sensor_origin,
                const octomap::point3d& point, octomap::KeySet* free_cells,
                octomap::KeySet* occupied_cells);
+  // Same as above, but uses the given key ray as temporary storage so it can be
+  // called concurrently from several threads.
+  void castRay(const octomap::point3d& sensor_origin,
+               const octomap::point3d& point, octomap::KeyRay* key_ray,
+               octomap::KeySet* free_cells,
+               octomap::KeySet* occupied_cells) const;
+  void castRay(const octomap::point3d& sensor_origin,
+               const octomap::point3d& point, octomap::KeyRay* key_ray,
+               KeyBatch* key_batch) const;
+  // Casts the rays of all points in the (world frame) cloud on
+  // params_.num_insertion_threads threads.
+  void castRaysParallel(const octomap::point3d& sensor_origin,
+                        const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                        octomap::KeySet* free_cells,
+                        octomap::KeySet* occupied_cells);
+  void castRaysParallel(const octomap::point3d& sensor_origin,
+                        const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                        KeyBatch* key_batch);
+  void castRays(const octomap::point3d& sensor_origin,
+                pcl::PointCloud<pcl::PointXYZ>::const_iterator begin,
+                pcl::PointCloud<pcl::PointXYZ>::const_iterator end,
+                octomap::KeyRay* key_ray, KeyBatch* key_batch) const;
+  // Casts all the rays of a pointcloud, in parallel if configured.
+  void castRays(const octomap::point3d& sensor_origin,
+                const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                octomap::KeySet* free_cells, octomap::KeySet* occupied_cells);
+  void castRays(const octomap::point3d& sensor_origin,
+                const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                KeyBatch* key_batch);
+  // Casts a ray with the given weight. The ray is skipped if its endpoint was
+  // already hit in this scan with at least the same weight.
+  void castWeightedRay(const octomap::point3d& sensor_origin,
+                       const octomap::point3d& point, double weight,
+                       KeyWeightMap* free_cells, KeyWeightMap* occupied_cells);
+  // Fills key_ray with the keys from the sensor origin to the point, cut off at
+  // the maximum sensor range. Returns true if the endpoint is within range and
+  // inside the map, and should thus be marked occupied.
+  bool computeRayKeys(const octomap::point3d& sensor_origin,
+                      const octomap::point3d& point, octomap::KeyRay* key_ray,
+                      octomap::OcTreeKey* endpoint_key) const;
+  // Checks max_free_space and min_height_free_space for a key on a ray.
+  bool isFreeSpaceUpdateAllowed(const octomap::point3d& sensor_origin,
+                                const octomap::OcTreeKey& key) const;
   void updateOccupancy(octomap::KeySet* free_cells,
                        octomap::KeySet* occupied_cells);
+  void updateOccupancy(KeyBatch* key_batch);
+  void updateOccupancy(const KeyWeightMap& free_cells,
+                       const KeyWeightMap& occupied_cells);
+  // Recomputes the inner nodes above the given leaf keys only, after they
+  // were updated with lazy_eval, optionally pruning them on the way up. Falls
+  // back to a pass over the whole tree if the keys touch most of it anyway.
+  void updateInnerOccupancy(const std::vector<octomap::OcTreeKey>& keys,
+                            bool prune);
+  // Same for the Morton codes of the keys (see KeyBatch). Takes the codes in
+  // any order, and reuses the vector as scratch space.
+  void updateInnerOccupancy(std::vector<uint64_t>* codes, bool prune);
+  // Queues the leaves at the Morton codes for the next map delta.
+  void addMapDeltaCodes(const std::vector<uint64_t>& codes);
+  // Moves the leaves changed since the last call from the octree to the
+  // change journal, with their current state.
+  void updateChangeJournal();
   bool isValidPoint(const cv::Vec3f& point) const;
+  // The endpoint voxel of a downsampled point, and the number of points in
+  // it.
+  struct DownsampledEndpoint {
+    octomap::OcTreeKey key;
+    // Points outside the map have no key.
+    bool in_map;
+    double hit_count;
+  };
+  // Replaces all points with the same endpoint voxel by their centroid, and
+  // counts the points per centroid. Points outside the map are kept as is.
+  // A centroid that falls into a neighboring voxel in single precision is
+  // moved to the center of its own voxel.
+  void downsampleEndpoints(const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                           pcl::PointCloud<pcl::PointXYZ>* downsampled_cloud,
+                           std::vector<DownsampledEndpoint>* endpoints);
+  // Ray casting for a downsampled cloud with weight_by_hit_count.
+  void insertDownsampledPointcloudWithHitCounts(
+      const octomap::point3d& sensor_origin,
+      const pcl::PointCloud<pcl::PointXYZ>& downsampled_cloud,
+      const std::vector<DownsampledEndpoint>& endpoints);
 
   void setOctomapFromBinaryMsg(const octomap_msgs::Octomap& msg);
   void setOctomapFromFullMsg(const octomap_msgs::Octomap& msg);
@@ -313,19 +896,216 @@ class OctomapWorld : public WorldBase {
 
   // Collision checking methods.
   bool checkSinglePoseCollision(const Eigen::Vector3d& robot_position) const;
+  // Whether the voxel at the key is occupied in the tree. The distance field
+  // only has the surfaces of occupied nodes, and measures the distances
+  // inside of them to these surfaces instead of zero.
+  bool isKeyInsideEsdfObstacle(const octomap::OcTreeKey& key) const;
+  // Whether the distance field shows that no occupied voxel overlaps the box.
+  // False if it can't tell, e.g. since the box is bigger than the field.
+  bool isBoxObstacleFreeInEsdf(const Eigen::Vector3d& center,
+                               const Eigen::Vector3d& bounding_box_size) const;
+
+  // Brings everything kept next to the tree (distance field, visualization
+  // blocks) up to date after the tree was replaced or cleared.
+  void handleMapReplaced();
+
+  // Passes the new state of the leaves at the Morton codes on to the distance
+  // field and propagates it.
+  void updateEsdf(const std::vector<uint64_t>& codes);
+  // Creates or removes the distance field according to params_, and rebuilds
+  // it from all occupied leaves of the tree.
+  void rebuildEsdf();
+  // The distance field only gets the surface of occupied nodes: every
+  // occupied voxel next to a voxel that isn't occupied is an obstacle of the
+  // field, which keeps the distances of all other voxels exact. Nodes are
+  // given by the Morton code of their minimum key and their depth. None of
+  // these propagate, see EsdfLayer::update().
+  // Adds the surface of the node, which is occupied now.
+  void setEsdfNodeOccupied(uint64_t min_code, unsigned int depth);
+  // Removes the obstacles of the node, which isn't occupied now. Coarse nodes
+  // around it have their surfaces added again from the tree.
+  void setEsdfNodeFree(uint64_t min_code, unsigned int depth);
+  // Adds the surfaces of the occupied leaves of the tree within the node.
+  void addEsdfOccupiedLeaves(uint64_t min_code, unsigned int depth);
+  // Forgets the coarse nodes within the node.
+  void eraseEsdfCoarseNodes(uint64_t min_code, unsigned int depth);
+
+  // Returns true if the node has to be deleted by its parent. The evicted
+  // subtrees are appended to evicted_nodes, as the Morton codes of their
+  // minimum keys and their depths.
+  bool evictOutsideKeyBoxRecurs(PooledOcTreeNode* node,
+                                const octomap::OcTreeKey& key,
+                                unsigned int depth,
+                                const octomap::OcTreeKey& keep_min_key,
+                                const octomap::OcTreeKey& keep_max_key,
+                                PooledOcTree* spill_tree,
+                                size_t* num_evicted_nodes,
+                                std::vector<std::pair<uint64_t, unsigned int> >*
+                                    evicted_nodes);
+  // Removes an evicted subtree from the layers next to the tree, and copies
+  // it into the spill tree if there is one. Returns the number of nodes.
+  size_t evictSubtree(const PooledOcTreeNode* node,
+                      const octomap::OcTreeKey& key, unsigned int depth,
+                      PooledOcTree* spill_tree);
+  // Registers the occupied leaves of the subtree as changed with change
+  // detection, which feeds the change journal. Returns the number of nodes.
+  size_t evictSubtreeLeaves(const PooledOcTreeNode* node,
+                            const octomap::OcTreeKey& key, unsigned int depth);
+
+  // Adds the source tree to the unknown parts of the map, and prunes. The
+  // occupied leaves that were added are appended to occupied_nodes, if set,
+  // as the Morton codes of their minimum keys and their depths.
+  void mergeOctomap(
+      PooledOcTree* source_tree,
+      std::vector<std::pair<uint64_t, unsigned int> >* occupied_nodes);
+
+  void closeTiledMap();
+  void loadTilesAroundSensor(const Eigen::Vector3d& sensor_position);
+  // Loads the entries of the open tiled map at the indices, which must not be
+  // loaded yet. Returns the number of loaded entries.
+  size_t loadTiles(const std::vector<size_t>& indices);
+  bool loadTile(size_t index, PooledOcTree* tile_tree) const;
+  // Writes the changed tiles at the tile codes to the open tiled map, and
+  // marks them as unchanged.
+  bool writeChangedTiles(const std::vector<uint64_t>& codes);
+  // Writes the changed tiles that are not completely inside the key box,
+  // before they are evicted.
+  bool writeTilesOutsideKeyBox(const octomap::OcTreeKey& keep_min_key,
+                               const octomap::OcTreeKey& keep_max_key);
+  // Splits the subtree into tiles, at the tile depth or at bigger leaves.
+  void serializeTilesRecurs(const PooledOcTreeNode* node,
+                            const octomap::OcTreeKey& min_key,
+                            unsigned int depth,
+                            std::vector<TiledMapStorage::Tile>* tiles) const;
+  // Splits the part of the map covered by the tile entry into tiles.
+  void serializeTileRegion(const TiledMapStorage::TileEntry& region,
+                           std::vector<TiledMapStorage::Tile>* tiles) const;
+  unsigned int getTileLevels() const;
+  void markTilesChanged(const std::vector<uint64_t>& codes);
+  // The same for the leaves of a node, with the Morton code of its minimum
+  // key.
+  void markTilesChanged(uint64_t min_code, unsigned int depth);
+
+  // Marks the visualization blocks of the leaves at the Morton codes as
+  // changed.
+  void markVisualizationBlocksChanged(const std::vector<uint64_t>& codes);
+  // The same for the leaves of a node, with the Morton code of its minimum
+  // key.
+  void markVisualizationBlocksChanged(uint64_t min_code, unsigned int depth);
+  // Regenerates the markers and points of one block and appends the changed
+  // markers to the arrays.
+  void regenerateVisualizationBlock(
+      uint64_t block_code, const std::string& tf_frame, double min_z,
+      double max_z, visualization_msgs::MarkerArray* occupied_nodes,
+      visualization_msgs::MarkerArray* free_nodes);
+  // Forgets all blocks, queueing deletes for their markers.
+  void resetVisualizationBlocks();
+  // Height range used to color the markers.
+  void getVisualizationHeightRange(double* min_z, double* max_z) const;
+  // Returns the index of the earliest pose that checkSinglePoseCollision()
+  // finds colliding, or the size of the path if there is none. The boxes of
+  // consecutive poses mostly overlap, so each pose only searches the keys
+  // that its box adds to the one of the previous pose.
+  size_t findFirstPoseCollision(
+      const std::vector<Eigen::Vector3d>& robot_positions) const;
 
   std_msgs::ColorRGBA percentToColor(double h) const;
 
-  std::shared_ptr<octomap::OcTree> octree_;
+  std::shared_ptr<PooledOcTree> octree_;
 
   OctomapParameters params_;
 
   // For collision checking.
   Eigen::Vector3d robot_size_;
 
+  // Only set if params_.use_esdf.
+  std::shared_ptr<EsdfLayer> esdf_;
+  // Occupied nodes whose inside is left out of the distance field, by depth,
+  // as the Morton codes of the nodes at their depth. Only nodes of at least
+  // four voxels a side have an inside.
+  std::vector<std::set<uint64_t> > esdf_coarse_nodes_;
+  // Only set after the first inflateOccupied().
+  std::shared_ptr<InflationLayer> inflation_;
+
+  // Recorded from const queries too, and from their worker threads.
+  mutable Instrumentation instrumentation_;
+
+  // Incremental visualization. Blocks are the octree nodes
+  // visualization_block_levels_ levels above the leaves, identified by the
+  // Morton code of their keys.
+  struct VisualizationBlock {
+    // Marker ids of the block are id * (visualization_block_levels_ + 1) +
+    // the depth below the block.
+    int id;
+    // Only the markers with points.
+    std::vector<visualization_msgs::Marker> occupied_markers;
+    std::vector<visualization_msgs::Marker> free_markers;
+    // Not a pcl::PointCloud, whose fixed-size Eigen members would need an
+    // aligned map node.
+    std::vector<pcl::PointXYZ, Eigen::aligned_allocator<pcl::PointXYZ> >
+        occupied_points;
+  };
+  std::unordered_map<uint64_t, VisualizationBlock> visualization_blocks_;
+  std::unordered_set<uint64_t> changed_visualization_blocks_;
+  bool all_visualization_blocks_changed_;
+  unsigned int visualization_block_levels_;
+  int next_visualization_block_id_;
+  // Height range that the cached markers are colored with.
+  double visualization_min_z_;
+  double visualization_max_z_;
+  // Number of evicted subtree files written so far.
+  size_t num_eviction_files_;
+
+  // Only set while a tiled map is open.
+  std::shared_ptr<TiledMapStorage> tiled_map_;
+  // Codes of the entries of the tiled map that are in the tree.
+  std::unordered_set<uint64_t> loaded_tiles_;
+  // Tile codes with changes that are not written yet.
+  std::unordered_set<uint64_t> changed_tiles_;
+  // Set when the tree was changed in ways that are not tracked per tile.
+  bool all_tiles_changed_;
+
+  // Morton codes of the leaves changed since the last map delta, only
+  // collected once enabled. May hold duplicates.
+  bool map_deltas_enabled_;
+  std::vector<uint64_t> map_delta_codes_;
+  size_t num_unique_map_delta_codes_;
+  bool map_delta_keyframe_needed_;
+
+  ChangeJournal change_journal_;
+
+  // Deletes for markers of forgotten blocks, sent with the next update.
+  visualization_msgs::MarkerArray pending_occupied_deletes_;
+  visualization_msgs::MarkerArray pending_free_deletes_;
+
   // Temporary variable for KeyRay since it resizes it to a HUGE value by
   // default. Thanks a lot to @xiaopenghuang for catching this.
   octomap::KeyRay key_ray_;
+  // One key ray per thread for castRaysParallel(), for the same reason.
+  std::vector<octomap::KeyRay> parallel_key_rays_;
+
+  // Key buffers reused between scans if params_.use_sorted_key_batches is set.
+  KeyBatch key_batch_;
+  std::vector<KeyBatch> parallel_key_batches_;
+
+  // Keys of the scans collected by addPointcloudToScanBatch().
+  KeyBatch scan_batch_;
+  // Atomic since managers read it to wait for the batch latency.
+  std::atomic<size_t> num_scans_in_batch_;
+
+  // Scratch buffer for the touched keys of an update.
+  std::vector<uint64_t> touched_codes_;
+
+  // Buffers reused between scans if params_.downsample_endpoints is set.
+  std::unordered_map<octomap::OcTreeKey, size_t, octomap::OcTreeKey::KeyHash>
+      endpoint_voxel_indices_;
+  std::vector<Eigen::Vector3d> endpoint_sums_;
+  pcl::PointCloud<pcl::PointXYZ> downsampled_cloud_;
+  std::vector<DownsampledEndpoint> downsampled_endpoints_;
+
+  // World-frame points of a PointCloud2, reused between scans, for the
+  // insertion modes that can't cast while streaming.
+  pcl::PointCloud<pcl::PointXYZ> streamed_cloud_;
 };
 
 }  // namespace volumetric_mapping
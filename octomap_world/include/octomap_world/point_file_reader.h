@@ -0,0 +1,100 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_POINT_FILE_READER_H_
+#define OCTOMAP_WORLD_POINT_FILE_READER_H_
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+namespace volumetric_mapping {
+
+// Reads the points of a .pcd or .ply file a chunk at a time, so big clouds
+// don't have to fit into memory as a whole. Supports ASCII and binary PCD,
+// and ASCII and little-endian binary PLY, with float or double x, y and z.
+// Other fields are skipped.
+class PointFileReader {
+ public:
+  PointFileReader();
+
+  // Reads the header. Returns false if the file can't be read, or if its
+  // points are stored in a way the reader doesn't support (e.g. compressed
+  // PCD, or PLY with other elements before the vertices).
+  bool open(const std::string& file_path);
+
+  // Reads up to max_points of the next points into the cloud. Returns false
+  // if there were no points left, or if the file is cut short or malformed.
+  bool readPoints(size_t max_points, pcl::PointCloud<pcl::PointXYZ>* cloud);
+
+  size_t getNumPoints() const { return num_points_; }
+  size_t getNumPointsRead() const { return num_points_read_; }
+  // Whether all points in the header were read.
+  bool done() const { return num_points_read_ == num_points_; }
+
+ private:
+  // Where a coordinate is in a point of a binary and of an ASCII file.
+  struct Coordinate {
+    size_t byte_offset;
+    size_t column;
+    // 4 for float, 8 for double.
+    size_t size;
+  };
+
+  bool readPcdHeader();
+  bool readPlyHeader();
+  // Adds a field of count values of size bytes each to the point, where x, y
+  // and z become the coordinates. Returns false for unsupported coordinates.
+  bool addField(const std::string& name, size_t size, bool floating_point,
+                size_t count);
+  bool readBinaryPoints(size_t num_points,
+                        pcl::PointCloud<pcl::PointXYZ>* cloud);
+  bool readAsciiPoints(size_t num_points,
+                       pcl::PointCloud<pcl::PointXYZ>* cloud);
+
+  std::ifstream file_;
+  bool binary_;
+  size_t num_points_;
+  size_t num_points_read_;
+  size_t point_bytes_;
+  size_t point_columns_;
+  Coordinate coordinates_[3];
+  bool has_coordinate_[3];
+
+  std::vector<char> buffer_;
+  std::string line_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_POINT_FILE_READER_H_
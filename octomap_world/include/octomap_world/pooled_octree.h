@@ -0,0 +1,172 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_POOLED_OCTREE_H_
+#define OCTOMAP_WORLD_POOLED_OCTREE_H_
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <octomap/octomap.h>
+
+namespace volumetric_mapping {
+
+// Usage of a NodePool.
+struct NodePoolStats {
+  NodePoolStats()
+      : num_slabs(0),
+        allocated_bytes(0),
+        num_used(0),
+        num_free(0),
+        max_num_used(0) {}
+
+  size_t num_slabs;
+  // Memory held by the slabs, in use or not.
+  size_t allocated_bytes;
+  size_t num_used;
+  // Freed objects kept for reuse.
+  size_t num_free;
+  size_t max_num_used;
+};
+
+// Allocates objects of one size from big slabs, and keeps freed objects for
+// reuse instead of returning them to the heap, so that expanding and pruning
+// the octree doesn't go through malloc for every node. Thread-safe.
+class NodePool {
+ public:
+  explicit NodePool(size_t object_size);
+  ~NodePool();
+
+  void* allocate();
+  void deallocate(void* object);
+
+  // Returns the slabs without objects in use to the heap.
+  void trim();
+
+  NodePoolStats getStats() const;
+
+ private:
+  struct FreeObject {
+    FreeObject* next;
+  };
+  struct SlabHeader {
+    size_t num_used;
+  };
+
+  // Slabs are aligned to their size, so the header of an object's slab is
+  // found by masking its address.
+  static const size_t kSlabSize = 1 << 16;
+
+  SlabHeader* getSlab(const void* object) const;
+  void addSlab();
+
+  const size_t object_size_;
+  // Objects start after the header.
+  const size_t header_size_;
+
+  mutable std::mutex mutex_;
+  std::vector<char*> slabs_;
+  FreeObject* free_list_;
+  // Never used part of the newest slab.
+  char* unused_begin_;
+  char* unused_end_;
+  size_t num_used_;
+  size_t num_free_;
+  size_t max_num_used_;
+
+  NodePool(const NodePool&) = delete;
+  NodePool& operator=(const NodePool&) = delete;
+};
+
+// An occupancy node allocated from a process-wide NodePool. Only the nodes
+// are pooled: octomap allocates the children arrays itself.
+class PooledOcTreeNode : public octomap::OcTreeNode {
+ public:
+  PooledOcTreeNode() : has_unknown_(true) {}
+
+  static void* operator new(size_t size);
+  static void operator delete(void* node, size_t size);
+
+  static NodePool& getPool();
+
+  // Frees the array of child pointers, once all children are deleted.
+  void releaseChildren();
+
+  // Sets the maximum log-odds of the children, like for an OcTreeNode, and
+  // also whether any space below the node is unknown. Hides the OcTreeNode
+  // version, so octomap's own updates of the inner nodes call it as well.
+  void updateOccupancyChildren();
+  // Whether some space below an inner node is unknown, as of the last
+  // updateOccupancyChildren(). Not meaningful for leaves, which are known.
+  bool hasUnknown() const { return has_unknown_; }
+
+ private:
+  friend class PooledOcTree;
+
+  bool hasChildren() const;
+
+  // Fits into the padding of an OcTreeNode, so the nodes don't grow.
+  bool has_unknown_;
+};
+
+// Same as octomap::OcTree, but with pooled nodes. Reads and writes the same
+// data as an OcTree, under the same tree type.
+class PooledOcTree : public octomap::OccupancyOcTreeBase<PooledOcTreeNode> {
+ public:
+  explicit PooledOcTree(double resolution);
+  // Copies the nodes directly, with their log-odds.
+  PooledOcTree(const PooledOcTree& rhs);
+
+  PooledOcTree* create() const { return new PooledOcTree(resolution); }
+  std::string getTreeType() const { return "OcTree"; }
+
+  // Creates the root of an empty tree.
+  PooledOcTreeNode* createRoot();
+  // Deletes the child with everything below it. deleteNodeChild() only
+  // deletes the child itself, and leaks its children.
+  void deleteNodeChildRecurs(PooledOcTreeNode* node, unsigned int child_index);
+  // Deletes everything below the node, which becomes a leaf.
+  void deleteNodeChildren(PooledOcTreeNode* node);
+  // Records a change of the leaf at the key for change detection, the same
+  // way as setNodeValue().
+  void registerLeafChange(const octomap::OcTreeKey& key, bool created,
+                          bool was_occupied, bool is_occupied);
+
+ private:
+  void copyNodeRecurs(const PooledOcTree& rhs, const PooledOcTreeNode* src,
+                      PooledOcTreeNode* dst);
+
+  PooledOcTree& operator=(const PooledOcTree&) = delete;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_POOLED_OCTREE_H_
@@ -0,0 +1,150 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_TILED_MAP_STORAGE_H_
+#define OCTOMAP_WORLD_TILED_MAP_STORAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace volumetric_mapping {
+
+// A map on disk, split into spatial tiles so that big maps can be opened
+// without parsing them and tiles can be read and written one by one.
+//
+// A tiled map is a directory with two files:
+// - tiles.idx: a header and one entry per tile, sorted by code. It is
+//   memory-mapped and searched in place.
+// - tiles.dat: the subtrees of the tiles, in the format of
+//   OcTree::writeBinaryNode(), one after another.
+// A tile is an octree node 2^tile_levels voxels wide, and its code is the
+// Morton code of its minimum key shifted right by 3 * tile_levels. Parts of
+// the map that are pruned to leaves bigger than a tile are stored as a single
+// entry at the depth of the leaf, which covers a range of codes.
+class TiledMapStorage {
+ public:
+  enum TileStatus : uint8_t { kFreeLeaf = 0, kOccupiedLeaf = 1, kInner = 2 };
+
+  // The layout in tiles.idx.
+  struct TileEntry {
+    // First tile code covered by the entry.
+    uint64_t code;
+    // Location of the data in tiles.dat, empty for leaves.
+    uint64_t offset;
+    uint32_t size;
+    // Depth of the node in the tree.
+    uint8_t depth;
+    uint8_t status;
+    uint16_t reserved;
+  };
+
+  // A tile to write, with its data.
+  struct Tile {
+    TileEntry entry;
+    std::string data;
+  };
+
+  TiledMapStorage();
+  ~TiledMapStorage();
+
+  // Maps the index of the tiled map in the directory.
+  bool open(const std::string& directory);
+  void close();
+  bool isOpen() const { return entries_ != NULL; }
+
+  // Writes a new tiled map to the directory, replacing any map there, and
+  // opens it.
+  bool create(const std::string& directory, double resolution,
+              unsigned int tree_depth, unsigned int tile_levels,
+              std::vector<Tile>* tiles);
+  // Replaces the entries at the indices with the tiles. The new data is
+  // appended to tiles.dat, and the index is replaced atomically. Invalidates
+  // all entry indices.
+  bool update(const std::vector<size_t>& removed_entries,
+              std::vector<Tile>* tiles);
+
+  const std::string& getDirectory() const { return directory_; }
+  double getResolution() const { return resolution_; }
+  unsigned int getTreeDepth() const { return tree_depth_; }
+  unsigned int getTileLevels() const { return tile_levels_; }
+  size_t getNumEntries() const { return num_entries_; }
+  const TileEntry& getEntry(size_t index) const { return entries_[index]; }
+  // Number of tile codes covered by the entry.
+  uint64_t getNumCodes(const TileEntry& entry) const;
+
+  // Finds the entry that covers the tile code.
+  bool findEntry(uint64_t code, size_t* index) const;
+  // Range [begin, end) of the entries that cover any of the tile codes in
+  // [min_code, max_code].
+  void findEntries(uint64_t min_code, uint64_t max_code, size_t* begin,
+                   size_t* end) const;
+  bool readTile(size_t index, std::string* data) const;
+
+ private:
+  // The layout of the beginning of tiles.idx.
+  struct Header {
+    char magic[8];
+    double resolution;
+    uint32_t tree_depth;
+    uint32_t tile_levels;
+    uint64_t num_entries;
+  };
+
+  // Sorts the entries, and writes them to tiles.idx through a temporary
+  // file.
+  bool writeIndex(const std::string& directory, double resolution,
+                  unsigned int tree_depth, unsigned int tile_levels,
+                  std::vector<TileEntry>* entries) const;
+  // Appends the data of the tiles to tiles.dat and sets their offsets.
+  static bool appendData(const std::string& directory, bool truncate,
+                         std::vector<Tile>* tiles);
+
+  std::string directory_;
+  double resolution_;
+  unsigned int tree_depth_;
+  unsigned int tile_levels_;
+
+  // The mapped index file.
+  void* index_data_;
+  size_t index_size_;
+  const TileEntry* entries_;
+  size_t num_entries_;
+  // Open for reads of the tiles.
+  int data_fd_;
+
+  // Owns a mapping and a file descriptor.
+  TiledMapStorage(const TiledMapStorage&) = delete;
+  TiledMapStorage& operator=(const TiledMapStorage&) = delete;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_TILED_MAP_STORAGE_H_
@@ -0,0 +1,236 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_TRANSFORM_BUFFER_H_
+#define OCTOMAP_WORLD_TRANSFORM_BUFFER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <glog/logging.h>
+#include <kindr/minimal/quat-transformation.h>
+
+namespace volumetric_mapping {
+
+// Fixed-capacity ring buffer of timestamped transforms, for one thread that
+// adds transforms in time order and any number of threads that look them up
+// at the same time, without locks. Each slot is a sequence lock: readers copy
+// it and check that it wasn't written in between. Once full, every new
+// transform replaces the oldest one.
+class TransformBuffer {
+ public:
+  typedef kindr::minimal::QuatTransformation Transformation;
+
+  explicit TransformBuffer(size_t capacity)
+      : capacity_(capacity > 1 ? capacity : 2),
+        slots_(new Slot[capacity_]),
+        num_pushed_(0),
+        newest_timestamp_ns_(0) {
+    for (size_t i = 0; i < capacity_; ++i) {
+      slots_[i].version.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Only from a single thread. Returns false, and drops the transform, if it
+  // isn't newer than the newest one.
+  bool push(int64_t timestamp_ns, const Transformation& transform) {
+    const uint64_t index = num_pushed_.load(std::memory_order_relaxed);
+    if (index > 0 && timestamp_ns <= newest_timestamp_ns_) {
+      return false;
+    }
+    const Eigen::Vector3d& position = transform.getPosition();
+    const Eigen::Quaterniond& rotation =
+        transform.getRotation().toImplementation();
+    Slot& slot = slots_[index % capacity_];
+    slot.version.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.timestamp_ns.store(timestamp_ns, std::memory_order_relaxed);
+    const double values[kNumValues] = {position.x(), position.y(),
+                                       position.z(), rotation.w(),
+                                       rotation.x(), rotation.y(),
+                                       rotation.z()};
+    for (int i = 0; i < kNumValues; ++i) {
+      slot.values[i].store(values[i], std::memory_order_relaxed);
+    }
+    slot.version.store(2 * index + 2, std::memory_order_release);
+    num_pushed_.store(index + 1, std::memory_order_release);
+    newest_timestamp_ns_ = timestamp_ns;
+    return true;
+  }
+
+  // Interpolates between the transforms before and after the timestamp,
+  // linearly for the position and by SLERP for the rotation. Outside of the
+  // buffered time range, only matches the oldest or newest transform within
+  // tolerance_ns. O(log capacity).
+  bool lookup(int64_t timestamp_ns, int64_t tolerance_ns,
+              Transformation* transform) const {
+    CHECK_NOTNULL(transform);
+    // Only fails this often if the producer laps the search, with a tiny
+    // buffer for its rate.
+    const int max_attempts = 4;
+    for (int attempt = 0; attempt < max_attempts; ++attempt) {
+      const uint64_t end = num_pushed_.load(std::memory_order_acquire);
+      if (end == 0) {
+        return false;
+      }
+      // The oldest slot is the next one to be written, so leave it out.
+      const uint64_t begin = end > capacity_ - 1 ? end - (capacity_ - 1) : 0;
+      Sample before, after;
+      if (!read(end - 1, &after)) {
+        continue;
+      }
+      if (timestamp_ns >= after.timestamp_ns) {
+        if (timestamp_ns - after.timestamp_ns > tolerance_ns) {
+          return false;
+        }
+        *transform = Transformation(after.rotation, after.position);
+        return true;
+      }
+      if (!read(begin, &before)) {
+        continue;
+      }
+      if (timestamp_ns < before.timestamp_ns) {
+        if (before.timestamp_ns - timestamp_ns > tolerance_ns) {
+          return false;
+        }
+        *transform = Transformation(before.rotation, before.position);
+        return true;
+      }
+
+      // Keeps before.timestamp_ns <= timestamp_ns < after.timestamp_ns.
+      uint64_t before_index = begin, after_index = end - 1;
+      bool overwritten = false;
+      while (after_index - before_index > 1) {
+        const uint64_t middle_index =
+            before_index + (after_index - before_index) / 2;
+        Sample middle;
+        if (!read(middle_index, &middle)) {
+          overwritten = true;
+          break;
+        }
+        if (middle.timestamp_ns <= timestamp_ns) {
+          before_index = middle_index;
+          before = middle;
+        } else {
+          after_index = middle_index;
+          after = middle;
+        }
+      }
+      if (overwritten) {
+        continue;
+      }
+      const double t =
+          static_cast<double>(timestamp_ns - before.timestamp_ns) /
+          static_cast<double>(after.timestamp_ns - before.timestamp_ns);
+      *transform = Transformation(
+          before.rotation.slerp(t, after.rotation),
+          before.position + t * (after.position - before.position));
+      return true;
+    }
+    return false;
+  }
+
+  // Time range of the buffered transforms.
+  bool getTimeRange(int64_t* oldest_ns, int64_t* newest_ns) const {
+    CHECK_NOTNULL(oldest_ns);
+    CHECK_NOTNULL(newest_ns);
+    const uint64_t end = num_pushed_.load(std::memory_order_acquire);
+    if (end == 0) {
+      return false;
+    }
+    const uint64_t begin = end > capacity_ - 1 ? end - (capacity_ - 1) : 0;
+    Sample oldest, newest;
+    if (!read(begin, &oldest) || !read(end - 1, &newest)) {
+      return false;
+    }
+    *oldest_ns = oldest.timestamp_ns;
+    *newest_ns = newest.timestamp_ns;
+    return true;
+  }
+
+  size_t capacity() const { return capacity_; }
+
+ private:
+  static const int kNumValues = 7;
+
+  struct Slot {
+    // 2 * (index + 1) once the transform with the index is written, and odd
+    // while it is written.
+    std::atomic<uint64_t> version;
+    std::atomic<int64_t> timestamp_ns;
+    // Position, then rotation as w, x, y, z.
+    std::atomic<double> values[kNumValues];
+  };
+
+  struct Sample {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    int64_t timestamp_ns;
+    Eigen::Vector3d position;
+    Eigen::Quaterniond rotation;
+  };
+
+  // Copies the transform with the index, false if it's not in the buffer
+  // (anymore).
+  bool read(uint64_t index, Sample* sample) const {
+    const Slot& slot = slots_[index % capacity_];
+    const uint64_t version = 2 * index + 2;
+    if (slot.version.load(std::memory_order_acquire) != version) {
+      return false;
+    }
+    sample->timestamp_ns = slot.timestamp_ns.load(std::memory_order_relaxed);
+    double values[kNumValues];
+    for (int i = 0; i < kNumValues; ++i) {
+      values[i] = slot.values[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.version.load(std::memory_order_relaxed) != version) {
+      return false;
+    }
+    sample->position = Eigen::Vector3d(values[0], values[1], values[2]);
+    sample->rotation =
+        Eigen::Quaterniond(values[3], values[4], values[5], values[6]);
+    return true;
+  }
+
+  const size_t capacity_;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> num_pushed_;
+  // Only used by the producer.
+  int64_t newest_timestamp_ns_;
+
+  TransformBuffer(const TransformBuffer&) = delete;
+  TransformBuffer& operator=(const TransformBuffer&) = delete;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_TRANSFORM_BUFFER_H_
@@ -0,0 +1,308 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/block_hash_manager.h"
+
+#include <glog/logging.h>
+#include <minkindr_conversions/kindr_msg.h>
+#include <pcl/io/ply_io.h>
+
+namespace volumetric_mapping {
+
+BlockHashManager::BlockHashManager(const ros::NodeHandle& nh,
+                                   const ros::NodeHandle& nh_private)
+    : MapManagerBase<BlockHashWorld>(nh, nh_private),
+      map_publish_frequency_(0.0) {
+  setParametersFromROS();
+  subscribe();
+  advertiseServices();
+  advertisePublishers();
+
+  // After creating the manager, if the octomap_file parameter is set,
+  // load the octomap at that path and publish it.
+  std::string octomap_file;
+  if (nh_private_.getParam("octomap_file", octomap_file)) {
+    if (loadOctomapFromFile(octomap_file)) {
+      ROS_INFO_STREAM(
+          "Successfully loaded octomap from path: " << octomap_file);
+      publishAll();
+    } else {
+      ROS_ERROR_STREAM("Could not load octomap from path: " << octomap_file);
+    }
+  }
+}
+
+void BlockHashManager::setParametersFromROS() {
+  BlockHashParameters params;
+  nh_private_.param("resolution", params.resolution, params.resolution);
+  nh_private_.param("probability_hit", params.probability_hit,
+                    params.probability_hit);
+  nh_private_.param("probability_miss", params.probability_miss,
+                    params.probability_miss);
+  nh_private_.param("threshold_min", params.threshold_min,
+                    params.threshold_min);
+  nh_private_.param("threshold_max", params.threshold_max,
+                    params.threshold_max);
+  nh_private_.param("threshold_occupancy", params.threshold_occupancy,
+                    params.threshold_occupancy);
+  nh_private_.param("max_free_space", params.max_free_space,
+                    params.max_free_space);
+  nh_private_.param("min_height_free_space", params.min_height_free_space,
+                    params.min_height_free_space);
+  nh_private_.param("sensor_max_range", params.sensor_max_range,
+                    params.sensor_max_range);
+  nh_private_.param("treat_unknown_as_occupied",
+                    params.treat_unknown_as_occupied,
+                    params.treat_unknown_as_occupied);
+  nh_private_.param("map_publish_frequency", map_publish_frequency_,
+                    map_publish_frequency_);
+
+  // Set the parent class parameters.
+  setParameters(params);
+}
+
+void BlockHashManager::subscribe() {
+  disparity_sub_ = nh_.subscribe(
+      "disparity", 40, &BlockHashManager::insertDisparityImageWithTf, this);
+  pointcloud_sub_ = nh_.subscribe(
+      "pointcloud", 40, &BlockHashManager::insertPointcloudWithTf, this);
+  octomap_sub_ = nh_.subscribe("input_octomap", 1,
+                               &BlockHashManager::octomapCallback, this);
+}
+
+void BlockHashManager::octomapCallback(const octomap_msgs::Octomap& msg) {
+  {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    setOctomapFromMsg(msg);
+  }
+  publishAll();
+  ROS_INFO_ONCE("Got octomap from message.");
+}
+
+void BlockHashManager::advertiseServices() {
+  reset_map_service_ = nh_private_.advertiseService(
+      "reset_map", &BlockHashManager::resetMapCallback, this);
+  publish_all_service_ = nh_private_.advertiseService(
+      "publish_all", &BlockHashManager::publishAllCallback, this);
+  get_map_service_ = nh_private_.advertiseService(
+      "get_map", &BlockHashManager::getOctomapCallback, this);
+  save_map_service_ = nh_private_.advertiseService(
+      "save_map", &BlockHashManager::saveOctomapCallback, this);
+  load_map_service_ = nh_private_.advertiseService(
+      "load_map", &BlockHashManager::loadOctomapCallback, this);
+  save_point_cloud_service_ = nh_private_.advertiseService(
+      "save_point_cloud", &BlockHashManager::savePointCloudCallback, this);
+  set_box_occupancy_service_ = nh_private_.advertiseService(
+      "set_box_occupancy", &BlockHashManager::setBoxOccupancyCallback, this);
+}
+
+void BlockHashManager::advertisePublishers() {
+  occupied_nodes_pub_ = nh_private_.advertise<visualization_msgs::MarkerArray>(
+      "octomap_occupied", 1, latch_topics_);
+  free_nodes_pub_ = nh_private_.advertise<visualization_msgs::MarkerArray>(
+      "octomap_free", 1, latch_topics_);
+
+  binary_map_pub_ = nh_private_.advertise<octomap_msgs::Octomap>(
+      "octomap_binary", 1, latch_topics_);
+  full_map_pub_ = nh_private_.advertise<octomap_msgs::Octomap>(
+      "octomap_full", 1, latch_topics_);
+
+  pcl_pub_ = nh_private_.advertise<sensor_msgs::PointCloud2>("octomap_pcl", 1,
+                                                             latch_topics_);
+  nearest_obstacle_pub_ = nh_private_.advertise<sensor_msgs::PointCloud2>(
+      "nearest_obstacle", 1, false);
+
+  if (map_publish_frequency_ > 0.0) {
+    map_publish_timer_ =
+        nh_private_.createTimer(ros::Duration(1.0 / map_publish_frequency_),
+                                &BlockHashManager::publishAllEvent, this);
+  }
+}
+
+void BlockHashManager::publishAll() {
+  boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+  if (latch_topics_ || occupied_nodes_pub_.getNumSubscribers() > 0 ||
+      free_nodes_pub_.getNumSubscribers() > 0) {
+    visualization_msgs::MarkerArray occupied_nodes, free_nodes;
+    generateMarkerArray(world_frame_, &occupied_nodes, &free_nodes);
+    occupied_nodes_pub_.publish(occupied_nodes);
+    free_nodes_pub_.publish(free_nodes);
+  }
+
+  // Same as for OctomapManager, both map topics carry the binary map.
+  const bool publish_binary_map =
+      latch_topics_ || binary_map_pub_.getNumSubscribers() > 0;
+  const bool publish_full_map =
+      latch_topics_ || full_map_pub_.getNumSubscribers() > 0;
+  if (publish_binary_map || publish_full_map) {
+    octomap_msgs::OctomapPtr map_msg(new octomap_msgs::Octomap);
+    getOctomapBinaryMsg(map_msg.get());
+    map_msg->header.frame_id = world_frame_;
+    if (publish_binary_map) {
+      binary_map_pub_.publish(map_msg);
+    }
+    if (publish_full_map) {
+      full_map_pub_.publish(map_msg);
+    }
+  }
+
+  if (latch_topics_ || pcl_pub_.getNumSubscribers() > 0) {
+    pcl::PointCloud<pcl::PointXYZ> point_cloud;
+    getOccupiedPointCloud(&point_cloud);
+    sensor_msgs::PointCloud2 cloud;
+    pcl::toROSMsg(point_cloud, cloud);
+    cloud.header.frame_id = world_frame_;
+    pcl_pub_.publish(cloud);
+  }
+
+  if (use_tf_transforms_ && nearest_obstacle_pub_.getNumSubscribers() > 0) {
+    Transformation robot_to_world;
+    if (lookupTransformTf(robot_frame_, world_frame_, ros::Time::now(),
+                          &robot_to_world)) {
+      pcl::PointCloud<pcl::PointXYZ> point_cloud;
+      getOccupiedPointcloudInBoundingBox(robot_to_world.getPosition(),
+                                         getRobotSize(), &point_cloud);
+      sensor_msgs::PointCloud2 cloud;
+      pcl::toROSMsg(point_cloud, cloud);
+      cloud.header.frame_id = world_frame_;
+      cloud.header.stamp = ros::Time::now();
+      nearest_obstacle_pub_.publish(cloud);
+    }
+  }
+}
+
+void BlockHashManager::publishAllEvent(const ros::TimerEvent& e) {
+  publishAll();
+}
+
+bool BlockHashManager::resetMapCallback(std_srvs::Empty::Request& request,
+                                        std_srvs::Empty::Response& response) {
+  boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+  resetMap();
+  return true;
+}
+
+bool BlockHashManager::publishAllCallback(
+    std_srvs::Empty::Request& request, std_srvs::Empty::Response& response) {
+  publishAll();
+  return true;
+}
+
+bool BlockHashManager::getOctomapCallback(
+    octomap_msgs::GetOctomap::Request& request,
+    octomap_msgs::GetOctomap::Response& response) {
+  boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+  return getOctomapFullMsg(&response.map);
+}
+
+bool BlockHashManager::loadOctomapCallback(
+    volumetric_msgs::LoadMap::Request& request,
+    volumetric_msgs::LoadMap::Response& response) {
+  const std::string extension =
+      request.file_path.substr(request.file_path.find_last_of(".") + 1);
+  if (extension != "bt" || request.merge) {
+    ROS_ERROR_STREAM("Can only replace the map by a .bt file: "
+                     << request.file_path);
+    return false;
+  }
+  boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+  return loadOctomapFromFile(request.file_path);
+}
+
+bool BlockHashManager::saveOctomapCallback(
+    volumetric_msgs::SaveMap::Request& request,
+    volumetric_msgs::SaveMap::Response& response) {
+  boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+  if (!writeOctomapToFile(request.file_path)) {
+    ROS_ERROR_STREAM("Could not write octomap to " << request.file_path);
+    return false;
+  }
+  return true;
+}
+
+bool BlockHashManager::savePointCloudCallback(
+    volumetric_msgs::SaveMap::Request& request,
+    volumetric_msgs::SaveMap::Response& response) {
+  pcl::PointCloud<pcl::PointXYZ> point_cloud;
+  {
+    boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+    getOccupiedPointCloud(&point_cloud);
+  }
+  if (pcl::io::savePLYFileASCII(request.file_path, point_cloud) != 0) {
+    ROS_ERROR_STREAM("Could not write point cloud to " << request.file_path);
+    return false;
+  }
+  return true;
+}
+
+bool BlockHashManager::setBoxOccupancyCallback(
+    volumetric_msgs::SetBoxOccupancy::Request& request,
+    volumetric_msgs::SetBoxOccupancy::Response& response) {
+  Eigen::Vector3d bounding_box_center;
+  Eigen::Vector3d bounding_box_size;
+  tf::vectorMsgToKindr(request.box_center, &bounding_box_center);
+  tf::vectorMsgToKindr(request.box_size, &bounding_box_size);
+  {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    if (request.set_occupied) {
+      setOccupied(bounding_box_center, bounding_box_size);
+    } else {
+      setFree(bounding_box_center, bounding_box_size);
+    }
+  }
+  publishAll();
+  return true;
+}
+
+void BlockHashManager::insertDisparityImageWithTf(
+    const stereo_msgs::DisparityImageConstPtr& disparity) {
+  if (!Q_initialized_) {
+    ROS_WARN_THROTTLE(
+        1, "No camera info available yet, skipping adding disparity.");
+    return;
+  }
+  Transformation sensor_to_world;
+  if (lookupTransform(disparity->header.frame_id, world_frame_,
+                      disparity->header.stamp, &sensor_to_world)) {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    insertDisparityImage(sensor_to_world, disparity, Q_, full_image_size_);
+  }
+}
+
+void BlockHashManager::insertPointcloudWithTf(
+    const sensor_msgs::PointCloud2::ConstPtr& pointcloud) {
+  Transformation sensor_to_world;
+  if (lookupTransform(pointcloud->header.frame_id, world_frame_,
+                      pointcloud->header.stamp, &sensor_to_world)) {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    insertPointcloud(sensor_to_world, pointcloud);
+  }
+}
+
+}  // namespace volumetric_mapping
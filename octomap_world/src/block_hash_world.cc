@@ -0,0 +1,959 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/block_hash_world.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+
+#include <glog/logging.h>
+#include <octomap_msgs/conversions.h>
+
+namespace volumetric_mapping {
+
+namespace {
+
+const float kUnknownLogOdds = -std::numeric_limits<float>::infinity();
+
+// Voxel codes: 18 bits of block index and 3 bits of voxel in the block per
+// axis, offset to be non-negative.
+const int kVoxelCodeOffset = 1 << 20;
+const int kBlockCodeOffset = kVoxelCodeOffset / BlockHashWorld::kBlockSize;
+const int kBlockCodeBits = 18;
+const int kLocalCodeBits = 3;
+const uint64_t kBlockCodeMask = (uint64_t(1) << kBlockCodeBits) - 1;
+
+float probabilityToLogOdds(double probability) {
+  return static_cast<float>(std::log(probability / (1.0 - probability)));
+}
+
+int floorDivide(int value, int divisor) {
+  return value >= 0 ? value / divisor : -((-value - 1) / divisor) - 1;
+}
+
+// Keeps the maximum weight of each voxel, and sorts them by code.
+void collapseWeightedVoxels(
+    std::vector<std::pair<uint64_t, double> >* voxels) {
+  std::sort(voxels->begin(), voxels->end());
+  // Equal codes are sorted by increasing weight, so the last one is kept.
+  size_t num_unique = 0;
+  for (size_t i = 0; i < voxels->size(); ++i) {
+    if (i + 1 < voxels->size() &&
+        (*voxels)[i + 1].first == (*voxels)[i].first) {
+      continue;
+    }
+    (*voxels)[num_unique++] = (*voxels)[i];
+  }
+  voxels->resize(num_unique);
+}
+
+}  // namespace
+
+BlockHashWorld::BlockHashWorld() : BlockHashWorld(BlockHashParameters()) {}
+
+BlockHashWorld::BlockHashWorld(const BlockHashParameters& params)
+    : robot_size_(Eigen::Vector3d::Zero()) {
+  setParameters(params);
+}
+
+void BlockHashWorld::setParameters(const BlockHashParameters& params) {
+  CHECK_GT(params.resolution, 0.0);
+  params_ = params;
+  resolution_factor_ = 1.0 / params_.resolution;
+  log_odds_hit_ = probabilityToLogOdds(params_.probability_hit);
+  log_odds_miss_ = probabilityToLogOdds(params_.probability_miss);
+  log_odds_min_ = probabilityToLogOdds(params_.threshold_min);
+  log_odds_max_ = probabilityToLogOdds(params_.threshold_max);
+  log_odds_occupancy_ = probabilityToLogOdds(params_.threshold_occupancy);
+  resetMap();
+}
+
+void BlockHashWorld::resetMap() { blocks_.clear(); }
+
+size_t BlockHashWorld::getMemoryUsage() const {
+  // Every entry is a node of the hash map holding the index and the pointer.
+  const size_t entry_size = sizeof(BlockMap::value_type) + 2 * sizeof(void*);
+  return blocks_.size() * (sizeof(Block) + entry_size) +
+         blocks_.bucket_count() * sizeof(void*);
+}
+
+Eigen::Vector3i BlockHashWorld::getVoxelIndex(
+    const Eigen::Vector3d& point) const {
+  return Eigen::Vector3i(
+      static_cast<int>(std::floor(resolution_factor_ * point.x())),
+      static_cast<int>(std::floor(resolution_factor_ * point.y())),
+      static_cast<int>(std::floor(resolution_factor_ * point.z())));
+}
+
+Eigen::Vector3d BlockHashWorld::getVoxelCenter(
+    const Eigen::Vector3i& voxel) const {
+  return (voxel.cast<double>() + Eigen::Vector3d::Constant(0.5)) *
+         params_.resolution;
+}
+
+Eigen::Vector3i BlockHashWorld::getBlockIndex(const Eigen::Vector3i& voxel) {
+  return Eigen::Vector3i(floorDivide(voxel.x(), kBlockSize),
+                         floorDivide(voxel.y(), kBlockSize),
+                         floorDivide(voxel.z(), kBlockSize));
+}
+
+int BlockHashWorld::getLinearIndex(const Eigen::Vector3i& voxel) {
+  const Eigen::Vector3i local = voxel - getBlockIndex(voxel) * kBlockSize;
+  return local.x() + kBlockSize * (local.y() + kBlockSize * local.z());
+}
+
+void BlockHashWorld::getVoxelRange(const Eigen::Vector3d& center,
+                                   const Eigen::Vector3d& bounding_box_size,
+                                   Eigen::Vector3i* min_voxel,
+                                   Eigen::Vector3i* max_voxel) const {
+  CHECK_NOTNULL(min_voxel);
+  CHECK_NOTNULL(max_voxel);
+  *min_voxel = getVoxelIndex(center - bounding_box_size / 2);
+  *max_voxel = getVoxelIndex(center + bounding_box_size / 2);
+}
+
+bool BlockHashWorld::isEncodable(const Eigen::Vector3i& voxel) {
+  return (voxel.array() >= -kVoxelCodeOffset).all() &&
+         (voxel.array() < kVoxelCodeOffset).all();
+}
+
+uint64_t BlockHashWorld::encodeVoxel(const Eigen::Vector3i& voxel) {
+  uint64_t code = 0;
+  // Block indices in the high bits, z first, then the voxels in the block.
+  for (int axis = 2; axis >= 0; --axis) {
+    const uint64_t value = voxel[axis] + kVoxelCodeOffset;
+    code = (code << kBlockCodeBits) | (value >> kLocalCodeBits);
+  }
+  for (int axis = 2; axis >= 0; --axis) {
+    const uint64_t value = voxel[axis] + kVoxelCodeOffset;
+    code = (code << kLocalCodeBits) | (value & (kBlockSize - 1));
+  }
+  return code;
+}
+
+Eigen::Vector3i BlockHashWorld::decodeBlockIndex(uint64_t code) {
+  const uint64_t block_code = code >> (3 * kLocalCodeBits);
+  Eigen::Vector3i block_index;
+  for (int axis = 0; axis < 3; ++axis) {
+    block_index[axis] =
+        static_cast<int>((block_code >> (axis * kBlockCodeBits)) &
+                         kBlockCodeMask) -
+        kBlockCodeOffset;
+  }
+  return block_index;
+}
+
+const BlockHashWorld::Block* BlockHashWorld::findBlock(
+    const Eigen::Vector3i& block_index) const {
+  BlockMap::const_iterator it = blocks_.find(block_index);
+  if (it == blocks_.end()) {
+    return NULL;
+  }
+  return it->second.get();
+}
+
+BlockHashWorld::Block* BlockHashWorld::getOrCreateBlock(
+    const Eigen::Vector3i& block_index) {
+  std::unique_ptr<Block>& block = blocks_[block_index];
+  if (!block) {
+    block.reset(new Block);
+    std::fill(block->log_odds, block->log_odds + kNumBlockVoxels,
+              kUnknownLogOdds);
+  }
+  return block.get();
+}
+
+BlockHashWorld::CellStatus BlockHashWorld::getUnknownStatus() const {
+  if (params_.treat_unknown_as_occupied) {
+    return CellStatus::kOccupied;
+  } else {
+    return CellStatus::kUnknown;
+  }
+}
+
+template <typename VoxelFunction>
+void BlockHashWorld::forEachVoxelOnLine(
+    const Eigen::Vector3d& start, const Eigen::Vector3d& end,
+    const VoxelFunction& voxel_function) const {
+  Eigen::Vector3i voxel = getVoxelIndex(start);
+  const Eigen::Vector3i end_voxel = getVoxelIndex(end);
+  const Eigen::Vector3d direction = end - start;
+
+  // Walks the grid in the order the line crosses the voxel faces (Amanatides
+  // and Woo), parametrized from 0 at start to 1 at end. Counting the steps
+  // left per axis ends the walk exactly at the end voxel despite rounding.
+  Eigen::Vector3i step, steps_left;
+  Eigen::Vector3d t_max, t_delta;
+  for (int axis = 0; axis < 3; ++axis) {
+    steps_left[axis] = std::abs(end_voxel[axis] - voxel[axis]);
+    step[axis] = end_voxel[axis] > voxel[axis] ? 1 : -1;
+    if (steps_left[axis] == 0) {
+      t_max[axis] = std::numeric_limits<double>::infinity();
+      t_delta[axis] = 0.0;
+      continue;
+    }
+    const double boundary =
+        (voxel[axis] + (step[axis] > 0 ? 1 : 0)) * params_.resolution;
+    t_max[axis] = (boundary - start[axis]) / direction[axis];
+    t_delta[axis] = params_.resolution / std::fabs(direction[axis]);
+  }
+
+  while (steps_left.sum() > 0) {
+    if (!voxel_function(voxel)) {
+      return;
+    }
+    int axis = 0;
+    for (int i = 1; i < 3; ++i) {
+      if (t_max[i] < t_max[axis]) {
+        axis = i;
+      }
+    }
+    voxel[axis] += step[axis];
+    if (--steps_left[axis] == 0) {
+      t_max[axis] = std::numeric_limits<double>::infinity();
+    } else {
+      t_max[axis] += t_delta[axis];
+    }
+  }
+}
+
+template <typename VoxelFunction>
+bool BlockHashWorld::computeRayVoxels(
+    const Eigen::Vector3d& sensor_origin, const Eigen::Vector3d& point,
+    const VoxelFunction& free_voxel_function) const {
+  // If the ray is longer than the max range, just update free space.
+  const bool within_range =
+      params_.sensor_max_range < 0.0 ||
+      (point - sensor_origin).norm() <= params_.sensor_max_range;
+  const Eigen::Vector3d ray_end =
+      within_range ? point
+                   : sensor_origin + (point - sensor_origin).normalized() *
+                                         params_.sensor_max_range;
+  // The voxels in between are encodable if both ends are.
+  if (!isEncodable(getVoxelIndex(sensor_origin)) ||
+      !isEncodable(getVoxelIndex(ray_end))) {
+    return false;
+  }
+  if (params_.max_free_space == 0.0) {
+    forEachVoxelOnLine(sensor_origin, ray_end,
+                       [&free_voxel_function](const Eigen::Vector3i& voxel) {
+                         free_voxel_function(voxel);
+                         return true;
+                       });
+  } else {
+    forEachVoxelOnLine(sensor_origin, ray_end,
+                       [this, &sensor_origin,
+                        &free_voxel_function](const Eigen::Vector3i& voxel) {
+                         if (isFreeSpaceUpdateAllowed(sensor_origin, voxel)) {
+                           free_voxel_function(voxel);
+                         }
+                         return true;
+                       });
+  }
+  return within_range;
+}
+
+bool BlockHashWorld::isFreeSpaceUpdateAllowed(
+    const Eigen::Vector3d& sensor_origin, const Eigen::Vector3i& voxel) const {
+  const Eigen::Vector3d voxel_center = getVoxelCenter(voxel);
+  return (voxel_center - sensor_origin).norm() < params_.max_free_space ||
+         voxel_center.z() >
+             (sensor_origin.z() - params_.min_height_free_space);
+}
+
+void BlockHashWorld::castRay(const Eigen::Vector3d& sensor_origin,
+                             const Eigen::Vector3d& point) {
+  const bool endpoint_occupied =
+      computeRayVoxels(sensor_origin, point,
+                       [this](const Eigen::Vector3i& voxel) {
+                         free_voxels_.push_back(encodeVoxel(voxel));
+                       });
+  if (endpoint_occupied) {
+    occupied_voxels_.push_back(encodeVoxel(getVoxelIndex(point)));
+  }
+}
+
+void BlockHashWorld::castWeightedRay(const Eigen::Vector3d& sensor_origin,
+                                     const Eigen::Vector3d& point,
+                                     double weight) {
+  const bool endpoint_occupied = computeRayVoxels(
+      sensor_origin, point, [this, weight](const Eigen::Vector3i& voxel) {
+        weighted_free_voxels_.push_back(
+            std::make_pair(encodeVoxel(voxel), weight));
+      });
+  if (endpoint_occupied) {
+    weighted_occupied_voxels_.push_back(
+        std::make_pair(encodeVoxel(getVoxelIndex(point)), weight));
+  }
+}
+
+void BlockHashWorld::updateVoxel(uint64_t code, float log_odds_update,
+                                 Eigen::Vector3i* block_index,
+                                 Block** block) {
+  // The codes come sorted by block, so the block rarely changes.
+  const Eigen::Vector3i code_block_index = decodeBlockIndex(code);
+  if (*block == NULL || code_block_index != *block_index) {
+    *block_index = code_block_index;
+    *block = getOrCreateBlock(code_block_index);
+  }
+  float& log_odds = (*block)->log_odds[code & (kNumBlockVoxels - 1)];
+  // Like octomap, new voxels start at probability 0.5.
+  const float previous = log_odds == kUnknownLogOdds ? 0.0f : log_odds;
+  log_odds = std::min(std::max(previous + log_odds_update, log_odds_min_),
+                      log_odds_max_);
+}
+
+void BlockHashWorld::updateOccupancy() {
+  std::sort(free_voxels_.begin(), free_voxels_.end());
+  free_voxels_.erase(std::unique(free_voxels_.begin(), free_voxels_.end()),
+                     free_voxels_.end());
+  std::sort(occupied_voxels_.begin(), occupied_voxels_.end());
+  occupied_voxels_.erase(
+      std::unique(occupied_voxels_.begin(), occupied_voxels_.end()),
+      occupied_voxels_.end());
+
+  Eigen::Vector3i block_index;
+  Block* block = NULL;
+  for (uint64_t code : occupied_voxels_) {
+    updateVoxel(code, log_odds_hit_, &block_index, &block);
+  }
+  // Both lists are sorted, so the occupied voxels are skipped in one pass.
+  std::vector<uint64_t>::const_iterator occupied_it = occupied_voxels_.begin();
+  for (uint64_t code : free_voxels_) {
+    while (occupied_it != occupied_voxels_.end() && *occupied_it < code) {
+      ++occupied_it;
+    }
+    if (occupied_it != occupied_voxels_.end() && *occupied_it == code) {
+      continue;
+    }
+    updateVoxel(code, log_odds_miss_, &block_index, &block);
+  }
+  free_voxels_.clear();
+  occupied_voxels_.clear();
+}
+
+void BlockHashWorld::updateOccupancyWithWeights() {
+  collapseWeightedVoxels(&weighted_free_voxels_);
+  collapseWeightedVoxels(&weighted_occupied_voxels_);
+
+  Eigen::Vector3i block_index;
+  Block* block = NULL;
+  // Scales the hit and miss log-odds by the weights.
+  for (const std::pair<uint64_t, double>& voxel : weighted_occupied_voxels_) {
+    updateVoxel(voxel.first, static_cast<float>(voxel.second * log_odds_hit_),
+                &block_index, &block);
+  }
+  WeightedVoxels::const_iterator occupied_it =
+      weighted_occupied_voxels_.begin();
+  for (const std::pair<uint64_t, double>& voxel : weighted_free_voxels_) {
+    while (occupied_it != weighted_occupied_voxels_.end() &&
+           occupied_it->first < voxel.first) {
+      ++occupied_it;
+    }
+    if (occupied_it != weighted_occupied_voxels_.end() &&
+        occupied_it->first == voxel.first) {
+      continue;
+    }
+    updateVoxel(voxel.first, static_cast<float>(voxel.second * log_odds_miss_),
+                &block_index, &block);
+  }
+  weighted_free_voxels_.clear();
+  weighted_occupied_voxels_.clear();
+}
+
+void BlockHashWorld::insertPointcloudIntoMapImpl(
+    const Transformation& T_G_sensor,
+    const pcl::PointCloud<pcl::PointXYZ>::Ptr& pointcloud_sensor) {
+  const Eigen::Vector3d sensor_origin = T_G_sensor.getPosition();
+  const Eigen::Matrix3d R_G_sensor = T_G_sensor.getRotationMatrix();
+  for (const pcl::PointXYZ& point : *pointcloud_sensor) {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+        !std::isfinite(point.z)) {
+      continue;
+    }
+    castRay(sensor_origin,
+            R_G_sensor * Eigen::Vector3d(point.x, point.y, point.z) +
+                sensor_origin);
+  }
+  updateOccupancy();
+}
+
+void BlockHashWorld::insertPointcloudIntoMapWithWeightsImpl(
+    const Transformation& T_G_sensor,
+    const pcl::PointCloud<pcl::PointXYZ>::Ptr& pointcloud_sensor,
+    const std::vector<double>& weights) {
+  CHECK_EQ(pointcloud_sensor->size(), weights.size());
+  const Eigen::Vector3d sensor_origin = T_G_sensor.getPosition();
+  const Eigen::Matrix3d R_G_sensor = T_G_sensor.getRotationMatrix();
+  for (size_t i = 0; i < pointcloud_sensor->size(); ++i) {
+    const pcl::PointXYZ& point = (*pointcloud_sensor)[i];
+    if (weights[i] <= 0.0 || !std::isfinite(point.x) ||
+        !std::isfinite(point.y) || !std::isfinite(point.z)) {
+      continue;
+    }
+    castWeightedRay(sensor_origin,
+                    R_G_sensor * Eigen::Vector3d(point.x, point.y, point.z) +
+                        sensor_origin,
+                    weights[i]);
+  }
+  updateOccupancyWithWeights();
+}
+
+void BlockHashWorld::insertPointcloud2IntoMapImpl(
+    const Transformation& T_G_sensor,
+    const sensor_msgs::PointCloud2& pointcloud_sensor) {
+  const Eigen::Vector3d sensor_origin = T_G_sensor.getPosition();
+  bool has_last_voxel = false;
+  Eigen::Vector3i last_voxel;
+  const bool streamed = forEachPointInWorldFrame(
+      T_G_sensor, pointcloud_sensor, [&](double x, double y, double z) {
+        // Consecutive points of a scan often end in the same voxel, which
+        // only needs one ray.
+        const Eigen::Vector3d point(x, y, z);
+        const Eigen::Vector3i voxel = getVoxelIndex(point);
+        if (has_last_voxel && voxel == last_voxel) {
+          return;
+        }
+        castRay(sensor_origin, point);
+        has_last_voxel = true;
+        last_voxel = voxel;
+      });
+  if (streamed) {
+    updateOccupancy();
+  } else {
+    // Unusual point formats go through the PCL conversion.
+    WorldBase::insertPointcloud2IntoMapImpl(T_G_sensor, pointcloud_sensor);
+  }
+}
+
+void BlockHashWorld::insertProjectedDisparityIntoMapImpl(
+    const Transformation& sensor_to_world, const cv::Mat& projected_points) {
+  const Eigen::Vector3d sensor_origin = sensor_to_world.getPosition();
+  for (int v = 0; v < projected_points.rows; ++v) {
+    const cv::Vec3f* row_pointer = projected_points.ptr<cv::Vec3f>(v);
+    for (int u = 0; u < projected_points.cols; ++u) {
+      // Skip missing (OpenCV's MISSING_Z) and zero disparities, and points
+      // behind the camera.
+      const cv::Vec3f& point = row_pointer[u];
+      if (point[2] == 10000.0f || std::isinf(point[2]) || point[2] < 0) {
+        continue;
+      }
+      castRay(sensor_origin,
+              sensor_to_world * Eigen::Vector3d(point[0], point[1], point[2]));
+    }
+  }
+  updateOccupancy();
+}
+
+void BlockHashWorld::insertProjectedDisparityIntoMapWithWeightsImpl(
+    const Transformation& sensor_to_world, const cv::Mat& projected_points,
+    const cv::Mat& weights) {
+  CHECK_EQ(projected_points.rows, weights.rows);
+  CHECK_EQ(projected_points.cols, weights.cols);
+  const Eigen::Vector3d sensor_origin = sensor_to_world.getPosition();
+  for (int v = 0; v < projected_points.rows; ++v) {
+    const cv::Vec3f* row_pointer = projected_points.ptr<cv::Vec3f>(v);
+    const float* weight_row_pointer = weights.ptr<float>(v);
+    for (int u = 0; u < projected_points.cols; ++u) {
+      const cv::Vec3f& point = row_pointer[u];
+      if (point[2] == 10000.0f || std::isinf(point[2]) || point[2] < 0 ||
+          weight_row_pointer[u] <= 0.0f) {
+        continue;
+      }
+      castWeightedRay(
+          sensor_origin,
+          sensor_to_world * Eigen::Vector3d(point[0], point[1], point[2]),
+          weight_row_pointer[u]);
+    }
+  }
+  updateOccupancyWithWeights();
+}
+
+void BlockHashWorld::insertDisparityIntoMapImpl(
+    const Transformation& sensor_to_world, const cv::Mat& disparity,
+    const Eigen::Matrix4d& Q) {
+  const Eigen::Vector3d sensor_origin = sensor_to_world.getPosition();
+  const bool streamed = forEachDisparityPointInWorldFrame(
+      sensor_to_world, disparity, Q, 1,
+      [this, &sensor_origin](int u, int v, double x, double y, double z) {
+        castRay(sensor_origin, Eigen::Vector3d(x, y, z));
+      });
+  if (streamed) {
+    updateOccupancy();
+  } else {
+    WorldBase::insertDisparityIntoMapImpl(sensor_to_world, disparity, Q);
+  }
+}
+
+void BlockHashWorld::setLogOddsBoundingBox(
+    const Eigen::Vector3d& position, const Eigen::Vector3d& bounding_box_size,
+    float log_odds) {
+  Eigen::Vector3i min_voxel, max_voxel;
+  getVoxelRange(position, bounding_box_size, &min_voxel, &max_voxel);
+  setLogOddsVoxelRange(min_voxel, max_voxel, log_odds);
+}
+
+void BlockHashWorld::setLogOddsVoxelRange(const Eigen::Vector3i& min_voxel,
+                                          const Eigen::Vector3i& max_voxel,
+                                          float log_odds) {
+  Eigen::Vector3i block_index;
+  Block* block = NULL;
+  Eigen::Vector3i voxel;
+  for (voxel.z() = min_voxel.z(); voxel.z() <= max_voxel.z(); ++voxel.z()) {
+    for (voxel.y() = min_voxel.y(); voxel.y() <= max_voxel.y(); ++voxel.y()) {
+      for (voxel.x() = min_voxel.x(); voxel.x() <= max_voxel.x();
+           ++voxel.x()) {
+        const Eigen::Vector3i voxel_block_index = getBlockIndex(voxel);
+        if (block == NULL || voxel_block_index != block_index) {
+          block_index = voxel_block_index;
+          block = getOrCreateBlock(block_index);
+        }
+        block->log_odds[getLinearIndex(voxel)] = log_odds;
+      }
+    }
+  }
+}
+
+void BlockHashWorld::setFree(const Eigen::Vector3d& position,
+                             const Eigen::Vector3d& bounding_box_size) {
+  setLogOddsBoundingBox(position, bounding_box_size, log_odds_min_);
+}
+
+void BlockHashWorld::setOccupied(const Eigen::Vector3d& position,
+                                 const Eigen::Vector3d& bounding_box_size) {
+  setLogOddsBoundingBox(position, bounding_box_size, log_odds_max_);
+}
+
+BlockHashWorld::CellStatus BlockHashWorld::getCellStatusPoint(
+    const Eigen::Vector3d& point) const {
+  const Eigen::Vector3i voxel = getVoxelIndex(point);
+  const Block* block = findBlock(getBlockIndex(voxel));
+  if (block == NULL) {
+    return getUnknownStatus();
+  }
+  const float log_odds = block->log_odds[getLinearIndex(voxel)];
+  if (log_odds == kUnknownLogOdds) {
+    return getUnknownStatus();
+  } else if (isOccupied(log_odds)) {
+    return CellStatus::kOccupied;
+  } else {
+    return CellStatus::kFree;
+  }
+}
+
+BlockHashWorld::CellStatus BlockHashWorld::getCellStatusBoundingBox(
+    const Eigen::Vector3d& point,
+    const Eigen::Vector3d& bounding_box_size) const {
+  Eigen::Vector3i min_voxel, max_voxel;
+  getVoxelRange(point, bounding_box_size, &min_voxel, &max_voxel);
+  const Eigen::Vector3i min_block = getBlockIndex(min_voxel);
+  const Eigen::Vector3i max_block = getBlockIndex(max_voxel);
+
+  // Occupied voxels take precedence over unknown ones, so the box is only
+  // unknown once all of it is checked.
+  bool unknown_found = false;
+  Eigen::Vector3i block_index;
+  for (block_index.z() = min_block.z(); block_index.z() <= max_block.z();
+       ++block_index.z()) {
+    for (block_index.y() = min_block.y(); block_index.y() <= max_block.y();
+         ++block_index.y()) {
+      for (block_index.x() = min_block.x(); block_index.x() <= max_block.x();
+           ++block_index.x()) {
+        const Block* block = findBlock(block_index);
+        if (block == NULL) {
+          if (params_.treat_unknown_as_occupied) {
+            return CellStatus::kOccupied;
+          }
+          unknown_found = true;
+          continue;
+        }
+        // The part of the box in this block, in voxels of the block.
+        const Eigen::Vector3i block_origin = block_index * kBlockSize;
+        const Eigen::Vector3i begin =
+            (min_voxel - block_origin).cwiseMax(Eigen::Vector3i::Zero());
+        const Eigen::Vector3i last = (max_voxel - block_origin).cwiseMin(
+            Eigen::Vector3i::Constant(kBlockSize - 1));
+        for (int z = begin.z(); z <= last.z(); ++z) {
+          for (int y = begin.y(); y <= last.y(); ++y) {
+            const float* row =
+                block->log_odds + kBlockSize * (y + kBlockSize * z);
+            for (int x = begin.x(); x <= last.x(); ++x) {
+              if (isOccupied(row[x])) {
+                return CellStatus::kOccupied;
+              }
+              if (row[x] == kUnknownLogOdds) {
+                if (params_.treat_unknown_as_occupied) {
+                  return CellStatus::kOccupied;
+                }
+                unknown_found = true;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  return unknown_found ? CellStatus::kUnknown : CellStatus::kFree;
+}
+
+BlockHashWorld::CellStatus BlockHashWorld::getLineStatus(
+    const Eigen::Vector3d& start, const Eigen::Vector3d& end) const {
+  CellStatus status = CellStatus::kFree;
+  // Neighboring voxels on the line are mostly in the same block.
+  Eigen::Vector3i block_index;
+  const Block* block = NULL;
+  bool has_block = false;
+  forEachVoxelOnLine(start, end, [&](const Eigen::Vector3i& voxel) {
+    const Eigen::Vector3i voxel_block_index = getBlockIndex(voxel);
+    if (!has_block || voxel_block_index != block_index) {
+      block_index = voxel_block_index;
+      block = findBlock(block_index);
+      has_block = true;
+    }
+    const float log_odds = block == NULL
+                               ? kUnknownLogOdds
+                               : block->log_odds[getLinearIndex(voxel)];
+    if (log_odds == kUnknownLogOdds) {
+      status = getUnknownStatus();
+      return false;
+    } else if (isOccupied(log_odds)) {
+      status = CellStatus::kOccupied;
+      return false;
+    }
+    return true;
+  });
+  return status;
+}
+
+BlockHashWorld::CellStatus BlockHashWorld::getLineStatusBoundingBox(
+    const Eigen::Vector3d& start, const Eigen::Vector3d& end,
+    const Eigen::Vector3d& bounding_box_size) const {
+  // Sweeps the lines between the same offsets as OctomapWorld, with steps
+  // smaller than the resolution so no voxel is missed.
+  const double epsilon = 0.001;
+  Eigen::Vector3d disc;
+  for (int axis = 0; axis < 3; ++axis) {
+    disc[axis] = bounding_box_size[axis] /
+                 std::ceil((bounding_box_size[axis] + epsilon) /
+                           params_.resolution);
+    if (disc[axis] <= 0.0) {
+      disc[axis] = 1.0;
+    }
+  }
+
+  const Eigen::Vector3d bounding_box_half_size = bounding_box_size * 0.5;
+  for (double x = -bounding_box_half_size.x(); x <= bounding_box_half_size.x();
+       x += disc.x()) {
+    for (double y = -bounding_box_half_size.y();
+         y <= bounding_box_half_size.y(); y += disc.y()) {
+      for (double z = -bounding_box_half_size.z();
+           z <= bounding_box_half_size.z(); z += disc.z()) {
+        const Eigen::Vector3d offset(x, y, z);
+        const CellStatus status = getLineStatus(start + offset, end + offset);
+        if (status != CellStatus::kFree) {
+          return status;
+        }
+      }
+    }
+  }
+  return CellStatus::kFree;
+}
+
+void BlockHashWorld::getOccupiedPointCloud(
+    pcl::PointCloud<pcl::PointXYZ>* output_cloud) const {
+  CHECK_NOTNULL(output_cloud);
+  output_cloud->clear();
+  for (const BlockMap::value_type& block : blocks_) {
+    const Eigen::Vector3i block_origin = block.first * kBlockSize;
+    for (int i = 0; i < kNumBlockVoxels; ++i) {
+      if (!isOccupied(block.second->log_odds[i])) {
+        continue;
+      }
+      const Eigen::Vector3i local(i % kBlockSize, (i / kBlockSize) % kBlockSize,
+                                  i / (kBlockSize * kBlockSize));
+      const Eigen::Vector3d center = getVoxelCenter(block_origin + local);
+      output_cloud->push_back(
+          pcl::PointXYZ(center.x(), center.y(), center.z()));
+    }
+  }
+}
+
+void BlockHashWorld::getOccupiedPointcloudInBoundingBox(
+    const Eigen::Vector3d& center, const Eigen::Vector3d& bounding_box_size,
+    pcl::PointCloud<pcl::PointXYZ>* output_cloud) const {
+  CHECK_NOTNULL(output_cloud);
+  output_cloud->clear();
+  Eigen::Vector3i min_voxel, max_voxel;
+  getVoxelRange(center, bounding_box_size, &min_voxel, &max_voxel);
+  const Eigen::Vector3i min_block = getBlockIndex(min_voxel);
+  const Eigen::Vector3i max_block = getBlockIndex(max_voxel);
+
+  for (const BlockMap::value_type& block : blocks_) {
+    if ((block.first.array() < min_block.array()).any() ||
+        (block.first.array() > max_block.array()).any()) {
+      continue;
+    }
+    const Eigen::Vector3i block_origin = block.first * kBlockSize;
+    for (int i = 0; i < kNumBlockVoxels; ++i) {
+      if (!isOccupied(block.second->log_odds[i])) {
+        continue;
+      }
+      const Eigen::Vector3i voxel =
+          block_origin + Eigen::Vector3i(i % kBlockSize,
+                                         (i / kBlockSize) % kBlockSize,
+                                         i / (kBlockSize * kBlockSize));
+      if ((voxel.array() < min_voxel.array()).any() ||
+          (voxel.array() > max_voxel.array()).any()) {
+        continue;
+      }
+      const Eigen::Vector3d voxel_center = getVoxelCenter(voxel);
+      output_cloud->push_back(pcl::PointXYZ(
+          voxel_center.x(), voxel_center.y(), voxel_center.z()));
+    }
+  }
+}
+
+bool BlockHashWorld::checkCollisionWithRobot(
+    const Eigen::Vector3d& robot_position) {
+  return checkSinglePoseCollision(robot_position);
+}
+
+bool BlockHashWorld::checkPathForCollisionsWithRobot(
+    const std::vector<Eigen::Vector3d>& robot_positions,
+    size_t* collision_index) {
+  for (size_t i = 0; i < robot_positions.size(); ++i) {
+    if (checkSinglePoseCollision(robot_positions[i])) {
+      if (collision_index != nullptr) {
+        *collision_index = i;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BlockHashWorld::checkSinglePoseCollision(
+    const Eigen::Vector3d& robot_position) const {
+  if (params_.treat_unknown_as_occupied) {
+    return (CellStatus::kFree !=
+            getCellStatusBoundingBox(robot_position, robot_size_));
+  } else {
+    return (CellStatus::kOccupied ==
+            getCellStatusBoundingBox(robot_position, robot_size_));
+  }
+}
+
+Eigen::Vector3d BlockHashWorld::getMapCenter() const {
+  Eigen::Vector3d min_bound, max_bound;
+  getMapBounds(&min_bound, &max_bound);
+  return min_bound + (max_bound - min_bound) / 2;
+}
+
+Eigen::Vector3d BlockHashWorld::getMapSize() const {
+  Eigen::Vector3d min_bound, max_bound;
+  getMapBounds(&min_bound, &max_bound);
+  return max_bound - min_bound;
+}
+
+void BlockHashWorld::getMapBounds(Eigen::Vector3d* min_bound,
+                                  Eigen::Vector3d* max_bound) const {
+  CHECK_NOTNULL(min_bound);
+  CHECK_NOTNULL(max_bound);
+  if (blocks_.empty()) {
+    *min_bound = Eigen::Vector3d::Zero();
+    *max_bound = Eigen::Vector3d::Zero();
+    return;
+  }
+  Eigen::Vector3i min_block = blocks_.begin()->first;
+  Eigen::Vector3i max_block = min_block;
+  for (const BlockMap::value_type& block : blocks_) {
+    min_block = min_block.cwiseMin(block.first);
+    max_block = max_block.cwiseMax(block.first);
+  }
+  const double block_size = kBlockSize * params_.resolution;
+  *min_bound = min_block.cast<double>() * block_size;
+  *max_bound =
+      (max_block + Eigen::Vector3i::Ones()).cast<double>() * block_size;
+}
+
+void BlockHashWorld::writeToOctree(octomap::OcTree* octree) const {
+  CHECK_NOTNULL(octree);
+  octree->setProbHit(params_.probability_hit);
+  octree->setProbMiss(params_.probability_miss);
+  octree->setClampingThresMin(params_.threshold_min);
+  octree->setClampingThresMax(params_.threshold_max);
+  octree->setOccupancyThres(params_.threshold_occupancy);
+
+  // Octree keys are the voxel indices offset by half the key range.
+  const int key_offset = 1 << (octree->getTreeDepth() - 1);
+  const bool lazy_eval = true;
+  for (const BlockMap::value_type& block : blocks_) {
+    const Eigen::Vector3i block_origin = block.first * kBlockSize;
+    for (int i = 0; i < kNumBlockVoxels; ++i) {
+      const float log_odds = block.second->log_odds[i];
+      if (log_odds == kUnknownLogOdds) {
+        continue;
+      }
+      const Eigen::Vector3i key =
+          block_origin + Eigen::Vector3i::Constant(key_offset) +
+          Eigen::Vector3i(i % kBlockSize, (i / kBlockSize) % kBlockSize,
+                          i / (kBlockSize * kBlockSize));
+      if ((key.array() < 0).any() || (key.array() >= 2 * key_offset).any()) {
+        continue;
+      }
+      octree->setNodeValue(octomap::OcTreeKey(key.x(), key.y(), key.z()),
+                           log_odds, lazy_eval);
+    }
+  }
+  octree->updateInnerOccupancy();
+  octree->prune();
+}
+
+void BlockHashWorld::readFromOctree(const octomap::OcTree& octree) {
+  const int tree_depth = octree.getTreeDepth();
+  const int key_offset = 1 << (tree_depth - 1);
+  for (octomap::OcTree::leaf_iterator it = octree.begin_leafs(),
+                                      end = octree.end_leafs();
+       it != end; ++it) {
+    const octomap::OcTreeKey min_key = it.getIndexKey();
+    const Eigen::Vector3i min_voxel =
+        Eigen::Vector3i(min_key[0], min_key[1], min_key[2]) -
+        Eigen::Vector3i::Constant(key_offset);
+    const int leaf_size = 1 << (tree_depth - it.getDepth());
+    setLogOddsVoxelRange(
+        min_voxel, min_voxel + Eigen::Vector3i::Constant(leaf_size - 1),
+        it->getLogOdds());
+  }
+}
+
+bool BlockHashWorld::getOctomapBinaryMsg(octomap_msgs::Octomap* msg) const {
+  CHECK_NOTNULL(msg);
+  octomap::OcTree octree(params_.resolution);
+  writeToOctree(&octree);
+  return octomap_msgs::binaryMapToMsg(octree, *msg);
+}
+
+bool BlockHashWorld::getOctomapFullMsg(octomap_msgs::Octomap* msg) const {
+  CHECK_NOTNULL(msg);
+  octomap::OcTree octree(params_.resolution);
+  writeToOctree(&octree);
+  return octomap_msgs::fullMapToMsg(octree, *msg);
+}
+
+void BlockHashWorld::setOctomapFromMsg(const octomap_msgs::Octomap& msg) {
+  octomap::OcTree octree(msg.resolution);
+  if (msg.binary) {
+    if (!msg.data.empty()) {
+      std::stringstream datastream;
+      datastream.write(reinterpret_cast<const char*>(&msg.data[0]),
+                       msg.data.size());
+      octree.readBinaryData(datastream);
+    }
+  } else {
+    octomap_msgs::readTree(&octree, msg);
+  }
+  BlockHashParameters params = params_;
+  params.resolution = msg.resolution;
+  setParameters(params);
+  readFromOctree(octree);
+}
+
+bool BlockHashWorld::loadOctomapFromFile(const std::string& file_path) {
+  octomap::OcTree octree(params_.resolution);
+  if (!octree.readBinary(file_path)) {
+    return false;
+  }
+  BlockHashParameters params = params_;
+  params.resolution = octree.getResolution();
+  setParameters(params);
+  readFromOctree(octree);
+  return true;
+}
+
+bool BlockHashWorld::writeOctomapToFile(const std::string& file_path) const {
+  octomap::OcTree octree(params_.resolution);
+  writeToOctree(&octree);
+  return octree.writeBinary(file_path);
+}
+
+void BlockHashWorld::generateMarkerArray(
+    const std::string& tf_frame,
+    visualization_msgs::MarkerArray* occupied_nodes,
+    visualization_msgs::MarkerArray* free_nodes) const {
+  CHECK_NOTNULL(occupied_nodes);
+  CHECK_NOTNULL(free_nodes);
+  occupied_nodes->markers.resize(1);
+  free_nodes->markers.resize(1);
+  visualization_msgs::Marker& occupied_marker = occupied_nodes->markers[0];
+  occupied_marker.header.frame_id = tf_frame;
+  occupied_marker.ns = "map";
+  occupied_marker.id = 0;
+  occupied_marker.type = visualization_msgs::Marker::CUBE_LIST;
+  occupied_marker.scale.x = params_.resolution;
+  occupied_marker.scale.y = params_.resolution;
+  occupied_marker.scale.z = params_.resolution;
+  occupied_marker.pose.orientation.w = 1.0;
+  visualization_msgs::Marker& free_marker = free_nodes->markers[0];
+  free_marker = occupied_marker;
+  occupied_marker.color.b = 1.0;
+  occupied_marker.color.a = 1.0;
+  free_marker.color.g = 1.0;
+  free_marker.color.a = 0.25;
+
+  for (const BlockMap::value_type& block : blocks_) {
+    const Eigen::Vector3i block_origin = block.first * kBlockSize;
+    for (int i = 0; i < kNumBlockVoxels; ++i) {
+      const float log_odds = block.second->log_odds[i];
+      if (log_odds == kUnknownLogOdds) {
+        continue;
+      }
+      const Eigen::Vector3i local(i % kBlockSize, (i / kBlockSize) % kBlockSize,
+                                  i / (kBlockSize * kBlockSize));
+      const Eigen::Vector3d center = getVoxelCenter(block_origin + local);
+      geometry_msgs::Point point;
+      point.x = center.x();
+      point.y = center.y();
+      point.z = center.z();
+      (isOccupied(log_odds) ? occupied_marker : free_marker)
+          .points.push_back(point);
+    }
+  }
+
+  // Empty markers delete the ones of earlier calls.
+  occupied_marker.action = occupied_marker.points.empty()
+                               ? visualization_msgs::Marker::DELETE
+                               : visualization_msgs::Marker::ADD;
+  free_marker.action = free_marker.points.empty()
+                           ? visualization_msgs::Marker::DELETE
+                           : visualization_msgs::Marker::ADD;
+}
+
+}  // namespace volumetric_mapping
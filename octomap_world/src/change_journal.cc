@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/change_journal.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "octomap_world/key_batch.h"
+
+namespace volumetric_mapping {
+
+namespace {
+
+// Bit of a record above the Morton code that holds the state.
+const uint64_t kOccupiedBit = 1ull << 63;
+
+}  // namespace
+
+ChangeJournal::ChangeJournal(size_t capacity)
+    : capacity_(capacity), oldest_version_(0), next_version_(0) {}
+
+void ChangeJournal::setCapacity(size_t capacity) {
+  capacity_ = capacity;
+  records_.clear();
+  records_.shrink_to_fit();
+  invalidate();
+}
+
+void ChangeJournal::append(const octomap::OcTreeKey& key, bool occupied) {
+  if (capacity_ > 0) {
+    const size_t index = next_version_ % capacity_;
+    if (index >= records_.size()) {
+      records_.resize(index + 1);
+    }
+    records_[index] =
+        KeyBatch::mortonEncode(key) | (occupied ? kOccupiedBit : 0);
+  }
+  ++next_version_;
+  if (next_version_ - oldest_version_ > capacity_) {
+    oldest_version_ = next_version_ - capacity_;
+  }
+}
+
+void ChangeJournal::invalidate() {
+  // Skips a version, so that readers that are up to date lose changes too.
+  ++next_version_;
+  oldest_version_ = next_version_;
+}
+
+bool ChangeJournal::getChangesSince(uint64_t version,
+                                    std::vector<Change>* changes,
+                                    uint64_t* next_version) const {
+  CHECK_NOTNULL(changes);
+  CHECK_NOTNULL(next_version);
+  const bool complete = version >= oldest_version_ && version <= next_version_;
+  if (!complete) {
+    version = oldest_version_;
+  }
+  changes->reserve(changes->size() + (next_version_ - version));
+  for (; version < next_version_; ++version) {
+    const uint64_t record = records_[version % capacity_];
+    Change change;
+    change.key = KeyBatch::mortonDecode(record & ~kOccupiedBit);
+    change.occupied = (record & kOccupiedBit) != 0;
+    changes->push_back(change);
+  }
+  *next_version = next_version_;
+  return complete;
+}
+
+bool ChangeJournal::getChangesForConsumer(const std::string& consumer,
+                                          std::vector<Change>* changes) {
+  uint64_t& version = consumer_versions_[consumer];
+  return getChangesSince(version, changes, &version);
+}
+
+void ChangeJournal::removeConsumer(const std::string& consumer) {
+  consumer_versions_.erase(consumer);
+}
+
+size_t ChangeJournal::getMemoryUsage() const {
+  size_t bytes = sizeof(*this) + records_.capacity() * sizeof(uint64_t) +
+                 consumer_versions_.bucket_count() * sizeof(void*);
+  for (const std::pair<const std::string, uint64_t>& consumer :
+       consumer_versions_) {
+    bytes += sizeof(consumer) + sizeof(void*) + consumer.first.capacity();
+  }
+  return bytes;
+}
+
+}  // namespace volumetric_mapping
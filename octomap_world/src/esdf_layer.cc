@@ -0,0 +1,306 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/esdf_layer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glog/logging.h>
+
+namespace volumetric_mapping {
+
+const int32_t EsdfLayer::kInfiniteDistance =
+    std::numeric_limits<int32_t>::max();
+
+EsdfLayer::EsdfLayer(double resolution, double max_distance)
+    : resolution_(resolution), max_distance_(max_distance), num_obstacles_(0) {
+  CHECK_GT(resolution_, 0.0);
+  CHECK_GE(max_distance_, 0.0);
+  const double max_distance_voxels = max_distance_ / resolution_;
+  max_distance_sq_ = static_cast<int32_t>(
+      std::ceil(max_distance_voxels * max_distance_voxels));
+}
+
+void EsdfLayer::clear() {
+  voxels_.clear();
+  num_obstacles_ = 0;
+  open_ = decltype(open_)();
+  cleared_keys_.clear();
+}
+
+void EsdfLayer::setOccupied(const octomap::OcTreeKey& key) {
+  Voxel& voxel = voxels_[key];
+  if (voxel.is_obstacle) {
+    return;
+  }
+  voxel.is_obstacle = true;
+  ++num_obstacles_;
+  voxel.obstacle = key;
+  voxel.has_obstacle = true;
+  voxel.distance_sq = 0;
+  // If the voxel was just freed, its raise entry is still queued and runs
+  // first, so the voxel is lowered from this second entry afterwards.
+  open_.push(QueueEntry(0, key));
+}
+
+void EsdfLayer::setFree(const octomap::OcTreeKey& key) {
+  VoxelMap::iterator it = voxels_.find(key);
+  if (it == voxels_.end() || !it->second.is_obstacle) {
+    return;
+  }
+  Voxel& voxel = it->second;
+  voxel.is_obstacle = false;
+  --num_obstacles_;
+  voxel.has_obstacle = false;
+  voxel.distance_sq = kInfiniteDistance;
+  voxel.raise = true;
+  cleared_keys_.push_back(key);
+  open_.push(QueueEntry(0, key));
+}
+
+bool EsdfLayer::isOccupied(const octomap::OcTreeKey& key) const {
+  VoxelMap::const_iterator it = voxels_.find(key);
+  return it != voxels_.end() && it->second.is_obstacle;
+}
+
+void EsdfLayer::setOccupiedBoxSurface(const octomap::OcTreeKey& min_key,
+                                      const octomap::OcTreeKey& max_key) {
+  for (unsigned int x = min_key[0]; x <= max_key[0]; ++x) {
+    const bool x_surface = x == min_key[0] || x == max_key[0];
+    for (unsigned int y = min_key[1]; y <= max_key[1]; ++y) {
+      if (x_surface || y == min_key[1] || y == max_key[1]) {
+        for (unsigned int z = min_key[2]; z <= max_key[2]; ++z) {
+          setOccupied(octomap::OcTreeKey(x, y, z));
+        }
+      } else {
+        setOccupied(octomap::OcTreeKey(x, y, min_key[2]));
+        setOccupied(octomap::OcTreeKey(x, y, max_key[2]));
+      }
+    }
+  }
+}
+
+void EsdfLayer::setBoxFree(const octomap::OcTreeKey& min_key,
+                           const octomap::OcTreeKey& max_key) {
+  uint64_t num_box_voxels = 1;
+  for (int i = 0; i < 3; ++i) {
+    num_box_voxels *= max_key[i] - min_key[i] + 1;
+  }
+  // Big boxes are cheaper to find among the stored voxels.
+  if (num_box_voxels > voxels_.size()) {
+    std::vector<octomap::OcTreeKey> keys;
+    for (const VoxelMap::value_type& voxel : voxels_) {
+      const octomap::OcTreeKey& key = voxel.first;
+      if (voxel.second.is_obstacle && key[0] >= min_key[0] &&
+          key[0] <= max_key[0] && key[1] >= min_key[1] &&
+          key[1] <= max_key[1] && key[2] >= min_key[2] &&
+          key[2] <= max_key[2]) {
+        keys.push_back(key);
+      }
+    }
+    for (const octomap::OcTreeKey& key : keys) {
+      setFree(key);
+    }
+    return;
+  }
+  for (unsigned int x = min_key[0]; x <= max_key[0]; ++x) {
+    for (unsigned int y = min_key[1]; y <= max_key[1]; ++y) {
+      for (unsigned int z = min_key[2]; z <= max_key[2]; ++z) {
+        setFree(octomap::OcTreeKey(x, y, z));
+      }
+    }
+  }
+}
+
+void EsdfLayer::update() {
+  while (!open_.empty()) {
+    const QueueEntry entry = open_.top();
+    open_.pop();
+    VoxelMap::const_iterator it = voxels_.find(entry.second);
+    if (it == voxels_.end()) {
+      continue;
+    }
+    if (it->second.raise) {
+      processRaise(entry.second);
+    } else if (it->second.has_obstacle && isOccupied(it->second.obstacle)) {
+      // Entries queued before the voxel got closer to another obstacle are
+      // stale.
+      if (entry.first != it->second.distance_sq) {
+        continue;
+      }
+      // Copied, since lowering the neighbors can rehash the map.
+      const Voxel voxel = it->second;
+      processLower(entry.second, voxel);
+    }
+  }
+
+  // Only keep the voxels that are still within range of an obstacle.
+  for (const octomap::OcTreeKey& key : cleared_keys_) {
+    VoxelMap::iterator it = voxels_.find(key);
+    if (it != voxels_.end() && !it->second.has_obstacle &&
+        !it->second.is_obstacle && !it->second.raise) {
+      voxels_.erase(it);
+    }
+  }
+  cleared_keys_.clear();
+}
+
+void EsdfLayer::processRaise(const octomap::OcTreeKey& key) {
+  getNeighbors(key, &neighbors_);
+  for (const octomap::OcTreeKey& neighbor_key : neighbors_) {
+    VoxelMap::iterator it = voxels_.find(neighbor_key);
+    if (it == voxels_.end()) {
+      continue;
+    }
+    Voxel& neighbor = it->second;
+    if (!neighbor.has_obstacle || neighbor.raise) {
+      continue;
+    }
+    open_.push(QueueEntry(neighbor.distance_sq, neighbor_key));
+    if (!isOccupied(neighbor.obstacle)) {
+      // The neighbor lost its obstacle as well, so keep raising.
+      neighbor.has_obstacle = false;
+      neighbor.distance_sq = kInfiniteDistance;
+      neighbor.raise = true;
+      cleared_keys_.push_back(neighbor_key);
+    }
+    // Otherwise the neighbor is at the border of the cleared region and
+    // lowers it again from its own obstacle.
+  }
+  voxels_[key].raise = false;
+}
+
+void EsdfLayer::processLower(const octomap::OcTreeKey& key,
+                             const Voxel& voxel) {
+  getNeighbors(key, &neighbors_);
+  for (const octomap::OcTreeKey& neighbor_key : neighbors_) {
+    const int32_t distance_sq = squaredKeyDistance(voxel.obstacle, neighbor_key);
+    if (distance_sq > max_distance_sq_) {
+      continue;
+    }
+    Voxel& neighbor = voxels_[neighbor_key];
+    if (neighbor.raise || distance_sq >= neighbor.distance_sq) {
+      continue;
+    }
+    neighbor.obstacle = voxel.obstacle;
+    neighbor.has_obstacle = true;
+    neighbor.distance_sq = distance_sq;
+    open_.push(QueueEntry(distance_sq, neighbor_key));
+  }
+}
+
+double EsdfLayer::getDistance(const octomap::OcTreeKey& key) const {
+  VoxelMap::const_iterator it = voxels_.find(key);
+  if (it == voxels_.end() || !it->second.has_obstacle) {
+    return max_distance_;
+  }
+  return squaredDistanceToMeters(it->second.distance_sq);
+}
+
+double EsdfLayer::getDistanceAndGradient(const octomap::OcTreeKey& key,
+                                         Eigen::Vector3d* gradient) const {
+  CHECK_NOTNULL(gradient);
+  const double distance = getDistance(key);
+  for (int i = 0; i < 3; ++i) {
+    // Fall back to one-sided differences at the edges of the key range.
+    octomap::OcTreeKey plus_key = key, minus_key = key;
+    double step = 0.0;
+    if (key[i] < std::numeric_limits<octomap::key_type>::max()) {
+      ++plus_key[i];
+      step += 1.0;
+    }
+    if (key[i] > 0) {
+      --minus_key[i];
+      step += 1.0;
+    }
+    (*gradient)(i) = (getDistance(plus_key) - getDistance(minus_key)) /
+                     (step * resolution_);
+  }
+  return distance;
+}
+
+bool EsdfLayer::getClosestObstacle(const octomap::OcTreeKey& key,
+                                   octomap::OcTreeKey* obstacle_key) const {
+  CHECK_NOTNULL(obstacle_key);
+  VoxelMap::const_iterator it = voxels_.find(key);
+  if (it == voxels_.end() || !it->second.has_obstacle) {
+    return false;
+  }
+  *obstacle_key = it->second.obstacle;
+  return true;
+}
+
+int32_t EsdfLayer::squaredKeyDistance(const octomap::OcTreeKey& a,
+                                      const octomap::OcTreeKey& b) {
+  int32_t distance_sq = 0;
+  for (int i = 0; i < 3; ++i) {
+    const int32_t diff = static_cast<int32_t>(a[i]) - static_cast<int32_t>(b[i]);
+    distance_sq += diff * diff;
+  }
+  return distance_sq;
+}
+
+void EsdfLayer::getNeighbors(const octomap::OcTreeKey& key,
+                             std::vector<octomap::OcTreeKey>* neighbors) {
+  CHECK_NOTNULL(neighbors);
+  neighbors->clear();
+  const int key_max = std::numeric_limits<octomap::key_type>::max();
+  for (int dx = -1; dx <= 1; ++dx) {
+    for (int dy = -1; dy <= 1; ++dy) {
+      for (int dz = -1; dz <= 1; ++dz) {
+        if (dx == 0 && dy == 0 && dz == 0) {
+          continue;
+        }
+        const int x = key[0] + dx, y = key[1] + dy, z = key[2] + dz;
+        if (x < 0 || y < 0 || z < 0 || x > key_max || y > key_max ||
+            z > key_max) {
+          continue;
+        }
+        neighbors->push_back(octomap::OcTreeKey(x, y, z));
+      }
+    }
+  }
+}
+
+size_t EsdfLayer::getMemoryUsage() const {
+  // A hash map node holds the value and the next pointer.
+  return sizeof(*this) + voxels_.bucket_count() * sizeof(void*) +
+         voxels_.size() * (sizeof(VoxelMap::value_type) + sizeof(void*)) +
+         open_.size() * sizeof(QueueEntry) +
+         (cleared_keys_.capacity() + neighbors_.capacity()) *
+             sizeof(octomap::OcTreeKey);
+}
+
+double EsdfLayer::squaredDistanceToMeters(int32_t distance_sq) const {
+  return std::min(max_distance_, std::sqrt(distance_sq) * resolution_);
+}
+
+}  // namespace volumetric_mapping
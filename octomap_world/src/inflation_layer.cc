@@ -0,0 +1,466 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/inflation_layer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <glog/logging.h>
+
+#include "octomap_world/key_batch.h"
+
+namespace volumetric_mapping {
+namespace {
+
+// Beyond this many blocks changed by a single node, a full update is cheaper
+// than keeping track of them.
+const uint64_t kMaxChangedBlocks = 4096;
+
+int floorDivide(int value, int divisor) {
+  return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+}
+
+int countBits(uint16_t row) {
+  int count = 0;
+  for (; row != 0; row &= row - 1) {
+    ++count;
+  }
+  return count;
+}
+
+}  // namespace
+
+const unsigned int InflationLayer::kBlockLevels;
+const int InflationLayer::kBlockSize;
+const int InflationLayer::kNumBlocks;
+
+void InflationLayer::Mask::clear() { std::memset(rows, 0, sizeof(rows)); }
+
+void InflationLayer::Mask::fill() { std::memset(rows, 0xff, sizeof(rows)); }
+
+bool InflationLayer::Mask::empty() const {
+  for (int x = 0; x < kBlockSize; ++x) {
+    for (int y = 0; y < kBlockSize; ++y) {
+      if (rows[x][y] != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool InflationLayer::Mask::full() const {
+  for (int x = 0; x < kBlockSize; ++x) {
+    for (int y = 0; y < kBlockSize; ++y) {
+      if (rows[x][y] != 0xffff) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void InflationLayer::Mask::setBox(const Eigen::Vector3i& min,
+                                  const Eigen::Vector3i& max) {
+  const uint16_t bits = static_cast<uint16_t>(((1u << (max.z() + 1)) - 1) &
+                                              ~((1u << min.z()) - 1));
+  for (int x = min.x(); x <= max.x(); ++x) {
+    for (int y = min.y(); y <= max.y(); ++y) {
+      rows[x][y] |= bits;
+    }
+  }
+}
+
+InflationLayer::Mask& InflationLayer::Mask::operator|=(const Mask& rhs) {
+  for (int x = 0; x < kBlockSize; ++x) {
+    for (int y = 0; y < kBlockSize; ++y) {
+      rows[x][y] |= rhs.rows[x][y];
+    }
+  }
+  return *this;
+}
+
+InflationLayer::Mask& InflationLayer::Mask::operator&=(const Mask& rhs) {
+  for (int x = 0; x < kBlockSize; ++x) {
+    for (int y = 0; y < kBlockSize; ++y) {
+      rows[x][y] &= rhs.rows[x][y];
+    }
+  }
+  return *this;
+}
+
+InflationLayer::Mask InflationLayer::Mask::operator~() const {
+  Mask mask;
+  for (int x = 0; x < kBlockSize; ++x) {
+    for (int y = 0; y < kBlockSize; ++y) {
+      mask.rows[x][y] = static_cast<uint16_t>(~rows[x][y]);
+    }
+  }
+  return mask;
+}
+
+InflationLayer::InflationLayer()
+    : radius_(Eigen::Vector3i::Zero()),
+      unknown_as_occupied_(false),
+      full_update_needed_(true) {}
+
+void InflationLayer::clear() {
+  inflated_.clear();
+  changed_blocks_.clear();
+  full_update_needed_ = true;
+}
+
+void InflationLayer::markChanged(const std::vector<uint64_t>& codes) {
+  if (full_update_needed_) {
+    return;
+  }
+  const unsigned int block_shift = 3 * kBlockLevels;
+  // The codes usually come in runs within the same block.
+  bool has_last_block = false;
+  uint64_t last_block = 0;
+  for (const uint64_t code : codes) {
+    const uint64_t block_code = code >> block_shift;
+    if (!has_last_block || block_code != last_block) {
+      changed_blocks_.insert(block_code);
+      last_block = block_code;
+      has_last_block = true;
+    }
+  }
+}
+
+void InflationLayer::markChanged(uint64_t min_code, unsigned int levels) {
+  if (full_update_needed_) {
+    return;
+  }
+  const uint64_t min_block = min_code >> (3 * kBlockLevels);
+  if (levels <= kBlockLevels) {
+    changed_blocks_.insert(min_block);
+    return;
+  }
+  const uint64_t num_blocks = uint64_t(1) << (3 * (levels - kBlockLevels));
+  if (num_blocks > kMaxChangedBlocks) {
+    full_update_needed_ = true;
+    changed_blocks_.clear();
+    return;
+  }
+  for (uint64_t block = min_block; block < min_block + num_blocks; ++block) {
+    changed_blocks_.insert(block);
+  }
+}
+
+void InflationLayer::clearChanged() { changed_blocks_.clear(); }
+
+bool InflationLayer::needsFullUpdate(const Eigen::Vector3i& radius,
+                                     bool unknown_as_occupied) const {
+  return full_update_needed_ || radius != radius_ ||
+         unknown_as_occupied != unknown_as_occupied_;
+}
+
+void InflationLayer::getChangedBlocks(std::vector<uint64_t>* blocks) const {
+  CHECK_NOTNULL(blocks);
+  blocks->assign(changed_blocks_.begin(), changed_blocks_.end());
+}
+
+void InflationLayer::update(const Eigen::Vector3i& radius,
+                            bool unknown_as_occupied,
+                            const std::vector<uint64_t>& blocks,
+                            const BlockReader& read_block, Result* result) {
+  CHECK_NOTNULL(result);
+  CHECK_GE(radius.minCoeff(), 0);
+  const bool full_update = needsFullUpdate(radius, unknown_as_occupied);
+
+  // Only voxels within the radius of the given blocks can change, and only
+  // obstacles within the radius of those are needed to compute them.
+  const Eigen::Vector3i block_radius =
+      (radius + Eigen::Vector3i::Constant(kBlockSize - 1)) / kBlockSize;
+  std::unordered_set<uint64_t> seeds(blocks.begin(), blocks.end());
+  if (full_update) {
+    for (const std::pair<const uint64_t, InflatedBlock>& block : inflated_) {
+      seeds.insert(block.first);
+    }
+  }
+  std::unordered_set<uint64_t> targets;
+  expandRegion(seeds, block_radius, &targets);
+  std::unordered_set<uint64_t> region;
+  expandRegion(targets, block_radius, &region);
+
+  // Inflated voxels that were freed in the meantime are not inflated any
+  // more, and the ones that are still occupied are no obstacles.
+  MaskMap sources;
+  MaskMap candidates;
+  MaskMap unknown_candidates;
+  BlockState state;
+  for (const uint64_t block_code : region) {
+    state.occupied.clear();
+    state.free.clear();
+    state.outside_bounds.clear();
+    read_block(block_code, &state);
+
+    Mask inflated;
+    InflatedBlockMap::iterator inflated_it = inflated_.find(block_code);
+    if (inflated_it != inflated_.end()) {
+      inflated_it->second.voxels &= state.occupied;
+      inflated_it->second.unknown &= state.occupied;
+      if (inflated_it->second.voxels.empty()) {
+        inflated_.erase(inflated_it);
+      } else {
+        inflated = inflated_it->second.voxels;
+      }
+    }
+    Mask known = state.occupied;
+    known |= state.free;
+    const Mask unknown = ~known;
+
+    Mask source = state.occupied;
+    source &= ~inflated;
+    if (unknown_as_occupied) {
+      Mask unknown_inside = unknown;
+      unknown_inside &= ~state.outside_bounds;
+      source |= unknown_inside;
+    }
+    if (!source.empty()) {
+      sources[block_code] = source;
+    }
+
+    if (targets.count(block_code) > 0) {
+      Mask unknown_candidate = unknown;
+      unknown_candidate &= state.outside_bounds;
+      Mask candidate = unknown_candidate;
+      candidate |= state.free;
+      candidate |= inflated;
+      if (!candidate.empty()) {
+        candidates[block_code] = candidate;
+      }
+      if (!unknown_candidate.empty()) {
+        unknown_candidates[block_code] = unknown_candidate;
+      }
+    }
+  }
+
+  // Dilation by a box is separable, and along each axis a radius is covered
+  // by steps that at most double it.
+  MaskMap dilated = sources;
+  MaskMap step_output;
+  for (int axis = 0; axis < 3; ++axis) {
+    for (int covered = 0; covered < radius[axis];) {
+      const int step = std::min(covered + 1, radius[axis] - covered);
+      dilateStep(dilated, axis, step, region, &step_output);
+      dilated.swap(step_output);
+      covered += step;
+    }
+  }
+
+  const Mask empty_mask;
+  for (const uint64_t block_code : targets) {
+    MaskMap::const_iterator candidate_it = candidates.find(block_code);
+    InflatedBlockMap::iterator inflated_it = inflated_.find(block_code);
+    if (candidate_it == candidates.end() && inflated_it == inflated_.end()) {
+      continue;
+    }
+    MaskMap::const_iterator dilated_it = dilated.find(block_code);
+    MaskMap::const_iterator source_it = sources.find(block_code);
+    MaskMap::const_iterator unknown_it = unknown_candidates.find(block_code);
+
+    Mask wanted = candidate_it == candidates.end() ? empty_mask
+                                                   : candidate_it->second;
+    wanted &= dilated_it == dilated.end() ? empty_mask : dilated_it->second;
+    if (source_it != sources.end()) {
+      wanted &= ~source_it->second;
+    }
+    InflatedBlock previous;
+    if (inflated_it != inflated_.end()) {
+      previous = inflated_it->second;
+    }
+
+    Mask newly_inflated = wanted;
+    newly_inflated &= ~previous.voxels;
+    appendVoxels(block_code, newly_inflated, &result->occupied_codes,
+                 &result->occupied_blocks);
+    Mask no_longer_inflated = previous.voxels;
+    no_longer_inflated &= ~wanted;
+    Mask back_to_unknown = no_longer_inflated;
+    back_to_unknown &= previous.unknown;
+    no_longer_inflated &= ~previous.unknown;
+    appendVoxels(block_code, no_longer_inflated, &result->free_codes,
+                 &result->free_blocks);
+    appendVoxels(block_code, back_to_unknown, &result->unknown_codes,
+                 &result->unknown_blocks);
+
+    if (wanted.empty()) {
+      if (inflated_it != inflated_.end()) {
+        inflated_.erase(inflated_it);
+      }
+      continue;
+    }
+    InflatedBlock& inflated = inflated_[block_code];
+    inflated.voxels = wanted;
+    inflated.unknown = previous.unknown;
+    if (unknown_it != unknown_candidates.end()) {
+      inflated.unknown |= unknown_it->second;
+    }
+    inflated.unknown &= wanted;
+  }
+
+  radius_ = radius;
+  unknown_as_occupied_ = unknown_as_occupied;
+  full_update_needed_ = false;
+  changed_blocks_.clear();
+}
+
+size_t InflationLayer::getNumInflatedVoxels() const {
+  size_t num_voxels = 0;
+  for (const std::pair<const uint64_t, InflatedBlock>& block : inflated_) {
+    for (int x = 0; x < kBlockSize; ++x) {
+      for (int y = 0; y < kBlockSize; ++y) {
+        num_voxels += countBits(block.second.voxels.rows[x][y]);
+      }
+    }
+  }
+  return num_voxels;
+}
+
+size_t InflationLayer::getMemoryUsage() const {
+  // A hash map node holds the value and the next pointer.
+  return sizeof(*this) + inflated_.bucket_count() * sizeof(void*) +
+         inflated_.size() *
+             (sizeof(InflatedBlockMap::value_type) + sizeof(void*)) +
+         changed_blocks_.bucket_count() * sizeof(void*) +
+         changed_blocks_.size() * (sizeof(uint64_t) + sizeof(void*));
+}
+
+Eigen::Vector3i InflationLayer::getBlockIndex(uint64_t block_code) {
+  const octomap::OcTreeKey key = KeyBatch::mortonDecode(block_code);
+  return Eigen::Vector3i(key[0], key[1], key[2]);
+}
+
+uint64_t InflationLayer::getBlockCode(const Eigen::Vector3i& block_index) {
+  return KeyBatch::mortonEncode(
+      octomap::OcTreeKey(block_index.x(), block_index.y(), block_index.z()));
+}
+
+void InflationLayer::appendVoxels(uint64_t block_code, const Mask& mask,
+                                  std::vector<uint64_t>* codes,
+                                  std::vector<uint64_t>* whole_blocks) {
+  if (mask.full()) {
+    whole_blocks->push_back(block_code);
+    return;
+  }
+  const uint64_t min_code = block_code << (3 * kBlockLevels);
+  for (int x = 0; x < kBlockSize; ++x) {
+    for (int y = 0; y < kBlockSize; ++y) {
+      for (uint16_t row = mask.rows[x][y]; row != 0; row &= row - 1) {
+        const int z = __builtin_ctz(row);
+        codes->push_back(min_code |
+                         KeyBatch::mortonEncode(octomap::OcTreeKey(x, y, z)));
+      }
+    }
+  }
+}
+
+void InflationLayer::dilateStep(const MaskMap& input, int axis, int step,
+                                const std::unordered_set<uint64_t>& region,
+                                MaskMap* output) {
+  output->clear();
+  for (const std::pair<const uint64_t, Mask>& block : input) {
+    (*output)[block.first] |= block.second;
+    const Eigen::Vector3i block_index = getBlockIndex(block.first);
+    for (int sign = -1; sign <= 1; sign += 2) {
+      // Moved voxels end up in at most two blocks.
+      const int shift = sign * step;
+      const int block_offset = floorDivide(shift, kBlockSize);
+      for (int i = 0; i < 2; ++i) {
+        const int local_shift = shift - (block_offset + i) * kBlockSize;
+        if (local_shift <= -kBlockSize || local_shift >= kBlockSize) {
+          continue;
+        }
+        Eigen::Vector3i neighbor_index = block_index;
+        neighbor_index[axis] += block_offset + i;
+        if (neighbor_index[axis] < 0 || neighbor_index[axis] >= kNumBlocks) {
+          continue;
+        }
+        const uint64_t neighbor_code = getBlockCode(neighbor_index);
+        if (region.count(neighbor_code) == 0) {
+          continue;
+        }
+        orShifted(block.second, axis, local_shift, &(*output)[neighbor_code]);
+      }
+    }
+  }
+}
+
+void InflationLayer::orShifted(const Mask& mask, int axis, int shift,
+                               Mask* output) {
+  const int begin = std::max(0, -shift);
+  const int end = std::min(kBlockSize, kBlockSize - shift);
+  if (axis == 0) {
+    for (int x = begin; x < end; ++x) {
+      for (int y = 0; y < kBlockSize; ++y) {
+        output->rows[x + shift][y] |= mask.rows[x][y];
+      }
+    }
+  } else if (axis == 1) {
+    for (int x = 0; x < kBlockSize; ++x) {
+      for (int y = begin; y < end; ++y) {
+        output->rows[x][y + shift] |= mask.rows[x][y];
+      }
+    }
+  } else {
+    // Voxels along z are the bits of a row.
+    for (int x = 0; x < kBlockSize; ++x) {
+      for (int y = 0; y < kBlockSize; ++y) {
+        const uint16_t row = mask.rows[x][y];
+        output->rows[x][y] |= static_cast<uint16_t>(
+            shift >= 0 ? row << shift : row >> -shift);
+      }
+    }
+  }
+}
+
+void InflationLayer::expandRegion(const std::unordered_set<uint64_t>& blocks,
+                                  const Eigen::Vector3i& block_radius,
+                                  std::unordered_set<uint64_t>* region) {
+  for (const uint64_t block_code : blocks) {
+    const Eigen::Vector3i block_index = getBlockIndex(block_code);
+    const Eigen::Vector3i min_index =
+        (block_index - block_radius).cwiseMax(Eigen::Vector3i::Zero());
+    const Eigen::Vector3i max_index =
+        (block_index + block_radius)
+            .cwiseMin(Eigen::Vector3i::Constant(kNumBlocks - 1));
+    for (int x = min_index.x(); x <= max_index.x(); ++x) {
+      for (int y = min_index.y(); y <= max_index.y(); ++y) {
+        for (int z = min_index.z(); z <= max_index.z(); ++z) {
+          region->insert(getBlockCode(Eigen::Vector3i(x, y, z)));
+        }
+      }
+    }
+  }
+}
+
+}  // namespace volumetric_mapping
@@ -0,0 +1,197 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/instrumentation.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace volumetric_mapping {
+
+const size_t Instrumentation::kNumShards;
+const size_t Instrumentation::kNumSamples;
+const size_t Instrumentation::kNumSamplesPerShard;
+const size_t Instrumentation::kNumTimers;
+const size_t Instrumentation::kNumCounters;
+
+namespace {
+
+// Threads get their shards round robin, the same for all instrumentations.
+size_t getThreadShard() {
+  static std::atomic<size_t> next_shard(0);
+  thread_local const size_t shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) %
+      Instrumentation::kNumShards;
+  return shard;
+}
+
+}  // namespace
+
+Instrumentation::Instrumentation() { reset(); }
+
+void Instrumentation::addTime(Timer timer, int64_t nanoseconds) {
+  TimerData& data = timers_[getThreadShard()][static_cast<size_t>(timer)];
+  const uint64_t index =
+      data.num_samples.fetch_add(1, std::memory_order_relaxed);
+  data.samples_ns[index % kNumSamplesPerShard].store(
+      nanoseconds, std::memory_order_relaxed);
+  data.total_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+  int64_t max_ns = data.max_ns.load(std::memory_order_relaxed);
+  while (nanoseconds > max_ns &&
+         !data.max_ns.compare_exchange_weak(max_ns, nanoseconds,
+                                            std::memory_order_relaxed)) {
+  }
+}
+
+void Instrumentation::addCount(Counter counter, int64_t count) {
+  counters_[static_cast<size_t>(counter)].fetch_add(count,
+                                                    std::memory_order_relaxed);
+}
+
+void Instrumentation::setCount(Counter counter, int64_t value) {
+  counters_[static_cast<size_t>(counter)].store(value,
+                                                std::memory_order_relaxed);
+}
+
+void Instrumentation::getTimerStatistics(Timer timer,
+                                         TimerStatistics* statistics) const {
+  CHECK_NOTNULL(statistics);
+  // Samples that are being written while copying only shift the percentiles
+  // by one sample per shard.
+  uint64_t num_samples = 0;
+  int64_t total_ns = 0;
+  int64_t max_ns = 0;
+  std::vector<int64_t> samples_ns;
+  samples_ns.reserve(kNumSamples);
+  for (size_t shard = 0; shard < kNumShards; ++shard) {
+    const TimerData& data = timers_[shard][static_cast<size_t>(timer)];
+    const uint64_t shard_num_samples =
+        data.num_samples.load(std::memory_order_relaxed);
+    num_samples += shard_num_samples;
+    total_ns += data.total_ns.load(std::memory_order_relaxed);
+    max_ns = std::max(max_ns, data.max_ns.load(std::memory_order_relaxed));
+    const size_t num_stored = static_cast<size_t>(
+        std::min<uint64_t>(shard_num_samples, kNumSamplesPerShard));
+    for (size_t i = 0; i < num_stored; ++i) {
+      samples_ns.push_back(data.samples_ns[i].load(std::memory_order_relaxed));
+    }
+  }
+  statistics->num_samples = num_samples;
+  statistics->total_seconds = 1e-9 * total_ns;
+  statistics->max_seconds = 1e-9 * max_ns;
+  statistics->mean_seconds =
+      num_samples > 0 ? statistics->total_seconds / num_samples : 0.0;
+
+  std::sort(samples_ns.begin(), samples_ns.end());
+  const auto percentile = [&samples_ns](double fraction) {
+    if (samples_ns.empty()) {
+      return 0.0;
+    }
+    const size_t index = std::min(
+        samples_ns.size() - 1,
+        static_cast<size_t>(fraction * static_cast<double>(samples_ns.size())));
+    return 1e-9 * samples_ns[index];
+  };
+  statistics->p50_seconds = percentile(0.5);
+  statistics->p90_seconds = percentile(0.9);
+  statistics->p99_seconds = percentile(0.99);
+}
+
+int64_t Instrumentation::getCount(Counter counter) const {
+  return counters_[static_cast<size_t>(counter)].load(
+      std::memory_order_relaxed);
+}
+
+void Instrumentation::reset() {
+  for (auto& shard : timers_) {
+    for (TimerData& data : shard) {
+      data.num_samples.store(0, std::memory_order_relaxed);
+      data.total_ns.store(0, std::memory_order_relaxed);
+      data.max_ns.store(0, std::memory_order_relaxed);
+      for (std::atomic<int64_t>& sample_ns : data.samples_ns) {
+        sample_ns.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+  for (std::atomic<int64_t>& count : counters_) {
+    count.store(0, std::memory_order_relaxed);
+  }
+}
+
+const char* Instrumentation::getName(Timer timer) {
+  switch (timer) {
+    case Timer::kRayCasting:
+      return "ray_casting";
+    case Timer::kUpdateOccupancy:
+      return "update_occupancy";
+    case Timer::kBoxQuery:
+      return "box_query";
+    case Timer::kCollisionCheck:
+      return "collision_check";
+    case Timer::kVisibility:
+      return "visibility";
+    case Timer::kInflation:
+      return "inflation";
+    case Timer::kGenerateMarkers:
+      return "generate_markers";
+    case Timer::kSerialization:
+      return "serialization";
+    case Timer::kTfLookup:
+      return "tf_lookup";
+    case Timer::kPublishAll:
+      return "publish_all";
+    case Timer::kNumTimers:
+      break;
+  }
+  return "unknown";
+}
+
+const char* Instrumentation::getName(Counter counter) {
+  switch (counter) {
+    case Counter::kScansInserted:
+      return "scans_inserted";
+    case Counter::kRaysCast:
+      return "rays_cast";
+    case Counter::kKeysTouched:
+      return "keys_touched";
+    case Counter::kScansDropped:
+      return "scans_dropped";
+    case Counter::kQueueDepth:
+      return "queue_depth";
+    case Counter::kNumTreeNodes:
+      return "tree_nodes";
+    case Counter::kNumCounters:
+      break;
+  }
+  return "unknown";
+}
+
+}  // namespace volumetric_mapping
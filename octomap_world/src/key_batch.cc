@@ -0,0 +1,162 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/key_batch.h"
+
+#include <algorithm>
+
+namespace volumetric_mapping {
+
+namespace {
+
+// Spreads the lower 16 bits of x so there are two zero bits between each.
+inline uint64_t spreadBits(uint64_t x) {
+  x &= 0xffff;
+  x = (x | (x << 16)) & 0x0000ff0000ffULL;
+  x = (x | (x << 8)) & 0x00f00f00f00fULL;
+  x = (x | (x << 4)) & 0x0c30c30c30c3ULL;
+  x = (x | (x << 2)) & 0x249249249249ULL;
+  return x;
+}
+
+// Inverse of spreadBits().
+inline uint64_t compactBits(uint64_t x) {
+  x &= 0x249249249249ULL;
+  x = (x | (x >> 2)) & 0x0c30c30c30c3ULL;
+  x = (x | (x >> 4)) & 0x00f00f00f00fULL;
+  x = (x | (x >> 8)) & 0x0000ff0000ffULL;
+  x = (x | (x >> 16)) & 0xffff;
+  return x;
+}
+
+}  // namespace
+
+uint64_t KeyBatch::mortonEncode(const octomap::OcTreeKey& key) {
+  return spreadBits(key[0]) | (spreadBits(key[1]) << 1) |
+         (spreadBits(key[2]) << 2);
+}
+
+octomap::OcTreeKey KeyBatch::mortonDecode(uint64_t code) {
+  return octomap::OcTreeKey(compactBits(code), compactBits(code >> 1),
+                            compactBits(code >> 2));
+}
+
+void KeyBatch::clear() {
+  free_codes_.clear();
+  occupied_codes_.clear();
+  finalized_ = true;
+}
+
+void KeyBatch::append(const KeyBatch& other) {
+  free_codes_.insert(free_codes_.end(), other.free_codes_.begin(),
+                     other.free_codes_.end());
+  occupied_codes_.insert(occupied_codes_.end(), other.occupied_codes_.begin(),
+                         other.occupied_codes_.end());
+  finalized_ = finalized_ && other.empty();
+}
+
+void KeyBatch::finalize() {
+  if (finalized_) {
+    return;
+  }
+  radixSort(&occupied_codes_);
+  deduplicate(&occupied_codes_);
+  radixSort(&free_codes_);
+  deduplicate(&free_codes_);
+
+  // Both are sorted now, so removing the occupied keys from the free keys is
+  // a single linear merge.
+  std::vector<uint64_t>::iterator free_out = free_codes_.begin();
+  std::vector<uint64_t>::const_iterator occupied_it = occupied_codes_.begin();
+  for (std::vector<uint64_t>::const_iterator free_it = free_codes_.begin();
+       free_it != free_codes_.end(); ++free_it) {
+    while (occupied_it != occupied_codes_.end() && *occupied_it < *free_it) {
+      ++occupied_it;
+    }
+    if (occupied_it == occupied_codes_.end() || *occupied_it != *free_it) {
+      *free_out = *free_it;
+      ++free_out;
+    }
+  }
+  free_codes_.erase(free_out, free_codes_.end());
+  finalized_ = true;
+}
+
+void KeyBatch::radixSort(std::vector<uint64_t>* codes) {
+  const size_t num_codes = codes->size();
+  if (num_codes < 2) {
+    return;
+  }
+  // Small batches are faster with a comparison sort.
+  if (num_codes < 256) {
+    std::sort(codes->begin(), codes->end());
+    return;
+  }
+
+  const int kBitsPerDigit = 8;
+  const int kNumBuckets = 1 << kBitsPerDigit;
+  const int kNumCodeBits = 48;
+  sort_buffer_.resize(num_codes);
+  std::vector<uint64_t>* source = codes;
+  std::vector<uint64_t>* target = &sort_buffer_;
+  size_t bucket_offsets[kNumBuckets];
+
+  for (int shift = 0; shift < kNumCodeBits; shift += kBitsPerDigit) {
+    std::fill(bucket_offsets, bucket_offsets + kNumBuckets, 0u);
+    for (const uint64_t code : *source) {
+      ++bucket_offsets[(code >> shift) & (kNumBuckets - 1)];
+    }
+    // Keys of a local map often share their upper bits, nothing to do then.
+    if (bucket_offsets[((*source)[0] >> shift) & (kNumBuckets - 1)] ==
+        num_codes) {
+      continue;
+    }
+    size_t offset = 0u;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      const size_t count = bucket_offsets[i];
+      bucket_offsets[i] = offset;
+      offset += count;
+    }
+    for (const uint64_t code : *source) {
+      (*target)[bucket_offsets[(code >> shift) & (kNumBuckets - 1)]++] = code;
+    }
+    std::swap(source, target);
+  }
+
+  // Make sure the result ends up in the caller's vector.
+  if (source != codes) {
+    codes->swap(sort_buffer_);
+  }
+}
+
+void KeyBatch::deduplicate(std::vector<uint64_t>* codes) {
+  codes->erase(std::unique(codes->begin(), codes->end()), codes->end());
+}
+
+}  // namespace volumetric_mapping
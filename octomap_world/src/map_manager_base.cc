@@ -0,0 +1,267 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/map_manager_base.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+#include <minkindr_conversions/kindr_msg.h>
+#include <minkindr_conversions/kindr_tf.h>
+#include <minkindr_conversions/kindr_xml.h>
+
+#include "octomap_world/block_hash_world.h"
+#include "octomap_world/octomap_world.h"
+
+namespace volumetric_mapping {
+
+template <typename World>
+MapManagerBase<World>::MapManagerBase(const ros::NodeHandle& nh,
+                                      const ros::NodeHandle& nh_private)
+    : nh_(nh),
+      nh_private_(nh_private),
+      world_frame_("world"),
+      robot_frame_("state"),
+      use_tf_transforms_(true),
+      latch_topics_(true),
+      Q_initialized_(false),
+      Q_(Eigen::Matrix4d::Identity()),
+      full_image_size_(752, 480),
+      tf_lookup_instrumentation_(NULL),
+      timestamp_tolerance_ns_(10000000),
+      transform_buffer_size_(1000) {
+  setParametersFromROS();
+  left_info_sub_ = nh_.subscribe(
+      "cam0/camera_info", 1, &MapManagerBase::leftCameraInfoCallback, this);
+  right_info_sub_ = nh_.subscribe(
+      "cam1/camera_info", 1, &MapManagerBase::rightCameraInfoCallback, this);
+}
+
+template <typename World>
+void MapManagerBase<World>::setParametersFromROS() {
+  nh_private_.param("tf_frame", world_frame_, world_frame_);
+  nh_private_.param("robot_frame", robot_frame_, robot_frame_);
+  nh_private_.param("full_image_width", full_image_size_.x(),
+                    full_image_size_.x());
+  nh_private_.param("full_image_height", full_image_size_.y(),
+                    full_image_size_.y());
+
+  // Try to initialize Q matrix from parameters, if available.
+  std::vector<double> Q_vec;
+  if (nh_private_.getParam("Q", Q_vec)) {
+    Q_initialized_ = setQFromParams(&Q_vec);
+  }
+
+  // Publisher/subscriber settings.
+  nh_private_.param("latch_topics", latch_topics_, latch_topics_);
+
+  // Transform settings.
+  nh_private_.param("use_tf_transforms", use_tf_transforms_,
+                    use_tf_transforms_);
+  nh_private_.param("transform_buffer_size", transform_buffer_size_,
+                    transform_buffer_size_);
+  // If we use topic transforms, we have 2 parts: a dynamic transform from a
+  // topic and a static transform from parameters.
+  // Static transform should be T_G_D (where D is whatever sensor the
+  // dynamic coordinate frame is in) and the static should be T_D_C (where
+  // C is the sensor frame that produces the depth data). It is possible to
+  // specific T_C_D and set invert_static_tranform to true.
+  if (!use_tf_transforms_) {
+    transform_buffer_.reset(new TransformBuffer(
+        static_cast<size_t>(std::max(transform_buffer_size_, 2))));
+    transform_sub_ = nh_.subscribe("transform", 40,
+                                   &MapManagerBase::transformCallback, this);
+    // Retrieve T_D_C from params.
+    XmlRpc::XmlRpcValue T_B_D_xml;
+    // TODO(helenol): split out into a function to avoid duplication.
+    if (nh_private_.getParam("T_B_D", T_B_D_xml)) {
+      kindr::minimal::xmlRpcToKindr(T_B_D_xml, &T_B_D_);
+
+      // See if we need to invert it.
+      bool invert_static_tranform = false;
+      nh_private_.param("invert_T_B_D", invert_static_tranform,
+                        invert_static_tranform);
+      if (invert_static_tranform) {
+        T_B_D_ = T_B_D_.inverse();
+      }
+    }
+    XmlRpc::XmlRpcValue T_B_C_xml;
+    if (nh_private_.getParam("T_B_C", T_B_C_xml)) {
+      kindr::minimal::xmlRpcToKindr(T_B_C_xml, &T_B_C_);
+
+      // See if we need to invert it.
+      bool invert_static_tranform = false;
+      nh_private_.param("invert_T_B_C", invert_static_tranform,
+                        invert_static_tranform);
+      if (invert_static_tranform) {
+        T_B_C_ = T_B_C_.inverse();
+      }
+    }
+  }
+}
+
+template <typename World>
+bool MapManagerBase<World>::setQFromParams(std::vector<double>* Q_vec) {
+  if (Q_vec->size() != 16) {
+    ROS_ERROR_STREAM("Invalid Q matrix size, expected size: 16, actual size: "
+                     << Q_vec->size());
+    return false;
+  }
+
+  // Try to map the vector as coefficients.
+  Eigen::Map<Eigen::Matrix<double, 4, 4, Eigen::RowMajor> > Q_vec_map(
+      Q_vec->data());
+  // Copy over to the Q member.
+  Q_ = Q_vec_map;
+
+  return true;
+}
+
+template <typename World>
+void MapManagerBase<World>::leftCameraInfoCallback(
+    const sensor_msgs::CameraInfoPtr& left_info) {
+  left_info_ = left_info;
+  if (left_info_ && right_info_ && !Q_initialized_) {
+    calculateQ();
+  }
+}
+
+template <typename World>
+void MapManagerBase<World>::rightCameraInfoCallback(
+    const sensor_msgs::CameraInfoPtr& right_info) {
+  right_info_ = right_info;
+  if (left_info_ && right_info_ && !Q_initialized_) {
+    calculateQ();
+  }
+}
+
+template <typename World>
+void MapManagerBase<World>::calculateQ() {
+  Q_ = this->getQForROSCameras(*left_info_, *right_info_);
+  full_image_size_.x() = left_info_->width;
+  full_image_size_.y() = left_info_->height;
+  Q_initialized_ = true;
+}
+
+template <typename World>
+bool MapManagerBase<World>::lookupTransform(const std::string& from_frame,
+                                            const std::string& to_frame,
+                                            const ros::Time& timestamp,
+                                            Transformation* transform) {
+  if (use_tf_transforms_) {
+    return lookupTransformTf(from_frame, to_frame, timestamp, transform);
+  } else {
+    return lookupTransformQueue(from_frame, to_frame, timestamp, transform);
+  }
+}
+
+template <typename World>
+bool MapManagerBase<World>::lookupTransformTf(const std::string& from_frame,
+                                              const std::string& to_frame,
+                                              const ros::Time& timestamp,
+                                              Transformation* transform) {
+  OCTOMAP_WORLD_TIMER(tf_lookup_instrumentation_, kTfLookup);
+  tf::StampedTransform tf_transform;
+
+  ros::Time time_to_lookup = timestamp;
+
+  // If this transform isn't possible at the time, then try to just look up
+  // the latest (this is to work with bag files and static transform publisher,
+  // etc).
+  if (!tf_listener_.canTransform(to_frame, from_frame, time_to_lookup)) {
+    ros::Duration timestamp_age = ros::Time::now() - time_to_lookup;
+    if (timestamp_age < tf_listener_.getCacheLength()) {
+      time_to_lookup = ros::Time(0);
+      ROS_WARN("Using latest TF transform instead of timestamp match.");
+    } else {
+      ROS_ERROR("Requested transform time older than cache limit.");
+      return false;
+    }
+  }
+
+  try {
+    tf_listener_.lookupTransform(to_frame, from_frame, time_to_lookup,
+                                 tf_transform);
+  } catch (tf::TransformException& ex) {
+    ROS_ERROR_STREAM(
+        "Error getting TF transform from sensor data: " << ex.what());
+    return false;
+  }
+
+  tf::transformTFToKindr(tf_transform, transform);
+  return true;
+}
+
+template <typename World>
+void MapManagerBase<World>::transformCallback(
+    const geometry_msgs::TransformStamped& transform_msg) {
+  Transformation T_G_D;
+  tf::transformMsgToKindr(transform_msg.transform, &T_G_D);
+  if (!transform_buffer_->push(transform_msg.header.stamp.toNSec(), T_G_D)) {
+    ROS_WARN_STREAM_THROTTLE(30, "Dropping out-of-order transform at "
+                                     << transform_msg.header.stamp);
+  }
+}
+
+template <typename World>
+bool MapManagerBase<World>::lookupTransformQueue(const std::string& from_frame,
+                                                 const std::string& to_frame,
+                                                 const ros::Time& timestamp,
+                                                 Transformation* transform) {
+  CHECK(transform_buffer_);
+  // Interpolates between the transforms around the timestamp. Old transforms
+  // are overwritten by new ones, so nothing needs to be cleared here.
+  Transformation T_G_D;
+  if (!transform_buffer_->lookup(timestamp.toNSec(), timestamp_tolerance_ns_,
+                                 &T_G_D)) {
+    ROS_WARN_STREAM_THROTTLE(
+        30, "No match found for transform timestamp: " << timestamp);
+    int64_t oldest_ns, newest_ns;
+    if (transform_buffer_->getTimeRange(&oldest_ns, &newest_ns)) {
+      ros::Time oldest, newest;
+      oldest.fromNSec(oldest_ns);
+      newest.fromNSec(newest_ns);
+      ROS_WARN_STREAM_THROTTLE(
+          30, "Buffer front: " << oldest << " back: " << newest);
+    }
+    return false;
+  }
+
+  // If we have a static transform, apply it too.
+  // Transform should actually be T_G_C. So need to take it through the full
+  // chain.
+  *transform = T_G_D * T_B_D_.inverse() * T_B_C_;
+  return true;
+}
+
+// The two managers.
+template class MapManagerBase<OctomapWorld>;
+template class MapManagerBase<BlockHashWorld>;
+
+}  // namespace volumetric_mapping
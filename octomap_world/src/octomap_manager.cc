@@ -29,29 +29,55 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "octomap_world/octomap_manager.h"
 
+#include <boost/bind.hpp>
+#include <cv_bridge/cv_bridge.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <glog/logging.h>
 #include <minkindr_conversions/kindr_msg.h>
-#include <minkindr_conversions/kindr_tf.h>
-#include <minkindr_conversions/kindr_xml.h>
+#include <octomap_msgs/conversions.h>
+#include <pcl/filters/filter.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/io/ply_io.h>
+#include <pcl_ros/transforms.h>
+#include <zlib.h>
+
+#include "octomap_world/point_file_reader.h"
 
 namespace volumetric_mapping {
 
+const size_t OctomapManager::kMaxScansHeldDuringLoad;
+
 OctomapManager::OctomapManager(const ros::NodeHandle& nh,
                                const ros::NodeHandle& nh_private)
-    : nh_(nh),
-      nh_private_(nh_private),
-      world_frame_("world"),
-      robot_frame_("state"),
-      use_tf_transforms_(true),
-      latch_topics_(true),
-      timestamp_tolerance_ns_(10000000),
-      Q_initialized_(false),
-      Q_(Eigen::Matrix4d::Identity()),
-      full_image_size_(752, 480),
-      map_publish_frequency_(0.0) {
+    : MapManagerBase<OctomapWorld>(nh, nh_private),
+      map_publish_frequency_(0.0),
+      map_window_update_frequency_(1.0),
+      diagnostics_publish_frequency_(1.0),
+      visualization_depth_(0),
+      async_insertion_(false),
+      insertion_queue_size_(10),
+      insertion_queue_policy_("drop_oldest"),
+      scan_batch_size_(1),
+      scan_batch_max_latency_ms_(100.0),
+      save_in_background_(false),
+      load_map_in_background_(false),
+      load_chunk_size_(1000000),
+      loading_(false),
+      stop_loading_(false),
+      holding_scans_(false),
+      publish_map_deltas_(false),
+      map_delta_keyframe_interval_(20),
+      map_delta_sequence_(0),
+      num_map_deltas_since_keyframe_(0),
+      map_delta_keyframe_requested_(true),
+      map_delta_max_size_mb_(256.0),
+      has_map_delta_keyframe_(false),
+      next_map_delta_sequence_(0) {
+  tf_lookup_instrumentation_ = &instrumentation_;
   setParametersFromROS();
+  if (publish_map_deltas_) {
+    enableMapDeltas();
+  }
   subscribe();
   advertiseServices();
   advertisePublishers();
@@ -60,7 +86,9 @@ OctomapManager::OctomapManager(const ros::NodeHandle& nh,
   // load the octomap at that path and publish it.
   std::string octomap_file;
   if (nh_private_.getParam("octomap_file", octomap_file)) {
-    if (loadOctomapFromFile(octomap_file)) {
+    if (load_map_in_background_) {
+      startLoadingThread(octomap_file, false);
+    } else if (loadMap(octomap_file, false)) {
       ROS_INFO_STREAM(
           "Successfully loaded octomap from path: " << octomap_file);
       publishAll();
@@ -68,12 +96,23 @@ OctomapManager::OctomapManager(const ros::NodeHandle& nh,
       ROS_ERROR_STREAM("Could not load octomap from path: " << octomap_file);
     }
   }
+
+  if (async_insertion_) {
+    startInsertionThreads();
+  }
+  if (save_in_background_) {
+    startSavingThread();
+  }
+}
+
+OctomapManager::~OctomapManager() {
+  stopLoadingThread();
+  stopInsertionThreads();
+  stopSavingThread();
 }
 
 void OctomapManager::setParametersFromROS() {
   OctomapParameters params;
-  nh_private_.param("tf_frame", world_frame_, world_frame_);
-  nh_private_.param("robot_frame", robot_frame_, robot_frame_);
   nh_private_.param("resolution", params.resolution, params.resolution);
   nh_private_.param("probability_hit", params.probability_hit,
                     params.probability_hit);
@@ -97,106 +136,162 @@ void OctomapManager::setParametersFromROS() {
                     params.visualize_min_z);
   nh_private_.param("visualize_max_z", params.visualize_max_z,
                     params.visualize_max_z);
-  nh_private_.param("full_image_width", full_image_size_.x(),
-                    full_image_size_.x());
-  nh_private_.param("full_image_height", full_image_size_.y(),
-                    full_image_size_.y());
   nh_private_.param("map_publish_frequency", map_publish_frequency_,
                     map_publish_frequency_);
+  nh_private_.param("publish_map_deltas", publish_map_deltas_,
+                    publish_map_deltas_);
+  nh_private_.param("map_delta_keyframe_interval",
+                    map_delta_keyframe_interval_, map_delta_keyframe_interval_);
+  nh_private_.param("map_delta_max_size_mb", map_delta_max_size_mb_,
+                    map_delta_max_size_mb_);
   nh_private_.param("treat_unknown_as_occupied",
                     params.treat_unknown_as_occupied,
                     params.treat_unknown_as_occupied);
   nh_private_.param("change_detection_enabled", params.change_detection_enabled,
                     params.change_detection_enabled);
+  nh_private_.param("change_journal_capacity", params.change_journal_capacity,
+                    params.change_journal_capacity);
+  nh_private_.param("num_insertion_threads", params.num_insertion_threads,
+                    params.num_insertion_threads);
+  nh_private_.param("use_sorted_key_batches", params.use_sorted_key_batches,
+                    params.use_sorted_key_batches);
+  nh_private_.param("downsample_endpoints", params.downsample_endpoints,
+                    params.downsample_endpoints);
+  nh_private_.param("weight_by_hit_count", params.weight_by_hit_count,
+                    params.weight_by_hit_count);
+  nh_private_.param("disparity_stride", params.disparity_stride,
+                    params.disparity_stride);
+  nh_private_.param("num_collision_check_threads",
+                    params.num_collision_check_threads,
+                    params.num_collision_check_threads);
+  nh_private_.param("use_esdf", params.use_esdf, params.use_esdf);
+  nh_private_.param("esdf_max_distance", params.esdf_max_distance,
+                    params.esdf_max_distance);
+  nh_private_.param("num_visibility_threads", params.num_visibility_threads,
+                    params.num_visibility_threads);
+  nh_private_.param("num_export_threads", params.num_export_threads,
+                    params.num_export_threads);
+  nh_private_.param("num_load_threads", params.num_load_threads,
+                    params.num_load_threads);
+  nh_private_.param("incremental_visualization",
+                    params.incremental_visualization,
+                    params.incremental_visualization);
+  nh_private_.param("visualization_block_size",
+                    params.visualization_block_size,
+                    params.visualization_block_size);
+  nh_private_.param("map_window_size_x", params.map_window_size.x(),
+                    params.map_window_size.x());
+  nh_private_.param("map_window_size_y", params.map_window_size.y(),
+                    params.map_window_size.y());
+  nh_private_.param("map_window_size_z", params.map_window_size.z(),
+                    params.map_window_size.z());
+  nh_private_.param("memory_budget_mb", params.memory_budget_mb,
+                    params.memory_budget_mb);
+  nh_private_.param("map_eviction_directory", params.map_eviction_directory,
+                    params.map_eviction_directory);
+  nh_private_.param("map_tile_size", params.map_tile_size,
+                    params.map_tile_size);
+  nh_private_.param("tile_load_distance", params.tile_load_distance,
+                    params.tile_load_distance);
+  nh_private_.param("map_window_update_frequency",
+                    map_window_update_frequency_, map_window_update_frequency_);
+  nh_private_.param("diagnostics_publish_frequency",
+                    diagnostics_publish_frequency_,
+                    diagnostics_publish_frequency_);
+  nh_private_.param("visualization_depth", visualization_depth_,
+                    visualization_depth_);
+  if (visualization_depth_ < 0 ||
+      visualization_depth_ > static_cast<int>(octree_->getTreeDepth())) {
+    ROS_WARN_STREAM("visualization_depth must be between 0 and "
+                    << octree_->getTreeDepth() << ", using the leaves.");
+    visualization_depth_ = 0;
+  }
 
-  // Try to initialize Q matrix from parameters, if available.
-  std::vector<double> Q_vec;
-  if (nh_private_.getParam("Q", Q_vec)) {
-    Q_initialized_ = setQFromParams(&Q_vec);
-  }
-
-  // Publisher/subscriber settings.
-  nh_private_.param("latch_topics", latch_topics_, latch_topics_);
-
-  // Transform settings.
-  nh_private_.param("use_tf_transforms", use_tf_transforms_,
-                    use_tf_transforms_);
-  // If we use topic transforms, we have 2 parts: a dynamic transform from a
-  // topic and a static transform from parameters.
-  // Static transform should be T_G_D (where D is whatever sensor the
-  // dynamic coordinate frame is in) and the static should be T_D_C (where
-  // C is the sensor frame that produces the depth data). It is possible to
-  // specific T_C_D and set invert_static_tranform to true.
-  if (!use_tf_transforms_) {
-    transform_sub_ = nh_.subscribe("transform", 40,
-                                   &OctomapManager::transformCallback, this);
-    // Retrieve T_D_C from params.
-    XmlRpc::XmlRpcValue T_B_D_xml;
-    // TODO(helenol): split out into a function to avoid duplication.
-    if (nh_private_.getParam("T_B_D", T_B_D_xml)) {
-      kindr::minimal::xmlRpcToKindr(T_B_D_xml, &T_B_D_);
-
-      // See if we need to invert it.
-      bool invert_static_tranform = false;
-      nh_private_.param("invert_T_B_D", invert_static_tranform,
-                        invert_static_tranform);
-      if (invert_static_tranform) {
-        T_B_D_ = T_B_D_.inverse();
-      }
-    }
-    XmlRpc::XmlRpcValue T_B_C_xml;
-    if (nh_private_.getParam("T_B_C", T_B_C_xml)) {
-      kindr::minimal::xmlRpcToKindr(T_B_C_xml, &T_B_C_);
-
-      // See if we need to invert it.
-      bool invert_static_tranform = false;
-      nh_private_.param("invert_T_B_C", invert_static_tranform,
-                        invert_static_tranform);
-      if (invert_static_tranform) {
-        T_B_C_ = T_B_C_.inverse();
-      }
-    }
+  // Insertion pipeline settings.
+  nh_private_.param("async_insertion", async_insertion_, async_insertion_);
+  nh_private_.param("insertion_queue_size", insertion_queue_size_,
+                    insertion_queue_size_);
+  nh_private_.param("insertion_queue_policy", insertion_queue_policy_,
+                    insertion_queue_policy_);
+  nh_private_.param("scan_batch_size", scan_batch_size_, scan_batch_size_);
+  nh_private_.param("scan_batch_max_latency_ms", scan_batch_max_latency_ms_,
+                    scan_batch_max_latency_ms_);
+  nh_private_.param("save_in_background", save_in_background_,
+                    save_in_background_);
+  nh_private_.param("load_map_in_background", load_map_in_background_,
+                    load_map_in_background_);
+  nh_private_.param("load_chunk_size", load_chunk_size_, load_chunk_size_);
+  if (scan_batch_size_ > 1 && !async_insertion_) {
+    ROS_WARN("scan_batch_size only has an effect with async_insertion.");
   }
 
   // Set the parent class parameters.
   setOctomapParameters(params);
 }
 
-bool OctomapManager::setQFromParams(std::vector<double>* Q_vec) {
-  if (Q_vec->size() != 16) {
-    ROS_ERROR_STREAM("Invalid Q matrix size, expected size: 16, actual size: "
-                     << Q_vec->size());
-    return false;
-  }
-
-  // Try to map the vector as coefficients.
-  Eigen::Map<Eigen::Matrix<double, 4, 4, Eigen::RowMajor> > Q_vec_map(
-      Q_vec->data());
-  // Copy over to the Q member.
-  Q_ = Q_vec_map;
-
-  return true;
-}
-
 void OctomapManager::subscribe() {
-  left_info_sub_ = nh_.subscribe("cam0/camera_info", 1,
-                                 &OctomapManager::leftCameraInfoCallback, this);
-  right_info_sub_ = nh_.subscribe(
-      "cam1/camera_info", 1, &OctomapManager::rightCameraInfoCallback, this);
   disparity_sub_ = nh_.subscribe(
       "disparity", 40, &OctomapManager::insertDisparityImageWithTf, this);
   pointcloud_sub_ = nh_.subscribe(
       "pointcloud", 40, &OctomapManager::insertPointcloudWithTf, this);
   octomap_sub_ =
       nh_.subscribe("input_octomap", 1, &OctomapManager::octomapCallback, this);
+  // Deltas only apply in order, so none should be dropped.
+  octomap_delta_sub_ = nh_.subscribe(
+      "input_octomap_delta", 10, &OctomapManager::octomapDeltaCallback, this);
 }
 
 void OctomapManager::octomapCallback(const octomap_msgs::Octomap& msg) {
-  setOctomapFromMsg(msg);
+  {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    setOctomapFromMsg(msg);
+  }
   publishAll();
   ROS_INFO_ONCE("Got octomap from message.");
 }
 
+void OctomapManager::octomapDeltaCallback(
+    const volumetric_msgs::OctomapDeltaConstPtr& msg) {
+  if (!msg->keyframe && (!has_map_delta_keyframe_ ||
+                         msg->sequence != next_map_delta_sequence_)) {
+    ROS_WARN_STREAM_THROTTLE(
+        5.0, "Missed map deltas before " << msg->sequence
+                                         << ", waiting for a keyframe.");
+    has_map_delta_keyframe_ = false;
+    return;
+  }
+  // zlib doesn't compress by more than about 1032:1, so a larger claimed size
+  // is corrupt.
+  const double uncompressed_size_mb =
+      msg->uncompressed_size / (1024.0 * 1024.0);
+  if (uncompressed_size_mb > map_delta_max_size_mb_ ||
+      msg->uncompressed_size > 1032 * (msg->data.size() + 1)) {
+    ROS_ERROR_STREAM("Dropping map delta " << msg->sequence << " of "
+                                           << uncompressed_size_mb
+                                           << " MB uncompressed.");
+    has_map_delta_keyframe_ = false;
+    return;
+  }
+  std::string data(msg->uncompressed_size, '\0');
+  if (msg->uncompressed_size > 0) {
+    uLongf size = msg->uncompressed_size;
+    if (uncompress(reinterpret_cast<Bytef*>(&data[0]), &size,
+                   msg->data.data(), msg->data.size()) != Z_OK ||
+        size != msg->uncompressed_size) {
+      ROS_ERROR_STREAM("Could not decompress map delta " << msg->sequence);
+      has_map_delta_keyframe_ = false;
+      return;
+    }
+  }
+  {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    has_map_delta_keyframe_ =
+        applyMapDelta(msg->keyframe, msg->resolution, data);
+  }
+  next_map_delta_sequence_ = msg->sequence + 1;
+  ROS_INFO_ONCE("Got octomap delta from message.");
+}
+
 void OctomapManager::advertiseServices() {
   reset_map_service_ = nh_private_.advertiseService(
       "reset_map", &OctomapManager::resetMapCallback, this);
@@ -219,10 +314,31 @@ void OctomapManager::advertiseServices() {
 }
 
 void OctomapManager::advertisePublishers() {
-  occupied_nodes_pub_ = nh_private_.advertise<visualization_msgs::MarkerArray>(
-      "octomap_occupied", 1, latch_topics_);
-  free_nodes_pub_ = nh_private_.advertise<visualization_msgs::MarkerArray>(
-      "octomap_free", 1, latch_topics_);
+  if (params_.incremental_visualization) {
+    occupied_nodes_pub_ =
+        nh_private_.advertise<visualization_msgs::MarkerArray>(
+            "octomap_occupied", 1,
+            boost::bind(&OctomapManager::occupiedNodesConnectCallback, this,
+                        _1),
+            ros::SubscriberStatusCallback(), ros::VoidConstPtr(),
+            latch_topics_);
+    free_nodes_pub_ = nh_private_.advertise<visualization_msgs::MarkerArray>(
+        "octomap_free", 1,
+        boost::bind(&OctomapManager::freeNodesConnectCallback, this, _1),
+        ros::SubscriberStatusCallback(), ros::VoidConstPtr(), latch_topics_);
+  } else {
+    occupied_nodes_pub_ =
+        nh_private_.advertise<visualization_msgs::MarkerArray>(
+            "octomap_occupied", 1, latch_topics_);
+    free_nodes_pub_ = nh_private_.advertise<visualization_msgs::MarkerArray>(
+        "octomap_free", 1, latch_topics_);
+  }
+  if (publish_map_deltas_) {
+    // Not latched, as receivers need a keyframe first.
+    map_delta_pub_ = nh_private_.advertise<volumetric_msgs::OctomapDelta>(
+        "octomap_delta", 10,
+        boost::bind(&OctomapManager::mapDeltaConnectCallback, this, _1));
+  }
 
   binary_map_pub_ = nh_private_.advertise<octomap_msgs::Octomap>(
       "octomap_binary", 1, latch_topics_);
@@ -239,34 +355,103 @@ void OctomapManager::advertisePublishers() {
         nh_private_.createTimer(ros::Duration(1.0 / map_publish_frequency_),
                                 &OctomapManager::publishAllEvent, this);
   }
+
+  // Also loads the tiles around the robot, as tiled maps can be opened later.
+  if (map_window_update_frequency_ > 0.0) {
+    map_window_timer_ = nh_private_.createTimer(
+        ros::Duration(1.0 / map_window_update_frequency_),
+        &OctomapManager::mapWindowEvent, this);
+  }
+
+  // Published where the diagnostic aggregator expects it.
+  diagnostics_pub_ =
+      nh_.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 10);
+  if (diagnostics_publish_frequency_ > 0.0) {
+    diagnostics_timer_ = nh_private_.createTimer(
+        ros::Duration(1.0 / diagnostics_publish_frequency_),
+        &OctomapManager::publishDiagnosticsEvent, this);
+  }
 }
 
 void OctomapManager::publishAll() {
-  if (latch_topics_ || occupied_nodes_pub_.getNumSubscribers() > 0 ||
-      free_nodes_pub_.getNumSubscribers() > 0) {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kPublishAll);
+  const bool publish_markers = latch_topics_ ||
+                               occupied_nodes_pub_.getNumSubscribers() > 0 ||
+                               free_nodes_pub_.getNumSubscribers() > 0;
+  const bool publish_cloud = latch_topics_ || pcl_pub_.getNumSubscribers() > 0;
+
+  if (params_.incremental_visualization) {
+    // Markers and cloud come from the same pass over the changed blocks.
+    if (publish_markers || publish_cloud) {
+      visualization_msgs::MarkerArray occupied_nodes, free_nodes;
+      pcl::PointCloud<pcl::PointXYZ> point_cloud;
+      {
+        // Updates the cached blocks.
+        boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+        generateMarkerArrayIncremental(world_frame_, &occupied_nodes,
+                                       &free_nodes,
+                                       publish_cloud ? &point_cloud : NULL);
+      }
+      // Only send the changes, which also keeps the latched message.
+      if (!occupied_nodes.markers.empty()) {
+        occupied_nodes_pub_.publish(occupied_nodes);
+      }
+      if (!free_nodes.markers.empty()) {
+        free_nodes_pub_.publish(free_nodes);
+      }
+      if (publish_cloud) {
+        sensor_msgs::PointCloud2 cloud;
+        pcl::toROSMsg(point_cloud, cloud);
+        cloud.header.frame_id = world_frame_;
+        pcl_pub_.publish(cloud);
+      }
+    }
+  } else if (publish_markers) {
     visualization_msgs::MarkerArray occupied_nodes, free_nodes;
-    generateMarkerArray(world_frame_, &occupied_nodes, &free_nodes);
+    {
+      // Generating the markers expands the tree to the maximum depth.
+      boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+      if (visualization_depth_ > 0) {
+        generateMarkerArrayAtDepth(world_frame_, visualization_depth_,
+                                   &occupied_nodes, &free_nodes);
+      } else {
+        generateMarkerArray(world_frame_, &occupied_nodes, &free_nodes);
+      }
+    }
     occupied_nodes_pub_.publish(occupied_nodes);
     free_nodes_pub_.publish(free_nodes);
   }
 
-  if (latch_topics_ || binary_map_pub_.getNumSubscribers() > 0) {
-    octomap_msgs::Octomap binary_map;
-    getOctomapBinaryMsg(&binary_map);
-    binary_map.header.frame_id = world_frame_;
-    binary_map_pub_.publish(binary_map);
+  if (publish_map_deltas_) {
+    publishMapDelta();
   }
 
-  if (latch_topics_ || full_map_pub_.getNumSubscribers() > 0) {
-    octomap_msgs::Octomap full_map;
-    getOctomapBinaryMsg(&full_map);
-    full_map.header.frame_id = world_frame_;
-    full_map_pub_.publish(full_map);
+  boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+  // Both map topics carry the binary map, so serialize it once and share the
+  // message.
+  const bool publish_binary_map =
+      latch_topics_ || binary_map_pub_.getNumSubscribers() > 0;
+  const bool publish_full_map =
+      latch_topics_ || full_map_pub_.getNumSubscribers() > 0;
+  if (publish_binary_map || publish_full_map) {
+    octomap_msgs::OctomapPtr map_msg(new octomap_msgs::Octomap);
+    getOctomapBinaryMsg(map_msg.get());
+    map_msg->header.frame_id = world_frame_;
+    if (publish_binary_map) {
+      binary_map_pub_.publish(map_msg);
+    }
+    if (publish_full_map) {
+      full_map_pub_.publish(map_msg);
+    }
   }
 
-  if (latch_topics_ || pcl_pub_.getNumSubscribers() > 0) {
+  if (!params_.incremental_visualization && publish_cloud) {
     pcl::PointCloud<pcl::PointXYZ> point_cloud;
-    getOccupiedPointCloud(&point_cloud);
+    if (visualization_depth_ > 0) {
+      getOccupiedPointCloudAtDepth(visualization_depth_, &point_cloud);
+    } else {
+      getOccupiedPointCloud(&point_cloud);
+    }
     sensor_msgs::PointCloud2 cloud;
     pcl::toROSMsg(point_cloud, cloud);
     cloud.header.frame_id = world_frame_;
@@ -292,8 +477,153 @@ void OctomapManager::publishAll() {
 
 void OctomapManager::publishAllEvent(const ros::TimerEvent& e) { publishAll(); }
 
+void OctomapManager::publishDiagnostics() {
+  const Instrumentation& instrumentation = getInstrumentation();
+  const std::string node_name = ros::this_node::getName();
+  const auto add_value = [](const std::string& key, const std::string& value,
+                            diagnostic_msgs::DiagnosticStatus* status) {
+    diagnostic_msgs::KeyValue key_value;
+    key_value.key = key;
+    key_value.value = value;
+    status->values.push_back(key_value);
+  };
+
+  diagnostic_msgs::DiagnosticArray diagnostics;
+  diagnostics.header.stamp = ros::Time::now();
+  for (size_t i = 0; i < Instrumentation::kNumTimers; ++i) {
+    const Timer timer = static_cast<Timer>(i);
+    Instrumentation::TimerStatistics statistics;
+    instrumentation.getTimerStatistics(timer, &statistics);
+
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = node_name + ": " + Instrumentation::getName(timer);
+    status.hardware_id = world_frame_;
+    status.message = "Timings in ms";
+    add_value("count", std::to_string(statistics.num_samples), &status);
+    add_value("mean", std::to_string(1e3 * statistics.mean_seconds), &status);
+    add_value("p50", std::to_string(1e3 * statistics.p50_seconds), &status);
+    add_value("p90", std::to_string(1e3 * statistics.p90_seconds), &status);
+    add_value("p99", std::to_string(1e3 * statistics.p99_seconds), &status);
+    add_value("max", std::to_string(1e3 * statistics.max_seconds), &status);
+    add_value("total", std::to_string(1e3 * statistics.total_seconds),
+              &status);
+    diagnostics.status.push_back(status);
+  }
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  status.name = node_name + ": counters";
+  status.hardware_id = world_frame_;
+  status.message = "Totals since the last reset and current values";
+  for (size_t i = 0; i < Instrumentation::kNumCounters; ++i) {
+    const Counter counter = static_cast<Counter>(i);
+    add_value(Instrumentation::getName(counter),
+              std::to_string(instrumentation.getCount(counter)), &status);
+  }
+  diagnostics.status.push_back(status);
+  diagnostics_pub_.publish(diagnostics);
+}
+
+void OctomapManager::publishDiagnosticsEvent(const ros::TimerEvent& e) {
+  publishDiagnostics();
+}
+
+void OctomapManager::mapWindowEvent(const ros::TimerEvent& e) {
+  const bool has_map_window = (params_.map_window_size.array() > 0.0).all();
+  if (!has_map_window && params_.memory_budget_mb <= 0.0 &&
+      !isTiledMapOpen()) {
+    return;
+  }
+  Transformation robot_to_world;
+  if (!lookupTransform(robot_frame_, world_frame_, ros::Time::now(),
+                       &robot_to_world)) {
+    ROS_WARN_STREAM_THROTTLE(
+        10.0, "Could not look up " << robot_frame_ << " for the map window.");
+    return;
+  }
+  boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+  if (isTiledMapOpen()) {
+    loadTilesInBoundingBox(
+        robot_to_world.getPosition(),
+        Eigen::Vector3d::Constant(2.0 * params_.tile_load_distance));
+  }
+  const size_t num_evicted_nodes =
+      updateMapWindow(robot_to_world.getPosition());
+  if (num_evicted_nodes > 0) {
+    ROS_DEBUG_STREAM("Evicted " << num_evicted_nodes
+                                << " nodes outside of the map window.");
+  }
+}
+
+void OctomapManager::occupiedNodesConnectCallback(
+    const ros::SingleSubscriberPublisher& pub) {
+  visualization_msgs::MarkerArray occupied_nodes, free_nodes;
+  {
+    boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+    getIncrementalMarkerArray(&occupied_nodes, &free_nodes);
+  }
+  pub.publish(occupied_nodes);
+}
+
+void OctomapManager::freeNodesConnectCallback(
+    const ros::SingleSubscriberPublisher& pub) {
+  visualization_msgs::MarkerArray occupied_nodes, free_nodes;
+  {
+    boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+    getIncrementalMarkerArray(&occupied_nodes, &free_nodes);
+  }
+  pub.publish(free_nodes);
+}
+
+void OctomapManager::mapDeltaConnectCallback(
+    const ros::SingleSubscriberPublisher& pub) {
+  map_delta_keyframe_requested_ = true;
+}
+
+void OctomapManager::publishMapDelta() {
+  if (map_delta_pub_.getNumSubscribers() == 0) {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    resetMapDelta();
+    return;
+  }
+  const bool force_keyframe =
+      map_delta_keyframe_requested_.exchange(false) ||
+      num_map_deltas_since_keyframe_ >= map_delta_keyframe_interval_;
+  volumetric_msgs::OctomapDeltaPtr msg(new volumetric_msgs::OctomapDelta);
+  std::string data;
+  {
+    // Collecting the delta resets the changes.
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    msg->keyframe = serializeMapDelta(force_keyframe, &data);
+    msg->resolution = getResolution();
+  }
+  if (!msg->keyframe && data.empty()) {
+    return;
+  }
+
+  uLongf size = compressBound(data.size());
+  msg->data.resize(size);
+  if (compress2(msg->data.data(), &size,
+                reinterpret_cast<const Bytef*>(data.data()), data.size(),
+                Z_DEFAULT_COMPRESSION) != Z_OK) {
+    ROS_ERROR("Could not compress the map delta.");
+    map_delta_keyframe_requested_ = true;
+    return;
+  }
+  msg->data.resize(size);
+  msg->uncompressed_size = data.size();
+  msg->header.frame_id = world_frame_;
+  msg->header.stamp = ros::Time::now();
+  msg->sequence = map_delta_sequence_++;
+  num_map_deltas_since_keyframe_ =
+      msg->keyframe ? 0 : num_map_deltas_since_keyframe_ + 1;
+  map_delta_pub_.publish(msg);
+}
+
 bool OctomapManager::resetMapCallback(std_srvs::Empty::Request& request,
                                       std_srvs::Empty::Response& response) {
+  boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
   resetMap();
   return true;
 }
@@ -307,55 +637,176 @@ bool OctomapManager::publishAllCallback(std_srvs::Empty::Request& request,
 bool OctomapManager::getOctomapCallback(
     octomap_msgs::GetOctomap::Request& request,
     octomap_msgs::GetOctomap::Response& response) {
-  return getOctomapFullMsg(&response.map);
+  std::shared_ptr<PooledOcTree> snapshot;
+  {
+    boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+    snapshot = getOctreeSnapshot();
+  }
+  return octomap_msgs::fullMapToMsg(*snapshot, response.map);
 }
 
 bool OctomapManager::loadOctomapCallback(
     volumetric_msgs::LoadMap::Request& request,
     volumetric_msgs::LoadMap::Response& response) {
-  std::string extension =
-      request.file_path.substr(request.file_path.find_last_of(".") + 1);
-  if (extension == "bt") {
-    return loadOctomapFromFile(request.file_path);
-  } else {
-    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(
-        new pcl::PointCloud<pcl::PointXYZ>);
-    if (extension == "pcd") {
-      pcl::io::loadPCDFile<pcl::PointXYZ>(request.file_path, *cloud);
-    } else if (extension == "ply") {
-      pcl::io::loadPLYFile<pcl::PointXYZ>(request.file_path, *cloud);
-    } else {
-      ROS_ERROR_STREAM(
-          "No known file extension (.bt, .pcd, .ply): " << request.file_path);
-      return false;
+  if (load_map_in_background_) {
+    return startLoadingThread(request.file_path, request.merge);
+  }
+  return loadMap(request.file_path, request.merge);
+}
+
+bool OctomapManager::loadMap(const std::string& file_path, bool merge) {
+  const std::string extension =
+      file_path.substr(file_path.find_last_of(".") + 1);
+  if (extension == "pcd" || extension == "ply") {
+    return loadPointCloudFile(file_path);
+  }
+  if (extension == "bt" && !merge) {
+    // Read without the map lock, which is only needed to swap the tree. Scans
+    // that arrive in the meantime go into the new tree.
+    {
+      std::lock_guard<std::mutex> lock(held_scans_mutex_);
+      holding_scans_ = true;
     }
-    octomap::KeySet free_cells, occupied_cells;
-    for (size_t i = 0u; i < cloud->size(); ++i) {
-      const octomap::point3d p_G_point((*cloud)[i].x, (*cloud)[i].y,
-                                       (*cloud)[i].z);
-      octomap::OcTreeKey key;
-      if (octree_->coordToKeyChecked(p_G_point, key)) {
-        occupied_cells.insert(key);
-      }
+    std::unique_ptr<PooledOcTree> tree(new PooledOcTree(params_.resolution));
+    const bool success = tree->readBinary(file_path);
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    if (success) {
+      setOctree(std::move(tree));
     }
-    updateOccupancy(&free_cells, &occupied_cells);
+    insertHeldScans();
+    return success;
+  }
+  boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+  if (extension == "tiles") {
+    return openTiledMap(file_path);
+  } else if (extension == "bt") {
+    return mergeOctomapFromFile(file_path);
+  }
+  ROS_ERROR_STREAM("No known file extension (.bt, .tiles, .pcd, .ply): "
+                   << file_path);
+  return false;
+}
+
+bool OctomapManager::loadPointCloudFile(const std::string& file_path) {
+  pcl::PointCloud<pcl::PointXYZ> cloud;
+  KeyBatch key_batch;
+  PointFileReader reader;
+  if (!reader.open(file_path)) {
+    // Compressed PCD files and the like are read as a whole.
+    const std::string extension =
+        file_path.substr(file_path.find_last_of(".") + 1);
+    const int result =
+        extension == "pcd"
+            ? pcl::io::loadPCDFile<pcl::PointXYZ>(file_path, cloud)
+            : pcl::io::loadPLYFile<pcl::PointXYZ>(file_path, cloud);
+    if (result < 0) {
+      return false;
+    }
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    computeOccupiedKeys(cloud, &key_batch);
+    insertOccupiedKeys(&key_batch);
     return true;
   }
+
+  const size_t chunk_size = std::max(1, load_chunk_size_);
+  while (!stop_loading_ && reader.readPoints(chunk_size, &cloud)) {
+    {
+      // Converting the points doesn't change the map.
+      boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+      computeOccupiedKeys(cloud, &key_batch);
+    }
+    {
+      boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+      insertOccupiedKeys(&key_batch);
+    }
+    ROS_INFO_STREAM_THROTTLE(
+        1, "Loaded " << reader.getNumPointsRead() << " of "
+                     << reader.getNumPoints() << " points ("
+                     << 100 * reader.getNumPointsRead() /
+                            std::max<size_t>(reader.getNumPoints(), 1)
+                     << "%) from " << file_path);
+  }
+  if (!reader.done()) {
+    ROS_ERROR_STREAM("Only loaded " << reader.getNumPointsRead() << " of "
+                                    << reader.getNumPoints()
+                                    << " points from " << file_path);
+    return false;
+  }
+  return true;
+}
+
+bool OctomapManager::startLoadingThread(const std::string& file_path,
+                                        bool merge) {
+  if (loading_) {
+    ROS_ERROR_STREAM("Still loading a map, not loading " << file_path);
+    return false;
+  }
+  if (loading_thread_.joinable()) {
+    loading_thread_.join();
+  }
+  loading_ = true;
+  loading_thread_ = std::thread([this, file_path, merge]() {
+    if (loadMap(file_path, merge)) {
+      ROS_INFO_STREAM("Successfully loaded octomap from path: " << file_path);
+      publishAll();
+    } else {
+      ROS_ERROR_STREAM("Could not load octomap from path: " << file_path);
+    }
+    loading_ = false;
+  });
+  return true;
+}
+
+void OctomapManager::stopLoadingThread() {
+  stop_loading_ = true;
+  if (loading_thread_.joinable()) {
+    loading_thread_.join();
+  }
 }
 
 bool OctomapManager::saveOctomapCallback(
     volumetric_msgs::SaveMap::Request& request,
     volumetric_msgs::SaveMap::Response& response) {
-  return writeOctomapToFile(request.file_path);
+  const std::string extension =
+      request.file_path.substr(request.file_path.find_last_of(".") + 1);
+  if (extension == "tiles") {
+    // Only the live map knows which tiles changed.
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    return writeTiledMap(request.file_path);
+  }
+  std::shared_ptr<PooledOcTree> snapshot;
+  {
+    boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+    snapshot = getOctreeSnapshot();
+  }
+  // Writing prunes the snapshot.
+  const std::string file_path = request.file_path;
+  return runSave([snapshot, file_path]() {
+    if (!snapshot->writeBinary(file_path)) {
+      ROS_ERROR_STREAM("Could not write octomap to " << file_path);
+      return false;
+    }
+    return true;
+  });
 }
 
 bool OctomapManager::savePointCloudCallback(
     volumetric_msgs::SaveMap::Request& request,
     volumetric_msgs::SaveMap::Response& response) {
-  pcl::PointCloud<pcl::PointXYZ> point_cloud;
-  getOccupiedPointCloud(&point_cloud);
-  pcl::io::savePLYFileASCII(request.file_path, point_cloud);
-  return true;
+  pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud(
+      new pcl::PointCloud<pcl::PointXYZ>);
+  {
+    boost::shared_lock<boost::shared_mutex> lock(map_mutex_);
+    getOccupiedPointCloud(point_cloud.get());
+  }
+  const std::string file_path = request.file_path;
+  return runSave([point_cloud, file_path]() {
+    if (pcl::io::savePLYFileASCII(file_path, *point_cloud) != 0) {
+      ROS_ERROR_STREAM("Could not write point cloud to " << file_path);
+      return false;
+    }
+    return true;
+  });
 }
 
 bool OctomapManager::setBoxOccupancyCallback(
@@ -368,10 +819,13 @@ bool OctomapManager::setBoxOccupancyCallback(
   tf::vectorMsgToKindr(request.box_size, &bounding_box_size);
   bool set_occupied = request.set_occupied;
 
-  if (set_occupied) {
-    setOccupied(bounding_box_center, bounding_box_size);
-  } else {
-    setFree(bounding_box_center, bounding_box_size);
+  {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    if (set_occupied) {
+      setOccupied(bounding_box_center, bounding_box_size);
+    } else {
+      setFree(bounding_box_center, bounding_box_size);
+    }
   }
   publishAll();
   return true;
@@ -380,8 +834,11 @@ bool OctomapManager::setBoxOccupancyCallback(
 bool OctomapManager::setDisplayBoundsCallback(
     volumetric_msgs::SetDisplayBounds::Request& request,
     volumetric_msgs::SetDisplayBounds::Response& response) {
-  params_.visualize_min_z = request.min_z;
-  params_.visualize_max_z = request.max_z;
+  {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    params_.visualize_min_z = request.min_z;
+    params_.visualize_max_z = request.max_z;
+  }
   publishAll();
   return true;
 }
@@ -391,7 +848,12 @@ bool OctomapManager::getChangedPointsCallback(
     volumetric_msgs::GetChangedPoints::Response& response) {
   std::vector<Eigen::Vector3d> changed_points;
   std::vector<bool> changed_states;
-  getChangedPoints(&changed_points, &changed_states);
+  {
+    // Reading the changes moves the cursor of the consumer in the journal.
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    response.complete = getChangedPointsForConsumer(
+        request.consumer, &changed_points, &changed_states);
+  }
   if (changed_points.size() != changed_states.size()) {
     std::cerr << "In getChangedPointsCallback changed_points and "
                  "changed_states have different size!\n";
@@ -408,28 +870,6 @@ bool OctomapManager::getChangedPointsCallback(
   return true;
 }
 
-void OctomapManager::leftCameraInfoCallback(
-    const sensor_msgs::CameraInfoPtr& left_info) {
-  left_info_ = left_info;
-  if (left_info_ && right_info_ && !Q_initialized_) {
-    calculateQ();
-  }
-}
-void OctomapManager::rightCameraInfoCallback(
-    const sensor_msgs::CameraInfoPtr& right_info) {
-  right_info_ = right_info;
-  if (left_info_ && right_info_ && !Q_initialized_) {
-    calculateQ();
-  }
-}
-
-void OctomapManager::calculateQ() {
-  Q_ = getQForROSCameras(*left_info_, *right_info_);
-  full_image_size_.x() = left_info_->width;
-  full_image_size_.y() = left_info_->height;
-  Q_initialized_ = true;
-}
-
 void OctomapManager::insertDisparityImageWithTf(
     const stereo_msgs::DisparityImageConstPtr& disparity) {
   if (!Q_initialized_) {
@@ -438,122 +878,379 @@ void OctomapManager::insertDisparityImageWithTf(
     return;
   }
 
+  if (async_insertion_) {
+    SensorMessage message;
+    message.disparity = disparity;
+    message.Q = Q_;
+    message.full_image_size = full_image_size_;
+    enqueueSensorMessage(message);
+    return;
+  }
+
+  if (holding_scans_) {
+    SensorMessage message;
+    message.disparity = disparity;
+    message.Q = Q_;
+    message.full_image_size = full_image_size_;
+    PreprocessedScan scan;
+    if (preprocessDisparity(message, &scan) && !holdScanDuringLoad(scan)) {
+      boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+      insertPreprocessedScan(scan);
+    }
+    return;
+  }
+
   // Look up transform from sensor frame to world frame.
   Transformation sensor_to_world;
   if (lookupTransform(disparity->header.frame_id, world_frame_,
                       disparity->header.stamp, &sensor_to_world)) {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
     insertDisparityImage(sensor_to_world, disparity, Q_, full_image_size_);
   }
 }
 
 void OctomapManager::insertPointcloudWithTf(
     const sensor_msgs::PointCloud2::ConstPtr& pointcloud) {
+  if (async_insertion_) {
+    SensorMessage message;
+    message.pointcloud = pointcloud;
+    enqueueSensorMessage(message);
+    return;
+  }
+
+  if (holding_scans_) {
+    PreprocessedScan scan;
+    if (preprocessPointcloud(*pointcloud, &scan) &&
+        !holdScanDuringLoad(scan)) {
+      boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+      insertPreprocessedScan(scan);
+    }
+    return;
+  }
+
   // Look up transform from sensor frame to world frame.
   Transformation sensor_to_world;
   if (lookupTransform(pointcloud->header.frame_id, world_frame_,
                       pointcloud->header.stamp, &sensor_to_world)) {
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
     insertPointcloud(sensor_to_world, pointcloud);
   }
 }
 
-bool OctomapManager::lookupTransform(const std::string& from_frame,
-                                     const std::string& to_frame,
-                                     const ros::Time& timestamp,
-                                     Transformation* transform) {
-  if (use_tf_transforms_) {
-    return lookupTransformTf(from_frame, to_frame, timestamp, transform);
-  } else {
-    return lookupTransformQueue(from_frame, to_frame, timestamp, transform);
+void OctomapManager::startInsertionThreads() {
+  QueueOverflowPolicy policy = QueueOverflowPolicy::kDropOldest;
+  if (!queueOverflowPolicyFromString(insertion_queue_policy_, &policy)) {
+    ROS_ERROR_STREAM("Unknown insertion queue policy: "
+                     << insertion_queue_policy_
+                     << ", expected drop_oldest, drop_newest or merge. Using "
+                        "drop_oldest.");
+  }
+  // Raw messages can't be merged before their transform is known, so the
+  // first stage drops the oldest message instead.
+  const QueueOverflowPolicy message_policy =
+      policy == QueueOverflowPolicy::kDropNewest
+          ? QueueOverflowPolicy::kDropNewest
+          : QueueOverflowPolicy::kDropOldest;
+  message_queue_.reset(
+      new BoundedQueue<SensorMessage>(insertion_queue_size_, message_policy));
+  scan_queue_.reset(new BoundedQueue<ScanBatch>(
+      insertion_queue_size_, policy, [](ScanBatch* queued, ScanBatch* added) {
+        queued->insert(queued->end(), added->begin(), added->end());
+      }));
+
+  preprocessing_thread_ =
+      std::thread(&OctomapManager::preprocessingLoop, this);
+  integration_thread_ = std::thread(&OctomapManager::integrationLoop, this);
+}
+
+void OctomapManager::stopInsertionThreads() {
+  if (message_queue_) {
+    message_queue_->shutdown();
+  }
+  if (scan_queue_) {
+    scan_queue_->shutdown();
+  }
+  if (preprocessing_thread_.joinable()) {
+    preprocessing_thread_.join();
+  }
+  if (integration_thread_.joinable()) {
+    integration_thread_.join();
   }
 }
 
-bool OctomapManager::lookupTransformTf(const std::string& from_frame,
-                                       const std::string& to_frame,
-                                       const ros::Time& timestamp,
-                                       Transformation* transform) {
-  tf::StampedTransform tf_transform;
+void OctomapManager::startSavingThread() {
+  // Each queued save holds a copy of the map, so only a few may wait.
+  const size_t max_queued_saves = 2;
+  save_queue_.reset(new BoundedQueue<std::function<bool()> >(
+      max_queued_saves, QueueOverflowPolicy::kDropNewest));
+  saving_thread_ = std::thread(&OctomapManager::savingLoop, this);
+}
 
-  ros::Time time_to_lookup = timestamp;
+void OctomapManager::stopSavingThread() {
+  if (save_queue_) {
+    save_queue_->close();
+  }
+  if (saving_thread_.joinable()) {
+    saving_thread_.join();
+  }
+}
 
-  // If this transform isn't possible at the time, then try to just look up
-  // the latest (this is to work with bag files and static transform publisher,
-  // etc).
-  if (!tf_listener_.canTransform(to_frame, from_frame, time_to_lookup)) {
-    ros::Duration timestamp_age = ros::Time::now() - time_to_lookup;
-    if (timestamp_age < tf_listener_.getCacheLength()) {
-      time_to_lookup = ros::Time(0);
-      ROS_WARN("Using latest TF transform instead of timestamp match.");
-    } else {
-      ROS_ERROR("Requested transform time older than cache limit.");
-      return false;
+bool OctomapManager::runSave(const std::function<bool()>& save) {
+  if (!save_queue_) {
+    return save();
+  }
+  if (!save_queue_->push(save)) {
+    ROS_ERROR("Too many saves in progress, not saving.");
+    return false;
+  }
+  return true;
+}
+
+void OctomapManager::savingLoop() {
+  std::function<bool()> save;
+  while (save_queue_->pop(&save)) {
+    save();
+  }
+}
+
+void OctomapManager::enqueueSensorMessage(const SensorMessage& message) {
+  if (!message_queue_->push(message)) {
+    ROS_WARN_STREAM_THROTTLE(
+        1, "Insertion queue full, dropped " << message_queue_->getNumDropped()
+                                            << " sensor messages so far.");
+  }
+  updateQueueCounters();
+}
+
+void OctomapManager::preprocessingLoop() {
+  SensorMessage message;
+  while (message_queue_->pop(&message)) {
+    PreprocessedScan scan;
+    bool success = false;
+    if (message.pointcloud) {
+      success = preprocessPointcloud(*message.pointcloud, &scan);
+    } else if (message.disparity) {
+      success = preprocessDisparity(message, &scan);
     }
+    if (!success) {
+      continue;
+    }
+
+    ScanBatch batch(1, scan);
+    if (!scan_queue_->push(batch)) {
+      ROS_WARN_STREAM_THROTTLE(
+          1, "Integration is falling behind, dropped "
+                 << scan_queue_->getNumDropped() << " and merged "
+                 << scan_queue_->getNumMerged() << " scans so far.");
+    }
+    updateQueueCounters();
   }
+}
 
-  try {
-    tf_listener_.lookupTransform(to_frame, from_frame, time_to_lookup,
-                                 tf_transform);
-  } catch (tf::TransformException& ex) {
-    ROS_ERROR_STREAM(
-        "Error getting TF transform from sensor data: " << ex.what());
+void OctomapManager::updateQueueCounters() {
+  OCTOMAP_WORLD_SET_COUNT(&instrumentation_, kQueueDepth,
+                          message_queue_->size() + scan_queue_->size());
+  OCTOMAP_WORLD_SET_COUNT(
+      &instrumentation_, kScansDropped,
+      message_queue_->getNumDropped() + scan_queue_->getNumDropped());
+}
+
+bool OctomapManager::preprocessPointcloud(
+    const sensor_msgs::PointCloud2& pointcloud, PreprocessedScan* scan) {
+  CHECK_NOTNULL(scan);
+  Transformation sensor_to_world;
+  if (!lookupTransform(pointcloud.header.frame_id, world_frame_,
+                       pointcloud.header.stamp, &sensor_to_world)) {
     return false;
   }
 
-  tf::transformTFToKindr(tf_transform, transform);
+  scan->cloud_world.reset(new pcl::PointCloud<pcl::PointXYZ>);
+  scan->sensor_position = sensor_to_world.getPosition();
+  if (!isPointWeighingSet()) {
+    // Read, filter and transform in a single pass over the message.
+    pcl::PointCloud<pcl::PointXYZ>* cloud_world = scan->cloud_world.get();
+    cloud_world->reserve(pointcloud.width * pointcloud.height);
+    if (forEachPointInWorldFrame(
+            sensor_to_world, pointcloud,
+            [cloud_world](double x, double y, double z) {
+              cloud_world->push_back(pcl::PointXYZ(x, y, z));
+            })) {
+      return true;
+    }
+  }
+
+  pcl::fromROSMsg(pointcloud, *scan->cloud_world);
+  if (isPointWeighingSet()) {
+    // Weights are indexed like the input, so NaNs are skipped at insertion.
+    computeWeights(scan->cloud_world, &scan->weights);
+  } else {
+    std::vector<int> indices;
+    pcl::removeNaNFromPointCloud(*scan->cloud_world, *scan->cloud_world,
+                                 indices);
+  }
+  pcl::transformPointCloud(*scan->cloud_world, *scan->cloud_world,
+                           sensor_to_world.getTransformationMatrix());
   return true;
 }
 
-void OctomapManager::transformCallback(
-    const geometry_msgs::TransformStamped& transform_msg) {
-  transform_queue_.push_back(transform_msg);
-}
-
-bool OctomapManager::lookupTransformQueue(const std::string& from_frame,
-                                          const std::string& to_frame,
-                                          const ros::Time& timestamp,
-                                          Transformation* transform) {
-  // Try to match the transforms in the queue.
-  bool match_found = false;
-  std::deque<geometry_msgs::TransformStamped>::iterator it =
-      transform_queue_.begin();
-  for (; it != transform_queue_.end(); ++it) {
-    // If the current transform is newer than the requested timestamp, we need
-    // to break.
-    if (it->header.stamp > timestamp) {
-      if ((it->header.stamp - timestamp).toNSec() < timestamp_tolerance_ns_) {
-        match_found = true;
+bool OctomapManager::preprocessDisparity(const SensorMessage& message,
+                                         PreprocessedScan* scan) {
+  CHECK_NOTNULL(scan);
+  const stereo_msgs::DisparityImage& disparity = *message.disparity;
+  Transformation sensor_to_world;
+  if (!lookupTransform(disparity.header.frame_id, world_frame_,
+                       disparity.header.stamp, &sensor_to_world)) {
+    return false;
+  }
+
+  cv_bridge::CvImageConstPtr cv_img_ptr =
+      cv_bridge::toCvShare(disparity.image, message.disparity);
+  const cv::Mat& disparity_image = cv_img_ptr->image;
+  const bool use_weights = isPointWeighingSet();
+  cv::Mat weights;
+  if (use_weights) {
+    computeWeights(disparity_image, &weights);
+  }
+  // Weighted insertion uses all pixels, like in OctomapWorld.
+  const int stride = use_weights ? 1 : std::max(params_.disparity_stride, 1);
+
+  // Only keep the points the disparity insertion would use.
+  scan->cloud_world.reset(new pcl::PointCloud<pcl::PointXYZ>);
+  pcl::PointCloud<pcl::PointXYZ>* cloud_world = scan->cloud_world.get();
+  std::vector<double>* scan_weights = &scan->weights;
+  const auto add_point = [cloud_world, scan_weights, use_weights, &weights](
+      int u, int v, double x, double y, double z) {
+    if (use_weights) {
+      const float weight = weights.at<float>(v, u);
+      if (weight <= 0.0f) {
+        return;
       }
-      break;
+      scan_weights->push_back(weight);
     }
-
-    if ((timestamp - it->header.stamp).toNSec() < timestamp_tolerance_ns_) {
-      match_found = true;
-      break;
+    cloud_world->push_back(pcl::PointXYZ(x, y, z));
+  };
+  const Eigen::Matrix4d Q = getDisparityQ(message.Q, message.full_image_size,
+                                          disparity_image.cols);
+  if (!forEachDisparityPointInWorldFrame(sensor_to_world, disparity_image, Q,
+                                         stride, add_point)) {
+    // Other disparity formats are projected by OpenCV first.
+    cv::Mat projected_points;
+    projectDisparityImage(disparity_image, message.Q, message.full_image_size,
+                          &projected_points);
+    for (int v = 0; v < projected_points.rows; ++v) {
+      const cv::Vec3f* row_pointer = projected_points.ptr<cv::Vec3f>(v);
+      for (int u = 0; u < projected_points.cols; ++u) {
+        if (!isValidPoint(row_pointer[u]) || row_pointer[u][2] < 0) {
+          continue;
+        }
+        const Eigen::Vector3d point_world =
+            sensor_to_world * Eigen::Vector3d(row_pointer[u][0],
+                                              row_pointer[u][1],
+                                              row_pointer[u][2]);
+        add_point(u, v, point_world.x(), point_world.y(), point_world.z());
+      }
     }
   }
+  scan->sensor_position = sensor_to_world.getPosition();
+  return true;
+}
+
+void OctomapManager::insertPreprocessedScan(const PreprocessedScan& scan) {
+  if (scan.weights.empty()) {
+    insertPointcloudInWorldFrame(scan.sensor_position, *scan.cloud_world);
+  } else {
+    insertPointcloudInWorldFrameWithWeights(scan.sensor_position,
+                                            *scan.cloud_world, scan.weights);
+  }
+}
+
+bool OctomapManager::holdScanDuringLoad(const PreprocessedScan& scan) {
+  if (!holding_scans_) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(held_scans_mutex_);
+  // Checked again, as the held scans may have been inserted meanwhile.
+  if (!holding_scans_) {
+    return false;
+  }
+  if (held_scans_.size() >= kMaxScansHeldDuringLoad) {
+    ROS_WARN_THROTTLE(10.0, "Dropping scans held back while loading a map.");
+    OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kScansDropped, 1);
+    held_scans_.pop_front();
+  }
+  held_scans_.push_back(scan);
+  return true;
+}
+
+void OctomapManager::insertHeldScans() {
+  std::deque<PreprocessedScan> scans;
+  {
+    std::lock_guard<std::mutex> lock(held_scans_mutex_);
+    holding_scans_ = false;
+    scans.swap(held_scans_);
+  }
+  if (scans.empty()) {
+    return;
+  }
+  // Batched scans are older than the held ones.
+  integrateScanBatch();
+  for (const PreprocessedScan& scan : scans) {
+    insertPreprocessedScan(scan);
+  }
+  ROS_INFO_STREAM("Inserted " << scans.size()
+                              << " scans that arrived while loading the map.");
+}
 
-  if (match_found) {
-    Transformation T_G_D;
-    tf::transformMsgToKindr(it->transform, &T_G_D);
+void OctomapManager::integrationLoop() {
+  const bool merge_scans = scan_batch_size_ > 1;
+  const std::chrono::steady_clock::duration max_latency =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double, std::milli>(
+              scan_batch_max_latency_ms_));
+  std::chrono::steady_clock::time_point batch_deadline;
 
-    // If we have a static transform, apply it too.
-    // Transform should actually be T_G_C. So need to take it through the full
-    // chain.
-    *transform = T_G_D * T_B_D_.inverse() * T_B_C_;
+  while (true) {
+    ScanBatch batch;
+    // Only the latency bound of an open scan batch limits the wait.
+    bool popped = false;
+    if (getNumScansInBatch() > 0) {
+      popped = scan_queue_->pop(&batch, batch_deadline);
+    } else {
+      popped = scan_queue_->pop(&batch);
+    }
+    if (!popped && scan_queue_->isShutdown()) {
+      break;
+    }
 
-    // And also clear the queue up to this point. This leaves the current
-    // message in place.
-    transform_queue_.erase(transform_queue_.begin(), it);
-  } else {
-    ROS_WARN_STREAM_THROTTLE(
-        30, "No match found for transform timestamp: " << timestamp);
-    if (!transform_queue_.empty()) {
-      ROS_WARN_STREAM_THROTTLE(
-          30,
-          "Queue front: " << transform_queue_.front().header.stamp
-                          << " back: " << transform_queue_.back().header.stamp);
+    boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+    for (const PreprocessedScan& scan : batch) {
+      if (holdScanDuringLoad(scan)) {
+        continue;
+      }
+      if (!scan.weights.empty()) {
+        // Weighted scans are not merged, but must not overtake older scans.
+        integrateScanBatch();
+        insertPointcloudInWorldFrameWithWeights(
+            scan.sensor_position, *scan.cloud_world, scan.weights);
+      } else if (merge_scans) {
+        if (getNumScansInBatch() == 0) {
+          batch_deadline = std::chrono::steady_clock::now() + max_latency;
+        }
+        addPointcloudToScanBatch(scan.sensor_position, *scan.cloud_world);
+      } else {
+        insertPointcloudInWorldFrame(scan.sensor_position, *scan.cloud_world);
+      }
+    }
+    if (getNumScansInBatch() >= static_cast<size_t>(scan_batch_size_) ||
+        (getNumScansInBatch() > 0 &&
+         std::chrono::steady_clock::now() >= batch_deadline)) {
+      integrateScanBatch();
     }
   }
-  return match_found;
+
+  // Don't lose the scans collected so far.
+  boost::unique_lock<boost::shared_mutex> lock(map_mutex_);
+  integrateScanBatch();
 }
 
 }  // namespace volumetric_mapping
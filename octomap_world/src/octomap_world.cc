@@ -29,6 +29,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "octomap_world/octomap_world.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
 #include <glog/logging.h>
 #include <octomap_msgs/conversions.h>
 #include <octomap_ros/conversions.h>
@@ -46,61 +55,185 @@ Eigen::Vector3d pointOctomapToEigen(const octomap::point3d& point) {
   return Eigen::Vector3d(point.x(), point.y(), point.z());
 }
 
+// Sets the probabilities and thresholds of the parameters on the tree.
+void setOctreeProbabilities(const OctomapParameters& params,
+                            PooledOcTree* octree) {
+  octree->setProbHit(params.probability_hit);
+  octree->setProbMiss(params.probability_miss);
+  octree->setClampingThresMin(params.threshold_min);
+  octree->setClampingThresMax(params.threshold_max);
+  octree->setOccupancyThres(params.threshold_occupancy);
+}
+
+// Keeps the maximum weight seen for each key.
+void insertMaxWeight(const octomap::OcTreeKey& key, double weight,
+                     KeyWeightMap* key_weights) {
+  std::pair<KeyWeightMap::iterator, bool> result =
+      key_weights->emplace(key, weight);
+  if (!result.second && result.first->second < weight) {
+    result.first->second = weight;
+  }
+}
+
+// Sets nearest_position to the point closest to position that lies within
+// one of the boxes (at least epsilon from its faces) and returns its distance.
+double findNearestPointInBoxes(
+    const Eigen::Vector3d& position,
+    const std::vector<std::pair<Eigen::Vector3d, double>>& box_vector,
+    double epsilon, Eigen::Vector3d* nearest_position) {
+  double min_distance = std::numeric_limits<double>::max();
+  Eigen::Vector3d actual_distance;
+  Eigen::Vector3d actual_nearest_position;
+  for (const std::pair<Eigen::Vector3d, double>& box : box_vector) {
+    // Distance between center of box and position
+    actual_distance = position - box.first;
+    // Limit the distance such that it is still in the box
+    actual_distance = actual_distance.cwiseMin(
+        Eigen::Vector3d::Constant(box.second / 2 - epsilon));
+    actual_distance = actual_distance.cwiseMax(
+        Eigen::Vector3d::Constant(-box.second / 2 + epsilon));
+    // Nearest position to the desired position
+    actual_nearest_position = box.first + actual_distance;
+    // Check if this is the best position found so far
+    if ((position - actual_nearest_position).norm() < min_distance) {
+      min_distance = (position - actual_nearest_position).norm();
+      *nearest_position = actual_nearest_position;
+    }
+  }
+  return min_distance;
+}
+
+// Number of tree levels below a block of at most block_size meters, and at
+// least two voxels if the block size allows.
+unsigned int getLevelsForBlockSize(double resolution, unsigned int tree_depth,
+                                   double block_size) {
+  unsigned int levels = 0;
+  while (levels < tree_depth && (2 << levels) * resolution <= block_size) {
+    ++levels;
+  }
+  return levels;
+}
+
 // Create a default parameters object and call the other constructor with it.
 OctomapWorld::OctomapWorld() : OctomapWorld(OctomapParameters()) {}
 
 // Creates an octomap with the correct parameters.
 OctomapWorld::OctomapWorld(const OctomapParameters& params)
-    : robot_size_(Eigen::Vector3d::Ones()) {
+    : robot_size_(Eigen::Vector3d::Ones()),
+      all_visualization_blocks_changed_(true),
+      visualization_block_levels_(0),
+      next_visualization_block_id_(0),
+      visualization_min_z_(0.0),
+      visualization_max_z_(0.0),
+      num_eviction_files_(0),
+      all_tiles_changed_(false),
+      map_deltas_enabled_(false),
+      num_unique_map_delta_codes_(0),
+      map_delta_keyframe_needed_(true) {
   setOctomapParameters(params);
 }
 
 // Creates deepcopy of OctomapWorld
-OctomapWorld::OctomapWorld(const OctomapWorld& rhs) {
+OctomapWorld::OctomapWorld(const OctomapWorld& rhs)
+    : all_visualization_blocks_changed_(true),
+      visualization_block_levels_(0),
+      next_visualization_block_id_(0),
+      visualization_min_z_(0.0),
+      visualization_max_z_(0.0),
+      num_eviction_files_(0),
+      all_tiles_changed_(false),
+      map_deltas_enabled_(false),
+      num_unique_map_delta_codes_(0),
+      map_delta_keyframe_needed_(true) {
   OctomapParameters params;
   rhs.getOctomapParameters(&params);
   setOctomapParameters(params);
   robot_size_ = rhs.getRobotSize();
 
-  // Get rhs octomap binary
-  std::stringstream datastream;
-  rhs.writeOctomapToBinaryConst(datastream);
-  // Write octomap binary
-  if (!octree_->readBinary(datastream)) {
-    std::cerr << "Could not copy octree!\n";
-  }
-  octree_->prune();
+  // Copy the nodes directly, which keeps their probabilities and is much
+  // faster than going through the binary format.
+  octree_.reset(new PooledOcTree(*rhs.octree_));
+  handleMapReplaced();
 }
 
 void OctomapWorld::resetMap() {
   if (!octree_) {
-    octree_.reset(new octomap::OcTree(params_.resolution));
+    octree_.reset(new PooledOcTree(params_.resolution));
   }
   octree_->clear();
+  // Release the memory of the cleared nodes in bulk.
+  PooledOcTreeNode::getPool().trim();
+  scan_batch_.clear();
+  num_scans_in_batch_ = 0;
+  closeTiledMap();
+  handleMapReplaced();
 }
 
 void OctomapWorld::prune() { octree_->prune(); }
 
 void OctomapWorld::setOctomapParameters(const OctomapParameters& params) {
+  bool tree_replaced = false;
   if (octree_) {
     if (octree_->getResolution() != params.resolution) {
       LOG(WARNING) << "Octomap resolution has changed! Resetting tree!";
-      octree_.reset(new octomap::OcTree(params.resolution));
+      octree_.reset(new PooledOcTree(params.resolution));
+      PooledOcTreeNode::getPool().trim();
+      closeTiledMap();
+      tree_replaced = true;
     }
   } else {
-    octree_.reset(new octomap::OcTree(params.resolution));
+    octree_.reset(new PooledOcTree(params.resolution));
+    tree_replaced = true;
   }
-
-  octree_->setProbHit(params.probability_hit);
-  octree_->setProbMiss(params.probability_miss);
-  octree_->setClampingThresMin(params.threshold_min);
-  octree_->setClampingThresMax(params.threshold_max);
-  octree_->setOccupancyThres(params.threshold_occupancy);
+  if (tree_replaced) {
+    // Keys collected for a scan batch are only valid for the current tree.
+    scan_batch_.clear();
+    num_scans_in_batch_ = 0;
+  }
+  // A new occupancy threshold changes which voxels are occupied, which is
+  // as good as a new map for everything derived from it.
+  const bool occupancy_changed =
+      !tree_replaced &&
+      params.threshold_occupancy != params_.threshold_occupancy;
+  const bool esdf_changed =
+      !tree_replaced && (params.use_esdf != params_.use_esdf ||
+                         params.esdf_max_distance != params_.esdf_max_distance);
+  const bool visualization_bounds_changed =
+      !tree_replaced && (params.visualize_min_z != params_.visualize_min_z ||
+                         params.visualize_max_z != params_.visualize_max_z);
+
+  setOctreeProbabilities(params, octree_.get());
   octree_->enableChangeDetection(params.change_detection_enabled);
+  const size_t change_journal_capacity =
+      std::max(0, params.change_journal_capacity);
+  if (change_journal_capacity != change_journal_.getCapacity()) {
+    change_journal_.setCapacity(change_journal_capacity);
+  }
+
+  // Blocks are only valid for one block size.
+  const unsigned int visualization_block_levels =
+      getLevelsForBlockSize(params.resolution, octree_->getTreeDepth(),
+                            params.visualization_block_size);
+  if (visualization_block_levels != visualization_block_levels_) {
+    resetVisualizationBlocks();
+    visualization_block_levels_ = visualization_block_levels;
+  }
 
   // Copy over all the parameters for future use (some are not used just for
   // creating the octree).
   params_ = params;
+  // Everything else, e.g. the insertion and query settings, leaves the map
+  // and the changes that consumers haven't read yet as they are.
+  if (tree_replaced || occupancy_changed) {
+    handleMapReplaced();
+    return;
+  }
+  if (esdf_changed) {
+    rebuildEsdf();
+  }
+  if (visualization_bounds_changed) {
+    all_visualization_blocks_changed_ = true;
+  }
 }
 
 void OctomapWorld::getOctomapParameters(OctomapParameters* params) const {
@@ -117,27 +250,441 @@ void OctomapWorld::insertPointcloudIntoMapImpl(
   // First, rotate the pointcloud into the world frame.
   pcl::transformPointCloud(*cloud, *cloud,
                            T_G_sensor.getTransformationMatrix());
-  const octomap::point3d p_G_sensor =
-      pointEigenToOctomap(T_G_sensor.getPosition());
+  insertPointcloudInWorldFrame(T_G_sensor.getPosition(), *cloud);
+}
+
+void OctomapWorld::insertPointcloud2IntoMapImpl(
+    const Transformation& T_G_sensor,
+    const sensor_msgs::PointCloud2& pointcloud_sensor) {
+  const bool streamed = insertStreamedPoints(
+      T_G_sensor.getPosition(),
+      pointcloud_sensor.width * pointcloud_sensor.height,
+      [&T_G_sensor, &pointcloud_sensor](const PointFunction& point_function) {
+        return forEachPointInWorldFrame(T_G_sensor, pointcloud_sensor,
+                                        point_function);
+      });
+  if (!streamed) {
+    // Unusual point formats go through the PCL conversion.
+    WorldBase::insertPointcloud2IntoMapImpl(T_G_sensor, pointcloud_sensor);
+  }
+}
+
+void OctomapWorld::insertDisparityIntoMapImpl(
+    const Transformation& sensor_to_world, const cv::Mat& disparity,
+    const Eigen::Matrix4d& Q) {
+  const int stride = std::max(params_.disparity_stride, 1);
+  const size_t max_num_points =
+      ((disparity.rows + stride - 1) / stride) *
+      ((disparity.cols + stride - 1) / stride);
+  const bool streamed = insertStreamedPoints(
+      sensor_to_world.getPosition(), max_num_points,
+      [this, &sensor_to_world, &disparity, &Q,
+       stride](const PointFunction& point_function) {
+        return forEachDisparityPointInWorldFrame(
+            sensor_to_world, disparity, Q, stride,
+            [&point_function](int u, int v, double x, double y, double z) {
+              point_function(x, y, z);
+            });
+      });
+  if (!streamed) {
+    WorldBase::insertDisparityIntoMapImpl(sensor_to_world, disparity, Q);
+  }
+}
+
+bool OctomapWorld::insertStreamedPoints(
+    const Eigen::Vector3d& sensor_position, size_t max_num_points,
+    const std::function<bool(const PointFunction&)>& stream_points) {
+  // Transform and filtering happen in the same pass that reads the points;
+  // the serial path even casts the rays right away.
+  const bool cast_while_streaming = !params_.use_sorted_key_batches &&
+                                    !params_.downsample_endpoints &&
+                                    params_.num_insertion_threads <= 1;
+  if (cast_while_streaming) {
+    loadTilesAroundSensor(sensor_position);
+    const octomap::point3d p_G_sensor = pointEigenToOctomap(sensor_position);
+    octomap::KeySet free_cells, occupied_cells;
+    size_t num_rays = 0;
+    bool streamed = false;
+    {
+      OCTOMAP_WORLD_TIMER(&instrumentation_, kRayCasting);
+      streamed = stream_points([this, &p_G_sensor, &free_cells,
+                                &occupied_cells,
+                                &num_rays](double x, double y, double z) {
+        const octomap::point3d p_G_point(x, y, z);
+        const octomap::OcTreeKey key = octree_->coordToKey(p_G_point);
+        if (occupied_cells.find(key) == occupied_cells.end()) {
+          castRay(p_G_sensor, p_G_point, &free_cells, &occupied_cells);
+          ++num_rays;
+        }
+      });
+    }
+    if (streamed) {
+      OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kScansInserted, 1);
+      OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kRaysCast, num_rays);
+      updateOccupancy(&free_cells, &occupied_cells);
+    }
+    return streamed;
+  }
+
+  streamed_cloud_.clear();
+  streamed_cloud_.reserve(max_num_points);
+  if (!stream_points([this](double x, double y, double z) {
+        streamed_cloud_.push_back(pcl::PointXYZ(x, y, z));
+      })) {
+    return false;
+  }
+  insertPointcloudInWorldFrame(sensor_position, streamed_cloud_);
+  return true;
+}
+
+void OctomapWorld::insertPointcloudInWorldFrame(
+    const Eigen::Vector3d& sensor_position,
+    const pcl::PointCloud<pcl::PointXYZ>& cloud_world) {
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kScansInserted, 1);
+  loadTilesAroundSensor(sensor_position);
+  const octomap::point3d p_G_sensor = pointEigenToOctomap(sensor_position);
+
+  const pcl::PointCloud<pcl::PointXYZ>* cloud = &cloud_world;
+  if (params_.downsample_endpoints) {
+    downsampleEndpoints(cloud_world, &downsampled_cloud_,
+                        &downsampled_endpoints_);
+    cloud = &downsampled_cloud_;
+  }
 
   // Then add all the rays from this pointcloud.
   // We do this as a batch operation - so first get all the keys in a set, then
   // do the update in batch.
+  if (params_.use_sorted_key_batches) {
+    key_batch_.clear();
+    castRays(p_G_sensor, *cloud, &key_batch_);
+    updateOccupancy(&key_batch_);
+    return;
+  }
+
+  if (params_.downsample_endpoints && params_.weight_by_hit_count) {
+    insertDownsampledPointcloudWithHitCounts(p_G_sensor, *cloud,
+                                             downsampled_endpoints_);
+    return;
+  }
+
+  octomap::KeySet free_cells, occupied_cells;
+  castRays(p_G_sensor, *cloud, &free_cells, &occupied_cells);
+
+  // Apply the new free cells and occupied cells from
+  updateOccupancy(&free_cells, &occupied_cells);
+}
+
+void OctomapWorld::addPointcloudToScanBatch(
+    const Eigen::Vector3d& sensor_position,
+    const pcl::PointCloud<pcl::PointXYZ>& cloud_world) {
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kScansInserted, 1);
+  loadTilesAroundSensor(sensor_position);
+  const octomap::point3d p_G_sensor = pointEigenToOctomap(sensor_position);
+  const pcl::PointCloud<pcl::PointXYZ>* cloud = &cloud_world;
+  if (params_.downsample_endpoints) {
+    downsampleEndpoints(cloud_world, &downsampled_cloud_,
+                        &downsampled_endpoints_);
+    cloud = &downsampled_cloud_;
+  }
+
+  if (params_.use_sorted_key_batches) {
+    castRays(p_G_sensor, *cloud, &scan_batch_);
+  } else {
+    // Cast into per-scan sets, so the endpoint check only skips rays of the
+    // same scan (i.e. from the same origin).
+    octomap::KeySet free_cells, occupied_cells;
+    castRays(p_G_sensor, *cloud, &free_cells, &occupied_cells);
+    scan_batch_.addFreeKeys(free_cells.begin(), free_cells.end());
+    scan_batch_.addOccupiedKeys(occupied_cells.begin(), occupied_cells.end());
+  }
+  ++num_scans_in_batch_;
+}
+
+void OctomapWorld::downsampleEndpoints(
+    const pcl::PointCloud<pcl::PointXYZ>& cloud,
+    pcl::PointCloud<pcl::PointXYZ>* downsampled_cloud,
+    std::vector<DownsampledEndpoint>* endpoints) {
+  CHECK_NOTNULL(downsampled_cloud);
+  CHECK_NOTNULL(endpoints);
+  downsampled_cloud->clear();
+  endpoints->clear();
+  endpoint_voxel_indices_.clear();
+  endpoint_sums_.clear();
+
+  // Buckets keep the order in which their voxel was first hit, so the output
+  // is deterministic.
+  for (const pcl::PointXYZ& point : cloud) {
+    const Eigen::Vector3d point_eigen(point.x, point.y, point.z);
+    DownsampledEndpoint endpoint;
+    endpoint.hit_count = 1.0;
+    endpoint.in_map =
+        octree_->coordToKeyChecked(pointEigenToOctomap(point_eigen),
+                                   endpoint.key);
+    if (!endpoint.in_map) {
+      endpoint_sums_.push_back(point_eigen);
+      endpoints->push_back(endpoint);
+      continue;
+    }
+    std::pair<std::unordered_map<octomap::OcTreeKey, size_t,
+                                 octomap::OcTreeKey::KeyHash>::iterator,
+              bool>
+        result = endpoint_voxel_indices_.emplace(endpoint.key,
+                                                 endpoint_sums_.size());
+    if (result.second) {
+      endpoint_sums_.push_back(point_eigen);
+      endpoints->push_back(endpoint);
+    } else {
+      endpoint_sums_[result.first->second] += point_eigen;
+      (*endpoints)[result.first->second].hit_count += 1.0;
+    }
+  }
+
+  // The centroid of each bucket is inside its voxel, but rounding it to
+  // floats can move it across the voxel border. The voxel center keeps the
+  // endpoint key of the ray the same then.
+  downsampled_cloud->reserve(endpoint_sums_.size());
+  for (size_t i = 0; i < endpoint_sums_.size(); ++i) {
+    const DownsampledEndpoint& endpoint = (*endpoints)[i];
+    const Eigen::Vector3d centroid = endpoint_sums_[i] / endpoint.hit_count;
+    pcl::PointXYZ point(centroid.x(), centroid.y(), centroid.z());
+    if (endpoint.in_map &&
+        octree_->coordToKey(octomap::point3d(point.x, point.y, point.z)) !=
+            endpoint.key) {
+      const octomap::point3d center = octree_->keyToCoord(endpoint.key);
+      point = pcl::PointXYZ(center.x(), center.y(), center.z());
+    }
+    downsampled_cloud->push_back(point);
+  }
+}
+
+void OctomapWorld::insertDownsampledPointcloudWithHitCounts(
+    const octomap::point3d& sensor_origin,
+    const pcl::PointCloud<pcl::PointXYZ>& downsampled_cloud,
+    const std::vector<DownsampledEndpoint>& endpoints) {
+  CHECK_EQ(downsampled_cloud.size(), endpoints.size());
   octomap::KeySet free_cells, occupied_cells;
-  for (pcl::PointCloud<pcl::PointXYZ>::const_iterator it = cloud->begin();
-       it != cloud->end(); ++it) {
+  castRays(sensor_origin, downsampled_cloud, &free_cells, &occupied_cells);
+
+  // Every endpoint voxel appears once in the downsampled cloud, so its hit
+  // count can be looked up by its key. Rays clipped to the sensor range have
+  // no occupied endpoint.
+  KeyWeightMap free_weights, occupied_weights;
+  for (const DownsampledEndpoint& endpoint : endpoints) {
+    if (endpoint.in_map &&
+        occupied_cells.find(endpoint.key) != occupied_cells.end()) {
+      occupied_weights.emplace(endpoint.key, endpoint.hit_count);
+    }
+  }
+  free_weights.reserve(free_cells.size());
+  for (const octomap::OcTreeKey& key : free_cells) {
+    free_weights.emplace(key, 1.0);
+  }
+  updateOccupancy(free_weights, occupied_weights);
+}
+
+void OctomapWorld::integrateScanBatch() {
+  if (num_scans_in_batch_ == 0) {
+    return;
+  }
+  updateOccupancy(&scan_batch_);
+  scan_batch_.clear();
+  num_scans_in_batch_ = 0;
+}
+
+void OctomapWorld::castRays(const octomap::point3d& sensor_origin,
+                            const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                            octomap::KeySet* free_cells,
+                            octomap::KeySet* occupied_cells) {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kRayCasting);
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kRaysCast, cloud.size());
+  if (params_.num_insertion_threads > 1) {
+    castRaysParallel(sensor_origin, cloud, free_cells, occupied_cells);
+    return;
+  }
+  for (pcl::PointCloud<pcl::PointXYZ>::const_iterator it = cloud.begin();
+       it != cloud.end(); ++it) {
     const octomap::point3d p_G_point(it->x, it->y, it->z);
     // First, check if we've already checked this.
     octomap::OcTreeKey key = octree_->coordToKey(p_G_point);
 
-    if (occupied_cells.find(key) == occupied_cells.end()) {
+    if (occupied_cells->find(key) == occupied_cells->end()) {
       // Check if this is within the allowed sensor range.
-      castRay(p_G_sensor, p_G_point, &free_cells, &occupied_cells);
+      castRay(sensor_origin, p_G_point, free_cells, occupied_cells);
     }
   }
+}
 
-  // Apply the new free cells and occupied cells from
-  updateOccupancy(&free_cells, &occupied_cells);
+void OctomapWorld::castRays(const octomap::point3d& sensor_origin,
+                            const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                            KeyBatch* key_batch) {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kRayCasting);
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kRaysCast, cloud.size());
+  if (params_.num_insertion_threads > 1) {
+    castRaysParallel(sensor_origin, cloud, key_batch);
+  } else {
+    castRays(sensor_origin, cloud.begin(), cloud.end(), &key_ray_, key_batch);
+  }
+}
+
+void OctomapWorld::castRaysParallel(const octomap::point3d& sensor_origin,
+                                    const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                                    octomap::KeySet* free_cells,
+                                    octomap::KeySet* occupied_cells) {
+  CHECK_NOTNULL(free_cells);
+  CHECK_NOTNULL(occupied_cells);
+
+  const size_t num_points = cloud.size();
+  const size_t num_threads = std::max<size_t>(
+      1u, std::min<size_t>(params_.num_insertion_threads, num_points));
+  if (parallel_key_rays_.size() < num_threads) {
+    parallel_key_rays_.resize(num_threads);
+  }
+
+  // Each thread works on a contiguous chunk of the cloud.
+  struct ChunkData {
+    size_t begin;
+    size_t end;
+    // Indices and endpoint keys of the points that need a ray cast, after
+    // skipping points whose endpoint was already hit earlier in the chunk.
+    std::vector<size_t> ray_indices;
+    std::vector<octomap::OcTreeKey> ray_keys;
+    octomap::KeySet free_cells;
+    octomap::KeySet occupied_cells;
+  };
+  std::vector<ChunkData> chunks(num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    chunks[i].begin = num_points * i / num_threads;
+    chunks[i].end = num_points * (i + 1) / num_threads;
+  }
+
+  // The serial path skips a point if an earlier point in the cloud already
+  // marked its endpoint as occupied. To get the same map, first collect the
+  // occupied endpoints of every chunk...
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back([this, &chunks, &cloud, &sensor_origin, i]() {
+      ChunkData& chunk = chunks[i];
+      for (size_t j = chunk.begin; j < chunk.end; ++j) {
+        const octomap::point3d p_G_point(cloud[j].x, cloud[j].y, cloud[j].z);
+        const octomap::OcTreeKey key = octree_->coordToKey(p_G_point);
+        if (chunk.occupied_cells.find(key) != chunk.occupied_cells.end()) {
+          continue;
+        }
+        chunk.ray_indices.push_back(j);
+        chunk.ray_keys.push_back(key);
+        if (params_.sensor_max_range < 0.0 ||
+            (p_G_point - sensor_origin).norm() <= params_.sensor_max_range) {
+          octomap::OcTreeKey checked_key;
+          if (octree_->coordToKeyChecked(p_G_point, checked_key)) {
+            chunk.occupied_cells.insert(checked_key);
+          }
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+
+  // ... then cast the remaining rays, dropping those whose endpoint is marked
+  // occupied by any earlier chunk.
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back([this, &chunks, &cloud, &sensor_origin, i]() {
+      ChunkData& chunk = chunks[i];
+      octomap::KeyRay* key_ray = &parallel_key_rays_[i];
+      // The occupied endpoints were all found above; other threads read
+      // chunk.occupied_cells concurrently, so it may not be written here.
+      octomap::KeySet discarded_occupied_cells;
+      for (size_t j = 0; j < chunk.ray_indices.size(); ++j) {
+        bool hit_in_earlier_chunk = false;
+        for (size_t k = 0; k < i; ++k) {
+          if (chunks[k].occupied_cells.find(chunk.ray_keys[j]) !=
+              chunks[k].occupied_cells.end()) {
+            hit_in_earlier_chunk = true;
+            break;
+          }
+        }
+        if (hit_in_earlier_chunk) {
+          continue;
+        }
+        const pcl::PointXYZ& point = cloud[chunk.ray_indices[j]];
+        castRay(sensor_origin, octomap::point3d(point.x, point.y, point.z),
+                key_ray, &chunk.free_cells, &discarded_occupied_cells);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  // Deterministic merge in chunk order.
+  for (const ChunkData& chunk : chunks) {
+    free_cells->insert(chunk.free_cells.begin(), chunk.free_cells.end());
+    occupied_cells->insert(chunk.occupied_cells.begin(),
+                           chunk.occupied_cells.end());
+  }
+}
+
+void OctomapWorld::castRaysParallel(const octomap::point3d& sensor_origin,
+                                    const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                                    KeyBatch* key_batch) {
+  CHECK_NOTNULL(key_batch);
+
+  const size_t num_points = cloud.size();
+  const size_t num_threads = std::max<size_t>(
+      1u, std::min<size_t>(params_.num_insertion_threads, num_points));
+  if (parallel_key_rays_.size() < num_threads) {
+    parallel_key_rays_.resize(num_threads);
+  }
+  if (parallel_key_batches_.size() < num_threads) {
+    parallel_key_batches_.resize(num_threads);
+  }
+
+  // Duplicates are removed when the batch is finalized, so the chunks can be
+  // cast completely independently.
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back([this, &cloud, &sensor_origin, num_points, num_threads,
+                          i]() {
+      KeyBatch* thread_batch = &parallel_key_batches_[i];
+      thread_batch->clear();
+      castRays(sensor_origin, cloud.begin() + num_points * i / num_threads,
+               cloud.begin() + num_points * (i + 1) / num_threads,
+               &parallel_key_rays_[i], thread_batch);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    key_batch->append(parallel_key_batches_[i]);
+  }
+}
+
+void OctomapWorld::castRays(
+    const octomap::point3d& sensor_origin,
+    pcl::PointCloud<pcl::PointXYZ>::const_iterator begin,
+    pcl::PointCloud<pcl::PointXYZ>::const_iterator end,
+    octomap::KeyRay* key_ray, KeyBatch* key_batch) const {
+  // Without a hash set there is no cheap lookup of all endpoints hit so far;
+  // consecutive points very often hit the same voxel though, so at least skip
+  // those.
+  bool has_last_endpoint = false;
+  octomap::OcTreeKey last_endpoint_key;
+  for (pcl::PointCloud<pcl::PointXYZ>::const_iterator it = begin; it != end;
+       ++it) {
+    const octomap::point3d p_G_point(it->x, it->y, it->z);
+    const octomap::OcTreeKey key = octree_->coordToKey(p_G_point);
+    if (has_last_endpoint && key == last_endpoint_key) {
+      continue;
+    }
+    const size_t num_occupied_before = key_batch->numOccupiedKeys();
+    castRay(sensor_origin, p_G_point, key_ray, key_batch);
+    has_last_endpoint = key_batch->numOccupiedKeys() > num_occupied_before;
+    last_endpoint_key = key;
+  }
 }
 
 void OctomapWorld::insertProjectedDisparityIntoMapImpl(
@@ -145,88 +692,262 @@ void OctomapWorld::insertProjectedDisparityIntoMapImpl(
   // Get the sensor origin in the world frame.
   Eigen::Vector3d sensor_origin_eigen = Eigen::Vector3d::Zero();
   sensor_origin_eigen = sensor_to_world * sensor_origin_eigen;
+  loadTilesAroundSensor(sensor_origin_eigen);
   octomap::point3d sensor_origin = pointEigenToOctomap(sensor_origin_eigen);
 
+  if (params_.use_sorted_key_batches) {
+    key_batch_.clear();
+  }
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kScansInserted, 1);
   octomap::KeySet free_cells, occupied_cells;
-  for (int v = 0; v < projected_points.rows; ++v) {
-    const cv::Vec3f* row_pointer = projected_points.ptr<cv::Vec3f>(v);
+  bool has_last_endpoint = false;
+  octomap::OcTreeKey last_endpoint_key;
+  size_t num_rays = 0;
+  {
+    OCTOMAP_WORLD_TIMER(&instrumentation_, kRayCasting);
+    for (int v = 0; v < projected_points.rows; ++v) {
+      const cv::Vec3f* row_pointer = projected_points.ptr<cv::Vec3f>(v);
+
+      for (int u = 0; u < projected_points.cols; ++u) {
+        // Check whether we're within the correct range for disparity.
+        if (!isValidPoint(row_pointer[u]) || row_pointer[u][2] < 0) {
+          continue;
+        }
+        Eigen::Vector3d point_eigen(row_pointer[u][0], row_pointer[u][1],
+                                    row_pointer[u][2]);
+
+        point_eigen = sensor_to_world * point_eigen;
+        octomap::point3d point_octomap = pointEigenToOctomap(point_eigen);
+
+        // First, check if we've already checked this.
+        octomap::OcTreeKey key = octree_->coordToKey(point_octomap);
+
+        if (params_.use_sorted_key_batches) {
+          if (has_last_endpoint && key == last_endpoint_key) {
+            continue;
+          }
+          const size_t num_occupied_before = key_batch_.numOccupiedKeys();
+          castRay(sensor_origin, point_octomap, &key_ray_, &key_batch_);
+          has_last_endpoint =
+              key_batch_.numOccupiedKeys() > num_occupied_before;
+          last_endpoint_key = key;
+          ++num_rays;
+        } else if (occupied_cells.find(key) == occupied_cells.end()) {
+          // Check if this is within the allowed sensor range.
+          castRay(sensor_origin, point_octomap, &free_cells, &occupied_cells);
+          ++num_rays;
+        }
+      }
+    }
+  }
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kRaysCast, num_rays);
+  if (params_.use_sorted_key_batches) {
+    updateOccupancy(&key_batch_);
+  } else {
+    updateOccupancy(&free_cells, &occupied_cells);
+  }
+}
+
+void OctomapWorld::insertPointcloudIntoMapWithWeightsImpl(
+    const Transformation& T_G_sensor,
+    const pcl::PointCloud<pcl::PointXYZ>::Ptr& cloud,
+    const std::vector<double>& weights) {
+  CHECK_EQ(cloud->size(), weights.size());
+
+  // The weights are indexed like the input cloud, so NaNs are skipped when
+  // inserting instead of being removed from the cloud.
+  pcl::transformPointCloud(*cloud, *cloud,
+                           T_G_sensor.getTransformationMatrix());
+  insertPointcloudInWorldFrameWithWeights(T_G_sensor.getPosition(), *cloud,
+                                          weights);
+}
 
-    for (int u = 0; u < projected_points.cols; ++u) {
-      // Check whether we're within the correct range for disparity.
-      if (!isValidPoint(row_pointer[u]) || row_pointer[u][2] < 0) {
+void OctomapWorld::insertPointcloudInWorldFrameWithWeights(
+    const Eigen::Vector3d& sensor_position,
+    const pcl::PointCloud<pcl::PointXYZ>& cloud_world,
+    const std::vector<double>& weights) {
+  CHECK_EQ(cloud_world.size(), weights.size());
+  loadTilesAroundSensor(sensor_position);
+  const octomap::point3d p_G_sensor = pointEigenToOctomap(sensor_position);
+
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kScansInserted, 1);
+  KeyWeightMap free_cells, occupied_cells;
+  size_t num_rays = 0;
+  {
+    OCTOMAP_WORLD_TIMER(&instrumentation_, kRayCasting);
+    for (size_t i = 0; i < cloud_world.size(); ++i) {
+      const pcl::PointXYZ& point = cloud_world[i];
+      if (weights[i] <= 0.0 || !std::isfinite(point.x) ||
+          !std::isfinite(point.y) || !std::isfinite(point.z)) {
         continue;
       }
-      Eigen::Vector3d point_eigen(row_pointer[u][0], row_pointer[u][1],
-                                  row_pointer[u][2]);
+      castWeightedRay(p_G_sensor,
+                      octomap::point3d(point.x, point.y, point.z), weights[i],
+                      &free_cells, &occupied_cells);
+      ++num_rays;
+    }
+  }
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kRaysCast, num_rays);
+  updateOccupancy(free_cells, occupied_cells);
+}
 
-      point_eigen = sensor_to_world * point_eigen;
-      octomap::point3d point_octomap = pointEigenToOctomap(point_eigen);
+void OctomapWorld::insertProjectedDisparityIntoMapWithWeightsImpl(
+    const Transformation& sensor_to_world, const cv::Mat& projected_points,
+    const cv::Mat& weights) {
+  CHECK_EQ(projected_points.rows, weights.rows);
+  CHECK_EQ(projected_points.cols, weights.cols);
+
+  // Get the sensor origin in the world frame.
+  Eigen::Vector3d sensor_origin_eigen = Eigen::Vector3d::Zero();
+  sensor_origin_eigen = sensor_to_world * sensor_origin_eigen;
+  loadTilesAroundSensor(sensor_origin_eigen);
+  octomap::point3d sensor_origin = pointEigenToOctomap(sensor_origin_eigen);
 
-      // First, check if we've already checked this.
-      octomap::OcTreeKey key = octree_->coordToKey(point_octomap);
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kScansInserted, 1);
+  KeyWeightMap free_cells, occupied_cells;
+  size_t num_rays = 0;
+  {
+    OCTOMAP_WORLD_TIMER(&instrumentation_, kRayCasting);
+    for (int v = 0; v < projected_points.rows; ++v) {
+      const cv::Vec3f* row_pointer = projected_points.ptr<cv::Vec3f>(v);
+      const float* weight_row_pointer = weights.ptr<float>(v);
+
+      for (int u = 0; u < projected_points.cols; ++u) {
+        // Check whether we're within the correct range for disparity.
+        if (!isValidPoint(row_pointer[u]) || row_pointer[u][2] < 0 ||
+            weight_row_pointer[u] <= 0.0f) {
+          continue;
+        }
+        Eigen::Vector3d point_eigen(row_pointer[u][0], row_pointer[u][1],
+                                    row_pointer[u][2]);
 
-      if (occupied_cells.find(key) == occupied_cells.end()) {
-        // Check if this is within the allowed sensor range.
-        castRay(sensor_origin, point_octomap, &free_cells, &occupied_cells);
+        point_eigen = sensor_to_world * point_eigen;
+        castWeightedRay(sensor_origin, pointEigenToOctomap(point_eigen),
+                        weight_row_pointer[u], &free_cells, &occupied_cells);
+        ++num_rays;
       }
     }
   }
-  updateOccupancy(&free_cells, &occupied_cells);
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kRaysCast, num_rays);
+  updateOccupancy(free_cells, occupied_cells);
+}
+
+void OctomapWorld::castWeightedRay(const octomap::point3d& sensor_origin,
+                                   const octomap::point3d& point,
+                                   double weight, KeyWeightMap* free_cells,
+                                   KeyWeightMap* occupied_cells) {
+  CHECK_NOTNULL(free_cells);
+  CHECK_NOTNULL(occupied_cells);
+
+  // First, check if we've already checked this with a stronger measurement.
+  KeyWeightMap::const_iterator occupied_it =
+      occupied_cells->find(octree_->coordToKey(point));
+  if (occupied_it != occupied_cells->end() && occupied_it->second >= weight) {
+    return;
+  }
+
+  octomap::OcTreeKey endpoint_key;
+  const bool endpoint_occupied =
+      computeRayKeys(sensor_origin, point, &key_ray_, &endpoint_key);
+  for (const octomap::OcTreeKey& key : key_ray_) {
+    if (params_.max_free_space == 0.0 ||
+        isFreeSpaceUpdateAllowed(sensor_origin, key)) {
+      insertMaxWeight(key, weight, free_cells);
+    }
+  }
+  if (endpoint_occupied) {
+    insertMaxWeight(endpoint_key, weight, occupied_cells);
+  }
 }
 
 void OctomapWorld::castRay(const octomap::point3d& sensor_origin,
                            const octomap::point3d& point,
                            octomap::KeySet* free_cells,
                            octomap::KeySet* occupied_cells) {
+  castRay(sensor_origin, point, &key_ray_, free_cells, occupied_cells);
+}
+
+void OctomapWorld::castRay(const octomap::point3d& sensor_origin,
+                           const octomap::point3d& point,
+                           octomap::KeyRay* key_ray,
+                           octomap::KeySet* free_cells,
+                           octomap::KeySet* occupied_cells) const {
   CHECK_NOTNULL(free_cells);
   CHECK_NOTNULL(occupied_cells);
 
-  if (params_.sensor_max_range < 0.0 ||
-      (point - sensor_origin).norm() <= params_.sensor_max_range) {
-    // Cast a ray to compute all the free cells.
-    key_ray_.reset();
-    if (octree_->computeRayKeys(sensor_origin, point, key_ray_)) {
-      if (params_.max_free_space == 0.0) {
-        free_cells->insert(key_ray_.begin(), key_ray_.end());
-      } else {
-        for (const auto& key : key_ray_) {
-          octomap::point3d voxel_coordinate = octree_->keyToCoord(key);
-          if ((voxel_coordinate - sensor_origin).norm() <
-                  params_.max_free_space ||
-              voxel_coordinate.z() >
-                  (sensor_origin.z() - params_.min_height_free_space)) {
-            free_cells->insert(key);
-          }
-        }
+  octomap::OcTreeKey endpoint_key;
+  const bool endpoint_occupied =
+      computeRayKeys(sensor_origin, point, key_ray, &endpoint_key);
+  if (params_.max_free_space == 0.0) {
+    free_cells->insert(key_ray->begin(), key_ray->end());
+  } else {
+    for (const octomap::OcTreeKey& key : *key_ray) {
+      if (isFreeSpaceUpdateAllowed(sensor_origin, key)) {
+        free_cells->insert(key);
       }
     }
-    // Mark endpoing as occupied.
-    octomap::OcTreeKey key;
-    if (octree_->coordToKeyChecked(point, key)) {
-      occupied_cells->insert(key);
-    }
+  }
+  // Mark endpoint as occupied.
+  if (endpoint_occupied) {
+    occupied_cells->insert(endpoint_key);
+  }
+}
+
+void OctomapWorld::castRay(const octomap::point3d& sensor_origin,
+                           const octomap::point3d& point,
+                           octomap::KeyRay* key_ray,
+                           KeyBatch* key_batch) const {
+  CHECK_NOTNULL(key_batch);
+
+  octomap::OcTreeKey endpoint_key;
+  const bool endpoint_occupied =
+      computeRayKeys(sensor_origin, point, key_ray, &endpoint_key);
+  if (params_.max_free_space == 0.0) {
+    key_batch->addFreeKeys(key_ray->begin(), key_ray->end());
   } else {
-    // If the ray is longer than the max range, just update free space.
-    octomap::point3d new_end =
-        sensor_origin +
-        (point - sensor_origin).normalized() * params_.sensor_max_range;
-    key_ray_.reset();
-    if (octree_->computeRayKeys(sensor_origin, new_end, key_ray_)) {
-      if (params_.max_free_space == 0.0) {
-        free_cells->insert(key_ray_.begin(), key_ray_.end());
-      } else {
-        for (const auto& key : key_ray_) {
-          octomap::point3d voxel_coordinate = octree_->keyToCoord(key);
-          if ((voxel_coordinate - sensor_origin).norm() <
-                  params_.max_free_space ||
-              voxel_coordinate.z() >
-                  (sensor_origin.z() - params_.min_height_free_space)) {
-            free_cells->insert(key);
-          }
-        }
+    for (const octomap::OcTreeKey& key : *key_ray) {
+      if (isFreeSpaceUpdateAllowed(sensor_origin, key)) {
+        key_batch->addFreeKey(key);
       }
     }
   }
+  if (endpoint_occupied) {
+    key_batch->addOccupiedKey(endpoint_key);
+  }
+}
+
+bool OctomapWorld::computeRayKeys(const octomap::point3d& sensor_origin,
+                                  const octomap::point3d& point,
+                                  octomap::KeyRay* key_ray,
+                                  octomap::OcTreeKey* endpoint_key) const {
+  CHECK_NOTNULL(key_ray);
+  CHECK_NOTNULL(endpoint_key);
+
+  // Check if this is within the allowed sensor range. If the ray is longer
+  // than the max range, just update free space.
+  const bool within_range =
+      params_.sensor_max_range < 0.0 ||
+      (point - sensor_origin).norm() <= params_.sensor_max_range;
+  const octomap::point3d ray_end =
+      within_range
+          ? point
+          : sensor_origin +
+                (point - sensor_origin).normalized() * params_.sensor_max_range;
+
+  // Cast a ray to compute all the free cells.
+  key_ray->reset();
+  if (!octree_->computeRayKeys(sensor_origin, ray_end, *key_ray)) {
+    key_ray->reset();
+  }
+  return within_range && octree_->coordToKeyChecked(point, *endpoint_key);
+}
+
+bool OctomapWorld::isFreeSpaceUpdateAllowed(
+    const octomap::point3d& sensor_origin, const octomap::OcTreeKey& key) const {
+  octomap::point3d voxel_coordinate = octree_->keyToCoord(key);
+  return (voxel_coordinate - sensor_origin).norm() < params_.max_free_space ||
+         voxel_coordinate.z() >
+             (sensor_origin.z() - params_.min_height_free_space);
 }
 
 bool OctomapWorld::isValidPoint(const cv::Vec3f& point) const {
@@ -239,12 +960,18 @@ void OctomapWorld::updateOccupancy(octomap::KeySet* free_cells,
                                    octomap::KeySet* occupied_cells) {
   CHECK_NOTNULL(free_cells);
   CHECK_NOTNULL(occupied_cells);
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kUpdateOccupancy);
+
+  const bool lazy_eval = true;
+  std::vector<octomap::OcTreeKey> touched_keys;
+  touched_keys.reserve(free_cells->size() + occupied_cells->size());
 
   // Mark occupied cells.
   for (octomap::KeySet::iterator it = occupied_cells->begin(),
                                  end = occupied_cells->end();
        it != end; it++) {
-    octree_->updateNode(*it, true);
+    octree_->updateNode(*it, true, lazy_eval);
+    touched_keys.push_back(*it);
 
     // Remove any occupied cells from free cells - assume there are far fewer
     // occupied cells than free cells, so this is much faster than checking on
@@ -258,57 +985,599 @@ void OctomapWorld::updateOccupancy(octomap::KeySet* free_cells,
   for (octomap::KeySet::iterator it = free_cells->begin(),
                                  end = free_cells->end();
        it != end; ++it) {
-    octree_->updateNode(*it, false);
+    octree_->updateNode(*it, false, lazy_eval);
+    touched_keys.push_back(*it);
   }
-  octree_->updateInnerOccupancy();
+  updateInnerOccupancy(touched_keys, true);
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kKeysTouched, touched_keys.size());
+  OCTOMAP_WORLD_SET_COUNT(&instrumentation_, kNumTreeNodes, octree_->size());
 }
 
-void OctomapWorld::enableTreatUnknownAsOccupied() {
-  params_.treat_unknown_as_occupied = true;
-}
+void OctomapWorld::updateOccupancy(const KeyWeightMap& free_cells,
+                                   const KeyWeightMap& occupied_cells) {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kUpdateOccupancy);
+  const float hit_log_odds = octree_->getProbHitLog();
+  const float miss_log_odds = octree_->getProbMissLog();
+  const bool lazy_eval = true;
+  std::vector<octomap::OcTreeKey> touched_keys;
+  touched_keys.reserve(free_cells.size() + occupied_cells.size());
+
+  // Mark occupied cells, scaling the hit log-odds by their weight.
+  for (const KeyWeightMap::value_type& key_weight : occupied_cells) {
+    octree_->updateNode(key_weight.first,
+                        static_cast<float>(key_weight.second * hit_log_odds),
+                        lazy_eval);
+    touched_keys.push_back(key_weight.first);
+  }
 
-void OctomapWorld::disableTreatUnknownAsOccupied() {
-  params_.treat_unknown_as_occupied = false;
+  // Mark free cells, skipping the ones already marked occupied.
+  for (const KeyWeightMap::value_type& key_weight : free_cells) {
+    if (occupied_cells.find(key_weight.first) != occupied_cells.end()) {
+      continue;
+    }
+    octree_->updateNode(key_weight.first,
+                        static_cast<float>(key_weight.second * miss_log_odds),
+                        lazy_eval);
+    touched_keys.push_back(key_weight.first);
+  }
+  updateInnerOccupancy(touched_keys, true);
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kKeysTouched, touched_keys.size());
+  OCTOMAP_WORLD_SET_COUNT(&instrumentation_, kNumTreeNodes, octree_->size());
 }
 
-OctomapWorld::CellStatus OctomapWorld::getCellStatusBoundingBox(
-    const Eigen::Vector3d& point,
-    const Eigen::Vector3d& bounding_box_size) const {
-  // First case: center point is unknown or occupied. Can just quit.
-  CellStatus center_status = getCellStatusPoint(point);
-  if (center_status != CellStatus::kFree) {
-    return center_status;
-  }
+void OctomapWorld::updateOccupancy(KeyBatch* key_batch) {
+  CHECK_NOTNULL(key_batch);
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kUpdateOccupancy);
 
-  // Also if center is outside of the bounds.
-  octomap::OcTreeKey key;
-  if (!octree_->coordToKeyChecked(pointEigenToOctomap(point), key)) {
-    if (params_.treat_unknown_as_occupied) {
-      return CellStatus::kOccupied;
-    } else {
-      return CellStatus::kUnknown;
-    }
+  // Sorts the keys and resolves occupied/free conflicts, so each key is updated
+  // exactly once and in depth-first order of the tree.
+  key_batch->finalize();
+  const bool lazy_eval = true;
+  for (size_t i = 0; i < key_batch->numOccupiedKeys(); ++i) {
+    octree_->updateNode(key_batch->getOccupiedKey(i), true, lazy_eval);
+  }
+  for (size_t i = 0; i < key_batch->numFreeKeys(); ++i) {
+    octree_->updateNode(key_batch->getFreeKey(i), false, lazy_eval);
   }
 
-  // Now we have to iterate over everything in the bounding box.
-  Eigen::Vector3d bbx_min_eigen = point - bounding_box_size / 2;
-  Eigen::Vector3d bbx_max_eigen = point + bounding_box_size / 2;
+  const std::vector<uint64_t>& free_codes = key_batch->getFreeCodes();
+  const std::vector<uint64_t>& occupied_codes = key_batch->getOccupiedCodes();
+  touched_codes_.resize(free_codes.size() + occupied_codes.size());
+  std::merge(free_codes.begin(), free_codes.end(), occupied_codes.begin(),
+             occupied_codes.end(), touched_codes_.begin());
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kKeysTouched,
+                          touched_codes_.size());
+  updateInnerOccupancy(&touched_codes_, true);
+  OCTOMAP_WORLD_SET_COUNT(&instrumentation_, kNumTreeNodes, octree_->size());
+}
 
-  octomap::point3d bbx_min = pointEigenToOctomap(bbx_min_eigen);
-  octomap::point3d bbx_max = pointEigenToOctomap(bbx_max_eigen);
+void OctomapWorld::computeOccupiedKeys(
+    const pcl::PointCloud<pcl::PointXYZ>& cloud, KeyBatch* key_batch) const {
+  CHECK_NOTNULL(key_batch)->clear();
+  const size_t num_threads = std::max<size_t>(
+      1u, std::min<size_t>(params_.num_load_threads, cloud.size()));
+  // Neighboring points mostly fall into the same voxels, so each thread
+  // deduplicates its contiguous part of the cloud before the merge.
+  std::vector<KeyBatch> thread_batches(num_threads);
+  auto compute_keys = [this, &cloud, num_threads,
+                       &thread_batches](size_t thread_index) {
+    const size_t begin = cloud.size() * thread_index / num_threads;
+    const size_t end = cloud.size() * (thread_index + 1) / num_threads;
+    KeyBatch& batch = thread_batches[thread_index];
+    for (size_t i = begin; i < end; ++i) {
+      octomap::OcTreeKey key;
+      if (octree_->coordToKeyChecked(
+              octomap::point3d(cloud[i].x, cloud[i].y, cloud[i].z), key)) {
+        batch.addOccupiedKey(key);
+      }
+    }
+    batch.finalize();
+  };
 
-  for (octomap::OcTree::leaf_bbx_iterator
-           iter = octree_->begin_leafs_bbx(bbx_min, bbx_max),
-           end = octree_->end_leafs_bbx();
-       iter != end; ++iter) {
-    Eigen::Vector3d cube_center(iter.getX(), iter.getY(), iter.getZ());
-    int depth_level = iter.getDepth();
-    double cube_size = octree_->getNodeSize(depth_level);
+  if (num_threads <= 1) {
+    compute_keys(0);
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_threads; ++i) {
+      threads.emplace_back(compute_keys, i);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+  for (const KeyBatch& batch : thread_batches) {
+    key_batch->append(batch);
+  }
+  key_batch->finalize();
+}
 
-    // Check if it is really inside bounding box, since leaf_bbx_iterator begins
-    // "too early"
-    Eigen::Vector3d cube_lower_bound =
-        cube_center - (cube_size / 2) * Eigen::Vector3d::Ones();
+void OctomapWorld::insertOccupiedKeys(KeyBatch* key_batch) {
+  CHECK_NOTNULL(key_batch);
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kUpdateOccupancy);
+  key_batch->finalize();
+  const std::vector<uint64_t>& codes = key_batch->getOccupiedCodes();
+  if (codes.empty()) {
+    return;
+  }
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const float hit_log_odds = octree_->getProbHitLog();
+  bool root_created = false;
+  if (octree_->getRoot() == NULL) {
+    octree_->createRoot();
+    root_created = true;
+  }
+
+  // Nodes from the root to the previous key.
+  std::vector<PooledOcTreeNode*> path(tree_depth + 1, NULL);
+  path[0] = octree_->getRoot();
+  unsigned int path_depth = 0;
+  for (size_t i = 0; i < codes.size(); ++i) {
+    const octomap::OcTreeKey key = KeyBatch::mortonDecode(codes[i]);
+    // Each level is 3 bits of the codes, so the keys share the nodes above
+    // the highest level at which the codes differ.
+    unsigned int depth = 0;
+    if (i > 0) {
+      unsigned int levels = 0;
+      for (uint64_t diff = codes[i] ^ codes[i - 1]; diff != 0; diff >>= 3) {
+        ++levels;
+      }
+      depth = std::min(path_depth, tree_depth - levels);
+    }
+    // Only the root of an empty tree is a new node without children.
+    bool created = root_created && i == 0;
+    PooledOcTreeNode* node = path[depth];
+    for (; depth < tree_depth; ++depth) {
+      const unsigned int child_index =
+          octomap::computeChildIdx(key, tree_depth - 1 - depth);
+      bool child_created = false;
+      if (!octree_->nodeChildExists(node, child_index)) {
+        if (!created && !octree_->nodeHasChildren(node)) {
+          // A pruned leaf, which only changes if it isn't occupied for good.
+          if (node->getLogOdds() >= octree_->getClampingThresMaxLog()) {
+            break;
+          }
+          octree_->expandNode(node);
+        } else {
+          octree_->createNodeChild(node, child_index);
+          child_created = true;
+        }
+      }
+      node = octree_->getNodeChild(node, child_index);
+      created = child_created;
+      path[depth + 1] = node;
+    }
+    path_depth = depth;
+    if (depth < tree_depth) {
+      continue;
+    }
+    const bool was_occupied = !created && octree_->isNodeOccupied(node);
+    octree_->updateNodeLogOdds(node, hit_log_odds);
+    octree_->registerLeafChange(key, created, was_occupied,
+                                octree_->isNodeOccupied(node));
+  }
+
+  touched_codes_ = codes;
+  OCTOMAP_WORLD_ADD_COUNT(&instrumentation_, kKeysTouched,
+                          touched_codes_.size());
+  updateInnerOccupancy(&touched_codes_, true);
+  OCTOMAP_WORLD_SET_COUNT(&instrumentation_, kNumTreeNodes, octree_->size());
+}
+
+void OctomapWorld::updateInnerOccupancy(
+    const std::vector<octomap::OcTreeKey>& keys, bool prune) {
+  touched_codes_.clear();
+  touched_codes_.reserve(keys.size());
+  for (const octomap::OcTreeKey& key : keys) {
+    touched_codes_.push_back(KeyBatch::mortonEncode(key));
+  }
+  updateInnerOccupancy(&touched_codes_, prune);
+}
+
+void OctomapWorld::updateInnerOccupancy(std::vector<uint64_t>* codes,
+                                        bool prune) {
+  CHECK_NOTNULL(codes);
+  const unsigned int tree_depth = octree_->getTreeDepth();
+
+  // The leaves are final already, and pruning keeps them searchable.
+  if (esdf_) {
+    updateEsdf(*codes);
+  }
+  if (params_.incremental_visualization) {
+    markVisualizationBlocksChanged(*codes);
+  }
+  if (tiled_map_) {
+    markTilesChanged(*codes);
+  }
+  if (map_deltas_enabled_) {
+    addMapDeltaCodes(*codes);
+  }
+  if (inflation_) {
+    inflation_->markChanged(*codes);
+  }
+
+  // Every key costs a search per level, so for big updates a single pass over
+  // the whole tree is cheaper.
+  if (codes->size() * tree_depth >= octree_->size()) {
+    octree_->updateInnerOccupancy();
+    if (prune) {
+      octree_->prune();
+    }
+    return;
+  }
+
+  // Going up one level drops the lowest 3 bits of the Morton code. Parents of
+  // sorted codes are sorted as well, so each level only needs to remove
+  // adjacent duplicates.
+  std::sort(codes->begin(), codes->end());
+  codes->erase(std::unique(codes->begin(), codes->end()), codes->end());
+  for (unsigned int level = 1; level <= tree_depth; ++level) {
+    size_t num_parents = 0;
+    for (size_t i = 0; i < codes->size(); ++i) {
+      const uint64_t parent_code = (*codes)[i] >> 3;
+      if (num_parents == 0 || (*codes)[num_parents - 1] != parent_code) {
+        (*codes)[num_parents++] = parent_code;
+      }
+    }
+    codes->resize(num_parents);
+
+    // Depth 0 means the leaf level for search(), so the root is special.
+    const unsigned int depth = tree_depth - level;
+    for (const uint64_t code : *codes) {
+      PooledOcTreeNode* node =
+          depth == 0
+              ? octree_->getRoot()
+              : octree_->search(KeyBatch::mortonDecode(code << (3 * level)),
+                                depth);
+      // Nodes above a pruned leaf don't exist, and the leaf itself has no
+      // children to update from.
+      if (node == NULL || !octree_->nodeHasChildren(node)) {
+        continue;
+      }
+      if (!prune || !octree_->pruneNode(node)) {
+        node->updateOccupancyChildren();
+      }
+    }
+  }
+}
+
+void OctomapWorld::addMapDeltaCodes(const std::vector<uint64_t>& codes) {
+  map_delta_codes_.insert(map_delta_codes_.end(), codes.begin(), codes.end());
+  // Long runs of updates between deltas touch the same leaves over again.
+  if (map_delta_codes_.size() > 2 * num_unique_map_delta_codes_ + 65536) {
+    std::sort(map_delta_codes_.begin(), map_delta_codes_.end());
+    map_delta_codes_.erase(
+        std::unique(map_delta_codes_.begin(), map_delta_codes_.end()),
+        map_delta_codes_.end());
+    num_unique_map_delta_codes_ = map_delta_codes_.size();
+  }
+}
+
+void OctomapWorld::enableTreatUnknownAsOccupied() {
+  params_.treat_unknown_as_occupied = true;
+}
+
+void OctomapWorld::disableTreatUnknownAsOccupied() {
+  params_.treat_unknown_as_occupied = false;
+}
+
+namespace {
+
+// Key of the coordinate, clamped to the keys of the map.
+octomap::key_type coordToKeyClamped(double coordinate, double resolution,
+                                    unsigned int tree_depth) {
+  const int tree_max_val = 1 << (tree_depth - 1);
+  const int key =
+      static_cast<int>(std::floor(coordinate / resolution)) + tree_max_val;
+  return std::min(std::max(key, 0), 2 * tree_max_val - 1);
+}
+
+// Key range covered by the node at the key and depth.
+void getNodeKeyRange(const octomap::OcTreeKey& key, unsigned int depth,
+                     unsigned int tree_depth, octomap::OcTreeKey* min_key,
+                     octomap::OcTreeKey* max_key) {
+  *min_key = key;
+  *max_key = key;
+  if (depth < tree_depth) {
+    const octomap::key_type half_size = 1 << (tree_depth - 1 - depth);
+    for (int i = 0; i < 3; ++i) {
+      (*min_key)[i] = key[i] - half_size;
+      (*max_key)[i] = key[i] + half_size - 1;
+    }
+  }
+}
+
+// Whether the keys [min_a, max_a] and [min_b, max_b] overlap on all axes.
+bool keyBoxesIntersect(const octomap::OcTreeKey& min_a,
+                       const octomap::OcTreeKey& max_a,
+                       const octomap::OcTreeKey& min_b,
+                       const octomap::OcTreeKey& max_b) {
+  for (int i = 0; i < 3; ++i) {
+    if (max_a[i] < min_b[i] || min_a[i] > max_b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether the keys [min_inner, max_inner] are all in [min_outer, max_outer].
+bool keyBoxContains(const octomap::OcTreeKey& min_outer,
+                    const octomap::OcTreeKey& max_outer,
+                    const octomap::OcTreeKey& min_inner,
+                    const octomap::OcTreeKey& max_inner) {
+  for (int i = 0; i < 3; ++i) {
+    if (min_inner[i] < min_outer[i] || max_inner[i] > max_outer[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Appends the keys of [min_key, max_key] outside of [cut_min, cut_max] as up
+// to six disjoint boxes.
+void appendKeyBoxDifference(
+    const octomap::OcTreeKey& min_key, const octomap::OcTreeKey& max_key,
+    const octomap::OcTreeKey& cut_min, const octomap::OcTreeKey& cut_max,
+    std::vector<std::pair<octomap::OcTreeKey, octomap::OcTreeKey> >* parts) {
+  if (!keyBoxesIntersect(min_key, max_key, cut_min, cut_max)) {
+    parts->push_back(std::make_pair(min_key, max_key));
+    return;
+  }
+  // Cut off the slabs below and above the cut box axis by axis, and shrink
+  // the rest to the cut box.
+  octomap::OcTreeKey rest_min = min_key, rest_max = max_key;
+  for (int i = 0; i < 3; ++i) {
+    if (rest_min[i] < cut_min[i]) {
+      octomap::OcTreeKey slab_max = rest_max;
+      slab_max[i] = cut_min[i] - 1;
+      parts->push_back(std::make_pair(rest_min, slab_max));
+      rest_min[i] = cut_min[i];
+    }
+    if (rest_max[i] > cut_max[i]) {
+      octomap::OcTreeKey slab_min = rest_min;
+      slab_min[i] = cut_max[i] + 1;
+      parts->push_back(std::make_pair(slab_min, rest_max));
+      rest_max[i] = cut_max[i];
+    }
+  }
+}
+
+}  // namespace
+
+OctomapWorld::CellStatus OctomapWorld::getCellStatusBoundingBox(
+    const Eigen::Vector3d& point,
+    const Eigen::Vector3d& bounding_box_size) const {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kBoxQuery);
+  BoundingBoxQuery query;
+  return getCellStatusBoundingBoxOutside(point, bounding_box_size, NULL,
+                                         &query);
+}
+
+OctomapWorld::CellStatus OctomapWorld::getCellStatusBoundingBoxOutside(
+    const Eigen::Vector3d& point, const Eigen::Vector3d& bounding_box_size,
+    const BoundingBoxQuery* checked, BoundingBoxQuery* query_out) const {
+  CHECK_NOTNULL(query_out);
+  BoundingBoxQuery& query = *query_out;
+  query.has_occupied_box = false;
+  // First case: center point is unknown or occupied. Can just quit.
+  CellStatus center_status = getCellStatusPoint(point);
+  if (center_status != CellStatus::kFree) {
+    return center_status;
+  }
+
+  // Also if center is outside of the bounds.
+  octomap::OcTreeKey key;
+  if (!octree_->coordToKeyChecked(pointEigenToOctomap(point), key)) {
+    if (params_.treat_unknown_as_occupied) {
+      return CellStatus::kOccupied;
+    } else {
+      return CellStatus::kUnknown;
+    }
+  }
+
+  // Now we have to check everything in the bounding box.
+  Eigen::Vector3d bbx_min_eigen = point - bounding_box_size / 2;
+  Eigen::Vector3d bbx_max_eigen = point + bounding_box_size / 2;
+
+  query.bbx_min = pointEigenToOctomap(bbx_min_eigen);
+  query.bbx_max = pointEigenToOctomap(bbx_max_eigen);
+  if (!octree_->coordToKeyChecked(query.bbx_min, query.occupied_min_key) ||
+      !octree_->coordToKeyChecked(query.bbx_max, query.occupied_max_key)) {
+    return getCellStatusBoundingBoxByLeafIteration(query.bbx_min,
+                                                   query.bbx_max);
+  }
+
+  // getUnknownLeafCenters() steps from the center of the voxel containing the
+  // minimum corner, but only checks the cells after it (it increments before
+  // each search). Reproduce the same box, with the same float arithmetic.
+  const octomap::point3d min_center =
+      octree_->keyToCoord(query.occupied_min_key);
+  const octomap::point3d max_center =
+      octree_->keyToCoord(query.occupied_max_key);
+  const float step_size = octree_->getResolution();
+  query.has_unknown_box = true;
+  for (int i = 0; i < 3; ++i) {
+    const float diff = max_center(i) - min_center(i);
+    const unsigned int steps = floor(diff / step_size);
+    if (steps == 0) {
+      query.has_unknown_box = false;
+    }
+    query.unknown_min_key[i] = query.occupied_min_key[i] + 1;
+    query.unknown_max_key[i] = query.occupied_min_key[i] + steps;
+  }
+
+  query.stop_at_unknown = params_.treat_unknown_as_occupied;
+  query.occupied_found = false;
+  query.unknown_found = false;
+  const PooledOcTreeNode* root = octree_->getRoot();
+  const octomap::key_type root_key_value = 1 << (octree_->getTreeDepth() - 1);
+  const octomap::OcTreeKey root_key(root_key_value, root_key_value,
+                                    root_key_value);
+  if (checked == NULL) {
+    query.has_occupied_box = true;
+    if (root != NULL) {
+      queryBoundingBoxRecurs(root, root_key, 0, &query);
+    } else {
+      query.unknown_found = query.has_unknown_box;
+    }
+  } else {
+    // Only the slabs that the box adds to the checked one can hold occupied
+    // or (if it counts) unknown space. Unknown space doesn't change the
+    // result otherwise.
+    std::vector<std::pair<octomap::OcTreeKey, octomap::OcTreeKey> >
+        occupied_parts, unknown_parts;
+    appendKeyBoxDifference(query.occupied_min_key, query.occupied_max_key,
+                           checked->occupied_min_key,
+                           checked->occupied_max_key, &occupied_parts);
+    if (query.has_unknown_box && query.stop_at_unknown) {
+      if (checked->has_unknown_box) {
+        appendKeyBoxDifference(query.unknown_min_key, query.unknown_max_key,
+                               checked->unknown_min_key,
+                               checked->unknown_max_key, &unknown_parts);
+      } else {
+        unknown_parts.push_back(
+            std::make_pair(query.unknown_min_key, query.unknown_max_key));
+      }
+    }
+    BoundingBoxQuery part = query;
+    for (size_t i = 0;
+         i < std::max(occupied_parts.size(), unknown_parts.size()) &&
+         !query.occupied_found && !query.unknown_found;
+         ++i) {
+      part.has_occupied_box = i < occupied_parts.size();
+      if (part.has_occupied_box) {
+        part.occupied_min_key = occupied_parts[i].first;
+        part.occupied_max_key = occupied_parts[i].second;
+      }
+      part.has_unknown_box = i < unknown_parts.size();
+      if (part.has_unknown_box) {
+        part.unknown_min_key = unknown_parts[i].first;
+        part.unknown_max_key = unknown_parts[i].second;
+      }
+      if (root != NULL) {
+        queryBoundingBoxRecurs(root, root_key, 0, &part);
+      } else {
+        part.unknown_found = part.has_unknown_box;
+      }
+      query.occupied_found = part.occupied_found;
+      query.unknown_found = part.unknown_found;
+    }
+    query.has_occupied_box = true;
+  }
+
+  if (query.occupied_found) {
+    return CellStatus::kOccupied;
+  }
+  if (query.unknown_found) {
+    if (params_.treat_unknown_as_occupied) {
+      return CellStatus::kOccupied;
+    } else {
+      return CellStatus::kUnknown;
+    }
+  }
+  return CellStatus::kFree;
+}
+
+bool OctomapWorld::queryBoundingBoxRecurs(const PooledOcTreeNode* node,
+                                          const octomap::OcTreeKey& key,
+                                          unsigned int depth,
+                                          BoundingBoxQuery* query) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  // Key range covered by this node.
+  octomap::OcTreeKey min_key = key, max_key = key;
+  if (depth < tree_depth) {
+    const octomap::key_type half_size = 1 << (tree_depth - 1 - depth);
+    for (int i = 0; i < 3; ++i) {
+      min_key[i] = key[i] - half_size;
+      max_key[i] = key[i] + half_size - 1;
+    }
+  }
+  const bool in_occupied_box =
+      query->has_occupied_box &&
+      keyBoxesIntersect(min_key, max_key, query->occupied_min_key,
+                        query->occupied_max_key);
+  const bool in_unknown_box =
+      query->has_unknown_box && !query->unknown_found &&
+      keyBoxesIntersect(min_key, max_key, query->unknown_min_key,
+                        query->unknown_max_key);
+
+  if (!octree_->nodeHasChildren(node)) {
+    if (!in_occupied_box || !octree_->isNodeOccupied(node)) {
+      return false;
+    }
+    // Same check as for the leaf iterator, which begins "too early".
+    const octomap::point3d center = octree_->keyToCoord(key, depth);
+    const double half_cube_size = octree_->getNodeSize(depth) / 2;
+    for (int i = 0; i < 3; ++i) {
+      if (center(i) + half_cube_size < query->bbx_min(i) ||
+          center(i) - half_cube_size > query->bbx_max(i)) {
+        return false;
+      }
+    }
+    // Note that isSpeckleNode() only ever searches the node itself, so it
+    // never flags an occupied node and this costs a single search.
+    if (params_.filter_speckles && isSpeckleNode(key)) {
+      return false;
+    }
+    query->occupied_found = true;
+    return true;
+  }
+
+  // Inner nodes hold the maximum occupancy of their children, so there are no
+  // occupied leaves below a free inner node.
+  const bool search_occupied = in_occupied_box && octree_->isNodeOccupied(node);
+  if (!search_occupied && !in_unknown_box) {
+    return false;
+  }
+
+  // Half the key range of a child, zero for children at the leaf level.
+  const octomap::key_type center_offset_key =
+      depth + 1 < tree_depth ? 1 << (tree_depth - 2 - depth) : 0;
+  for (unsigned int i = 0; i < 8; ++i) {
+    octomap::OcTreeKey child_key;
+    octomap::computeChildKey(i, center_offset_key, key, child_key);
+    if (!octree_->nodeChildExists(node, i)) {
+      if (!in_unknown_box || query->unknown_found) {
+        continue;
+      }
+      // The whole child is unknown.
+      octomap::OcTreeKey child_min_key = child_key, child_max_key = child_key;
+      if (center_offset_key > 0) {
+        for (int j = 0; j < 3; ++j) {
+          child_min_key[j] = child_key[j] - center_offset_key;
+          child_max_key[j] = child_key[j] + center_offset_key - 1;
+        }
+      }
+      if (keyBoxesIntersect(child_min_key, child_max_key,
+                            query->unknown_min_key, query->unknown_max_key)) {
+        query->unknown_found = true;
+        if (query->stop_at_unknown) {
+          return true;
+        }
+      }
+      continue;
+    }
+    if (queryBoundingBoxRecurs(octree_->getNodeChild(node, i), child_key,
+                               depth + 1, query)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+OctomapWorld::CellStatus OctomapWorld::getCellStatusBoundingBoxByLeafIteration(
+    const octomap::point3d& bbx_min, const octomap::point3d& bbx_max) const {
+  for (PooledOcTree::leaf_bbx_iterator
+           iter = octree_->begin_leafs_bbx(bbx_min, bbx_max),
+           end = octree_->end_leafs_bbx();
+       iter != end; ++iter) {
+    Eigen::Vector3d cube_center(iter.getX(), iter.getY(), iter.getZ());
+    int depth_level = iter.getDepth();
+    double cube_size = octree_->getNodeSize(depth_level);
+
+    // Check if it is really inside bounding box, since leaf_bbx_iterator begins
+    // "too early"
+    Eigen::Vector3d cube_lower_bound =
+        cube_center - (cube_size / 2) * Eigen::Vector3d::Ones();
     Eigen::Vector3d cube_upper_bound =
         cube_center + (cube_size / 2) * Eigen::Vector3d::Ones();
     if (cube_upper_bound.x() < bbx_min.x() ||
@@ -343,9 +1612,226 @@ OctomapWorld::CellStatus OctomapWorld::getCellStatusBoundingBox(
   return CellStatus::kFree;
 }
 
+unsigned int OctomapWorld::getDepthForNodeSize(double node_size) const {
+  // Tolerates the rounding of the node sizes.
+  unsigned int depth = octree_->getTreeDepth();
+  while (depth > 0 && octree_->getNodeSize(depth) < node_size * (1.0 - 1e-6)) {
+    --depth;
+  }
+  return depth;
+}
+
+const PooledOcTreeNode* OctomapWorld::searchAtDepth(
+    const octomap::OcTreeKey& key, unsigned int depth) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const PooledOcTreeNode* node = octree_->getRoot();
+  for (unsigned int current_depth = 0;
+       node != NULL && current_depth < depth && octree_->nodeHasChildren(node);
+       ++current_depth) {
+    const unsigned int child_index =
+        octomap::computeChildIdx(key, tree_depth - 1 - current_depth);
+    if (!octree_->nodeChildExists(node, child_index)) {
+      return NULL;
+    }
+    node = octree_->getNodeChild(node, child_index);
+  }
+  return node;
+}
+
+OctomapWorld::CellStatus OctomapWorld::getStatusAtDepth(
+    const PooledOcTreeNode* node) const {
+  // Only inner nodes can be partly unknown, the search stops at leaves above
+  // the depth.
+  if (node == NULL ||
+      (!octree_->isNodeOccupied(node) && octree_->nodeHasChildren(node) &&
+       node->hasUnknown())) {
+    if (params_.treat_unknown_as_occupied) {
+      return CellStatus::kOccupied;
+    } else {
+      return CellStatus::kUnknown;
+    }
+  } else if (octree_->isNodeOccupied(node)) {
+    return CellStatus::kOccupied;
+  } else {
+    return CellStatus::kFree;
+  }
+}
+
+OctomapWorld::CellStatus OctomapWorld::getCellStatusPointAtDepth(
+    const Eigen::Vector3d& point, unsigned int depth) const {
+  CHECK_LE(depth, octree_->getTreeDepth());
+  octomap::OcTreeKey key;
+  if (!octree_->coordToKeyChecked(pointEigenToOctomap(point), key)) {
+    return getStatusAtDepth(NULL);
+  }
+  return getStatusAtDepth(searchAtDepth(key, depth));
+}
+
+OctomapWorld::CellStatus OctomapWorld::getLineStatusAtDepth(
+    const Eigen::Vector3d& start, const Eigen::Vector3d& end,
+    unsigned int depth) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  CHECK_LE(depth, tree_depth);
+  octomap::OcTreeKey start_key, end_key;
+  if (!octree_->coordToKeyChecked(pointEigenToOctomap(start), start_key) ||
+      !octree_->coordToKeyChecked(pointEigenToOctomap(end), end_key)) {
+    return getStatusAtDepth(NULL);
+  }
+
+  // Walks the grid of the nodes at the depth, in units of their size with
+  // the origin at key 0 (Amanatides and Woo).
+  const unsigned int shift = tree_depth - depth;
+  const double node_size = octree_->getNodeSize(depth);
+  const Eigen::Vector3d origin =
+      -octree_->getResolution() * (1 << (tree_depth - 1)) *
+      Eigen::Vector3d::Ones();
+  const Eigen::Vector3d start_scaled = (start - origin) / node_size;
+  const Eigen::Vector3d direction = (end - start) / node_size;
+  // Cells and steps left on each axis come from the keys of start and end,
+  // so rounding can't walk past the end.
+  Eigen::Vector3i cell, step, num_steps_left;
+  Eigen::Vector3d t_max, t_delta;
+  for (int i = 0; i < 3; ++i) {
+    cell[i] = start_key[i] >> shift;
+    const int end_cell = end_key[i] >> shift;
+    num_steps_left[i] = std::abs(end_cell - cell[i]);
+    step[i] = end_cell > cell[i] ? 1 : -1;
+    if (num_steps_left[i] == 0) {
+      continue;
+    }
+    const double boundary = step[i] > 0 ? cell[i] + 1 : cell[i];
+    t_delta[i] = 1.0 / std::abs(direction[i]);
+    t_max[i] = std::abs(boundary - start_scaled[i]) * t_delta[i];
+  }
+
+  while (true) {
+    octomap::OcTreeKey key;
+    for (int i = 0; i < 3; ++i) {
+      key[i] = static_cast<octomap::key_type>(cell[i] << shift);
+    }
+    const CellStatus status = getStatusAtDepth(searchAtDepth(key, depth));
+    if (status != CellStatus::kFree || num_steps_left.sum() == 0) {
+      return status;
+    }
+    // Steps over the nearest boundary.
+    int axis = -1;
+    for (int i = 0; i < 3; ++i) {
+      if (num_steps_left[i] > 0 && (axis < 0 || t_max[i] < t_max[axis])) {
+        axis = i;
+      }
+    }
+    cell[axis] += step[axis];
+    t_max[axis] += t_delta[axis];
+    --num_steps_left[axis];
+  }
+}
+
+OctomapWorld::CellStatus OctomapWorld::getCellStatusBoundingBoxAtDepth(
+    const Eigen::Vector3d& point, const Eigen::Vector3d& bounding_box_size,
+    unsigned int depth) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  CHECK_LE(depth, tree_depth);
+  const double resolution = octree_->getResolution();
+  const Eigen::Vector3d bbx_min = point - bounding_box_size / 2;
+  const Eigen::Vector3d bbx_max = point + bounding_box_size / 2;
+
+  // Space outside of the map is unknown, but occupied nodes in the part
+  // inside still take precedence.
+  octomap::OcTreeKey key;
+  bool unknown_found =
+      !octree_->coordToKeyChecked(pointEigenToOctomap(bbx_min), key) ||
+      !octree_->coordToKeyChecked(pointEigenToOctomap(bbx_max), key);
+  const octomap::key_type mask = (1 << (tree_depth - depth)) - 1;
+  octomap::OcTreeKey min_key, max_key;
+  for (int i = 0; i < 3; ++i) {
+    min_key[i] = coordToKeyClamped(bbx_min[i], resolution, tree_depth) & ~mask;
+    max_key[i] = coordToKeyClamped(bbx_max[i], resolution, tree_depth) | mask;
+  }
+
+  const PooledOcTreeNode* root = octree_->getRoot();
+  bool occupied_found = false;
+  if (root != NULL) {
+    const octomap::key_type root_key_value = 1 << (tree_depth - 1);
+    const octomap::OcTreeKey root_key(root_key_value, root_key_value,
+                                      root_key_value);
+    occupied_found = queryBoundingBoxAtDepthRecurs(
+        root, root_key, 0, depth, min_key, max_key, &unknown_found);
+  } else {
+    unknown_found = true;
+  }
+
+  if (occupied_found) {
+    return CellStatus::kOccupied;
+  }
+  if (unknown_found) {
+    if (params_.treat_unknown_as_occupied) {
+      return CellStatus::kOccupied;
+    } else {
+      return CellStatus::kUnknown;
+    }
+  }
+  return CellStatus::kFree;
+}
+
+bool OctomapWorld::queryBoundingBoxAtDepthRecurs(
+    const PooledOcTreeNode* node, const octomap::OcTreeKey& key,
+    unsigned int depth, unsigned int max_depth,
+    const octomap::OcTreeKey& min_key, const octomap::OcTreeKey& max_key,
+    bool* unknown_found) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  if (octree_->isNodeOccupied(node)) {
+    // Occupied inner nodes inside the box have an occupied leaf inside too.
+    octomap::OcTreeKey node_min_key, node_max_key;
+    getNodeKeyRange(key, depth, tree_depth, &node_min_key, &node_max_key);
+    if (depth == max_depth || !octree_->nodeHasChildren(node) ||
+        keyBoxContains(min_key, max_key, node_min_key, node_max_key)) {
+      return true;
+    }
+  } else {
+    // Free nodes only have unknown space left to find.
+    if (!octree_->nodeHasChildren(node) || *unknown_found ||
+        !node->hasUnknown()) {
+      return false;
+    }
+    octomap::OcTreeKey node_min_key, node_max_key;
+    getNodeKeyRange(key, depth, tree_depth, &node_min_key, &node_max_key);
+    if (depth == max_depth ||
+        keyBoxContains(min_key, max_key, node_min_key, node_max_key)) {
+      *unknown_found = true;
+      return params_.treat_unknown_as_occupied;
+    }
+  }
+
+  // Half the key range of a child, zero for children at the leaf level.
+  const octomap::key_type center_offset_key =
+      depth + 1 < tree_depth ? 1 << (tree_depth - 2 - depth) : 0;
+  for (unsigned int i = 0; i < 8; ++i) {
+    octomap::OcTreeKey child_key, child_min_key, child_max_key;
+    octomap::computeChildKey(i, center_offset_key, key, child_key);
+    getNodeKeyRange(child_key, depth + 1, tree_depth, &child_min_key,
+                    &child_max_key);
+    if (!keyBoxesIntersect(min_key, max_key, child_min_key, child_max_key)) {
+      continue;
+    }
+    if (!octree_->nodeChildExists(node, i)) {
+      *unknown_found = true;
+      if (params_.treat_unknown_as_occupied) {
+        return true;
+      }
+      continue;
+    }
+    if (queryBoundingBoxAtDepthRecurs(octree_->getNodeChild(node, i),
+                                      child_key, depth + 1, max_depth,
+                                      min_key, max_key, unknown_found)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 OctomapWorld::CellStatus OctomapWorld::getCellStatusPoint(
     const Eigen::Vector3d& point) const {
-  octomap::OcTreeNode* node = octree_->search(point.x(), point.y(), point.z());
+  PooledOcTreeNode* node = octree_->search(point.x(), point.y(), point.z());
   if (node == NULL) {
     if (params_.treat_unknown_as_occupied) {
       return CellStatus::kOccupied;
@@ -362,7 +1848,7 @@ OctomapWorld::CellStatus OctomapWorld::getCellStatusPoint(
 // Returns kUnknown even if treat_unknown_as_occupied is true.
 OctomapWorld::CellStatus OctomapWorld::getCellTrueStatusPoint(
     const Eigen::Vector3d& point) const {
-  octomap::OcTreeNode* node = octree_->search(point.x(), point.y(), point.z());
+  PooledOcTreeNode* node = octree_->search(point.x(), point.y(), point.z());
   if (node == NULL) {
     return CellStatus::kUnknown;
   } else if (octree_->isNodeOccupied(node)) {
@@ -374,7 +1860,7 @@ OctomapWorld::CellStatus OctomapWorld::getCellTrueStatusPoint(
 
 OctomapWorld::CellStatus OctomapWorld::getCellProbabilityPoint(
     const Eigen::Vector3d& point, double* probability) const {
-  octomap::OcTreeNode* node = octree_->search(point.x(), point.y(), point.z());
+  PooledOcTreeNode* node = octree_->search(point.x(), point.y(), point.z());
   if (node == NULL) {
     if (probability) {
       *probability = -1.0;
@@ -396,14 +1882,16 @@ OctomapWorld::CellStatus OctomapWorld::getLineStatus(
     const Eigen::Vector3d& start, const Eigen::Vector3d& end) const {
   // Get all node keys for this line.
   // This is actually a typedef for a vector of OcTreeKeys.
-  // Can't use the key_ray_ temp member here because this is a const function.
-  octomap::KeyRay key_ray;
+  // Can't use the key_ray_ temp member here because this is a const function,
+  // so every thread keeps its own instead of allocating one per call.
+  static thread_local octomap::KeyRay key_ray;
   octree_->computeRayKeys(pointEigenToOctomap(start), pointEigenToOctomap(end),
                           key_ray);
 
   // Now check if there are any unknown or occupied nodes in the ray.
-  for (octomap::OcTreeKey key : key_ray) {
-    octomap::OcTreeNode* node = octree_->search(key);
+  NodePathCache node_cache(*octree_);
+  for (const octomap::OcTreeKey& key : key_ray) {
+    const PooledOcTreeNode* node = node_cache.search(key);
     if (node == NULL) {
       if (params_.treat_unknown_as_occupied) {
         return CellStatus::kOccupied;
@@ -422,20 +1910,109 @@ OctomapWorld::CellStatus OctomapWorld::getVisibility(
     bool stop_at_unknown_cell) const {
   // Get all node keys for this line.
   // This is actually a typedef for a vector of OcTreeKeys.
-  // Can't use the key_ray_ temp member here because this is a const function.
-  octomap::KeyRay key_ray;
+  // Can't use the key_ray_ temp member here because this is a const function,
+  // so every thread keeps its own instead of allocating one per call.
+  static thread_local octomap::KeyRay key_ray;
+  NodePathCache node_cache(*octree_);
+  return getVisibility(pointEigenToOctomap(view_point),
+                       pointEigenToOctomap(voxel_to_test), stop_at_unknown_cell,
+                       &key_ray, &node_cache);
+}
 
-  octree_->computeRayKeys(pointEigenToOctomap(view_point),
-                          pointEigenToOctomap(voxel_to_test), key_ray);
+void OctomapWorld::getVisibilityBatch(
+    const Eigen::Vector3d& view_point,
+    const std::vector<Eigen::Vector3d>& voxels_to_test,
+    bool stop_at_unknown_cell, std::vector<CellStatus>* visibility,
+    VisibilityCounts* counts) const {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kVisibility);
+  if (visibility != NULL) {
+    visibility->resize(voxels_to_test.size());
+  }
+  const size_t num_threads = std::max<size_t>(
+      1u, std::min<size_t>(params_.num_visibility_threads,
+                           voxels_to_test.size()));
+  const octomap::point3d view_point_octomap = pointEigenToOctomap(view_point);
+
+  // Threads take the next chunk of voxels, since rays differ a lot in length.
+  // Neighboring voxels in the input usually have similar rays, which keeps
+  // the node path cache warm within a chunk.
+  const size_t kChunkSize = 64;
+  std::atomic<size_t> next_chunk(0);
+  std::vector<VisibilityCounts> thread_counts(num_threads);
+  auto check_voxels = [this, &voxels_to_test, stop_at_unknown_cell, visibility,
+                       &view_point_octomap, &next_chunk,
+                       &thread_counts](size_t thread_index) {
+    octomap::KeyRay key_ray;
+    NodePathCache ray_cache(*octree_);
+    NodePathCache voxel_cache(*octree_);
+    VisibilityCounts& thread_count = thread_counts[thread_index];
+    for (size_t begin = kChunkSize * next_chunk++;
+         begin < voxels_to_test.size(); begin = kChunkSize * next_chunk++) {
+      const size_t end = std::min(begin + kChunkSize, voxels_to_test.size());
+      for (size_t i = begin; i < end; ++i) {
+        const octomap::point3d voxel = pointEigenToOctomap(voxels_to_test[i]);
+        const CellStatus status =
+            getVisibility(view_point_octomap, voxel, stop_at_unknown_cell,
+                          &key_ray, &ray_cache);
+        if (visibility != NULL) {
+          (*visibility)[i] = status;
+        }
+        if (status != CellStatus::kFree) {
+          continue;
+        }
+        octomap::OcTreeKey key;
+        const PooledOcTreeNode* node =
+            octree_->coordToKeyChecked(voxel, key) ? voxel_cache.search(key)
+                                                   : NULL;
+        if (node == NULL) {
+          ++thread_count.num_unknown;
+        } else if (octree_->isNodeOccupied(node)) {
+          ++thread_count.num_occupied;
+        } else {
+          ++thread_count.num_free;
+        }
+      }
+    }
+  };
 
-  const octomap::OcTreeKey& voxel_to_test_key =
-      octree_->coordToKey(pointEigenToOctomap(voxel_to_test));
+  if (num_threads <= 1) {
+    check_voxels(0);
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_threads; ++i) {
+      threads.emplace_back(check_voxels, i);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+
+  if (counts != NULL) {
+    *counts = VisibilityCounts();
+    for (const VisibilityCounts& thread_count : thread_counts) {
+      counts->num_unknown += thread_count.num_unknown;
+      counts->num_free += thread_count.num_free;
+      counts->num_occupied += thread_count.num_occupied;
+    }
+  }
+}
+
+OctomapWorld::CellStatus OctomapWorld::getVisibility(
+    const octomap::point3d& view_point, const octomap::point3d& voxel_to_test,
+    bool stop_at_unknown_cell, octomap::KeyRay* key_ray,
+    NodePathCache* node_cache) const {
+  CHECK_NOTNULL(key_ray);
+  CHECK_NOTNULL(node_cache);
+  octree_->computeRayKeys(view_point, voxel_to_test, *key_ray);
+
+  const octomap::OcTreeKey& voxel_to_test_key =
+      octree_->coordToKey(voxel_to_test);
 
   // Now check if there are any unknown or occupied nodes in the ray,
   // except for the voxel_to_test key.
-  for (octomap::OcTreeKey key : key_ray) {
+  for (const octomap::OcTreeKey& key : *key_ray) {
     if (key != voxel_to_test_key) {
-      octomap::OcTreeNode* node = octree_->search(key);
+      const PooledOcTreeNode* node = node_cache->search(key);
       if (node == NULL) {
         if (stop_at_unknown_cell) {
           return CellStatus::kUnknown;
@@ -565,51 +2142,197 @@ void OctomapWorld::setBordersOccupied(const Eigen::Vector3d& cropping_size) {
 
   // Set all infeasible points occupied
   for (octomap::OcTreeKey key : occupied_keys) {
-    octree_->setNodeValue(octree_->keyToCoord(key), log_odds_value, lazy_eval);
+    octree_->setNodeValue(key, log_odds_value, lazy_eval);
   }
 
-  if (lazy_eval) {
-    octree_->updateInnerOccupancy();
+  // Only the paths above the changed keys need to be updated and pruned.
+  updateInnerOccupancy(std::vector<octomap::OcTreeKey>(occupied_keys.begin(),
+                                                       occupied_keys.end()),
+                       true);
+}
+
+void OctomapWorld::getExportSubtrees(
+    unsigned int max_depth, size_t min_num_subtrees,
+    std::vector<ExportSubtree>* subtrees) const {
+  CHECK_NOTNULL(subtrees)->clear();
+  if (octree_->getRoot() == NULL) {
+    return;
+  }
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const octomap::key_type root_key_value = 1 << (tree_depth - 1);
+  ExportSubtree root;
+  root.node = octree_->getRoot();
+  root.key = octomap::OcTreeKey(root_key_value, root_key_value, root_key_value);
+  root.depth = 0;
+  subtrees->push_back(root);
+
+  std::vector<ExportSubtree> next_subtrees;
+  bool split = true;
+  while (split && subtrees->size() < min_num_subtrees) {
+    split = false;
+    next_subtrees.clear();
+    for (const ExportSubtree& subtree : *subtrees) {
+      if (subtree.depth >= max_depth ||
+          !octree_->nodeHasChildren(subtree.node)) {
+        next_subtrees.push_back(subtree);
+        continue;
+      }
+      split = true;
+      const octomap::key_type center_offset_key =
+          root_key_value >> (subtree.depth + 1);
+      for (unsigned int i = 0; i < 8; ++i) {
+        if (!octree_->nodeChildExists(subtree.node, i)) {
+          continue;
+        }
+        ExportSubtree child;
+        child.node = octree_->getNodeChild(subtree.node, i);
+        octomap::computeChildKey(i, center_offset_key, subtree.key, child.key);
+        child.depth = subtree.depth + 1;
+        next_subtrees.push_back(child);
+      }
+    }
+    subtrees->swap(next_subtrees);
+  }
+}
+
+template <typename Output, typename LeafFunction>
+void OctomapWorld::forEachLeafParallel(unsigned int max_depth,
+                                       const LeafFunction& leaf_function,
+                                       std::vector<Output>* outputs) const {
+  CHECK_NOTNULL(outputs)->clear();
+  const size_t num_threads = std::max(1, params_.num_export_threads);
+  // A few subtrees per thread, as their sizes differ a lot.
+  const size_t kSubtreesPerThread = 8;
+  std::vector<ExportSubtree> subtrees;
+  getExportSubtrees(max_depth,
+                    num_threads <= 1 ? 1 : kSubtreesPerThread * num_threads,
+                    &subtrees);
+  outputs->resize(subtrees.size());
+
+  std::atomic<size_t> next_subtree(0);
+  auto walk_subtrees = [this, max_depth, &leaf_function, &subtrees, outputs,
+                        &next_subtree]() {
+    for (size_t i = next_subtree++; i < subtrees.size(); i = next_subtree++) {
+      forEachLeafRecurs(subtrees[i].node, subtrees[i].key, subtrees[i].depth,
+                        max_depth, leaf_function, &(*outputs)[i]);
+    }
+  };
+
+  if (num_threads <= 1 || subtrees.size() <= 1) {
+    walk_subtrees();
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::min(num_threads, subtrees.size()); ++i) {
+      threads.emplace_back(walk_subtrees);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+}
+
+template <typename Output, typename LeafFunction>
+void OctomapWorld::forEachLeafRecurs(const PooledOcTreeNode* node,
+                                     const octomap::OcTreeKey& key,
+                                     unsigned int depth,
+                                     unsigned int max_depth,
+                                     const LeafFunction& leaf_function,
+                                     Output* output) const {
+  if (depth >= max_depth || !octree_->nodeHasChildren(node)) {
+    leaf_function(node, key, depth, output);
+    return;
+  }
+  // Half the key range of a child, zero for children at the leaf level.
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const octomap::key_type center_offset_key =
+      depth + 1 < tree_depth ? 1 << (tree_depth - 2 - depth) : 0;
+  // Children in index order, as leaf_iterator visits them.
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!octree_->nodeChildExists(node, i)) {
+      continue;
+    }
+    octomap::OcTreeKey child_key;
+    octomap::computeChildKey(i, center_offset_key, key, child_key);
+    forEachLeafRecurs(octree_->getNodeChild(node, i), child_key, depth + 1,
+                      max_depth, leaf_function, output);
   }
-  octree_->prune();
 }
 
 void OctomapWorld::getOccupiedPointCloud(
     pcl::PointCloud<pcl::PointXYZ>* output_cloud) const {
   CHECK_NOTNULL(output_cloud)->clear();
-  unsigned int max_tree_depth = octree_->getTreeDepth();
-  double resolution = octree_->getResolution();
-  for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs();
-       it != octree_->end_leafs(); ++it) {
-    if (octree_->isNodeOccupied(*it)) {
-      // If leaf is max depth add coordinates.
-      if (max_tree_depth == it.getDepth()) {
-        pcl::PointXYZ point(it.getX(), it.getY(), it.getZ());
-        output_cloud->push_back(point);
+  typedef std::vector<pcl::PointXYZ, Eigen::aligned_allocator<pcl::PointXYZ> >
+      PointVector;
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  auto add_leaf_points = [this, tree_depth](const PooledOcTreeNode* node,
+                                            const octomap::OcTreeKey& key,
+                                            unsigned int depth,
+                                            PointVector* points) {
+    if (!octree_->isNodeOccupied(node)) {
+      return;
+    }
+    // Leaves above the maximum depth represent an occupied cube of
+    // 2^(tree_depth - depth) voxels per side, which gets one point per voxel.
+    octomap::OcTreeKey min_key, max_key, voxel_key;
+    getNodeKeyRange(key, depth, tree_depth, &min_key, &max_key);
+    const size_t edge_length = max_key[0] - min_key[0] + 1;
+    points->reserve(points->size() + edge_length * edge_length * edge_length);
+    for (int x = min_key[0]; x <= max_key[0]; ++x) {
+      voxel_key[0] = x;
+      for (int y = min_key[1]; y <= max_key[1]; ++y) {
+        voxel_key[1] = y;
+        for (int z = min_key[2]; z <= max_key[2]; ++z) {
+          voxel_key[2] = z;
+          const octomap::point3d point = octree_->keyToCoord(voxel_key);
+          points->push_back(pcl::PointXYZ(point.x(), point.y(), point.z()));
+        }
       }
-      // If leaf is not max depth it represents an occupied voxel with edge
-      // length of 2^(max_tree_depth - leaf_depth) * resolution.
-      // We use multiple points to visualize this filled volume.
-      else {
-        const unsigned int box_edge_length =
-            pow(2, max_tree_depth - it.getDepth() - 1);
-        const double bbx_offset = box_edge_length * resolution - resolution / 2;
-        Eigen::Vector3d bbx_offset_vec(bbx_offset, bbx_offset, bbx_offset);
-        Eigen::Vector3d center(it.getX(), it.getY(), it.getZ());
-        Eigen::Vector3d bbx_min = center - bbx_offset_vec;
-        Eigen::Vector3d bbx_max = center + bbx_offset_vec;
-        // Add small offset to avoid overshooting bbx_max.
-        bbx_max += Eigen::Vector3d(0.001, 0.001, 0.001);
-        for (double x_position = bbx_min.x(); x_position <= bbx_max.x();
-             x_position += resolution) {
-          for (double y_position = bbx_min.y(); y_position <= bbx_max.y();
-               y_position += resolution) {
-            for (double z_position = bbx_min.z(); z_position <= bbx_max.z();
-                 z_position += resolution) {
-              output_cloud->push_back(
-                  pcl::PointXYZ(x_position, y_position, z_position));
-            }
-          }
+    }
+  };
+  std::vector<PointVector> subtree_points;
+  forEachLeafParallel(tree_depth, add_leaf_points, &subtree_points);
+
+  size_t num_points = 0;
+  for (const PointVector& points : subtree_points) {
+    num_points += points.size();
+  }
+  output_cloud->reserve(num_points);
+  for (const PointVector& points : subtree_points) {
+    output_cloud->insert(output_cloud->end(), points.begin(), points.end());
+  }
+}
+
+void OctomapWorld::getOccupiedPointCloudAtDepth(
+    unsigned int depth, pcl::PointCloud<pcl::PointXYZ>* output_cloud) const {
+  CHECK_NOTNULL(output_cloud)->clear();
+  // A maximum depth of 0 means the leaves for the iterator.
+  CHECK_GT(depth, 0u);
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  CHECK_LE(depth, tree_depth);
+  const octomap::key_type step = 1 << (tree_depth - depth);
+  for (PooledOcTree::leaf_iterator it = octree_->begin_leafs(depth),
+                                      end = octree_->end_leafs();
+       it != end; ++it) {
+    if (!octree_->isNodeOccupied(*it)) {
+      continue;
+    }
+    if (it.getDepth() == depth) {
+      output_cloud->push_back(pcl::PointXYZ(it.getX(), it.getY(), it.getZ()));
+      continue;
+    }
+    // Bigger leaves get one point per node at the depth.
+    octomap::OcTreeKey min_key, max_key, key;
+    getNodeKeyRange(it.getKey(), it.getDepth(), tree_depth, &min_key,
+                    &max_key);
+    for (int x = min_key[0]; x <= max_key[0]; x += step) {
+      key[0] = x;
+      for (int y = min_key[1]; y <= max_key[1]; y += step) {
+        key[1] = y;
+        for (int z = min_key[2]; z <= max_key[2]; z += step) {
+          key[2] = z;
+          const octomap::point3d center = octree_->keyToCoord(key, depth);
+          output_cloud->push_back(
+              pcl::PointXYZ(center.x(), center.y(), center.z()));
         }
       }
     }
@@ -641,22 +2364,59 @@ void OctomapWorld::getOccupiedPointcloudInBoundingBox(
                       &bbx_max);
   }
 
-  for (double x_position = bbx_min.x(); x_position <= bbx_max.x();
-       x_position += resolution) {
-    for (double y_position = bbx_min.y(); y_position <= bbx_max.y();
-         y_position += resolution) {
-      for (double z_position = bbx_min.z(); z_position <= bbx_max.z();
-           z_position += resolution) {
-        octomap::point3d point =
-            octomap::point3d(x_position, y_position, z_position);
-        octomap::OcTreeKey key = octree_->coordToKey(point);
-        octomap::OcTreeNode* node = octree_->search(key);
-        if (node != NULL && octree_->isNodeOccupied(node)) {
+  KeyBox box;
+  const PooledOcTreeNode* root = octree_->getRoot();
+  if (root == NULL || !getKeyBox(bbx_min, bbx_max, &box)) {
+    return;
+  }
+  // One descent for the whole box, which skips free and unknown subtrees.
+  const octomap::key_type root_key_value = 1 << (octree_->getTreeDepth() - 1);
+  const octomap::OcTreeKey root_key(root_key_value, root_key_value,
+                                    root_key_value);
+  getOccupiedPointsInKeyBoxRecurs(root, root_key, 0, box, output_cloud);
+}
+
+void OctomapWorld::getOccupiedPointsInKeyBoxRecurs(
+    const PooledOcTreeNode* node, const octomap::OcTreeKey& key,
+    unsigned int depth, const KeyBox& box,
+    pcl::PointCloud<pcl::PointXYZ>* output_cloud) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  octomap::OcTreeKey min_key, max_key;
+  getNodeKeyRange(key, depth, tree_depth, &min_key, &max_key);
+  // Inner nodes hold the maximum occupancy of their children, so there are no
+  // occupied leaves below a free inner node.
+  if (!keyBoxesIntersect(min_key, max_key, box.min_key, box.max_key) ||
+      !octree_->isNodeOccupied(node)) {
+    return;
+  }
+  if (!octree_->nodeHasChildren(node)) {
+    // The voxels of the leaf within the box.
+    for (unsigned int x = std::max(min_key[0], box.min_key[0]);
+         x <= std::min(max_key[0], box.max_key[0]); ++x) {
+      for (unsigned int y = std::max(min_key[1], box.min_key[1]);
+           y <= std::min(max_key[1], box.max_key[1]); ++y) {
+        for (unsigned int z = std::max(min_key[2], box.min_key[2]);
+             z <= std::min(max_key[2], box.max_key[2]); ++z) {
+          const octomap::point3d point = octree_->keyToCoord(
+              octomap::OcTreeKey(x, y, z));
           output_cloud->push_back(
               pcl::PointXYZ(point.x(), point.y(), point.z()));
         }
       }
     }
+    return;
+  }
+  // Half the key range of a child, zero for children at the leaf level.
+  const octomap::key_type center_offset_key =
+      depth + 1 < tree_depth ? 1 << (tree_depth - 2 - depth) : 0;
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!octree_->nodeChildExists(node, i)) {
+      continue;
+    }
+    octomap::OcTreeKey child_key;
+    octomap::computeChildKey(i, center_offset_key, key, child_key);
+    getOccupiedPointsInKeyBoxRecurs(octree_->getNodeChild(node, i), child_key,
+                                    depth + 1, box, output_cloud);
   }
 }
 
@@ -676,27 +2436,36 @@ void OctomapWorld::getAllOccupiedBoxes(
 void OctomapWorld::getAllBoxes(
     bool occupied_boxes,
     std::vector<std::pair<Eigen::Vector3d, double>>* box_vector) const {
-  box_vector->clear();
-  box_vector->reserve(octree_->size());
-  for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs(),
-                                      end = octree_->end_leafs();
-       it != end; ++it) {
-    Eigen::Vector3d cube_center(it.getX(), it.getY(), it.getZ());
-    int depth_level = it.getDepth();
-    double cube_size = octree_->getNodeSize(depth_level);
-
-    if (octree_->isNodeOccupied(*it) && occupied_boxes) {
-      box_vector->emplace_back(cube_center, cube_size);
-    } else if (!octree_->isNodeOccupied(*it) && !occupied_boxes) {
-      box_vector->emplace_back(cube_center, cube_size);
+  typedef std::vector<std::pair<Eigen::Vector3d, double>> BoxVector;
+  CHECK_NOTNULL(box_vector)->clear();
+  auto add_leaf_box = [this, occupied_boxes](const PooledOcTreeNode* node,
+                                             const octomap::OcTreeKey& key,
+                                             unsigned int depth,
+                                             BoxVector* boxes) {
+    if (octree_->isNodeOccupied(node) != occupied_boxes) {
+      return;
     }
+    const octomap::point3d center = octree_->keyToCoord(key, depth);
+    boxes->emplace_back(Eigen::Vector3d(center.x(), center.y(), center.z()),
+                        octree_->getNodeSize(depth));
+  };
+  std::vector<BoxVector> subtree_boxes;
+  forEachLeafParallel(octree_->getTreeDepth(), add_leaf_box, &subtree_boxes);
+
+  size_t num_boxes = 0;
+  for (const BoxVector& boxes : subtree_boxes) {
+    num_boxes += boxes.size();
+  }
+  box_vector->reserve(num_boxes);
+  for (const BoxVector& boxes : subtree_boxes) {
+    box_vector->insert(box_vector->end(), boxes.begin(), boxes.end());
   }
 }
 
 void OctomapWorld::getBox(const octomap::OcTreeKey& key,
                           std::pair<Eigen::Vector3d, double>* box) const {
   // bbx_iterator begins "too early", and the last leaf is the expected one
-  for (octomap::OcTree::leaf_bbx_iterator
+  for (PooledOcTree::leaf_bbx_iterator
            it = octree_->begin_leafs_bbx(key, key),
            end = octree_->end_leafs_bbx();
        it != end; ++it) {
@@ -747,7 +2516,7 @@ void OctomapWorld::getBoxesBoundingBox(
   octomap::point3d bbx_min = pointEigenToOctomap(bbx_min_eigen);
   octomap::point3d bbx_max = pointEigenToOctomap(bbx_max_eigen);
 
-  for (octomap::OcTree::leaf_bbx_iterator
+  for (PooledOcTree::leaf_bbx_iterator
            it = octree_->begin_leafs_bbx(bbx_min, bbx_max),
            end = octree_->end_leafs_bbx();
        it != end; ++it) {
@@ -791,37 +2560,245 @@ void OctomapWorld::setLogOddsBoundingBox(
     const std::vector<Eigen::Vector3d>& positions,
     const Eigen::Vector3d& bounding_box_size, double log_odds_value,
     const BoundHandling& insertion_method) {
-  const bool lazy_eval = true;
-  const double resolution = octree_->getResolution();
+  KeyBoxUpdate update;
+  update.log_odds = log_odds_value;
+  update.only_unknown = false;
+  update.prune = false;
   Eigen::Vector3d bbx_min, bbx_max;
-
   for (const Eigen::Vector3d& position : positions) {
     adjustBoundingBox(position, bounding_box_size, insertion_method, &bbx_min,
                       &bbx_max);
+    KeyBox box;
+    if (getKeyBox(bbx_min, bbx_max, &box)) {
+      update.boxes.push_back(box);
+    }
+  }
+  // All boxes are set in the same pass over the tree.
+  updateKeyBoxes(&update);
+}
 
-    for (double x_position = bbx_min.x(); x_position <= bbx_max.x();
-         x_position += resolution) {
-      for (double y_position = bbx_min.y(); y_position <= bbx_max.y();
-           y_position += resolution) {
-        for (double z_position = bbx_min.z(); z_position <= bbx_max.z();
-             z_position += resolution) {
-          octomap::point3d point =
-              octomap::point3d(x_position, y_position, z_position);
-          octree_->setNodeValue(point, log_odds_value, lazy_eval);
-        }
-      }
+bool OctomapWorld::getKeyBox(const Eigen::Vector3d& bbx_min,
+                             const Eigen::Vector3d& bbx_max,
+                             KeyBox* box) const {
+  CHECK_NOTNULL(box);
+  const double resolution = octree_->getResolution();
+  const int64_t tree_max_val = 1 << (octree_->getTreeDepth() - 1);
+  for (int i = 0; i < 3; ++i) {
+    if (bbx_max[i] < bbx_min[i]) {
+      return false;
+    }
+    const int64_t min_key =
+        static_cast<int64_t>(std::floor(bbx_min[i] / resolution)) +
+        tree_max_val;
+    // The number of steps, which doesn't depend on the rounding of the sum.
+    const int64_t num_steps = static_cast<int64_t>(
+        std::floor((bbx_max[i] - bbx_min[i]) / resolution));
+    const int64_t max_key = min_key + num_steps;
+    if (max_key < 0 || min_key > 2 * tree_max_val - 1) {
+      return false;
     }
+    box->min_key[i] = std::max<int64_t>(min_key, 0);
+    box->max_key[i] = std::min<int64_t>(max_key, 2 * tree_max_val - 1);
   }
+  return true;
+}
 
-  // This is necessary since lazy_eval is set to true.
-  octree_->updateInnerOccupancy();
+void OctomapWorld::updateKeyBoxes(KeyBoxUpdate* update) {
+  CHECK_NOTNULL(update);
+  if (update->boxes.empty()) {
+    return;
+  }
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  // Same clamping as setNodeValue().
+  update->log_odds =
+      std::min(std::max(update->log_odds, octree_->getClampingThresMinLog()),
+               octree_->getClampingThresMaxLog());
+  update->whole_nodes = !octree_->isChangeDetectionEnabled();
+  update->boxes_at_depth.assign(tree_depth + 1, std::vector<size_t>());
+  update->changed_nodes.clear();
+
+  const octomap::key_type root_key_value = 1 << (tree_depth - 1);
+  const octomap::OcTreeKey root_key(root_key_value, root_key_value,
+                                    root_key_value);
+  octomap::OcTreeKey root_min_key, root_max_key;
+  getNodeKeyRange(root_key, 0, tree_depth, &root_min_key, &root_max_key);
+  bool covered = false;
+  for (size_t i = 0; i < update->boxes.size(); ++i) {
+    update->boxes_at_depth[0].push_back(i);
+    covered = covered || keyBoxContains(update->boxes[i].min_key,
+                                        update->boxes[i].max_key,
+                                        root_min_key, root_max_key);
+  }
+  if (octree_->getRoot() == NULL) {
+    fillNewNodeRecurs(octree_->createRoot(), root_key, 0, covered, update);
+  } else {
+    updateKeyBoxesRecurs(octree_->getRoot(), root_key, 0, covered, update);
+  }
+  handleNodesChanged(update->changed_nodes);
+}
+
+void OctomapWorld::updateKeyBoxesRecurs(PooledOcTreeNode* node,
+                                        const octomap::OcTreeKey& key,
+                                        unsigned int depth, bool covered,
+                                        KeyBoxUpdate* update) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  if (covered && !update->only_unknown &&
+      (update->whole_nodes || depth == tree_depth)) {
+    setWholeNode(node, key, depth, false, update);
+    return;
+  }
+  if (!octree_->nodeHasChildren(node)) {
+    if (update->only_unknown) {
+      return;
+    }
+    // Only part of the leaf is in the boxes.
+    octree_->expandNode(node);
+  }
+
+  // Half the key range of a child, zero for children at the leaf level.
+  const octomap::key_type center_offset_key =
+      depth + 1 < tree_depth ? 1 << (tree_depth - 2 - depth) : 0;
+  for (unsigned int i = 0; i < 8; ++i) {
+    octomap::OcTreeKey child_key;
+    octomap::computeChildKey(i, center_offset_key, key, child_key);
+    bool child_covered;
+    if (!selectKeyBoxes(child_key, depth + 1, update, &child_covered)) {
+      continue;
+    }
+    if (octree_->nodeChildExists(node, i)) {
+      updateKeyBoxesRecurs(octree_->getNodeChild(node, i), child_key,
+                           depth + 1, child_covered, update);
+    } else {
+      fillNewNodeRecurs(octree_->createNodeChild(node, i), child_key,
+                        depth + 1, child_covered, update);
+    }
+  }
+  if (!update->prune || !octree_->pruneNode(node)) {
+    node->updateOccupancyChildren();
+  }
+}
+
+void OctomapWorld::fillNewNodeRecurs(PooledOcTreeNode* node,
+                                     const octomap::OcTreeKey& key,
+                                     unsigned int depth, bool covered,
+                                     KeyBoxUpdate* update) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  if (covered && (update->whole_nodes || depth == tree_depth)) {
+    setWholeNode(node, key, depth, true, update);
+    return;
+  }
+  const octomap::key_type center_offset_key =
+      depth + 1 < tree_depth ? 1 << (tree_depth - 2 - depth) : 0;
+  for (unsigned int i = 0; i < 8; ++i) {
+    octomap::OcTreeKey child_key;
+    octomap::computeChildKey(i, center_offset_key, key, child_key);
+    bool child_covered;
+    if (selectKeyBoxes(child_key, depth + 1, update, &child_covered)) {
+      fillNewNodeRecurs(octree_->createNodeChild(node, i), child_key,
+                        depth + 1, child_covered, update);
+    }
+  }
+  if (!update->prune || !octree_->pruneNode(node)) {
+    node->updateOccupancyChildren();
+  }
+}
+
+void OctomapWorld::setWholeNode(PooledOcTreeNode* node,
+                                const octomap::OcTreeKey& key,
+                                unsigned int depth, bool created,
+                                KeyBoxUpdate* update) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const bool was_occupied = !created && octree_->isNodeOccupied(node);
+  octree_->deleteNodeChildren(node);
+  node->setLogOdds(update->log_odds);
+  if (depth == tree_depth) {
+    octree_->registerLeafChange(key, created, was_occupied,
+                                octree_->isNodeOccupied(node));
+  }
+  const unsigned int level_shift = 3 * (tree_depth - depth);
+  update->changed_nodes.emplace_back(
+      (KeyBatch::mortonEncode(key) >> level_shift) << level_shift, depth);
+}
+
+bool OctomapWorld::selectKeyBoxes(const octomap::OcTreeKey& key,
+                                  unsigned int depth, KeyBoxUpdate* update,
+                                  bool* covered) const {
+  octomap::OcTreeKey min_key, max_key;
+  getNodeKeyRange(key, depth, octree_->getTreeDepth(), &min_key, &max_key);
+  std::vector<size_t>& boxes = update->boxes_at_depth[depth];
+  boxes.clear();
+  *covered = false;
+  for (const size_t i : update->boxes_at_depth[depth - 1]) {
+    const KeyBox& box = update->boxes[i];
+    if (keyBoxesIntersect(min_key, max_key, box.min_key, box.max_key)) {
+      boxes.push_back(i);
+      *covered = *covered ||
+                 keyBoxContains(box.min_key, box.max_key, min_key, max_key);
+    }
+  }
+  return !boxes.empty();
+}
+
+void OctomapWorld::handleNodesChanged(
+    const std::vector<std::pair<uint64_t, unsigned int> >& nodes) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  if (esdf_) {
+    for (const std::pair<uint64_t, unsigned int>& node : nodes) {
+      const PooledOcTreeNode* tree_node =
+          searchAtDepth(KeyBatch::mortonDecode(node.first), node.second);
+      if (tree_node != NULL && !octree_->nodeHasChildren(tree_node) &&
+          octree_->isNodeOccupied(tree_node)) {
+        setEsdfNodeOccupied(node.first, node.second);
+        continue;
+      }
+      setEsdfNodeFree(node.first, node.second);
+      if (tree_node != NULL && octree_->nodeHasChildren(tree_node)) {
+        addEsdfOccupiedLeaves(node.first, node.second);
+      }
+    }
+    esdf_->update();
+  }
+  if (params_.incremental_visualization) {
+    for (const std::pair<uint64_t, unsigned int>& node : nodes) {
+      markVisualizationBlocksChanged(node.first, node.second);
+    }
+  }
+  if (tiled_map_) {
+    for (const std::pair<uint64_t, unsigned int>& node : nodes) {
+      markTilesChanged(node.first, node.second);
+    }
+  }
+  if (map_deltas_enabled_) {
+    // Deltas describe leaves, so big nodes go out with the next keyframe.
+    const unsigned int max_delta_levels = 3;
+    std::vector<uint64_t> codes;
+    for (const std::pair<uint64_t, unsigned int>& node : nodes) {
+      if (tree_depth - node.second > max_delta_levels) {
+        map_delta_keyframe_needed_ = true;
+        continue;
+      }
+      const uint64_t num_codes = uint64_t(1)
+                                 << (3 * (tree_depth - node.second));
+      for (uint64_t code = node.first; code < node.first + num_codes; ++code) {
+        codes.push_back(code);
+      }
+    }
+    addMapDeltaCodes(codes);
+  }
+  if (inflation_) {
+    for (const std::pair<uint64_t, unsigned int>& node : nodes) {
+      inflation_->markChanged(node.first, tree_depth - node.second);
+    }
+  }
 }
 
 bool OctomapWorld::getOctomapBinaryMsg(octomap_msgs::Octomap* msg) const {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kSerialization);
   return octomap_msgs::binaryMapToMsg(*octree_, *msg);
 }
 
 bool OctomapWorld::getOctomapFullMsg(octomap_msgs::Octomap* msg) const {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kSerialization);
   return octomap_msgs::fullMapToMsg(*octree_, *msg);
 }
 
@@ -834,24 +2811,316 @@ void OctomapWorld::setOctomapFromMsg(const octomap_msgs::Octomap& msg) {
 }
 
 void OctomapWorld::setOctomapFromBinaryMsg(const octomap_msgs::Octomap& msg) {
-  octree_.reset(
-      dynamic_cast<octomap::OcTree*>(octomap_msgs::binaryMsgToMap(msg)));
+  // The messages carry OcTree data, which is read into a new pooled tree.
+  octree_.reset(new PooledOcTree(msg.resolution));
+  if (!msg.data.empty()) {
+    std::stringstream datastream;
+    datastream.write(reinterpret_cast<const char*>(&msg.data[0]),
+                     msg.data.size());
+    octree_->readBinaryData(datastream);
+  }
+  closeTiledMap();
+  handleMapReplaced();
 }
 
 void OctomapWorld::setOctomapFromFullMsg(const octomap_msgs::Octomap& msg) {
-  octree_.reset(
-      dynamic_cast<octomap::OcTree*>(octomap_msgs::fullMsgToMap(msg)));
+  octree_.reset(new PooledOcTree(msg.resolution));
+  octomap_msgs::readTree(octree_.get(), msg);
+  closeTiledMap();
+  handleMapReplaced();
 }
 
 bool OctomapWorld::loadOctomapFromFile(const std::string& filename) {
-  return octree_->readBinary(filename);
+  const bool success = octree_->readBinary(filename);
+  closeTiledMap();
+  handleMapReplaced();
+  return success;
+}
+
+void OctomapWorld::setOctree(std::unique_ptr<PooledOcTree> tree) {
+  CHECK(tree);
+  octree_.reset(tree.release());
+  setOctreeProbabilities(params_, octree_.get());
+  closeTiledMap();
+  handleMapReplaced();
+}
+
+namespace {
+
+// Returns the node at the depth that contains the key, without children,
+// creating the path to it where needed.
+PooledOcTreeNode* createEmptyNode(const octomap::OcTreeKey& key,
+                                     unsigned int depth,
+                                     PooledOcTree* tree) {
+  const unsigned int tree_depth = tree->getTreeDepth();
+  if (tree->getRoot() == NULL) {
+    tree->createRoot();
+  }
+  PooledOcTreeNode* node = tree->getRoot();
+  for (unsigned int d = 0; d < depth; ++d) {
+    const unsigned int child_index =
+        octomap::computeChildIdx(key, tree_depth - 1 - d);
+    if (!tree->nodeChildExists(node, child_index)) {
+      tree->createNodeChild(node, child_index);
+    }
+    node = tree->getNodeChild(node, child_index);
+  }
+  tree->deleteNodeChildren(node);
+  return node;
+}
+
+// Deep copy of the children of src_node into dst_node, which has none.
+void copySubtree(const PooledOcTree& src_tree,
+                 const PooledOcTreeNode* src_node,
+                 PooledOcTree* dst_tree, PooledOcTreeNode* dst_node) {
+  dst_node->setLogOdds(src_node->getLogOdds());
+  if (!src_tree.nodeHasChildren(src_node)) {
+    return;
+  }
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (src_tree.nodeChildExists(src_node, i)) {
+      copySubtree(src_tree, src_tree.getNodeChild(src_node, i), dst_tree,
+                  dst_tree->createNodeChild(dst_node, i));
+    }
+  }
+}
+
+// Appends the occupied leaves of the subtree as the Morton codes of their
+// minimum keys and their depths.
+void appendOccupiedLeaves(
+    const PooledOcTree& tree, const PooledOcTreeNode* node,
+    const octomap::OcTreeKey& min_key, unsigned int depth,
+    std::vector<std::pair<uint64_t, unsigned int> >* occupied_nodes) {
+  if (!tree.nodeHasChildren(node)) {
+    if (tree.isNodeOccupied(node)) {
+      occupied_nodes->push_back(
+          std::make_pair(KeyBatch::mortonEncode(min_key), depth));
+    }
+    return;
+  }
+  // Child i is offset on the axes of its bits.
+  const octomap::key_type child_size = 1 << (tree.getTreeDepth() - 1 - depth);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!tree.nodeChildExists(node, i)) {
+      continue;
+    }
+    octomap::OcTreeKey child_min_key = min_key;
+    for (unsigned int j = 0; j < 3; ++j) {
+      if (i & (1 << j)) {
+        child_min_key[j] += child_size;
+      }
+    }
+    appendOccupiedLeaves(tree, tree.getNodeChild(node, i), child_min_key,
+                         depth + 1, occupied_nodes);
+  }
+}
+
+// Copies the parts of the src subtree that are unknown in the dst subtree.
+// The occupied leaves it copies are appended to occupied_nodes, if set.
+void mergeUnknownSubtree(
+    const PooledOcTree& src_tree, const PooledOcTreeNode* src_node,
+    const octomap::OcTreeKey& min_key, unsigned int depth,
+    PooledOcTree* dst_tree, PooledOcTreeNode* dst_node,
+    std::vector<std::pair<uint64_t, unsigned int> >* occupied_nodes) {
+  // Known leaves of the destination are kept as they are.
+  if (!src_tree.nodeHasChildren(src_node) ||
+      !dst_tree->nodeHasChildren(dst_node)) {
+    return;
+  }
+  const octomap::key_type child_size =
+      1 << (src_tree.getTreeDepth() - 1 - depth);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!src_tree.nodeChildExists(src_node, i)) {
+      continue;
+    }
+    const PooledOcTreeNode* src_child = src_tree.getNodeChild(src_node, i);
+    octomap::OcTreeKey child_min_key = min_key;
+    for (unsigned int j = 0; j < 3; ++j) {
+      if (i & (1 << j)) {
+        child_min_key[j] += child_size;
+      }
+    }
+    if (dst_tree->nodeChildExists(dst_node, i)) {
+      mergeUnknownSubtree(src_tree, src_child, child_min_key, depth + 1,
+                          dst_tree, dst_tree->getNodeChild(dst_node, i),
+                          occupied_nodes);
+    } else {
+      copySubtree(src_tree, src_child, dst_tree,
+                  dst_tree->createNodeChild(dst_node, i));
+      if (occupied_nodes != NULL) {
+        appendOccupiedLeaves(src_tree, src_child, child_min_key, depth + 1,
+                             occupied_nodes);
+      }
+    }
+  }
+  dst_node->updateOccupancyChildren();
+}
+
+}  // namespace
+
+bool OctomapWorld::mergeOctomapFromFile(const std::string& filename) {
+  PooledOcTree source_tree(octree_->getResolution());
+  if (!source_tree.readBinary(filename)) {
+    return false;
+  }
+  if (source_tree.getResolution() != octree_->getResolution()) {
+    LOG(ERROR) << "Can't merge " << filename << " with resolution "
+               << source_tree.getResolution() << " into a map with resolution "
+               << octree_->getResolution() << ".";
+    return false;
+  }
+  mergeOctomap(&source_tree, NULL);
+  handleMapReplaced();
+  return true;
+}
+
+void OctomapWorld::mergeOctomap(
+    PooledOcTree* source_tree,
+    std::vector<std::pair<uint64_t, unsigned int> >* occupied_nodes) {
+  CHECK_NOTNULL(source_tree);
+  CHECK_EQ(source_tree->getResolution(), octree_->getResolution());
+  if (source_tree->getRoot() == NULL) {
+    return;
+  }
+  const octomap::OcTreeKey root_min_key(0, 0, 0);
+  if (octree_->getRoot() == NULL) {
+    if (occupied_nodes != NULL) {
+      appendOccupiedLeaves(*source_tree, source_tree->getRoot(), root_min_key,
+                           0, occupied_nodes);
+    }
+    octree_->swapContent(*source_tree);
+    return;
+  }
+  mergeUnknownSubtree(*source_tree, source_tree->getRoot(), root_min_key, 0,
+                      octree_.get(), octree_->getRoot(), occupied_nodes);
+  octree_->prune();
 }
 
 bool OctomapWorld::writeOctomapToFile(const std::string& filename) {
   return octree_->writeBinary(filename);
 }
 
+void OctomapWorld::enableMapDeltas() {
+  map_deltas_enabled_ = true;
+  resetMapDelta();
+}
+
+bool OctomapWorld::serializeMapDelta(bool force_keyframe, std::string* data) {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kSerialization);
+  CHECK_NOTNULL(data);
+  CHECK(map_deltas_enabled_);
+  std::ostringstream stream;
+  const bool keyframe = force_keyframe || map_delta_keyframe_needed_;
+  if (keyframe) {
+    octree_->writeData(stream);
+  } else {
+    std::sort(map_delta_codes_.begin(), map_delta_codes_.end());
+    map_delta_codes_.erase(
+        std::unique(map_delta_codes_.begin(), map_delta_codes_.end()),
+        map_delta_codes_.end());
+    // Sorted codes of nearby leaves are close, so their differences are
+    // short as varints.
+    uint64_t previous_code = 0;
+    for (const uint64_t code : map_delta_codes_) {
+      const PooledOcTreeNode* node =
+          octree_->search(KeyBatch::mortonDecode(code));
+      if (node == NULL) {
+        continue;
+      }
+      uint64_t difference = code - previous_code;
+      while (difference >= 0x80) {
+        stream.put(static_cast<char>((difference & 0x7f) | 0x80));
+        difference >>= 7;
+      }
+      stream.put(static_cast<char>(difference));
+      const float log_odds = node->getLogOdds();
+      stream.write(reinterpret_cast<const char*>(&log_odds), sizeof(float));
+      previous_code = code;
+    }
+  }
+  *data = stream.str();
+  map_delta_codes_.clear();
+  num_unique_map_delta_codes_ = 0;
+  map_delta_keyframe_needed_ = false;
+  return keyframe;
+}
+
+void OctomapWorld::resetMapDelta() {
+  map_delta_codes_.clear();
+  num_unique_map_delta_codes_ = 0;
+  map_delta_keyframe_needed_ = true;
+}
+
+bool OctomapWorld::applyMapDelta(bool keyframe, double resolution,
+                                 const std::string& data) {
+  std::istringstream stream(data);
+  if (keyframe) {
+    // Same as a full octomap message, the map takes the resolution of the
+    // keyframe.
+    octree_->clear();
+    octree_->setResolution(resolution);
+    // An empty map has no data.
+    if (!data.empty()) {
+      octree_->readData(stream);
+    }
+    closeTiledMap();
+    handleMapReplaced();
+    return data.empty() || static_cast<bool>(stream);
+  }
+  if (resolution != octree_->getResolution()) {
+    LOG(ERROR) << "Map delta with resolution " << resolution
+               << " doesn't fit the map resolution "
+               << octree_->getResolution() << ".";
+    return false;
+  }
+
+  // Decodes all records first, so that a malformed delta leaves the map as it
+  // was.
+  std::vector<octomap::OcTreeKey> touched_keys;
+  std::vector<float> values;
+  const uint64_t max_code = (uint64_t(1) << 48) - 1;
+  uint64_t code = 0;
+  while (stream.peek() != std::char_traits<char>::eof()) {
+    uint64_t difference = 0;
+    int shift = 0;
+    char byte;
+    do {
+      if (!stream.get(byte) || shift > 63) {
+        LOG(ERROR) << "Malformed map delta.";
+        return false;
+      }
+      difference |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    float log_odds;
+    if (!stream.read(reinterpret_cast<char*>(&log_odds), sizeof(float)) ||
+        difference > max_code - code) {
+      LOG(ERROR) << "Malformed map delta.";
+      return false;
+    }
+    code += difference;
+    touched_keys.push_back(KeyBatch::mortonDecode(code));
+    values.push_back(log_odds);
+  }
+
+  const bool lazy_eval = true;
+  for (size_t i = 0; i < touched_keys.size(); ++i) {
+    octree_->setNodeValue(touched_keys[i], values[i], lazy_eval);
+  }
+  updateInnerOccupancy(touched_keys, true);
+  return true;
+}
+
+NodePoolStats OctomapWorld::getNodePoolStats() const {
+  return PooledOcTreeNode::getPool().getStats();
+}
+
+std::shared_ptr<PooledOcTree> OctomapWorld::getOctreeSnapshot() const {
+  return std::make_shared<PooledOcTree>(*octree_);
+}
+
 bool OctomapWorld::writeOctomapToBinaryConst(std::ostream& s) const {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kSerialization);
   return octree_->writeBinaryConst(s);
 }
 
@@ -867,7 +3136,7 @@ bool OctomapWorld::isSpeckleNode(const octomap::OcTreeKey& key) const {
       for (current_key[0] = key[0] - 1; current_key[0] <= key[0] + 1;
            ++current_key[0]) {
         if (current_key != key) {
-          octomap::OcTreeNode* node = octree_->search(key);
+          PooledOcTreeNode* node = octree_->search(key);
           if (node && octree_->isNodeOccupied(node)) {
             // We have a neighbor => not a speckle!
             return false;
@@ -879,34 +3148,49 @@ bool OctomapWorld::isSpeckleNode(const octomap::OcTreeKey& key) const {
   return true;
 }
 
+namespace {
+
+// Leaf collected by generateMarkerArrayAtDepth(), for the marker of its depth.
+struct MarkerCube {
+  geometry_msgs::Point center;
+  std_msgs::ColorRGBA color;
+  unsigned int depth;
+  bool occupied;
+};
+
+}  // namespace
+
 void OctomapWorld::generateMarkerArray(
     const std::string& tf_frame,
     visualization_msgs::MarkerArray* occupied_nodes,
     visualization_msgs::MarkerArray* free_nodes) {
+  generateMarkerArrayAtDepth(tf_frame, octree_->getTreeDepth(), occupied_nodes,
+                             free_nodes);
+}
+
+void OctomapWorld::generateMarkerArrayAtDepth(
+    const std::string& tf_frame, unsigned int depth,
+    visualization_msgs::MarkerArray* occupied_nodes,
+    visualization_msgs::MarkerArray* free_nodes) {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kGenerateMarkers);
   CHECK_NOTNULL(occupied_nodes);
   CHECK_NOTNULL(free_nodes);
+  // A maximum depth of 0 means the leaves for the iterator.
+  CHECK_GT(depth, 0u);
+  CHECK_LE(depth, octree_->getTreeDepth());
 
   // Prune the octree first.
   octree_->prune();
   int tree_depth = octree_->getTreeDepth() + 1;
 
   // In the marker array, assign each node to its respective depth level, since
-  // all markers in a CUBE_LIST must have the same scale.
+  // all markers in a CUBE_LIST must have the same scale. The levels below the
+  // depth stay empty, which deletes their markers of earlier calls.
   occupied_nodes->markers.resize(tree_depth);
   free_nodes->markers.resize(tree_depth);
 
-  // Metric min and max z of the map:
-  double min_x, min_y, min_z, max_x, max_y, max_z;
-  octree_->getMetricMin(min_x, min_y, min_z);
-  octree_->getMetricMax(max_x, max_y, max_z);
-
-  // Update values from params if necessary.
-  if (params_.visualize_min_z > min_z) {
-    min_z = params_.visualize_min_z;
-  }
-  if (params_.visualize_max_z < max_z) {
-    max_z = params_.visualize_max_z;
-  }
+  double min_z, max_z;
+  getVisualizationHeightRange(&min_z, &max_z);
 
   for (int i = 0; i < tree_depth; ++i) {
     double size = octree_->getNodeSize(i);
@@ -919,49 +3203,1023 @@ void OctomapWorld::generateMarkerArray(
     occupied_nodes->markers[i].scale.y = size;
     occupied_nodes->markers[i].scale.z = size;
 
-    free_nodes->markers[i] = occupied_nodes->markers[i];
+    free_nodes->markers[i] = occupied_nodes->markers[i];
+  }
+
+  // Nodes at the depth are leaves, with the maximum occupancy of their
+  // children.
+  auto add_leaf_cube = [this, min_z, max_z](const PooledOcTreeNode* node,
+                                            const octomap::OcTreeKey& key,
+                                            unsigned int depth,
+                                            std::vector<MarkerCube>* cubes) {
+    const octomap::point3d center = octree_->keyToCoord(key, depth);
+    if (center.z() > max_z || center.z() < min_z) {
+      return;
+    }
+    MarkerCube cube;
+    cube.center.x = center.x();
+    cube.center.y = center.y();
+    cube.center.z = center.z();
+    cube.color = percentToColor(colorizeMapByHeight(center.z(), min_z, max_z));
+    cube.depth = depth;
+    cube.occupied = octree_->isNodeOccupied(node);
+    cubes->push_back(cube);
+  };
+  std::vector<std::vector<MarkerCube> > subtree_cubes;
+  forEachLeafParallel(depth, add_leaf_cube, &subtree_cubes);
+
+  std::vector<size_t> num_occupied(tree_depth, 0), num_free(tree_depth, 0);
+  for (const std::vector<MarkerCube>& cubes : subtree_cubes) {
+    for (const MarkerCube& cube : cubes) {
+      ++(cube.occupied ? num_occupied : num_free)[cube.depth];
+    }
+  }
+  for (int i = 0; i < tree_depth; ++i) {
+    occupied_nodes->markers[i].points.reserve(num_occupied[i]);
+    occupied_nodes->markers[i].colors.reserve(num_occupied[i]);
+    free_nodes->markers[i].points.reserve(num_free[i]);
+    free_nodes->markers[i].colors.reserve(num_free[i]);
+  }
+  for (const std::vector<MarkerCube>& cubes : subtree_cubes) {
+    for (const MarkerCube& cube : cubes) {
+      visualization_msgs::Marker& marker =
+          (cube.occupied ? occupied_nodes : free_nodes)->markers[cube.depth];
+      marker.points.push_back(cube.center);
+      marker.colors.push_back(cube.color);
+    }
+  }
+
+  for (int i = 0; i < tree_depth; ++i) {
+    if (occupied_nodes->markers[i].points.size() > 0) {
+      occupied_nodes->markers[i].action = visualization_msgs::Marker::ADD;
+    } else {
+      occupied_nodes->markers[i].action = visualization_msgs::Marker::DELETE;
+    }
+
+    if (free_nodes->markers[i].points.size() > 0) {
+      free_nodes->markers[i].action = visualization_msgs::Marker::ADD;
+    } else {
+      free_nodes->markers[i].action = visualization_msgs::Marker::DELETE;
+    }
+  }
+}
+
+void OctomapWorld::getVisualizationHeightRange(double* min_z,
+                                               double* max_z) const {
+  CHECK_NOTNULL(min_z);
+  CHECK_NOTNULL(max_z);
+  // Metric min and max z of the map:
+  double min_x, min_y, max_x, max_y;
+  octree_->getMetricMin(min_x, min_y, *min_z);
+  octree_->getMetricMax(max_x, max_y, *max_z);
+
+  // Update values from params if necessary.
+  if (params_.visualize_min_z > *min_z) {
+    *min_z = params_.visualize_min_z;
+  }
+  if (params_.visualize_max_z < *max_z) {
+    *max_z = params_.visualize_max_z;
+  }
+}
+
+void OctomapWorld::generateMarkerArrayIncremental(
+    const std::string& tf_frame,
+    visualization_msgs::MarkerArray* occupied_nodes,
+    visualization_msgs::MarkerArray* free_nodes,
+    pcl::PointCloud<pcl::PointXYZ>* occupied_cloud) {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kGenerateMarkers);
+  CHECK_NOTNULL(occupied_nodes);
+  CHECK_NOTNULL(free_nodes);
+  *occupied_nodes = pending_occupied_deletes_;
+  *free_nodes = pending_free_deletes_;
+  pending_occupied_deletes_.markers.clear();
+  pending_free_deletes_.markers.clear();
+
+  // The colors of all blocks depend on the height range.
+  double min_z, max_z;
+  getVisualizationHeightRange(&min_z, &max_z);
+  if (min_z != visualization_min_z_ || max_z != visualization_max_z_) {
+    visualization_min_z_ = min_z;
+    visualization_max_z_ = max_z;
+    all_visualization_blocks_changed_ = true;
+  }
+
+  const unsigned int block_shift = 3 * visualization_block_levels_;
+  if (all_visualization_blocks_changed_) {
+    all_visualization_blocks_changed_ = false;
+    // Regenerate the blocks that are gone as well, to delete their markers.
+    for (const std::pair<const uint64_t, VisualizationBlock>& block :
+         visualization_blocks_) {
+      changed_visualization_blocks_.insert(block.first);
+    }
+    const unsigned int tree_depth = octree_->getTreeDepth();
+    for (PooledOcTree::leaf_iterator it = octree_->begin_leafs(),
+                                        end = octree_->end_leafs();
+         it != end; ++it) {
+      // The voxels of a node have consecutive Morton codes, and so do the
+      // blocks of a node bigger than a block.
+      const uint64_t first_code = KeyBatch::mortonEncode(it.getIndexKey());
+      const uint64_t num_codes = uint64_t(1) << (3 * (tree_depth - it.getDepth()));
+      for (uint64_t block_code = first_code >> block_shift;
+           block_code <= (first_code + num_codes - 1) >> block_shift;
+           ++block_code) {
+        changed_visualization_blocks_.insert(block_code);
+      }
+    }
+  }
+
+  // Sorted so that the output does not depend on the hash order.
+  std::vector<uint64_t> changed_blocks(changed_visualization_blocks_.begin(),
+                                       changed_visualization_blocks_.end());
+  changed_visualization_blocks_.clear();
+  std::sort(changed_blocks.begin(), changed_blocks.end());
+  for (const uint64_t block_code : changed_blocks) {
+    regenerateVisualizationBlock(block_code, tf_frame, min_z, max_z,
+                                 occupied_nodes, free_nodes);
+  }
+
+  if (occupied_cloud != NULL) {
+    occupied_cloud->clear();
+    for (const std::pair<const uint64_t, VisualizationBlock>& block :
+         visualization_blocks_) {
+      occupied_cloud->insert(occupied_cloud->end(),
+                             block.second.occupied_points.begin(),
+                             block.second.occupied_points.end());
+    }
+  }
+}
+
+void OctomapWorld::getIncrementalMarkerArray(
+    visualization_msgs::MarkerArray* occupied_nodes,
+    visualization_msgs::MarkerArray* free_nodes) const {
+  CHECK_NOTNULL(occupied_nodes)->markers.clear();
+  CHECK_NOTNULL(free_nodes)->markers.clear();
+  for (const std::pair<const uint64_t, VisualizationBlock>& block :
+       visualization_blocks_) {
+    occupied_nodes->markers.insert(occupied_nodes->markers.end(),
+                                   block.second.occupied_markers.begin(),
+                                   block.second.occupied_markers.end());
+    free_nodes->markers.insert(free_nodes->markers.end(),
+                               block.second.free_markers.begin(),
+                               block.second.free_markers.end());
+  }
+}
+
+void OctomapWorld::regenerateVisualizationBlock(
+    uint64_t block_code, const std::string& tf_frame, double min_z,
+    double max_z, visualization_msgs::MarkerArray* occupied_nodes,
+    visualization_msgs::MarkerArray* free_nodes) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const unsigned int num_levels = visualization_block_levels_ + 1;
+  const unsigned int block_depth = tree_depth - visualization_block_levels_;
+  const octomap::key_type block_key_size = 1 << visualization_block_levels_;
+  const octomap::OcTreeKey block_min_key =
+      KeyBatch::mortonDecode(block_code << (3 * visualization_block_levels_));
+  octomap::OcTreeKey block_max_key;
+  for (int i = 0; i < 3; ++i) {
+    block_max_key[i] = block_min_key[i] + block_key_size - 1;
+  }
+
+  std::unordered_map<uint64_t, VisualizationBlock>::iterator block_it =
+      visualization_blocks_.find(block_code);
+  if (block_it == visualization_blocks_.end()) {
+    block_it = visualization_blocks_.emplace(block_code, VisualizationBlock())
+                   .first;
+    block_it->second.id = next_visualization_block_id_++;
+  }
+  VisualizationBlock& block = block_it->second;
+
+  // As in generateMarkerArray(), one CUBE_LIST per depth, but only for the
+  // depths at or below the block.
+  std::vector<visualization_msgs::Marker> occupied_markers(num_levels);
+  for (unsigned int i = 0; i < num_levels; ++i) {
+    const double size = octree_->getNodeSize(block_depth + i);
+    occupied_markers[i].header.frame_id = tf_frame;
+    occupied_markers[i].ns = "map_blocks";
+    occupied_markers[i].id = block.id * num_levels + i;
+    occupied_markers[i].type = visualization_msgs::Marker::CUBE_LIST;
+    occupied_markers[i].action = visualization_msgs::Marker::ADD;
+    occupied_markers[i].scale.x = size;
+    occupied_markers[i].scale.y = size;
+    occupied_markers[i].scale.z = size;
+  }
+  std::vector<visualization_msgs::Marker> free_markers = occupied_markers;
+
+  block.occupied_points.clear();
+  for (PooledOcTree::leaf_bbx_iterator
+           it = octree_->begin_leafs_bbx(block_min_key, block_max_key),
+           end = octree_->end_leafs_bbx();
+       it != end; ++it) {
+    const unsigned int depth = it.getDepth();
+    const bool occupied = octree_->isNodeOccupied(*it);
+    // Nodes bigger than the block are shown by the part inside of it.
+    octomap::OcTreeKey min_key = block_min_key, max_key = block_max_key;
+    octomap::point3d center =
+        octree_->keyToCoord(block_min_key, block_depth);
+    unsigned int level = 0;
+    if (depth >= block_depth) {
+      const octomap::key_type node_key_size = 1 << (tree_depth - depth);
+      min_key = it.getIndexKey();
+      for (int i = 0; i < 3; ++i) {
+        max_key[i] = min_key[i] + node_key_size - 1;
+      }
+      center = it.getCoordinate();
+      level = depth - block_depth;
+    }
+
+    if (occupied) {
+      // Same as getOccupiedPointCloud(): one point per voxel.
+      for (unsigned int x = min_key[0]; x <= max_key[0]; ++x) {
+        for (unsigned int y = min_key[1]; y <= max_key[1]; ++y) {
+          for (unsigned int z = min_key[2]; z <= max_key[2]; ++z) {
+            const octomap::point3d point =
+                octree_->keyToCoord(octomap::OcTreeKey(x, y, z));
+            block.occupied_points.push_back(
+                pcl::PointXYZ(point.x(), point.y(), point.z()));
+          }
+        }
+      }
+    }
+
+    if (center.z() > max_z || center.z() < min_z) {
+      continue;
+    }
+    geometry_msgs::Point cube_center;
+    cube_center.x = center.x();
+    cube_center.y = center.y();
+    cube_center.z = center.z();
+    visualization_msgs::Marker& marker =
+        occupied ? occupied_markers[level] : free_markers[level];
+    marker.points.push_back(cube_center);
+    marker.colors.push_back(
+        percentToColor(colorizeMapByHeight(center.z(), min_z, max_z)));
+  }
+
+  // Send the new markers, and deletes for the ones that are gone.
+  std::vector<bool> had_occupied_marker(num_levels, false);
+  std::vector<bool> had_free_marker(num_levels, false);
+  for (const visualization_msgs::Marker& marker : block.occupied_markers) {
+    had_occupied_marker[marker.id - block.id * num_levels] = true;
+  }
+  for (const visualization_msgs::Marker& marker : block.free_markers) {
+    had_free_marker[marker.id - block.id * num_levels] = true;
+  }
+  block.occupied_markers.clear();
+  block.free_markers.clear();
+  for (unsigned int i = 0; i < num_levels; ++i) {
+    if (!occupied_markers[i].points.empty()) {
+      occupied_nodes->markers.push_back(occupied_markers[i]);
+      block.occupied_markers.push_back(occupied_markers[i]);
+    } else if (had_occupied_marker[i]) {
+      occupied_markers[i].action = visualization_msgs::Marker::DELETE;
+      occupied_nodes->markers.push_back(occupied_markers[i]);
+    }
+    if (!free_markers[i].points.empty()) {
+      free_nodes->markers.push_back(free_markers[i]);
+      block.free_markers.push_back(free_markers[i]);
+    } else if (had_free_marker[i]) {
+      free_markers[i].action = visualization_msgs::Marker::DELETE;
+      free_nodes->markers.push_back(free_markers[i]);
+    }
+  }
+
+  if (block.occupied_markers.empty() && block.free_markers.empty() &&
+      block.occupied_points.empty()) {
+    visualization_blocks_.erase(block_it);
+  }
+}
+
+void OctomapWorld::markVisualizationBlocksChanged(
+    const std::vector<uint64_t>& codes) {
+  const unsigned int block_shift = 3 * visualization_block_levels_;
+  // The codes usually come in runs within the same block.
+  bool has_last_block = false;
+  uint64_t last_block = 0;
+  for (const uint64_t code : codes) {
+    const uint64_t block_code = code >> block_shift;
+    if (!has_last_block || block_code != last_block) {
+      changed_visualization_blocks_.insert(block_code);
+      last_block = block_code;
+      has_last_block = true;
+    }
+  }
+}
+
+void OctomapWorld::markVisualizationBlocksChanged(uint64_t min_code,
+                                                  unsigned int depth) {
+  const unsigned int block_shift = 3 * visualization_block_levels_;
+  const uint64_t min_block = min_code >> block_shift;
+  const uint64_t max_block =
+      (min_code +
+       ((uint64_t(1) << (3 * (octree_->getTreeDepth() - depth))) - 1)) >>
+      block_shift;
+  // Big nodes span more blocks than there are.
+  if (max_block - min_block < visualization_blocks_.size()) {
+    for (uint64_t block = min_block; block <= max_block; ++block) {
+      changed_visualization_blocks_.insert(block);
+    }
+  } else {
+    for (const std::pair<const uint64_t, VisualizationBlock>& block :
+         visualization_blocks_) {
+      if (block.first >= min_block && block.first <= max_block) {
+        changed_visualization_blocks_.insert(block.first);
+      }
+    }
+  }
+}
+
+void OctomapWorld::resetVisualizationBlocks() {
+  for (const std::pair<const uint64_t, VisualizationBlock>& block :
+       visualization_blocks_) {
+    for (visualization_msgs::Marker marker : block.second.occupied_markers) {
+      marker.action = visualization_msgs::Marker::DELETE;
+      marker.points.clear();
+      marker.colors.clear();
+      pending_occupied_deletes_.markers.push_back(marker);
+    }
+    for (visualization_msgs::Marker marker : block.second.free_markers) {
+      marker.action = visualization_msgs::Marker::DELETE;
+      marker.points.clear();
+      marker.colors.clear();
+      pending_free_deletes_.markers.push_back(marker);
+    }
+  }
+  visualization_blocks_.clear();
+  changed_visualization_blocks_.clear();
+  all_visualization_blocks_changed_ = true;
+}
+
+size_t OctomapWorld::updateMapWindow(const Eigen::Vector3d& robot_position) {
+  size_t num_evicted_nodes = 0;
+  Eigen::Vector3d window_size = params_.map_window_size;
+  const bool has_window = (window_size.array() > 0.0).all();
+  if (has_window) {
+    num_evicted_nodes += evictOutsideBoundingBox(robot_position, window_size);
+  }
+  if (params_.memory_budget_mb <= 0.0) {
+    return num_evicted_nodes;
+  }
+
+  const double budget_bytes = params_.memory_budget_mb * 1024.0 * 1024.0;
+  if (getMemoryUsage() <= budget_bytes) {
+    if (num_evicted_nodes > 0) {
+      PooledOcTreeNode::getPool().trim();
+    }
+    return num_evicted_nodes;
+  }
+  if (!has_window) {
+    // Start from the smallest window around the robot that keeps everything.
+    Eigen::Vector3d min_bound, max_bound;
+    getMapBounds(&min_bound, &max_bound);
+    window_size = 2.0 * (max_bound - robot_position)
+                            .cwiseAbs()
+                            .cwiseMax((robot_position - min_bound).cwiseAbs());
+  }
+  // Shrink the window until the map fits with some slack, so that the next
+  // few updates don't evict again right away. The distance field shrinks
+  // with the octree, the inflation and visualization caches of the evicted
+  // parts only at their next update.
+  const double shrink_factor = 0.75;
+  const double min_window_size = 8.0 * octree_->getResolution();
+  size_t memory_usage = getMemoryUsage();
+  while (memory_usage > 0.9 * budget_bytes &&
+         window_size.minCoeff() * shrink_factor >= min_window_size) {
+    window_size *= shrink_factor;
+    num_evicted_nodes += evictOutsideBoundingBox(robot_position, window_size);
+    memory_usage = getMemoryUsage();
+  }
+  // Give the slabs of the evicted nodes back.
+  if (num_evicted_nodes > 0) {
+    PooledOcTreeNode::getPool().trim();
+  }
+  if (memory_usage > budget_bytes) {
+    LOG(WARNING) << "Octomap uses " << memory_usage / (1024 * 1024)
+                 << " MB, over the budget of " << params_.memory_budget_mb
+                 << " MB, with a window of " << window_size.transpose()
+                 << " m.";
+  }
+  return num_evicted_nodes;
+}
+
+size_t OctomapWorld::getMemoryUsage() const {
+  size_t bytes = octree_->memoryUsage() + change_journal_.getMemoryUsage();
+  if (esdf_) {
+    bytes += esdf_->getMemoryUsage();
+  }
+  for (const std::set<uint64_t>& nodes : esdf_coarse_nodes_) {
+    // A set node holds the code, three pointers and the color.
+    bytes += nodes.size() * (sizeof(uint64_t) + 4 * sizeof(void*));
+  }
+  if (inflation_) {
+    bytes += inflation_->getMemoryUsage();
+  }
+  for (const std::pair<const uint64_t, VisualizationBlock>& block :
+       visualization_blocks_) {
+    bytes += sizeof(block) + sizeof(void*) +
+             block.second.occupied_points.capacity() * sizeof(pcl::PointXYZ);
+    for (const std::vector<visualization_msgs::Marker>* markers :
+         {&block.second.occupied_markers, &block.second.free_markers}) {
+      for (const visualization_msgs::Marker& marker : *markers) {
+        bytes += sizeof(marker) +
+                 marker.points.capacity() * sizeof(geometry_msgs::Point) +
+                 marker.colors.capacity() * sizeof(std_msgs::ColorRGBA);
+      }
+    }
+  }
+  return bytes;
+}
+
+size_t OctomapWorld::evictOutsideBoundingBox(
+    const Eigen::Vector3d& center, const Eigen::Vector3d& bounding_box_size) {
+  PooledOcTreeNode* root = octree_->getRoot();
+  if (root == NULL) {
+    return 0;
+  }
+  const double resolution = octree_->getResolution();
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const Eigen::Vector3d keep_min = center - bounding_box_size / 2;
+  const Eigen::Vector3d keep_max = center + bounding_box_size / 2;
+  octomap::OcTreeKey keep_min_key, keep_max_key;
+  for (int i = 0; i < 3; ++i) {
+    keep_min_key[i] = coordToKeyClamped(keep_min[i], resolution, tree_depth);
+    keep_max_key[i] = coordToKeyClamped(keep_max[i], resolution, tree_depth);
+  }
+
+  // Evicted tiles are read again from the tiled map when they are needed, so
+  // their changes have to be in there first.
+  if (tiled_map_ && !writeTilesOutsideKeyBox(keep_min_key, keep_max_key)) {
+    LOG(ERROR) << "Could not write the changed tiles to "
+               << tiled_map_->getDirectory() << ", nothing is evicted.";
+    return 0;
+  }
+
+  std::unique_ptr<PooledOcTree> spill_tree;
+  if (!params_.map_eviction_directory.empty()) {
+    spill_tree.reset(new PooledOcTree(resolution));
+  }
+
+  size_t num_evicted_nodes = 0;
+  std::vector<std::pair<uint64_t, unsigned int> > evicted_nodes;
+  const octomap::key_type root_key_value = 1 << (tree_depth - 1);
+  const octomap::OcTreeKey root_key(root_key_value, root_key_value,
+                                    root_key_value);
+  if (evictOutsideKeyBoxRecurs(root, root_key, 0, keep_min_key, keep_max_key,
+                               spill_tree.get(), &num_evicted_nodes,
+                               &evicted_nodes)) {
+    octree_->clear();
+  }
+  if (num_evicted_nodes == 0) {
+    return 0;
+  }
+  // Only now that the subtrees are gone, the surfaces next to them can be
+  // found in the tree.
+  if (esdf_) {
+    for (const std::pair<uint64_t, unsigned int>& node : evicted_nodes) {
+      setEsdfNodeFree(node.first, node.second);
+    }
+    esdf_->update();
+  }
+  map_delta_keyframe_needed_ = true;
+
+  if (spill_tree) {
+    spill_tree->updateInnerOccupancy();
+    const std::string filename = params_.map_eviction_directory +
+                                 "/evicted_" +
+                                 std::to_string(num_eviction_files_) + ".bt";
+    if (spill_tree->writeBinary(filename)) {
+      ++num_eviction_files_;
+      LOG(INFO) << "Wrote " << num_evicted_nodes << " evicted nodes to "
+                << filename << ".";
+    } else {
+      LOG(ERROR) << "Could not write evicted nodes to " << filename << ".";
+    }
+  }
+  return num_evicted_nodes;
+}
+
+bool OctomapWorld::evictOutsideKeyBoxRecurs(
+    PooledOcTreeNode* node, const octomap::OcTreeKey& key,
+    unsigned int depth, const octomap::OcTreeKey& keep_min_key,
+    const octomap::OcTreeKey& keep_max_key, PooledOcTree* spill_tree,
+    size_t* num_evicted_nodes,
+    std::vector<std::pair<uint64_t, unsigned int> >* evicted_nodes) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  // Key range covered by this node.
+  octomap::OcTreeKey min_key = key, max_key = key;
+  if (depth < tree_depth) {
+    const octomap::key_type half_size = 1 << (tree_depth - 1 - depth);
+    for (int i = 0; i < 3; ++i) {
+      min_key[i] = key[i] - half_size;
+      max_key[i] = key[i] + half_size - 1;
+    }
+  }
+  if (!keyBoxesIntersect(min_key, max_key, keep_min_key, keep_max_key)) {
+    *num_evicted_nodes += evictSubtree(node, key, depth, spill_tree);
+    const unsigned int level_shift = 3 * (tree_depth - depth);
+    evicted_nodes->push_back(std::make_pair(
+        (KeyBatch::mortonEncode(key) >> level_shift) << level_shift, depth));
+    return true;
+  }
+  bool inside = true;
+  for (int i = 0; i < 3; ++i) {
+    if (min_key[i] < keep_min_key[i] || max_key[i] > keep_max_key[i]) {
+      inside = false;
+    }
+  }
+  // Pruned leaves on the border of the window are kept whole.
+  if (inside || !octree_->nodeHasChildren(node)) {
+    return false;
+  }
+
+  // Half the key range of a child, zero for children at the leaf level.
+  const octomap::key_type center_offset_key =
+      depth + 1 < tree_depth ? 1 << (tree_depth - 2 - depth) : 0;
+  bool has_children = false;
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!octree_->nodeChildExists(node, i)) {
+      continue;
+    }
+    octomap::OcTreeKey child_key;
+    octomap::computeChildKey(i, center_offset_key, key, child_key);
+    if (evictOutsideKeyBoxRecurs(octree_->getNodeChild(node, i), child_key,
+                                 depth + 1, keep_min_key, keep_max_key,
+                                 spill_tree, num_evicted_nodes,
+                                 evicted_nodes)) {
+      octree_->deleteNodeChildRecurs(node, i);
+    } else {
+      has_children = true;
+    }
+  }
+  if (!has_children) {
+    ++(*num_evicted_nodes);
+    return true;
+  }
+  node->updateOccupancyChildren();
+  return false;
+}
+
+size_t OctomapWorld::evictSubtree(const PooledOcTreeNode* node,
+                                  const octomap::OcTreeKey& key,
+                                  unsigned int depth,
+                                  PooledOcTree* spill_tree) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  // The leaves of the subtree are a contiguous range of Morton codes.
+  const unsigned int level_shift = 3 * (tree_depth - depth);
+  const uint64_t min_code =
+      (KeyBatch::mortonEncode(key) >> level_shift) << level_shift;
+  if (params_.incremental_visualization) {
+    markVisualizationBlocksChanged(min_code, depth);
+  }
+  if (inflation_) {
+    inflation_->markChanged(min_code, tree_depth - depth);
+  }
+  if (tiled_map_) {
+    // Evicted tiles are loaded again when they are needed.
+    const unsigned int tile_shift = 3 * tiled_map_->getTileLevels();
+    size_t begin, end;
+    tiled_map_->findEntries(
+        min_code >> tile_shift,
+        (min_code + ((uint64_t(1) << level_shift) - 1)) >> tile_shift, &begin,
+        &end);
+    for (size_t i = begin; i < end; ++i) {
+      loaded_tiles_.erase(tiled_map_->getEntry(i).code);
+    }
+  }
+
+  if (spill_tree != NULL) {
+    copySubtree(*octree_, node, spill_tree,
+                createEmptyNode(key, depth, spill_tree));
+  }
+
+  return evictSubtreeLeaves(node, key, depth);
+}
+
+size_t OctomapWorld::evictSubtreeLeaves(const PooledOcTreeNode* node,
+                                        const octomap::OcTreeKey& key,
+                                        unsigned int depth) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  if (!octree_->nodeHasChildren(node)) {
+    // Evicted free leaves become unknown, which is no change.
+    if (!octree_->isChangeDetectionEnabled() ||
+        !octree_->isNodeOccupied(node)) {
+      return 1;
+    }
+    const unsigned int size = 1 << (tree_depth - depth);
+    const octomap::OcTreeKey min_key(key[0] - size / 2, key[1] - size / 2,
+                                     key[2] - size / 2);
+    for (unsigned int x = min_key[0]; x < min_key[0] + size; ++x) {
+      for (unsigned int y = min_key[1]; y < min_key[1] + size; ++y) {
+        for (unsigned int z = min_key[2]; z < min_key[2] + size; ++z) {
+          octree_->registerLeafChange(octomap::OcTreeKey(x, y, z), false,
+                                      true, false);
+        }
+      }
+    }
+    return 1;
+  }
+  size_t num_nodes = 1;
+  const octomap::key_type center_offset_key =
+      depth + 1 < tree_depth ? 1 << (tree_depth - 2 - depth) : 0;
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (octree_->nodeChildExists(node, i)) {
+      octomap::OcTreeKey child_key;
+      octomap::computeChildKey(i, center_offset_key, key, child_key);
+      num_nodes += evictSubtreeLeaves(octree_->getNodeChild(node, i),
+                                      child_key, depth + 1);
+    }
+  }
+  return num_nodes;
+}
+
+bool OctomapWorld::openTiledMap(const std::string& directory) {
+  std::shared_ptr<TiledMapStorage> tiled_map(new TiledMapStorage());
+  if (!tiled_map->open(directory)) {
+    return false;
+  }
+  if (tiled_map->getTreeDepth() != octree_->getTreeDepth()) {
+    LOG(ERROR) << "Tiled map " << directory << " has a tree depth of "
+               << tiled_map->getTreeDepth() << " instead of "
+               << octree_->getTreeDepth() << ".";
+    return false;
+  }
+  // Same as reading a .bt file, the map takes the resolution of the file.
+  octree_->clear();
+  octree_->setResolution(tiled_map->getResolution());
+  scan_batch_.clear();
+  num_scans_in_batch_ = 0;
+  closeTiledMap();
+  tiled_map_ = tiled_map;
+  handleMapReplaced();
+  all_tiles_changed_ = false;
+  LOG(INFO) << "Opened tiled map " << directory << " with "
+            << tiled_map_->getNumEntries() << " tiles.";
+  return true;
+}
+
+bool OctomapWorld::writeTiledMap(const std::string& directory) {
+  std::vector<TiledMapStorage::Tile> tiles;
+  if (tiled_map_ && tiled_map_->getDirectory() == directory &&
+      !all_tiles_changed_) {
+    if (!writeChangedTiles(std::vector<uint64_t>(changed_tiles_.begin(),
+                                                 changed_tiles_.end()))) {
+      return false;
+    }
+  } else {
+    // Everything has to be in memory to be written.
+    if (tiled_map_) {
+      std::vector<size_t> unloaded_indices;
+      for (size_t i = 0; i < tiled_map_->getNumEntries(); ++i) {
+        if (loaded_tiles_.insert(tiled_map_->getEntry(i).code).second) {
+          unloaded_indices.push_back(i);
+        }
+      }
+      loadTiles(unloaded_indices);
+    }
+    const unsigned int tile_levels = getTileLevels();
+    const PooledOcTreeNode* root = octree_->getRoot();
+    if (root != NULL) {
+      serializeTilesRecurs(root, octomap::OcTreeKey(0, 0, 0), 0, &tiles);
+    }
+    std::shared_ptr<TiledMapStorage> tiled_map(new TiledMapStorage());
+    if (!tiled_map->create(directory, octree_->getResolution(),
+                           octree_->getTreeDepth(), tile_levels, &tiles)) {
+      return false;
+    }
+    tiled_map_ = tiled_map;
+    loaded_tiles_.clear();
+    for (const TiledMapStorage::Tile& tile : tiles) {
+      loaded_tiles_.insert(tile.entry.code);
+    }
+    LOG(INFO) << "Wrote " << tiles.size() << " tiles to " << directory << ".";
+  }
+  changed_tiles_.clear();
+  all_tiles_changed_ = false;
+  return true;
+}
+
+bool OctomapWorld::writeChangedTiles(const std::vector<uint64_t>& codes) {
+  std::vector<TiledMapStorage::Tile> tiles;
+  // Changes in tiles that were never loaded are added to their old content,
+  // the same as if the tiles had been loaded first.
+  std::vector<size_t> unloaded_indices;
+  for (const uint64_t code : codes) {
+    size_t index;
+    if (tiled_map_->findEntry(code, &index) &&
+        loaded_tiles_.insert(tiled_map_->getEntry(index).code).second) {
+      unloaded_indices.push_back(index);
+    }
+  }
+  loadTiles(unloaded_indices);
+
+  // Changed tiles are written as the whole entry that covers them, if any.
+  std::unordered_set<uint64_t> written_codes;
+  std::vector<size_t> removed_indices;
+  for (const uint64_t code : codes) {
+    size_t index;
+    TiledMapStorage::TileEntry region;
+    if (tiled_map_->findEntry(code, &index)) {
+      region = tiled_map_->getEntry(index);
+      if (written_codes.insert(region.code).second) {
+        removed_indices.push_back(index);
+      } else {
+        continue;
+      }
+    } else {
+      region.code = code;
+      region.depth = octree_->getTreeDepth() - tiled_map_->getTileLevels();
+    }
+    serializeTileRegion(region, &tiles);
+  }
+  if (!tiled_map_->update(removed_indices, &tiles)) {
+    return false;
+  }
+  // The rewritten entries are all in the tree.
+  for (const uint64_t code : written_codes) {
+    loaded_tiles_.erase(code);
+  }
+  for (const TiledMapStorage::Tile& tile : tiles) {
+    loaded_tiles_.insert(tile.entry.code);
+  }
+  for (const uint64_t code : codes) {
+    changed_tiles_.erase(code);
+  }
+  LOG(INFO) << "Wrote " << tiles.size() << " changed tiles to "
+            << tiled_map_->getDirectory() << ".";
+  return true;
+}
+
+bool OctomapWorld::writeTilesOutsideKeyBox(
+    const octomap::OcTreeKey& keep_min_key,
+    const octomap::OcTreeKey& keep_max_key) {
+  if (all_tiles_changed_) {
+    return writeTiledMap(tiled_map_->getDirectory());
+  }
+  const unsigned int tile_levels = tiled_map_->getTileLevels();
+  const octomap::key_type tile_size = 1 << tile_levels;
+  std::vector<uint64_t> codes;
+  for (const uint64_t code : changed_tiles_) {
+    const octomap::OcTreeKey min_key =
+        KeyBatch::mortonDecode(code << (3 * tile_levels));
+    octomap::OcTreeKey max_key;
+    for (int i = 0; i < 3; ++i) {
+      max_key[i] = min_key[i] + tile_size - 1;
+    }
+    if (!keyBoxContains(keep_min_key, keep_max_key, min_key, max_key)) {
+      codes.push_back(code);
+    }
+  }
+  return codes.empty() || writeChangedTiles(codes);
+}
+
+size_t OctomapWorld::loadTilesInBoundingBox(
+    const Eigen::Vector3d& center, const Eigen::Vector3d& bounding_box_size) {
+  if (!tiled_map_) {
+    return 0;
+  }
+  const double resolution = octree_->getResolution();
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const unsigned int tile_levels = tiled_map_->getTileLevels();
+  const Eigen::Vector3d bbx_min = center - bounding_box_size / 2;
+  const Eigen::Vector3d bbx_max = center + bounding_box_size / 2;
+  unsigned int min_tile[3], max_tile[3];
+  for (int i = 0; i < 3; ++i) {
+    min_tile[i] =
+        coordToKeyClamped(bbx_min[i], resolution, tree_depth) >> tile_levels;
+    max_tile[i] =
+        coordToKeyClamped(bbx_max[i], resolution, tree_depth) >> tile_levels;
+  }
+
+  // The Morton code of the tile coordinates is the tile code.
+  std::vector<size_t> indices;
+  for (unsigned int x = min_tile[0]; x <= max_tile[0]; ++x) {
+    for (unsigned int y = min_tile[1]; y <= max_tile[1]; ++y) {
+      for (unsigned int z = min_tile[2]; z <= max_tile[2]; ++z) {
+        size_t index;
+        if (tiled_map_->findEntry(
+                KeyBatch::mortonEncode(octomap::OcTreeKey(x, y, z)), &index) &&
+            loaded_tiles_.insert(tiled_map_->getEntry(index).code).second) {
+          indices.push_back(index);
+        }
+      }
+    }
   }
+  return loadTiles(indices);
+}
 
-  for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs(),
-                                      end = octree_->end_leafs();
-       it != end; ++it) {
-    geometry_msgs::Point cube_center;
-    cube_center.x = it.getX();
-    cube_center.y = it.getY();
-    cube_center.z = it.getZ();
+void OctomapWorld::closeTiledMap() {
+  tiled_map_.reset();
+  loaded_tiles_.clear();
+  changed_tiles_.clear();
+}
+
+void OctomapWorld::loadTilesAroundSensor(
+    const Eigen::Vector3d& sensor_position) {
+  if (!tiled_map_) {
+    return;
+  }
+  const double distance = params_.sensor_max_range > 0.0
+                              ? params_.sensor_max_range
+                              : params_.tile_load_distance;
+  loadTilesInBoundingBox(sensor_position,
+                         Eigen::Vector3d::Constant(2.0 * distance));
+}
 
-    if (cube_center.z > max_z || cube_center.z < min_z) {
+size_t OctomapWorld::loadTiles(const std::vector<size_t>& indices) {
+  if (indices.empty()) {
+    return 0;
+  }
+  // All tiles are read into a separate tree first, which is then merged into
+  // the unknown parts of the map in one pass.
+  PooledOcTree tile_tree(octree_->getResolution());
+  tile_tree.setClampingThresMin(octree_->getClampingThresMin());
+  tile_tree.setClampingThresMax(octree_->getClampingThresMax());
+  size_t num_loaded = 0;
+  const unsigned int tile_shift = 3 * tiled_map_->getTileLevels();
+  for (const size_t index : indices) {
+    const TiledMapStorage::TileEntry& entry = tiled_map_->getEntry(index);
+    if (!loadTile(index, &tile_tree)) {
+      loaded_tiles_.erase(entry.code);
       continue;
     }
+    if (params_.incremental_visualization) {
+      markVisualizationBlocksChanged(entry.code << tile_shift, entry.depth);
+    }
+    if (inflation_) {
+      inflation_->markChanged(entry.code << tile_shift,
+                              octree_->getTreeDepth() - entry.depth);
+    }
+    ++num_loaded;
+  }
+  tile_tree.updateInnerOccupancy();
+  // The merged parts were unknown, so only their obstacles are new to the
+  // distance field and to change detection.
+  const bool detect_changes = octree_->isChangeDetectionEnabled();
+  std::vector<std::pair<uint64_t, unsigned int> > occupied_nodes;
+  mergeOctomap(&tile_tree,
+               esdf_ || detect_changes ? &occupied_nodes : NULL);
+  map_delta_keyframe_needed_ = true;
+  if (esdf_) {
+    for (const std::pair<uint64_t, unsigned int>& node : occupied_nodes) {
+      setEsdfNodeOccupied(node.first, node.second);
+    }
+    esdf_->update();
+  }
+  if (detect_changes) {
+    // The changed keys, and so the change journal, hold leaves.
+    const unsigned int tree_depth = octree_->getTreeDepth();
+    for (const std::pair<uint64_t, unsigned int>& node : occupied_nodes) {
+      const octomap::OcTreeKey min_key = KeyBatch::mortonDecode(node.first);
+      const unsigned int size = 1 << (tree_depth - node.second);
+      for (unsigned int x = min_key[0]; x < min_key[0] + size; ++x) {
+        for (unsigned int y = min_key[1]; y < min_key[1] + size; ++y) {
+          for (unsigned int z = min_key[2]; z < min_key[2] + size; ++z) {
+            octree_->registerLeafChange(octomap::OcTreeKey(x, y, z), true,
+                                        false, true);
+          }
+        }
+      }
+    }
+  }
+  return num_loaded;
+}
 
-    int depth_level = it.getDepth();
+bool OctomapWorld::loadTile(size_t index, PooledOcTree* tile_tree) const {
+  const TiledMapStorage::TileEntry& entry = tiled_map_->getEntry(index);
+  const octomap::OcTreeKey min_key = KeyBatch::mortonDecode(
+      entry.code << (3 * tiled_map_->getTileLevels()));
+  if (entry.status == TiledMapStorage::kInner) {
+    std::string data;
+    if (!tiled_map_->readTile(index, &data)) {
+      return false;
+    }
+    std::istringstream stream(data);
+    tile_tree->readBinaryNode(stream,
+                              createEmptyNode(min_key, entry.depth, tile_tree));
+    return static_cast<bool>(stream);
+  }
+  createEmptyNode(min_key, entry.depth, tile_tree)
+      ->setLogOdds(entry.status == TiledMapStorage::kOccupiedLeaf
+                       ? octree_->getClampingThresMaxLog()
+                       : octree_->getClampingThresMinLog());
+  return true;
+}
 
-    if (octree_->isNodeOccupied(*it)) {
-      occupied_nodes->markers[depth_level].points.push_back(cube_center);
-      occupied_nodes->markers[depth_level].colors.push_back(
-          percentToColor(colorizeMapByHeight(it.getZ(), min_z, max_z)));
+void OctomapWorld::serializeTilesRecurs(
+    const PooledOcTreeNode* node, const octomap::OcTreeKey& min_key,
+    unsigned int depth, std::vector<TiledMapStorage::Tile>* tiles) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const unsigned int tile_levels = getTileLevels();
+  if (depth == tree_depth - tile_levels || !octree_->nodeHasChildren(node)) {
+    TiledMapStorage::Tile tile;
+    tile.entry.code = KeyBatch::mortonEncode(min_key) >> (3 * tile_levels);
+    tile.entry.depth = depth;
+    tile.entry.reserved = 0;
+    if (!octree_->nodeHasChildren(node)) {
+      tile.entry.status = octree_->isNodeOccupied(node)
+                              ? TiledMapStorage::kOccupiedLeaf
+                              : TiledMapStorage::kFreeLeaf;
     } else {
-      free_nodes->markers[depth_level].points.push_back(cube_center);
-      free_nodes->markers[depth_level].colors.push_back(
-          percentToColor(colorizeMapByHeight(it.getZ(), min_z, max_z)));
+      tile.entry.status = TiledMapStorage::kInner;
+      std::ostringstream stream;
+      octree_->writeBinaryNode(stream, node);
+      tile.data = stream.str();
+    }
+    tiles->push_back(tile);
+    return;
+  }
+  // Child i is offset on the axes of its bits.
+  const octomap::key_type child_size = 1 << (tree_depth - 1 - depth);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!octree_->nodeChildExists(node, i)) {
+      continue;
+    }
+    octomap::OcTreeKey child_min_key = min_key;
+    for (unsigned int j = 0; j < 3; ++j) {
+      if (i & (1 << j)) {
+        child_min_key[j] += child_size;
+      }
     }
+    serializeTilesRecurs(octree_->getNodeChild(node, i), child_min_key,
+                         depth + 1, tiles);
   }
+}
 
-  for (int i = 0; i < tree_depth; ++i) {
-    if (occupied_nodes->markers[i].points.size() > 0) {
-      occupied_nodes->markers[i].action = visualization_msgs::Marker::ADD;
-    } else {
-      occupied_nodes->markers[i].action = visualization_msgs::Marker::DELETE;
+void OctomapWorld::serializeTileRegion(
+    const TiledMapStorage::TileEntry& region,
+    std::vector<TiledMapStorage::Tile>* tiles) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const octomap::OcTreeKey min_key = KeyBatch::mortonDecode(
+      region.code << (3 * tiled_map_->getTileLevels()));
+  const PooledOcTreeNode* node = octree_->getRoot();
+  if (node == NULL) {
+    return;
+  }
+  for (unsigned int depth = 0; depth < region.depth; ++depth) {
+    if (!octree_->nodeHasChildren(node)) {
+      // A leaf bigger than the region, which is written as a leaf of the
+      // size of the region so that it doesn't overlap other entries.
+      TiledMapStorage::Tile tile;
+      tile.entry.code = region.code;
+      tile.entry.depth = region.depth;
+      tile.entry.reserved = 0;
+      tile.entry.status = octree_->isNodeOccupied(node)
+                              ? TiledMapStorage::kOccupiedLeaf
+                              : TiledMapStorage::kFreeLeaf;
+      tiles->push_back(tile);
+      return;
     }
+    const unsigned int child_index =
+        octomap::computeChildIdx(min_key, tree_depth - 1 - depth);
+    if (!octree_->nodeChildExists(node, child_index)) {
+      // The region is unknown now.
+      return;
+    }
+    node = octree_->getNodeChild(node, child_index);
+  }
+  serializeTilesRecurs(node, min_key, region.depth, tiles);
+}
 
-    if (free_nodes->markers[i].points.size() > 0) {
-      free_nodes->markers[i].action = visualization_msgs::Marker::ADD;
-    } else {
-      free_nodes->markers[i].action = visualization_msgs::Marker::DELETE;
+unsigned int OctomapWorld::getTileLevels() const {
+  if (tiled_map_) {
+    return tiled_map_->getTileLevels();
+  }
+  return getLevelsForBlockSize(octree_->getResolution(),
+                               octree_->getTreeDepth(), params_.map_tile_size);
+}
+
+void OctomapWorld::markTilesChanged(const std::vector<uint64_t>& codes) {
+  const unsigned int tile_shift = 3 * tiled_map_->getTileLevels();
+  // The codes usually come in runs within the same tile.
+  bool has_last_tile = false;
+  uint64_t last_tile = 0;
+  for (const uint64_t code : codes) {
+    const uint64_t tile_code = code >> tile_shift;
+    if (!has_last_tile || tile_code != last_tile) {
+      changed_tiles_.insert(tile_code);
+      last_tile = tile_code;
+      has_last_tile = true;
     }
   }
 }
 
+void OctomapWorld::markTilesChanged(uint64_t min_code, unsigned int depth) {
+  const unsigned int tile_shift = 3 * tiled_map_->getTileLevels();
+  const uint64_t min_tile = min_code >> tile_shift;
+  const uint64_t max_tile =
+      (min_code +
+       ((uint64_t(1) << (3 * (octree_->getTreeDepth() - depth))) - 1)) >>
+      tile_shift;
+  // Big nodes span too many tiles to track one by one.
+  const uint64_t max_num_tiles = 4096;
+  if (max_tile - min_tile >= max_num_tiles) {
+    all_tiles_changed_ = true;
+    return;
+  }
+  for (uint64_t tile = min_tile; tile <= max_tile; ++tile) {
+    changed_tiles_.insert(tile);
+  }
+}
+
 void OctomapWorld::convertUnknownToFree() {
   Eigen::Vector3d min_bound, max_bound;
   getMapBounds(&min_bound, &max_bound);
@@ -970,202 +4228,291 @@ void OctomapWorld::convertUnknownToFree() {
 
 void OctomapWorld::convertUnknownToFree(const Eigen::Vector3d& min_bound,
                                         const Eigen::Vector3d& max_bound) {
-  const bool lazy_eval = true;
-  const double log_odds_value = octree_->getClampingThresMinLog();
-  const double resolution = octree_->getResolution();
   const double epsilon = 0.001;  // Small offset to not hit boundary of nodes.
   Eigen::Vector3d epsilon_3d;
   epsilon_3d.setConstant(epsilon);
-  octomap::point3d pmin = pointEigenToOctomap(min_bound + epsilon_3d);
-  octomap::point3d pmax = pointEigenToOctomap(max_bound - epsilon_3d);
+  KeyBoxUpdate update;
+  update.log_odds = octree_->getClampingThresMinLog();
+  update.only_unknown = true;
+  update.prune = true;
   // octree_->getUnknownLeafCenters would have been easier, but it doesn't get
-  // all the unknown points for some reason
-  for (float x = pmin.x() + epsilon; x < pmax.x(); x += resolution) {
-    for (float y = pmin.y() + epsilon; y < pmax.y(); y += resolution) {
-      for (float z = pmin.z() + epsilon; z < pmax.z(); z += resolution) {
-        octomap::OcTree::NodeType* res = octree_->search(x, y, z);
-        if (res == NULL) {
-          // Point is unknown, set it free
-          octree_->setNodeValue(x, y, z, log_odds_value, lazy_eval);
-        }
-      }
-    }
-  }
-  if (lazy_eval) {
-    octree_->updateInnerOccupancy();
+  // all the unknown points for some reason. Unknown space is set free in the
+  // biggest nodes that fit into the box.
+  KeyBox box;
+  if (getKeyBox(min_bound + epsilon_3d, max_bound - epsilon_3d, &box)) {
+    update.boxes.push_back(box);
   }
-  octree_->prune();
+  updateKeyBoxes(&update);
 }
 
 void OctomapWorld::inflateOccupied(const Eigen::Vector3d& safety_space) {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kInflation);
   // Inflate all obstacles by safety_space, such that if a collision free
   // trajectory is generated in this new space, it is guaranteed that
   // safety_space around this trajectory is collision free in the original space
-  const bool lazy_eval = true;
-  const double log_odds_value = octree_->getClampingThresMaxLog();
+  const unsigned int tree_depth = octree_->getTreeDepth();
   const double resolution = octree_->getResolution();
   const double epsilon = 0.001;  // Small offset to not hit boundary of nodes.
   Eigen::Vector3d epsilon_3d;
   epsilon_3d.setConstant(epsilon);
 
-  // Compute the maximal distance from the map's bounds where a small box has to
-  // be checked explicitly for its feasibility.
-  double bound_threshold = 0;
-  double resolution_multiple = resolution;
-  while (resolution_multiple < safety_space.minCoeff() / 4.0 - epsilon) {
-    bound_threshold += resolution_multiple;
-    resolution_multiple *= 2;
+  // Voxels within the radius of an obstacle voxel intersect the box of
+  // safety_space around some point of the obstacle.
+  Eigen::Vector3i radius;
+  for (int i = 0; i < 3; ++i) {
+    radius[i] = std::max(
+        0, static_cast<int>(std::ceil(safety_space[i] / (2 * resolution) -
+                                      epsilon / resolution)));
+  }
+  if (!inflation_) {
+    inflation_.reset(new InflationLayer());
   }
+  const bool unknown_as_occupied = params_.treat_unknown_as_occupied;
+
+  std::vector<uint64_t> blocks;
+  if (inflation_->needsFullUpdate(radius, unknown_as_occupied)) {
+    const Eigen::Vector3i block_radius =
+        (radius +
+         Eigen::Vector3i::Constant(InflationLayer::kBlockSize - 1)) /
+        InflationLayer::kBlockSize;
+    if (octree_->getRoot() != NULL) {
+      const octomap::key_type root_key_value = 1 << (tree_depth - 1);
+      const octomap::OcTreeKey root_key(root_key_value, root_key_value,
+                                        root_key_value);
+      getInflationBlocksRecurs(octree_->getRoot(), root_key, 0,
+                               unknown_as_occupied, block_radius, &blocks);
+    }
+  } else {
+    inflation_->getChangedBlocks(&blocks);
+  }
+
+  // Obstacles close to the map bounds are inflated beyond them.
   Eigen::Vector3d map_min_bound, map_max_bound;
   getMapBounds(&map_min_bound, &map_max_bound);
+  KeyBox bounds;
+  if (!getKeyBox(map_min_bound + epsilon_3d, map_max_bound - epsilon_3d,
+                 &bounds)) {
+    bounds.min_key = octomap::OcTreeKey(1, 1, 1);
+    bounds.max_key = octomap::OcTreeKey(0, 0, 0);
+  }
 
-  std::vector<std::pair<Eigen::Vector3d, double>> free_boxes_vector;
-  getAllFreeBoxes(&free_boxes_vector);
+  InflationLayer::Result result;
+  inflation_->update(
+      radius, unknown_as_occupied, blocks,
+      [this, &bounds](uint64_t block_code, InflationLayer::BlockState* state) {
+        readInflationBlock(block_code, bounds, state);
+      },
+      &result);
+  applyInflation(result);
+}
 
-  Eigen::Vector3d actual_position;
-  octomap::KeySet occupied_keys;
-  octomap::OcTreeKey actual_key;
-
-  for (const std::pair<Eigen::Vector3d, double>& free_box : free_boxes_vector) {
-    // In case box size implicates that the whole box is infeasible (an obstacle
-    // is at a distance of at most 2 * box_size (from the center of the
-    // safety_space), otherwise the pruned free box would have been bigger)
-    if (free_box.second < safety_space.minCoeff() / 4.0 - epsilon) {
-      Eigen::Vector3d min_bound_distance = free_box.first - map_min_bound;
-      Eigen::Vector3d max_bound_distance = map_max_bound - free_box.first;
-      Eigen::Vector3d bound_distance =
-          min_bound_distance.cwiseMin(max_bound_distance);
-      if (bound_distance.minCoeff() > bound_threshold) {
-        // It's not at the map's bounds, therefore its small size depends on a
-        // near obstacle.
-        getKeysBoundingBox(free_box.first,
-                           Eigen::Vector3d::Constant(free_box.second),
-                           &occupied_keys, BoundHandling::kIncludePartialBoxes);
-        continue;
+void OctomapWorld::getInflationBlocksRecurs(
+    const PooledOcTreeNode* node, const octomap::OcTreeKey& key,
+    unsigned int depth, bool all_known, const Eigen::Vector3i& block_radius,
+    std::vector<uint64_t>* blocks) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const unsigned int block_depth = tree_depth - InflationLayer::kBlockLevels;
+  // Inner nodes hold the maximum occupancy of their children, so there are no
+  // obstacles below a free inner node.
+  if (!all_known && !octree_->isNodeOccupied(node)) {
+    return;
+  }
+  if (depth == block_depth) {
+    blocks->push_back(KeyBatch::mortonEncode(key) >>
+                      (3 * InflationLayer::kBlockLevels));
+    return;
+  }
+  if (!octree_->nodeHasChildren(node)) {
+    // Voxels of a uniform node only change close to other nodes.
+    octomap::OcTreeKey min_key, max_key;
+    getNodeKeyRange(key, depth, tree_depth, &min_key, &max_key);
+    const Eigen::Vector3i min_index =
+        Eigen::Vector3i(min_key[0], min_key[1], min_key[2]) /
+        InflationLayer::kBlockSize;
+    const int num_blocks = 1 << (block_depth - depth);
+    for (int x = 0; x < num_blocks; ++x) {
+      for (int y = 0; y < num_blocks; ++y) {
+        const bool at_side = x < block_radius.x() ||
+                             x >= num_blocks - block_radius.x() ||
+                             y < block_radius.y() ||
+                             y >= num_blocks - block_radius.y();
+        for (int z = 0; z < num_blocks; ++z) {
+          if (!at_side && z == block_radius.z()) {
+            z = std::max(z, num_blocks - block_radius.z());
+            if (z >= num_blocks) {
+              break;
+            }
+          }
+          blocks->push_back(InflationLayer::getBlockCode(
+              min_index + Eigen::Vector3i(x, y, z)));
+        }
       }
     }
-
-    // In case the whole box is feasible, nothing has to be done with this box
-    if (getCellStatusBoundingBox(
-            free_box.first, safety_space + Eigen::Vector3d::Constant(
-                                               free_box.second)) != kOccupied) {
+    return;
+  }
+  // Half the key range of a child.
+  const octomap::key_type center_offset_key = 1 << (tree_depth - 2 - depth);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!octree_->nodeChildExists(node, i)) {
       continue;
     }
+    octomap::OcTreeKey child_key;
+    octomap::computeChildKey(i, center_offset_key, key, child_key);
+    getInflationBlocksRecurs(octree_->getNodeChild(node, i), child_key,
+                             depth + 1, all_known, block_radius, blocks);
+  }
+}
 
-    // In case the whole box can't be feasible (bounding box of safety_space
-    // around a point on one bound of the box would hit obstacle on the other
-    // side)
-    if (getCellStatusBoundingBox(
-            free_box.first,
-            Eigen::Vector3d::Constant(resolution - epsilon)
-                .cwiseMax(safety_space - Eigen::Vector3d::Constant(
-                                             free_box.second))) == kOccupied) {
-      getKeysBoundingBox(free_box.first,
-                         Eigen::Vector3d::Constant(free_box.second),
-                         &occupied_keys, BoundHandling::kIncludePartialBoxes);
-      continue;
+void OctomapWorld::readInflationBlock(uint64_t block_code,
+                                      const KeyBox& bounds,
+                                      InflationLayer::BlockState* state) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const unsigned int block_depth = tree_depth - InflationLayer::kBlockLevels;
+  const octomap::OcTreeKey min_key = KeyBatch::mortonDecode(
+      block_code << (3 * InflationLayer::kBlockLevels));
+
+  Eigen::Vector3i inside_min, inside_max;
+  for (int i = 0; i < 3; ++i) {
+    inside_min[i] = std::max<int>(bounds.min_key[i], min_key[i]) - min_key[i];
+    inside_max[i] =
+        std::min<int>(bounds.max_key[i],
+                      min_key[i] + InflationLayer::kBlockSize - 1) -
+        min_key[i];
+  }
+  InflationLayer::Mask inside;
+  if ((inside_min.array() <= inside_max.array()).all()) {
+    inside.setBox(inside_min, inside_max);
+  }
+  state->outside_bounds = ~inside;
+
+  // Uniform nodes above the block cover all of it.
+  const PooledOcTreeNode* node = octree_->getRoot();
+  for (unsigned int depth = 0; node != NULL && depth < block_depth; ++depth) {
+    if (!octree_->nodeHasChildren(node)) {
+      break;
     }
+    const unsigned int child =
+        octomap::computeChildIdx(min_key, tree_depth - 1 - depth);
+    node = octree_->nodeChildExists(node, child)
+               ? octree_->getNodeChild(node, child)
+               : NULL;
+  }
+  if (node != NULL) {
+    fillInflationBlockRecurs(node, Eigen::Vector3i::Zero(),
+                             InflationLayer::kBlockSize, state);
+  }
+}
 
-    // Otherwise find which obstacles cause some parts of the box to be
-    // infeasible, and find all those points through inflating those obstacles
-    std::vector<std::pair<Eigen::Vector3d, double>> occupied_boxes_vector;
-    getOccupiedBoxesBoundingBox(
-        free_box.first,
-        safety_space + Eigen::Vector3d::Constant(free_box.second),
-        &occupied_boxes_vector);
-    for (const std::pair<Eigen::Vector3d, double>& box_occupied :
-         occupied_boxes_vector) {
-      // Infeasible volume caused by box_occupied
-      Eigen::Vector3d infeasible_box_min =
-          box_occupied.first -
-          (Eigen::Vector3d::Constant(box_occupied.second) + safety_space) / 2;
-      Eigen::Vector3d infeasible_box_max =
-          box_occupied.first +
-          (Eigen::Vector3d::Constant(box_occupied.second) + safety_space) / 2;
-      // Volume of free_box
-      Eigen::Vector3d actual_box_min =
-          free_box.first - Eigen::Vector3d::Constant(free_box.second) / 2;
-      Eigen::Vector3d actual_box_max =
-          free_box.first + Eigen::Vector3d::Constant(free_box.second) / 2;
-      // Overlapping volume of box_infeasible and free_box
-      Eigen::Vector3d bbx_min = actual_box_min.cwiseMax(infeasible_box_min);
-      Eigen::Vector3d bbx_max = actual_box_max.cwiseMin(infeasible_box_max);
-      Eigen::Vector3d bbx_center = (bbx_min + bbx_max) / 2;
-      Eigen::Vector3d bbx_size = bbx_max - bbx_min;
-      getKeysBoundingBox(bbx_center, bbx_size, &occupied_keys,
-                         BoundHandling::kIncludePartialBoxes);
-    }
-  }
-
-  // Inflate all obstacles at the map's borders, since the obstacles that are
-  // less than safety_space / 2 away from the boundary have to be inflated
-  // beyond the boundary.
-  Eigen::Vector3d direction, bounding_box_center, bounding_box_size;
-  std::vector<std::pair<Eigen::Vector3d, double>> occupied_boxes_vector;
-  for (unsigned i = 0u; i < 3u; i++) {
-    for (int sign = -1; sign <= 1; sign += 2) {
-      direction = Eigen::Vector3d::Zero();
-      direction[i] = sign;
-      bounding_box_center = getMapCenter();
-      bounding_box_center[i] +=
-          sign * (getMapSize()[i] - safety_space[i] / 2) / 2;
-      bounding_box_size = getMapSize();
-      bounding_box_size[i] = safety_space[i] / 2;
-      getOccupiedBoxesBoundingBox(bounding_box_center,
-                                  bounding_box_size - epsilon_3d,
-                                  &occupied_boxes_vector);
-      for (const std::pair<Eigen::Vector3d, double>& occupied_box :
-           occupied_boxes_vector) {
-        // Set just the inflated volume that is outside the original map bounds.
-        Eigen::Vector3d outer_bbx_min =
-            occupied_box.first -
-            (Eigen::Vector3d::Constant(occupied_box.second) + safety_space) / 2;
-        Eigen::Vector3d outer_bbx_max =
-            occupied_box.first +
-            (Eigen::Vector3d::Constant(occupied_box.second) + safety_space) / 2;
-        if (sign == -1) {
-          outer_bbx_max[i] = map_min_bound[i];
-        } else {
-          outer_bbx_min[i] = map_max_bound[i];
-        }
-        Eigen::Vector3d outer_bbx_center = (outer_bbx_min + outer_bbx_max) / 2;
-        Eigen::Vector3d outer_bbx_size =
-            outer_bbx_max - outer_bbx_min - epsilon_3d;
-        getKeysBoundingBox(outer_bbx_center, outer_bbx_size, &occupied_keys,
-                           BoundHandling::kIncludePartialBoxes);
-      }
+void OctomapWorld::fillInflationBlockRecurs(
+    const PooledOcTreeNode* node, const Eigen::Vector3i& local_min, int size,
+    InflationLayer::BlockState* state) const {
+  if (!octree_->nodeHasChildren(node)) {
+    const Eigen::Vector3i local_max =
+        local_min + Eigen::Vector3i::Constant(size - 1);
+    if (octree_->isNodeOccupied(node)) {
+      state->occupied.setBox(local_min, local_max);
+    } else {
+      state->free.setBox(local_min, local_max);
+    }
+    return;
+  }
+  const int child_size = size / 2;
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!octree_->nodeChildExists(node, i)) {
+      continue;
     }
+    // Bits 0, 1 and 2 of the child index are the x, y and z halves.
+    const Eigen::Vector3i child_min =
+        local_min + child_size * Eigen::Vector3i(i & 1, (i >> 1) & 1,
+                                                 (i >> 2) & 1);
+    fillInflationBlockRecurs(octree_->getNodeChild(node, i), child_min,
+                             child_size, state);
   }
+}
 
-  // Set all infeasible points occupied
-  for (octomap::OcTreeKey key : occupied_keys) {
-    octree_->setNodeValue(octree_->keyToCoord(key), log_odds_value, lazy_eval);
+void OctomapWorld::applyInflation(const InflationLayer::Result& result) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const unsigned int block_depth = tree_depth - InflationLayer::kBlockLevels;
+  const unsigned int block_shift = 3 * InflationLayer::kBlockLevels;
+  setInflationBlocks(result.occupied_blocks,
+                     octree_->getClampingThresMaxLog());
+  setInflationBlocks(result.free_blocks, octree_->getClampingThresMinLog());
+
+  std::vector<uint64_t> codes;
+  std::vector<std::pair<uint64_t, unsigned int> > deleted_nodes;
+  for (const uint64_t block_code : result.unknown_blocks) {
+    const uint64_t min_code = block_code << block_shift;
+    octree_->deleteNode(KeyBatch::mortonDecode(min_code), block_depth);
+    deleted_nodes.push_back(std::make_pair(min_code, block_depth));
+    codes.push_back(min_code);
   }
+  const bool lazy_eval = true;
+  for (const uint64_t code : result.occupied_codes) {
+    octree_->setNodeValue(KeyBatch::mortonDecode(code),
+                          octree_->getClampingThresMaxLog(), lazy_eval);
+  }
+  for (const uint64_t code : result.free_codes) {
+    octree_->setNodeValue(KeyBatch::mortonDecode(code),
+                          octree_->getClampingThresMinLog(), lazy_eval);
+  }
+  for (const uint64_t code : result.unknown_codes) {
+    octree_->deleteNode(KeyBatch::mortonDecode(code));
+  }
+  codes.insert(codes.end(), result.occupied_codes.begin(),
+               result.occupied_codes.end());
+  codes.insert(codes.end(), result.free_codes.begin(),
+               result.free_codes.end());
+  codes.insert(codes.end(), result.unknown_codes.begin(),
+               result.unknown_codes.end());
+
+  // Deltas can't remove voxels.
+  if (!result.unknown_codes.empty() || !deleted_nodes.empty()) {
+    map_delta_keyframe_needed_ = true;
+  }
+  if (!deleted_nodes.empty()) {
+    handleNodesChanged(deleted_nodes);
+  }
+  if (!codes.empty()) {
+    // Only the paths above the changed keys need to be updated and pruned.
+    updateInnerOccupancy(&codes, true);
+  }
+  // The layer knows about its own changes.
+  inflation_->clearChanged();
+}
 
-  if (lazy_eval) {
-    octree_->updateInnerOccupancy();
+void OctomapWorld::setInflationBlocks(const std::vector<uint64_t>& blocks,
+                                      float log_odds) {
+  const unsigned int block_shift = 3 * InflationLayer::kBlockLevels;
+  KeyBoxUpdate update;
+  update.log_odds = log_odds;
+  update.only_unknown = false;
+  update.prune = true;
+  for (const uint64_t block_code : blocks) {
+    KeyBox box;
+    box.min_key = KeyBatch::mortonDecode(block_code << block_shift);
+    for (int i = 0; i < 3; ++i) {
+      box.max_key[i] = box.min_key[i] + InflationLayer::kBlockSize - 1;
+    }
+    update.boxes.push_back(box);
   }
-  octree_->prune();
+  updateKeyBoxes(&update);
 }
 
 void OctomapWorld::getKeysBoundingBox(
     const Eigen::Vector3d& position, const Eigen::Vector3d& bounding_box_size,
     octomap::KeySet* keys, const BoundHandling& insertion_method) const {
-  const double resolution = octree_->getResolution();
+  CHECK_NOTNULL(keys);
   Eigen::Vector3d bbx_min, bbx_max;
   adjustBoundingBox(position, bounding_box_size, insertion_method, &bbx_min,
                     &bbx_max);
-  Eigen::Vector3d actual_position;
-  octomap::OcTreeKey actual_key;
-  for (double x_position = bbx_min.x(); x_position <= bbx_max.x();
-       x_position += resolution) {
-    for (double y_position = bbx_min.y(); y_position <= bbx_max.y();
-         y_position += resolution) {
-      for (double z_position = bbx_min.z(); z_position <= bbx_max.z();
-           z_position += resolution) {
-        actual_position << x_position, y_position, z_position;
-        coordToKey(actual_position, &actual_key);
-        keys->insert(actual_key);
+  KeyBox box;
+  if (!getKeyBox(bbx_min, bbx_max, &box)) {
+    return;
+  }
+  for (unsigned int x = box.min_key[0]; x <= box.max_key[0]; ++x) {
+    for (unsigned int y = box.min_key[1]; y <= box.max_key[1]; ++y) {
+      for (unsigned int z = box.min_key[2]; z <= box.max_key[2]; ++z) {
+        keys->insert(octomap::OcTreeKey(x, y, z));
       }
     }
   }
@@ -1334,42 +4681,257 @@ bool OctomapWorld::getNearestFreePoint(const Eigen::Vector3d& position,
   }
 
   const double resolution = octree_->getResolution();
+  const double max_bbx_size = getMapSize().maxCoeff();
   double bbx_size = resolution;
   std::vector<std::pair<Eigen::Vector3d, double>> free_box_vector;
   // Find the nearest free boxes, enlarge searching volume around position until
-  // there is something unoccupied
-  while (free_box_vector.empty() && bbx_size < getMapSize().maxCoeff()) {
+  // there is something unoccupied. Doubling the volume (instead of growing it
+  // by one resolution step) keeps the total work linear in the final volume.
+  while (true) {
     getFreeBoxesBoundingBox(position, Eigen::Vector3d::Constant(bbx_size),
                             &free_box_vector);
-    bbx_size += resolution;
+    if (!free_box_vector.empty() || bbx_size >= max_bbx_size) {
+      break;
+    }
+    bbx_size = std::min(2 * bbx_size, max_bbx_size);
   }
   if (free_box_vector.empty()) {
     return false;  // There are no free boxes in the octomap
   }
 
-  // Overestimate minimum distance between desired position and free position
-  double min_distance = bbx_size;
-  Eigen::Vector3d actual_distance;
-  Eigen::Vector3d actual_nearest_position;
-  for (const std::pair<Eigen::Vector3d, double>& free_box : free_box_vector) {
-    // Distance between center of box and position
-    actual_distance = position - free_box.first;
-    // Limit the distance such that it is still in the box
-    actual_distance = actual_distance.cwiseMin(
-        Eigen::Vector3d::Constant(free_box.second / 2 - epsilon));
-    actual_distance = actual_distance.cwiseMax(
-        Eigen::Vector3d::Constant(-free_box.second / 2 + epsilon));
-    // Nearest position to the desired position
-    actual_nearest_position = free_box.first + actual_distance;
-    // Check if this is the best position found so far
-    if ((position - actual_nearest_position).norm() < min_distance) {
-      min_distance = (position - actual_nearest_position).norm();
-      *free_position = actual_nearest_position;
-    }
+  double min_distance = findNearestPointInBoxes(
+      position, free_box_vector, epsilon, free_position);
+  // A closer free box could still be outside of the searched volume, so search
+  // once more in the volume that contains every point closer than the best.
+  if (2 * min_distance > bbx_size) {
+    getFreeBoxesBoundingBox(
+        position, Eigen::Vector3d::Constant(2 * min_distance + resolution),
+        &free_box_vector);
+    findNearestPointInBoxes(position, free_box_vector, epsilon, free_position);
+  }
+  return true;
+}
+
+bool OctomapWorld::getEsdfDistance(const Eigen::Vector3d& position,
+                                   double* distance) const {
+  CHECK_NOTNULL(distance);
+  octomap::OcTreeKey key;
+  if (!esdf_ ||
+      !octree_->coordToKeyChecked(pointEigenToOctomap(position), key)) {
+    return false;
+  }
+  *distance = esdf_->getDistance(key);
+  if (*distance > 0.0 && isKeyInsideEsdfObstacle(key)) {
+    *distance = 0.0;
+  }
+  return true;
+}
+
+bool OctomapWorld::getEsdfDistanceAndGradient(const Eigen::Vector3d& position,
+                                              double* distance,
+                                              Eigen::Vector3d* gradient) const {
+  CHECK_NOTNULL(distance);
+  CHECK_NOTNULL(gradient);
+  octomap::OcTreeKey key;
+  if (!esdf_ ||
+      !octree_->coordToKeyChecked(pointEigenToOctomap(position), key)) {
+    return false;
+  }
+  *distance = esdf_->getDistanceAndGradient(key, gradient);
+  if (*distance > 0.0 && isKeyInsideEsdfObstacle(key)) {
+    *distance = 0.0;
+    gradient->setZero();
   }
   return true;
 }
 
+bool OctomapWorld::isBoxObstacleFreeInEsdf(
+    const Eigen::Vector3d& center,
+    const Eigen::Vector3d& bounding_box_size) const {
+  octomap::OcTreeKey key;
+  if (!esdf_ ||
+      !octree_->coordToKeyChecked(pointEigenToOctomap(center), key)) {
+    return false;
+  }
+  // An occupied voxel overlapping the box has its center within half the box
+  // plus half a voxel of the box center (on every axis), and the box center
+  // is at most half a voxel diagonal from the center of its own voxel. The
+  // brushfire distances are only quasi-Euclidean and can overestimate the
+  // true ones, so they get another voxel of slack.
+  const double resolution = octree_->getResolution();
+  const double radius =
+      (bounding_box_size.cwiseAbs() / 2 +
+       Eigen::Vector3d::Constant(resolution / 2)).norm() +
+      std::sqrt(3.0) * resolution / 2 + resolution;
+  if (radius >= esdf_->getMaxDistance()) {
+    return false;
+  }
+  return esdf_->getDistance(key) > radius && !isKeyInsideEsdfObstacle(key);
+}
+
+bool OctomapWorld::isKeyInsideEsdfObstacle(
+    const octomap::OcTreeKey& key) const {
+  const PooledOcTreeNode* node = octree_->search(key);
+  return node != NULL && octree_->isNodeOccupied(node);
+}
+
+void OctomapWorld::updateEsdf(const std::vector<uint64_t>& codes) {
+  CHECK(esdf_);
+  for (const uint64_t code : codes) {
+    const octomap::OcTreeKey key = KeyBatch::mortonDecode(code);
+    const PooledOcTreeNode* node = octree_->search(key);
+    if (node != NULL && octree_->isNodeOccupied(node)) {
+      esdf_->setOccupied(key);
+    } else {
+      setEsdfNodeFree(code, octree_->getTreeDepth());
+    }
+  }
+  esdf_->update();
+}
+
+void OctomapWorld::setEsdfNodeOccupied(uint64_t min_code, unsigned int depth) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const octomap::OcTreeKey min_key = KeyBatch::mortonDecode(min_code);
+  if (depth == tree_depth) {
+    esdf_->setOccupied(min_key);
+    return;
+  }
+  // Nodes up to the root, which is too big for a key_type.
+  const unsigned int size = 1 << (tree_depth - depth);
+  const octomap::OcTreeKey max_key(min_key[0] + size - 1, min_key[1] + size - 1,
+                                   min_key[2] + size - 1);
+  esdf_->setOccupiedBoxSurface(min_key, max_key);
+  eraseEsdfCoarseNodes(min_code, depth);
+  if (depth + 2 <= tree_depth) {
+    esdf_coarse_nodes_[depth].insert(min_code >> (3 * (tree_depth - depth)));
+  }
+}
+
+void OctomapWorld::setEsdfNodeFree(uint64_t min_code, unsigned int depth) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  // Coarse nodes around the node aren't occupied as a whole anymore, so the
+  // tree split them up. Their new surfaces are added from the tree below.
+  std::vector<std::pair<uint64_t, unsigned int> > split_nodes;
+  for (unsigned int d = 0; d < depth && d < esdf_coarse_nodes_.size(); ++d) {
+    if (esdf_coarse_nodes_[d].empty()) {
+      continue;
+    }
+    const unsigned int shift = 3 * (tree_depth - d);
+    if (esdf_coarse_nodes_[d].erase(min_code >> shift) > 0) {
+      split_nodes.push_back(
+          std::make_pair((min_code >> shift) << shift, d));
+    }
+  }
+  eraseEsdfCoarseNodes(min_code, depth);
+
+  const octomap::OcTreeKey min_key = KeyBatch::mortonDecode(min_code);
+  if (depth == tree_depth) {
+    esdf_->setFree(min_key);
+  } else {
+    const unsigned int size = 1 << (tree_depth - depth);
+    esdf_->setBoxFree(min_key, octomap::OcTreeKey(min_key[0] + size - 1,
+                                                  min_key[1] + size - 1,
+                                                  min_key[2] + size - 1));
+  }
+  for (const std::pair<uint64_t, unsigned int>& node : split_nodes) {
+    addEsdfOccupiedLeaves(node.first, node.second);
+  }
+}
+
+void OctomapWorld::addEsdfOccupiedLeaves(uint64_t min_code,
+                                         unsigned int depth) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const octomap::OcTreeKey min_key = KeyBatch::mortonDecode(min_code);
+  const PooledOcTreeNode* node = octree_->getRoot();
+  for (unsigned int d = 0; d < depth && node != NULL; ++d) {
+    if (!octree_->nodeHasChildren(node)) {
+      // A leaf bigger than the node.
+      if (octree_->isNodeOccupied(node)) {
+        const unsigned int shift = 3 * (tree_depth - d);
+        setEsdfNodeOccupied((min_code >> shift) << shift, d);
+      }
+      return;
+    }
+    const unsigned int child_index =
+        octomap::computeChildIdx(min_key, tree_depth - 1 - d);
+    node = octree_->nodeChildExists(node, child_index)
+               ? octree_->getNodeChild(node, child_index)
+               : NULL;
+  }
+  if (node == NULL) {
+    return;
+  }
+  std::vector<std::pair<uint64_t, unsigned int> > occupied_nodes;
+  appendOccupiedLeaves(*octree_, node, min_key, depth, &occupied_nodes);
+  for (const std::pair<uint64_t, unsigned int>& occupied_node :
+       occupied_nodes) {
+    setEsdfNodeOccupied(occupied_node.first, occupied_node.second);
+  }
+}
+
+void OctomapWorld::eraseEsdfCoarseNodes(uint64_t min_code,
+                                        unsigned int depth) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const uint64_t max_code =
+      min_code + ((uint64_t(1) << (3 * (tree_depth - depth))) - 1);
+  for (unsigned int d = depth; d < esdf_coarse_nodes_.size(); ++d) {
+    std::set<uint64_t>& nodes = esdf_coarse_nodes_[d];
+    if (nodes.empty()) {
+      continue;
+    }
+    const unsigned int shift = 3 * (tree_depth - d);
+    nodes.erase(nodes.lower_bound(min_code >> shift),
+                nodes.upper_bound(max_code >> shift));
+  }
+}
+
+void OctomapWorld::handleMapReplaced() {
+  // Maps read in the full format come with the occupancy of the inner nodes,
+  // but not with their summaries of unknown space.
+  octree_->updateInnerOccupancy();
+  // Consumers of the changes have to read the new map as a whole.
+  octree_->enableChangeDetection(params_.change_detection_enabled);
+  octree_->resetChangeDetection();
+  change_journal_.invalidate();
+  rebuildEsdf();
+  if (inflation_) {
+    inflation_->clear();
+  }
+  all_visualization_blocks_changed_ = true;
+  all_tiles_changed_ = true;
+  map_delta_keyframe_needed_ = true;
+}
+
+void OctomapWorld::rebuildEsdf() {
+  if (!params_.use_esdf) {
+    esdf_.reset();
+    esdf_coarse_nodes_.clear();
+    return;
+  }
+  if (!esdf_ || esdf_->getResolution() != octree_->getResolution() ||
+      esdf_->getMaxDistance() != params_.esdf_max_distance) {
+    esdf_.reset(
+        new EsdfLayer(octree_->getResolution(), params_.esdf_max_distance));
+  } else {
+    esdf_->clear();
+  }
+
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  esdf_coarse_nodes_.assign(tree_depth - 1, std::set<uint64_t>());
+  for (PooledOcTree::leaf_iterator it = octree_->begin_leafs(),
+                                      end = octree_->end_leafs();
+       it != end; ++it) {
+    if (!octree_->isNodeOccupied(*it)) {
+      continue;
+    }
+    octomap::OcTreeKey min_key, max_key;
+    getNodeKeyRange(it.getKey(), it.getDepth(), tree_depth, &min_key,
+                    &max_key);
+    setEsdfNodeOccupied(KeyBatch::mortonEncode(min_key), it.getDepth());
+  }
+  esdf_->update();
+}
+
 void OctomapWorld::setRobotSize(const Eigen::Vector3d& robot_size) {
   robot_size_ = robot_size;
 }
@@ -1384,23 +4946,27 @@ bool OctomapWorld::checkCollisionWithRobot(
 bool OctomapWorld::checkPathForCollisionsWithRobot(
     const std::vector<Eigen::Vector3d>& robot_positions,
     size_t* collision_index) {
-  // Iterate over vector of poses.
-  // Check each one.
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kCollisionCheck);
   // Return when a collision is found, and return the index of the earliest
   // collision.
-  for (size_t i = 0; i < robot_positions.size(); ++i) {
-    if (checkSinglePoseCollision(robot_positions[i])) {
-      if (collision_index != nullptr) {
-        *collision_index = i;
-      }
-      return true;
-    }
+  const size_t i = findFirstPoseCollision(robot_positions);
+  if (i == robot_positions.size()) {
+    return false;
   }
-  return false;
+  if (collision_index != nullptr) {
+    *collision_index = i;
+  }
+  return true;
 }
 
 bool OctomapWorld::checkSinglePoseCollision(
     const Eigen::Vector3d& robot_position) const {
+  // Without unknown space to consider, a box far enough from any obstacle in
+  // the distance field is free.
+  if (!params_.treat_unknown_as_occupied &&
+      isBoxObstacleFreeInEsdf(robot_position, robot_size_)) {
+    return false;
+  }
   if (params_.treat_unknown_as_occupied) {
     return (CellStatus::kFree !=
             getCellStatusBoundingBox(robot_position, robot_size_));
@@ -1410,33 +4976,131 @@ bool OctomapWorld::checkSinglePoseCollision(
   }
 }
 
-void OctomapWorld::getChangedPoints(
-    std::vector<Eigen::Vector3d>* changed_points,
+bool OctomapWorld::checkPathsForCollisionsWithRobot(
+    const std::vector<std::vector<Eigen::Vector3d> >& paths,
+    std::vector<size_t>* collision_indices) {
+  OCTOMAP_WORLD_TIMER(&instrumentation_, kCollisionCheck);
+  CHECK_NOTNULL(collision_indices);
+  collision_indices->resize(paths.size());
+
+  const size_t num_threads = std::max<size_t>(
+      1u, std::min<size_t>(params_.num_collision_check_threads, paths.size()));
+  // Paths can be of very different lengths (and collide early or not at all),
+  // so threads take the next unchecked path instead of a fixed chunk.
+  std::atomic<size_t> next_path(0);
+  std::atomic<bool> any_collision(false);
+  auto check_paths = [this, &paths, collision_indices, &next_path,
+                      &any_collision]() {
+    for (size_t i = next_path++; i < paths.size(); i = next_path++) {
+      (*collision_indices)[i] = findFirstPoseCollision(paths[i]);
+      if ((*collision_indices)[i] < paths[i].size()) {
+        any_collision = true;
+      }
+    }
+  };
+
+  if (num_threads <= 1) {
+    check_paths();
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_threads; ++i) {
+      threads.emplace_back(check_paths);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+  return any_collision;
+}
+
+size_t OctomapWorld::findFirstPoseCollision(
+    const std::vector<Eigen::Vector3d>& robot_positions) const {
+  // The query of the previous pose, which didn't collide. Only valid if it
+  // searched the tree.
+  BoundingBoxQuery queries[2];
+  const BoundingBoxQuery* checked = NULL;
+  for (size_t i = 0; i < robot_positions.size(); ++i) {
+    if (!params_.treat_unknown_as_occupied &&
+        isBoxObstacleFreeInEsdf(robot_positions[i], robot_size_)) {
+      checked = NULL;
+      continue;
+    }
+    BoundingBoxQuery* query = &queries[i % 2];
+    const CellStatus status = getCellStatusBoundingBoxOutside(
+        robot_positions[i], robot_size_, checked, query);
+    // The same decision as checkSinglePoseCollision().
+    if (params_.treat_unknown_as_occupied ? status != CellStatus::kFree
+                                          : status == CellStatus::kOccupied) {
+      return i;
+    }
+    checked = query->has_occupied_box ? query : NULL;
+  }
+  return robot_positions.size();
+}
+
+bool OctomapWorld::getChangedPointsForConsumer(
+    const std::string& consumer, std::vector<Eigen::Vector3d>* changed_points,
     std::vector<bool>* changed_states) {
   CHECK_NOTNULL(changed_points);
-  // These keys are always *leaf node* keys, even if the actual change was in
-  // a larger cube (see Octomap docs).
-  octomap::KeyBoolMap::const_iterator start_key = octree_->changedKeysBegin();
-  octomap::KeyBoolMap::const_iterator end_key = octree_->changedKeysEnd();
+  updateChangeJournal();
+  std::vector<ChangeJournal::Change> changes;
+  const bool complete =
+      change_journal_.getChangesForConsumer(consumer, &changes);
 
   changed_points->clear();
+  changed_points->reserve(changes.size());
   if (changed_states != NULL) {
     changed_states->clear();
+    changed_states->reserve(changes.size());
   }
-
-  for (octomap::KeyBoolMap::const_iterator iter = start_key; iter != end_key;
-       ++iter) {
-    octomap::OcTreeNode* node = octree_->search(iter->first);
-    bool occupied = octree_->isNodeOccupied(node);
-    Eigen::Vector3d center =
-        pointOctomapToEigen(octree_->keyToCoord(iter->first));
-
-    changed_points->push_back(center);
+  for (const ChangeJournal::Change& change : changes) {
+    changed_points->push_back(
+        pointOctomapToEigen(octree_->keyToCoord(change.key)));
     if (changed_states != NULL) {
-      changed_states->push_back(occupied);
+      changed_states->push_back(change.occupied);
     }
   }
+  return complete;
+}
+
+void OctomapWorld::getChangedPoints(
+    std::vector<Eigen::Vector3d>* changed_points,
+    std::vector<bool>* changed_states) {
+  getChangedPointsForConsumer("", changed_points, changed_states);
+}
+
+bool OctomapWorld::getChangesSince(uint64_t version,
+                                   std::vector<ChangeJournal::Change>* changes,
+                                   uint64_t* next_version) {
+  updateChangeJournal();
+  return change_journal_.getChangesSince(version, changes, next_version);
+}
+
+uint64_t OctomapWorld::getChangeVersion() {
+  updateChangeJournal();
+  return change_journal_.getVersion();
+}
+
+void OctomapWorld::updateChangeJournal() {
+  // These keys are always *leaf node* keys, even if the actual change was in
+  // a larger cube (see Octomap docs). Looking them up in Morton order lets
+  // the searches share the paths from the root.
+  std::vector<uint64_t> codes;
+  codes.reserve(octree_->numChangesDetected());
+  for (octomap::KeyBoolMap::const_iterator it = octree_->changedKeysBegin(),
+                                           end = octree_->changedKeysEnd();
+       it != end; ++it) {
+    codes.push_back(KeyBatch::mortonEncode(it->first));
+  }
   octree_->resetChangeDetection();
+  std::sort(codes.begin(), codes.end());
+
+  NodePathCache cache(*octree_);
+  for (const uint64_t code : codes) {
+    const octomap::OcTreeKey key = KeyBatch::mortonDecode(code);
+    const PooledOcTreeNode* node = cache.search(key);
+    change_journal_.append(key, node != NULL && octree_->isNodeOccupied(node));
+  }
 }
 
 void OctomapWorld::coordToKey(const Eigen::Vector3d& coord,
@@ -0,0 +1,615 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Benchmarks for the insertion and query hot paths of OctomapWorld on
+// synthetic sensor data. Run with --benchmark_format=json (or
+// --benchmark_out=<file> --benchmark_out_format=json) to get results that can
+// be compared across releases.
+
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include "octomap_world/block_hash_world.h"
+#include "octomap_world/octomap_world.h"
+
+namespace volumetric_mapping {
+namespace {
+
+// All sensors sit inside an empty box-shaped room centered at the origin.
+const Eigen::Vector3d kRoomHalfSize(10.0, 10.0, 3.0);
+
+// Distance from the origin to the room walls along a unit direction.
+double rangeToWall(const Eigen::Vector3d& direction) {
+  double range = std::numeric_limits<double>::max();
+  for (int i = 0; i < 3; ++i) {
+    if (std::fabs(direction[i]) > 1e-9) {
+      range = std::min(range, kRoomHalfSize[i] / std::fabs(direction[i]));
+    }
+  }
+  return range;
+}
+
+// Spinning lidar: 64 beams between -25 and 15 degrees elevation, 1024 points
+// per revolution.
+pcl::PointCloud<pcl::PointXYZ> generateLidarCloud() {
+  const int kNumBeams = 64;
+  const int kNumAzimuths = 1024;
+  pcl::PointCloud<pcl::PointXYZ> cloud;
+  cloud.reserve(kNumBeams * kNumAzimuths);
+  for (int beam = 0; beam < kNumBeams; ++beam) {
+    const double elevation =
+        (-25.0 + 40.0 * beam / (kNumBeams - 1)) * M_PI / 180.0;
+    for (int i = 0; i < kNumAzimuths; ++i) {
+      const double azimuth = 2.0 * M_PI * i / kNumAzimuths;
+      const Eigen::Vector3d direction(std::cos(elevation) * std::cos(azimuth),
+                                      std::cos(elevation) * std::sin(azimuth),
+                                      std::sin(elevation));
+      const Eigen::Vector3d point = direction * rangeToWall(direction);
+      cloud.push_back(pcl::PointXYZ(point.x(), point.y(), point.z()));
+    }
+  }
+  return cloud;
+}
+
+// Depth camera looking along x with a 90 x 74 degree field of view (at 4:3).
+pcl::PointCloud<pcl::PointXYZ> generateDepthCameraCloud(int width,
+                                                        int height) {
+  const double focal_length = 0.5 * width;
+  pcl::PointCloud<pcl::PointXYZ> cloud;
+  cloud.reserve(width * height);
+  for (int v = 0; v < height; ++v) {
+    for (int u = 0; u < width; ++u) {
+      const Eigen::Vector3d direction =
+          Eigen::Vector3d(focal_length, u - 0.5 * width, v - 0.5 * height)
+              .normalized();
+      const Eigen::Vector3d point = direction * rangeToWall(direction);
+      cloud.push_back(pcl::PointXYZ(point.x(), point.y(), point.z()));
+    }
+  }
+  return cloud;
+}
+
+// Q matrix for a rectified stereo pair with a 0.1 m baseline and the
+// principal point in the image center.
+Eigen::Matrix4d generateQ(int width, int height) {
+  const double focal_length = 0.5 * width;
+  const double baseline = 0.1;
+  Eigen::Matrix4d Q = Eigen::Matrix4d::Zero();
+  Q(0, 0) = 1.0;
+  Q(0, 3) = -0.5 * width;
+  Q(1, 1) = 1.0;
+  Q(1, 3) = -0.5 * height;
+  Q(2, 3) = focal_length;
+  Q(3, 2) = 1.0 / baseline;
+  return Q;
+}
+
+// Disparity image of the room walls, as seen by the camera of generateQ().
+cv::Mat generateDisparityImage(int width, int height) {
+  const double focal_length = 0.5 * width;
+  const double baseline = 0.1;
+  cv::Mat disparity(height, width, CV_32FC1);
+  for (int v = 0; v < height; ++v) {
+    float* row_pointer = disparity.ptr<float>(v);
+    for (int u = 0; u < width; ++u) {
+      // Camera frame: z forward, x right, y down.
+      const Eigen::Vector3d ray(u - 0.5 * width, v - 0.5 * height,
+                                focal_length);
+      const Eigen::Vector3d direction = ray.normalized();
+      const double depth = rangeToWall(direction) * direction.z();
+      row_pointer[u] = focal_length * baseline / depth;
+    }
+  }
+  return disparity;
+}
+
+OctomapParameters makeParameters(double resolution, double sensor_max_range) {
+  OctomapParameters params;
+  params.resolution = resolution;
+  params.sensor_max_range = sensor_max_range;
+  return params;
+}
+
+// A map of the room from a few lidar scans, shared by the query benchmarks.
+// Benchmarks that change the parameters work on a copy.
+OctomapWorld* getQueryWorld() {
+  static OctomapWorld* world = nullptr;
+  if (world == nullptr) {
+    world = new OctomapWorld(makeParameters(0.1, 20.0));
+    const pcl::PointCloud<pcl::PointXYZ> cloud = generateLidarCloud();
+    for (int i = 0; i < 4; ++i) {
+      const Transformation T_G_sensor(
+          Eigen::Quaterniond::Identity(),
+          Eigen::Vector3d(2.0 * i - 3.0, 0.5 * i, 0.0));
+      pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_copy(
+          new pcl::PointCloud<pcl::PointXYZ>(cloud));
+      world->insertPointcloud(T_G_sensor, cloud_copy);
+    }
+    world->setRobotSize(Eigen::Vector3d(0.6, 0.6, 0.3));
+  }
+  return world;
+}
+
+BlockHashParameters makeBlockHashParameters(double resolution,
+                                            double sensor_max_range) {
+  BlockHashParameters params;
+  params.resolution = resolution;
+  params.sensor_max_range = sensor_max_range;
+  return params;
+}
+
+// The map of getQueryWorld() in a BlockHashWorld.
+BlockHashWorld* getBlockHashQueryWorld() {
+  static BlockHashWorld* world = nullptr;
+  if (world == nullptr) {
+    world = new BlockHashWorld(makeBlockHashParameters(0.1, 20.0));
+    const pcl::PointCloud<pcl::PointXYZ> cloud = generateLidarCloud();
+    for (int i = 0; i < 4; ++i) {
+      const Transformation T_G_sensor(
+          Eigen::Quaterniond::Identity(),
+          Eigen::Vector3d(2.0 * i - 3.0, 0.5 * i, 0.0));
+      pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_copy(
+          new pcl::PointCloud<pcl::PointXYZ>(cloud));
+      world->insertPointcloud(T_G_sensor, cloud_copy);
+    }
+    world->setRobotSize(Eigen::Vector3d(0.6, 0.6, 0.3));
+  }
+  return world;
+}
+
+std::vector<Eigen::Vector3d> generateRandomPositions(size_t num_positions) {
+  std::mt19937 generator(42);
+  std::uniform_real_distribution<double> x(-9.0, 9.0), y(-9.0, 9.0),
+      z(-2.5, 2.5);
+  std::vector<Eigen::Vector3d> positions;
+  for (size_t i = 0; i < num_positions; ++i) {
+    positions.push_back(Eigen::Vector3d(x(generator), y(generator),
+                                        z(generator)));
+  }
+  return positions;
+}
+
+// Arguments: sensor pattern (0: lidar, 1: depth camera), resolution in cm,
+// sensor_max_range in m.
+void BM_InsertPointcloud(benchmark::State& state) {
+  const pcl::PointCloud<pcl::PointXYZ> cloud =
+      state.range(0) == 0 ? generateLidarCloud()
+                          : generateDepthCameraCloud(640, 480);
+  sensor_msgs::PointCloud2::Ptr cloud_msg(new sensor_msgs::PointCloud2);
+  pcl::toROSMsg(cloud, *cloud_msg);
+  OctomapWorld world(makeParameters(state.range(1) / 100.0,
+                                    static_cast<double>(state.range(2))));
+  const Transformation T_G_sensor;
+
+  for (auto _ : state) {
+    world.insertPointcloud(T_G_sensor, cloud_msg);
+  }
+  state.SetItemsProcessed(state.iterations() * cloud.size());
+  state.SetLabel(state.range(0) == 0 ? "lidar" : "depth_camera");
+}
+BENCHMARK(BM_InsertPointcloud)
+    ->ArgsProduct({{0, 1}, {5, 10, 20}, {5, 20}})
+    ->Unit(benchmark::kMillisecond);
+
+// Same through the PCL interface, which transforms a copy of the cloud.
+void BM_InsertPointcloudPcl(benchmark::State& state) {
+  const pcl::PointCloud<pcl::PointXYZ> cloud = generateLidarCloud();
+  OctomapWorld world(makeParameters(0.1, 20.0));
+  const Transformation T_G_sensor;
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_copy(
+        new pcl::PointCloud<pcl::PointXYZ>(cloud));
+    state.ResumeTiming();
+    world.insertPointcloud(T_G_sensor, cloud_copy);
+  }
+  state.SetItemsProcessed(state.iterations() * cloud.size());
+}
+BENCHMARK(BM_InsertPointcloudPcl)->Unit(benchmark::kMillisecond);
+
+// Loading a pointcloud as a map, as the manager does for .pcd and .ply files.
+// Argument: number of load threads.
+void BM_InsertOccupiedKeys(benchmark::State& state) {
+  const pcl::PointCloud<pcl::PointXYZ> cloud =
+      generateDepthCameraCloud(640, 480);
+  OctomapParameters params = makeParameters(0.05, 20.0);
+  params.num_load_threads = state.range(0);
+  KeyBatch key_batch;
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    OctomapWorld world(params);
+    state.ResumeTiming();
+    world.computeOccupiedKeys(cloud, &key_batch);
+    world.insertOccupiedKeys(&key_batch);
+  }
+  state.SetItemsProcessed(state.iterations() * cloud.size());
+}
+BENCHMARK(BM_InsertOccupiedKeys)
+    ->Arg(1)
+    ->Arg(4)
+    ->Unit(benchmark::kMillisecond);
+
+// Arguments: image width and height.
+void BM_InsertDisparityImage(benchmark::State& state) {
+  const int width = state.range(0);
+  const int height = state.range(1);
+  const cv::Mat disparity = generateDisparityImage(width, height);
+  const Eigen::Matrix4d Q = generateQ(width, height);
+  const Eigen::Vector2d full_image_size(width, height);
+  OctomapWorld world(makeParameters(0.1, 5.0));
+  const Transformation T_G_sensor;
+
+  for (auto _ : state) {
+    world.insertDisparityImage(T_G_sensor, disparity, Q, full_image_size);
+  }
+  state.SetItemsProcessed(state.iterations() * width * height);
+}
+BENCHMARK(BM_InsertDisparityImage)
+    ->Args({640, 480})
+    ->Args({1280, 720})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_GetCellStatusBoundingBox(benchmark::State& state) {
+  const OctomapWorld* world = getQueryWorld();
+  const std::vector<Eigen::Vector3d> positions =
+      generateRandomPositions(1024);
+  const Eigen::Vector3d box_size(1.0, 1.0, 0.5);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        world->getCellStatusBoundingBox(positions[i], box_size));
+    i = (i + 1) % positions.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetCellStatusBoundingBox);
+
+void BM_GetLineStatusBoundingBox(benchmark::State& state) {
+  const OctomapWorld* world = getQueryWorld();
+  const std::vector<Eigen::Vector3d> positions =
+      generateRandomPositions(1024);
+  const Eigen::Vector3d box_size(0.6, 0.6, 0.3);
+  size_t i = 0;
+  for (auto _ : state) {
+    const Eigen::Vector3d& start = positions[i];
+    const Eigen::Vector3d end = start + Eigen::Vector3d(2.0, 0.0, 0.0);
+    benchmark::DoNotOptimize(
+        world->getLineStatusBoundingBox(start, end, box_size));
+    i = (i + 1) % positions.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetLineStatusBoundingBox);
+
+// Argument: node size of the coarse queries in cm.
+void BM_GetCellStatusBoundingBoxAtDepth(benchmark::State& state) {
+  const OctomapWorld* world = getQueryWorld();
+  const unsigned int depth =
+      world->getDepthForNodeSize(static_cast<double>(state.range(0)) / 100.0);
+  const std::vector<Eigen::Vector3d> positions =
+      generateRandomPositions(1024);
+  const Eigen::Vector3d box_size(1.0, 1.0, 0.5);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        world->getCellStatusBoundingBoxAtDepth(positions[i], box_size, depth));
+    i = (i + 1) % positions.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetCellStatusBoundingBoxAtDepth)->Arg(40)->Arg(160);
+
+// Argument: node size of the coarse queries in cm.
+void BM_GetLineStatusAtDepth(benchmark::State& state) {
+  const OctomapWorld* world = getQueryWorld();
+  const unsigned int depth =
+      world->getDepthForNodeSize(static_cast<double>(state.range(0)) / 100.0);
+  const std::vector<Eigen::Vector3d> positions =
+      generateRandomPositions(1024);
+  size_t i = 0;
+  for (auto _ : state) {
+    const Eigen::Vector3d& start = positions[i];
+    const Eigen::Vector3d end = start + Eigen::Vector3d(10.0, 0.0, 0.0);
+    benchmark::DoNotOptimize(world->getLineStatusAtDepth(start, end, depth));
+    i = (i + 1) % positions.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetLineStatusAtDepth)->Arg(10)->Arg(40)->Arg(160);
+
+// Argument: number of poses on the path.
+void BM_CheckPathForCollisionsWithRobot(benchmark::State& state) {
+  OctomapWorld* world = getQueryWorld();
+  std::vector<Eigen::Vector3d> path;
+  for (int i = 0; i < state.range(0); ++i) {
+    path.push_back(
+        Eigen::Vector3d(-8.0 + 16.0 * i / state.range(0), 1.0, 0.0));
+  }
+  for (auto _ : state) {
+    size_t collision_index = 0;
+    benchmark::DoNotOptimize(
+        world->checkPathForCollisionsWithRobot(path, &collision_index));
+  }
+  state.SetItemsProcessed(state.iterations() * path.size());
+}
+BENCHMARK(BM_CheckPathForCollisionsWithRobot)->Arg(10)->Arg(100);
+
+// Arguments: number of paths, number of collision check threads.
+void BM_CheckPathsForCollisionsWithRobot(benchmark::State& state) {
+  OctomapWorld world(*getQueryWorld());
+  OctomapParameters params;
+  world.getOctomapParameters(&params);
+  params.num_collision_check_threads = state.range(1);
+  world.setOctomapParameters(params);
+
+  const std::vector<Eigen::Vector3d> starts =
+      generateRandomPositions(state.range(0));
+  std::vector<std::vector<Eigen::Vector3d> > paths(starts.size());
+  for (size_t i = 0; i < starts.size(); ++i) {
+    for (int j = 0; j < 100; ++j) {
+      paths[i].push_back(starts[i] + Eigen::Vector3d(0.02 * j, 0.0, 0.0));
+    }
+  }
+
+  std::vector<size_t> collision_indices;
+  size_t num_poses = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        world.checkPathsForCollisionsWithRobot(paths, &collision_indices));
+    for (size_t collision_index : collision_indices) {
+      num_poses += collision_index;
+    }
+  }
+  state.SetItemsProcessed(num_poses);
+}
+BENCHMARK(BM_CheckPathsForCollisionsWithRobot)
+    ->ArgsProduct({{16, 256}, {1, 4}});
+
+// Argument: number of visibility threads.
+void BM_GetVisibilityBatch(benchmark::State& state) {
+  OctomapWorld world(*getQueryWorld());
+  OctomapParameters params;
+  world.getOctomapParameters(&params);
+  params.num_visibility_threads = state.range(0);
+  world.setOctomapParameters(params);
+
+  // All voxels of a 4m cube in front of the view point.
+  const Eigen::Vector3d view_point(0.0, 0.0, 0.0);
+  std::vector<Eigen::Vector3d> voxels;
+  for (double x = 1.0; x < 5.0; x += 0.1) {
+    for (double y = -2.0; y < 2.0; y += 0.1) {
+      for (double z = -2.0; z < 2.0; z += 0.1) {
+        voxels.push_back(Eigen::Vector3d(x, y, z));
+      }
+    }
+  }
+  for (auto _ : state) {
+    OctomapWorld::VisibilityCounts counts;
+    world.getVisibilityBatch(view_point, voxels, false, NULL, &counts);
+    benchmark::DoNotOptimize(counts.num_unknown);
+  }
+  state.SetItemsProcessed(state.iterations() * voxels.size());
+}
+BENCHMARK(BM_GetVisibilityBatch)->Arg(1)->Arg(4);
+
+// Argument: safety space in cm.
+void BM_InflateOccupied(benchmark::State& state) {
+  const Eigen::Vector3d safety_space =
+      Eigen::Vector3d::Constant(state.range(0) / 100.0);
+  for (auto _ : state) {
+    state.PauseTiming();
+    OctomapWorld world(*getQueryWorld());
+    state.ResumeTiming();
+    world.inflateOccupied(safety_space);
+  }
+}
+BENCHMARK(BM_InflateOccupied)->Arg(30)->Arg(100)->Unit(benchmark::kMillisecond);
+
+// Inflation again after each scan, which only goes over the changed blocks.
+void BM_InflateOccupiedIncremental(benchmark::State& state) {
+  OctomapWorld world(*getQueryWorld());
+  const Eigen::Vector3d safety_space(0.6, 0.6, 0.3);
+  world.inflateOccupied(safety_space);
+  const pcl::PointCloud<pcl::PointXYZ> cloud =
+      generateDepthCameraCloud(160, 120);
+  sensor_msgs::PointCloud2::Ptr cloud_msg(new sensor_msgs::PointCloud2);
+  pcl::toROSMsg(cloud, *cloud_msg);
+  const Transformation T_G_sensor;
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    world.insertPointcloud(T_G_sensor, cloud_msg);
+    state.ResumeTiming();
+    world.inflateOccupied(safety_space);
+  }
+}
+BENCHMARK(BM_InflateOccupiedIncremental)->Unit(benchmark::kMillisecond);
+
+// Argument: number of export threads.
+void BM_GenerateMarkerArray(benchmark::State& state) {
+  OctomapWorld world(*getQueryWorld());
+  OctomapParameters params;
+  world.getOctomapParameters(&params);
+  params.num_export_threads = state.range(0);
+  world.setOctomapParameters(params);
+  for (auto _ : state) {
+    visualization_msgs::MarkerArray occupied_nodes, free_nodes;
+    world.generateMarkerArray("world", &occupied_nodes, &free_nodes);
+    benchmark::DoNotOptimize(occupied_nodes);
+  }
+}
+BENCHMARK(BM_GenerateMarkerArray)
+    ->Arg(1)
+    ->Arg(4)
+    ->Unit(benchmark::kMillisecond);
+
+// Argument: number of export threads.
+void BM_GetOccupiedPointCloud(benchmark::State& state) {
+  OctomapWorld world(*getQueryWorld());
+  OctomapParameters params;
+  world.getOctomapParameters(&params);
+  params.num_export_threads = state.range(0);
+  world.setOctomapParameters(params);
+  for (auto _ : state) {
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    world.getOccupiedPointCloud(&cloud);
+    benchmark::DoNotOptimize(cloud.points.data());
+  }
+}
+BENCHMARK(BM_GetOccupiedPointCloud)
+    ->Arg(1)
+    ->Arg(4)
+    ->Unit(benchmark::kMillisecond);
+
+// Argument: node size of the markers in cm.
+void BM_GenerateMarkerArrayAtDepth(benchmark::State& state) {
+  OctomapWorld* world = getQueryWorld();
+  const unsigned int depth =
+      world->getDepthForNodeSize(static_cast<double>(state.range(0)) / 100.0);
+  for (auto _ : state) {
+    visualization_msgs::MarkerArray occupied_nodes, free_nodes;
+    world->generateMarkerArrayAtDepth("world", depth, &occupied_nodes,
+                                      &free_nodes);
+    benchmark::DoNotOptimize(occupied_nodes);
+  }
+}
+BENCHMARK(BM_GenerateMarkerArrayAtDepth)
+    ->Arg(40)
+    ->Arg(160)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_GetOctomapBinaryMsg(benchmark::State& state) {
+  const OctomapWorld* world = getQueryWorld();
+  for (auto _ : state) {
+    octomap_msgs::Octomap msg;
+    world->getOctomapBinaryMsg(&msg);
+    benchmark::DoNotOptimize(msg);
+  }
+}
+BENCHMARK(BM_GetOctomapBinaryMsg)->Unit(benchmark::kMillisecond);
+
+void BM_WriteOctomapToBinaryStream(benchmark::State& state) {
+  const OctomapWorld* world = getQueryWorld();
+  int64_t bytes_written = 0;
+  for (auto _ : state) {
+    std::stringstream stream;
+    world->writeOctomapToBinaryConst(stream);
+    bytes_written += stream.tellp();
+  }
+  state.SetBytesProcessed(bytes_written);
+}
+BENCHMARK(BM_WriteOctomapToBinaryStream)->Unit(benchmark::kMillisecond);
+
+// The same insertions and queries on the block hash map.
+void BM_BlockHashInsertPointcloud(benchmark::State& state) {
+  const pcl::PointCloud<pcl::PointXYZ> cloud =
+      state.range(0) == 0 ? generateLidarCloud()
+                          : generateDepthCameraCloud(640, 480);
+  sensor_msgs::PointCloud2::Ptr cloud_msg(new sensor_msgs::PointCloud2);
+  pcl::toROSMsg(cloud, *cloud_msg);
+  BlockHashWorld world(makeBlockHashParameters(
+      state.range(1) / 100.0, static_cast<double>(state.range(2))));
+  const Transformation T_G_sensor;
+
+  for (auto _ : state) {
+    world.insertPointcloud(T_G_sensor, cloud_msg);
+  }
+  state.SetItemsProcessed(state.iterations() * cloud.size());
+  state.SetLabel(state.range(0) == 0 ? "lidar" : "depth_camera");
+}
+BENCHMARK(BM_BlockHashInsertPointcloud)
+    ->ArgsProduct({{0, 1}, {5, 10, 20}, {5, 20}})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_BlockHashGetCellStatusBoundingBox(benchmark::State& state) {
+  const BlockHashWorld* world = getBlockHashQueryWorld();
+  const std::vector<Eigen::Vector3d> positions =
+      generateRandomPositions(1024);
+  const Eigen::Vector3d box_size(1.0, 1.0, 0.5);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        world->getCellStatusBoundingBox(positions[i], box_size));
+    i = (i + 1) % positions.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BlockHashGetCellStatusBoundingBox);
+
+void BM_BlockHashGetLineStatusBoundingBox(benchmark::State& state) {
+  const BlockHashWorld* world = getBlockHashQueryWorld();
+  const std::vector<Eigen::Vector3d> positions =
+      generateRandomPositions(1024);
+  const Eigen::Vector3d box_size(0.6, 0.6, 0.3);
+  size_t i = 0;
+  for (auto _ : state) {
+    const Eigen::Vector3d& start = positions[i];
+    const Eigen::Vector3d end = start + Eigen::Vector3d(2.0, 0.0, 0.0);
+    benchmark::DoNotOptimize(
+        world->getLineStatusBoundingBox(start, end, box_size));
+    i = (i + 1) % positions.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BlockHashGetLineStatusBoundingBox);
+
+void BM_BlockHashCheckPathForCollisionsWithRobot(benchmark::State& state) {
+  BlockHashWorld* world = getBlockHashQueryWorld();
+  const std::vector<Eigen::Vector3d> path =
+      generateRandomPositions(state.range(0));
+  size_t collision_index = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        world->checkPathForCollisionsWithRobot(path, &collision_index));
+  }
+  state.SetItemsProcessed(state.iterations() * path.size());
+}
+BENCHMARK(BM_BlockHashCheckPathForCollisionsWithRobot)->Arg(10)->Arg(100);
+
+void BM_BlockHashGetOctomapBinaryMsg(benchmark::State& state) {
+  const BlockHashWorld* world = getBlockHashQueryWorld();
+  for (auto _ : state) {
+    octomap_msgs::Octomap msg;
+    world->getOctomapBinaryMsg(&msg);
+    benchmark::DoNotOptimize(msg);
+  }
+}
+BENCHMARK(BM_BlockHashGetOctomapBinaryMsg)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace volumetric_mapping
+
+BENCHMARK_MAIN();
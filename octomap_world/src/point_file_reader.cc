@@ -0,0 +1,294 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/point_file_reader.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <glog/logging.h>
+
+namespace volumetric_mapping {
+
+namespace {
+
+// Binary files are read as little-endian, which they are when written on the
+// platforms this runs on.
+double readCoordinate(const char* point, size_t byte_offset, size_t size) {
+  if (size == sizeof(double)) {
+    double value;
+    std::memcpy(&value, point + byte_offset, sizeof(value));
+    return value;
+  }
+  float value;
+  std::memcpy(&value, point + byte_offset, sizeof(value));
+  return value;
+}
+
+// Size in bytes of a PLY property type, 0 if unknown.
+size_t getPlyTypeSize(const std::string& type) {
+  if (type == "char" || type == "uchar" || type == "int8" ||
+      type == "uint8") {
+    return 1;
+  }
+  if (type == "short" || type == "ushort" || type == "int16" ||
+      type == "uint16") {
+    return 2;
+  }
+  if (type == "int" || type == "uint" || type == "int32" ||
+      type == "uint32" || type == "float" || type == "float32") {
+    return 4;
+  }
+  if (type == "double" || type == "float64") {
+    return 8;
+  }
+  return 0;
+}
+
+// Reads the next line without the line ending.
+bool getLine(std::ifstream* file, std::string* line) {
+  if (!std::getline(*file, *line)) {
+    return false;
+  }
+  if (!line->empty() && (*line)[line->size() - 1] == '\r') {
+    line->erase(line->size() - 1);
+  }
+  return true;
+}
+
+}  // namespace
+
+PointFileReader::PointFileReader()
+    : binary_(false),
+      num_points_(0),
+      num_points_read_(0),
+      point_bytes_(0),
+      point_columns_(0) {
+  std::fill(has_coordinate_, has_coordinate_ + 3, false);
+}
+
+bool PointFileReader::open(const std::string& file_path) {
+  file_.open(file_path.c_str(), std::ios::in | std::ios::binary);
+  if (!file_.is_open() || !getLine(&file_, &line_)) {
+    return false;
+  }
+  const bool header_read = line_ == "ply" ? readPlyHeader() : readPcdHeader();
+  return header_read && has_coordinate_[0] && has_coordinate_[1] &&
+         has_coordinate_[2];
+}
+
+bool PointFileReader::readPcdHeader() {
+  std::vector<std::string> names, types;
+  std::vector<size_t> sizes, counts;
+  size_t width = 0, height = 1;
+  bool has_num_points = false;
+  // The first line was read by open(), and is a comment or the version.
+  while (getLine(&file_, &line_)) {
+    std::istringstream stream(line_);
+    std::string keyword;
+    if (!(stream >> keyword) || keyword[0] == '#') {
+      continue;
+    }
+    if (keyword == "FIELDS") {
+      for (std::string name; stream >> name;) {
+        names.push_back(name);
+      }
+    } else if (keyword == "SIZE") {
+      for (size_t size; stream >> size;) {
+        sizes.push_back(size);
+      }
+    } else if (keyword == "TYPE") {
+      for (std::string type; stream >> type;) {
+        types.push_back(type);
+      }
+    } else if (keyword == "COUNT") {
+      for (size_t count; stream >> count;) {
+        counts.push_back(count);
+      }
+    } else if (keyword == "WIDTH") {
+      stream >> width;
+    } else if (keyword == "HEIGHT") {
+      stream >> height;
+    } else if (keyword == "POINTS") {
+      has_num_points = static_cast<bool>(stream >> num_points_);
+    } else if (keyword == "DATA") {
+      std::string data;
+      stream >> data;
+      if (data != "ascii" && data != "binary") {
+        return false;
+      }
+      binary_ = data == "binary";
+      if (!has_num_points) {
+        num_points_ = width * height;
+      }
+      if (counts.empty()) {
+        counts.resize(names.size(), 1);
+      }
+      if (sizes.size() != names.size() || types.size() != names.size() ||
+          counts.size() != names.size()) {
+        return false;
+      }
+      for (size_t i = 0; i < names.size(); ++i) {
+        if (!addField(names[i], sizes[i], types[i] == "F", counts[i])) {
+          return false;
+        }
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PointFileReader::readPlyHeader() {
+  bool in_vertices = false;
+  bool has_vertices = false;
+  while (getLine(&file_, &line_)) {
+    std::istringstream stream(line_);
+    std::string keyword;
+    if (!(stream >> keyword)) {
+      continue;
+    }
+    if (keyword == "format") {
+      std::string format;
+      stream >> format;
+      if (format != "ascii" && format != "binary_little_endian") {
+        return false;
+      }
+      binary_ = format == "binary_little_endian";
+    } else if (keyword == "element") {
+      std::string name;
+      stream >> name;
+      in_vertices = name == "vertex";
+      if (in_vertices) {
+        stream >> num_points_;
+        has_vertices = true;
+      } else if (!has_vertices) {
+        // The data of the element would come before the vertices.
+        return false;
+      }
+    } else if (keyword == "property" && in_vertices) {
+      std::string type, name;
+      stream >> type >> name;
+      const size_t size = getPlyTypeSize(type);
+      if (size == 0) {
+        return false;
+      }
+      const bool floating_point = type == "float" || type == "float32" ||
+                                  type == "double" || type == "float64";
+      if (!addField(name, size, floating_point, 1)) {
+        return false;
+      }
+    } else if (keyword == "end_header") {
+      return has_vertices;
+    }
+  }
+  return false;
+}
+
+bool PointFileReader::addField(const std::string& name, size_t size,
+                               bool floating_point, size_t count) {
+  const int axis = name == "x" ? 0 : name == "y" ? 1 : name == "z" ? 2 : -1;
+  if (axis >= 0) {
+    if (!floating_point || count != 1 ||
+        (size != sizeof(float) && size != sizeof(double))) {
+      return false;
+    }
+    coordinates_[axis].byte_offset = point_bytes_;
+    coordinates_[axis].column = point_columns_;
+    coordinates_[axis].size = size;
+    has_coordinate_[axis] = true;
+  }
+  point_bytes_ += size * count;
+  point_columns_ += count;
+  return true;
+}
+
+bool PointFileReader::readPoints(size_t max_points,
+                                 pcl::PointCloud<pcl::PointXYZ>* cloud) {
+  CHECK_NOTNULL(cloud)->clear();
+  const size_t num_points =
+      std::min(max_points, num_points_ - num_points_read_);
+  if (num_points == 0) {
+    return false;
+  }
+  cloud->reserve(num_points);
+  const bool success = binary_ ? readBinaryPoints(num_points, cloud)
+                               : readAsciiPoints(num_points, cloud);
+  return success && !cloud->empty();
+}
+
+bool PointFileReader::readBinaryPoints(size_t num_points,
+                                       pcl::PointCloud<pcl::PointXYZ>* cloud) {
+  buffer_.resize(num_points * point_bytes_);
+  file_.read(&buffer_[0], buffer_.size());
+  const size_t num_points_in_file = file_.gcount() / point_bytes_;
+  for (size_t i = 0; i < num_points_in_file; ++i) {
+    const char* point = &buffer_[i * point_bytes_];
+    float values[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      values[axis] = readCoordinate(point, coordinates_[axis].byte_offset,
+                                    coordinates_[axis].size);
+    }
+    cloud->push_back(pcl::PointXYZ(values[0], values[1], values[2]));
+  }
+  num_points_read_ += num_points_in_file;
+  return num_points_in_file == num_points;
+}
+
+bool PointFileReader::readAsciiPoints(size_t num_points,
+                                      pcl::PointCloud<pcl::PointXYZ>* cloud) {
+  const size_t num_columns =
+      1 + std::max(coordinates_[0].column,
+                   std::max(coordinates_[1].column, coordinates_[2].column));
+  std::vector<double> columns(num_columns);
+  while (cloud->size() < num_points && getLine(&file_, &line_)) {
+    const char* begin = line_.c_str();
+    // Skips blank lines.
+    if (line_.find_first_not_of(" \t") == std::string::npos) {
+      continue;
+    }
+    for (size_t i = 0; i < num_columns; ++i) {
+      char* end;
+      columns[i] = std::strtod(begin, &end);
+      if (end == begin) {
+        return false;
+      }
+      begin = end;
+    }
+    cloud->push_back(pcl::PointXYZ(columns[coordinates_[0].column],
+                                   columns[coordinates_[1].column],
+                                   columns[coordinates_[2].column]));
+    ++num_points_read_;
+  }
+  return cloud->size() == num_points;
+}
+
+}  // namespace volumetric_mapping
@@ -0,0 +1,319 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/pooled_octree.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+#include <glog/logging.h>
+
+namespace volumetric_mapping {
+
+static_assert(sizeof(PooledOcTreeNode) == sizeof(octomap::OcTreeNode),
+              "The summary of unknown space should fit into the padding.");
+
+NodePool::NodePool(size_t object_size)
+    : object_size_(
+          (std::max(object_size, sizeof(FreeObject)) + sizeof(void*) - 1) /
+          sizeof(void*) * sizeof(void*)),
+      header_size_((sizeof(SlabHeader) + object_size_ - 1) / object_size_ *
+                   object_size_),
+      free_list_(NULL),
+      unused_begin_(NULL),
+      unused_end_(NULL),
+      num_used_(0),
+      num_free_(0),
+      max_num_used_(0) {
+  CHECK_LT(header_size_ + object_size_, kSlabSize);
+}
+
+NodePool::~NodePool() {
+  LOG_IF(WARNING, num_used_ > 0)
+      << "Destroying a node pool with " << num_used_ << " nodes in use.";
+  for (char* slab : slabs_) {
+    free(slab);
+  }
+}
+
+void* NodePool::allocate() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  void* object;
+  if (free_list_ != NULL) {
+    object = free_list_;
+    free_list_ = free_list_->next;
+    --num_free_;
+  } else {
+    if (unused_begin_ + object_size_ > unused_end_) {
+      addSlab();
+    }
+    object = unused_begin_;
+    unused_begin_ += object_size_;
+  }
+  ++getSlab(object)->num_used;
+  ++num_used_;
+  max_num_used_ = std::max(max_num_used_, num_used_);
+  return object;
+}
+
+void NodePool::deallocate(void* object) {
+  if (object == NULL) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  FreeObject* free_object = static_cast<FreeObject*>(object);
+  free_object->next = free_list_;
+  free_list_ = free_object;
+  ++num_free_;
+  --getSlab(object)->num_used;
+  --num_used_;
+}
+
+void NodePool::trim() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<char*> empty_slabs;
+  for (char* slab : slabs_) {
+    if (reinterpret_cast<SlabHeader*>(slab)->num_used == 0) {
+      empty_slabs.push_back(slab);
+    }
+  }
+  if (empty_slabs.empty()) {
+    return;
+  }
+  std::sort(empty_slabs.begin(), empty_slabs.end());
+
+  // Drop the free objects of the empty slabs from the free list.
+  FreeObject* kept_list = NULL;
+  FreeObject** kept_end = &kept_list;
+  num_free_ = 0;
+  for (FreeObject* object = free_list_; object != NULL;
+       object = object->next) {
+    char* slab = reinterpret_cast<char*>(getSlab(object));
+    if (!std::binary_search(empty_slabs.begin(), empty_slabs.end(), slab)) {
+      *kept_end = object;
+      kept_end = &object->next;
+      ++num_free_;
+    }
+  }
+  *kept_end = NULL;
+  free_list_ = kept_list;
+
+  if (unused_begin_ != NULL &&
+      std::binary_search(empty_slabs.begin(), empty_slabs.end(),
+                         reinterpret_cast<char*>(getSlab(unused_begin_)))) {
+    unused_begin_ = NULL;
+    unused_end_ = NULL;
+  }
+  std::vector<char*> kept_slabs;
+  for (char* slab : slabs_) {
+    if (std::binary_search(empty_slabs.begin(), empty_slabs.end(), slab)) {
+      free(slab);
+    } else {
+      kept_slabs.push_back(slab);
+    }
+  }
+  slabs_.swap(kept_slabs);
+}
+
+NodePoolStats NodePool::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  NodePoolStats stats;
+  stats.num_slabs = slabs_.size();
+  stats.allocated_bytes = slabs_.size() * kSlabSize;
+  stats.num_used = num_used_;
+  stats.num_free = num_free_;
+  stats.max_num_used = max_num_used_;
+  return stats;
+}
+
+NodePool::SlabHeader* NodePool::getSlab(const void* object) const {
+  return reinterpret_cast<SlabHeader*>(reinterpret_cast<uintptr_t>(object) &
+                                       ~static_cast<uintptr_t>(kSlabSize - 1));
+}
+
+void NodePool::addSlab() {
+  void* slab = NULL;
+  if (posix_memalign(&slab, kSlabSize, kSlabSize) != 0) {
+    throw std::bad_alloc();
+  }
+  reinterpret_cast<SlabHeader*>(slab)->num_used = 0;
+  slabs_.push_back(static_cast<char*>(slab));
+  unused_begin_ = static_cast<char*>(slab) + header_size_;
+  // Leaves out the rest that doesn't fit a whole object.
+  unused_end_ = unused_begin_ +
+                (kSlabSize - header_size_) / object_size_ * object_size_;
+}
+
+void* PooledOcTreeNode::operator new(size_t size) {
+  // Classes derived from this one don't fit the pool.
+  if (size != sizeof(PooledOcTreeNode)) {
+    return ::operator new(size);
+  }
+  return getPool().allocate();
+}
+
+void PooledOcTreeNode::operator delete(void* node, size_t size) {
+  if (size != sizeof(PooledOcTreeNode)) {
+    ::operator delete(node);
+    return;
+  }
+  getPool().deallocate(node);
+}
+
+NodePool& PooledOcTreeNode::getPool() {
+  // Never destroyed, since trees might outlive it otherwise.
+  static NodePool* pool = new NodePool(sizeof(PooledOcTreeNode));
+  return *pool;
+}
+
+void PooledOcTreeNode::releaseChildren() {
+  delete[] children;
+  children = NULL;
+}
+
+void PooledOcTreeNode::updateOccupancyChildren() {
+  octomap::OcTreeNode::updateOccupancyChildren();
+  has_unknown_ = false;
+  if (children == NULL) {
+    return;
+  }
+  for (unsigned int i = 0; i < 8; ++i) {
+    const PooledOcTreeNode* child =
+        static_cast<const PooledOcTreeNode*>(children[i]);
+    if (child == NULL || (child->hasChildren() && child->has_unknown_)) {
+      has_unknown_ = true;
+      return;
+    }
+  }
+}
+
+bool PooledOcTreeNode::hasChildren() const {
+  if (children == NULL) {
+    return false;
+  }
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (children[i] != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+PooledOcTree::PooledOcTree(double resolution)
+    : octomap::OccupancyOcTreeBase<PooledOcTreeNode>(resolution) {}
+
+PooledOcTree::PooledOcTree(const PooledOcTree& rhs)
+    : octomap::OccupancyOcTreeBase<PooledOcTreeNode>(rhs.resolution) {
+  // The copy constructors of octomap allocate the children as octomap's own
+  // node type, so the nodes are copied here instead.
+  clamping_thres_min = rhs.clamping_thres_min;
+  clamping_thres_max = rhs.clamping_thres_max;
+  prob_hit_log = rhs.prob_hit_log;
+  prob_miss_log = rhs.prob_miss_log;
+  occ_prob_thres_log = rhs.occ_prob_thres_log;
+  useBBXLimit(rhs.bbxSet());
+  octomap::point3d bbx_min = rhs.getBBXMin();
+  octomap::point3d bbx_max = rhs.getBBXMax();
+  setBBXMin(bbx_min);
+  setBBXMax(bbx_max);
+  use_change_detection = rhs.use_change_detection;
+  changed_keys = rhs.changed_keys;
+
+  if (rhs.root != NULL) {
+    root = new PooledOcTreeNode();
+    tree_size = 1;
+    copyNodeRecurs(rhs, rhs.root, root);
+    size_changed = true;
+  }
+}
+
+PooledOcTreeNode* PooledOcTree::createRoot() {
+  CHECK(root == NULL);
+  root = new PooledOcTreeNode();
+  ++tree_size;
+  size_changed = true;
+  return root;
+}
+
+void PooledOcTree::deleteNodeChildRecurs(PooledOcTreeNode* node,
+                                         unsigned int child_index) {
+  deleteNodeChildren(getNodeChild(node, child_index));
+  deleteNodeChild(node, child_index);
+}
+
+void PooledOcTree::deleteNodeChildren(PooledOcTreeNode* node) {
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (nodeChildExists(node, i)) {
+      deleteNodeChildRecurs(node, i);
+    }
+  }
+  node->releaseChildren();
+}
+
+void PooledOcTree::registerLeafChange(const octomap::OcTreeKey& key,
+                                      bool created, bool was_occupied,
+                                      bool is_occupied) {
+  if (!use_change_detection) {
+    return;
+  }
+  if (created) {
+    changed_keys.insert(std::make_pair(key, true));
+    return;
+  }
+  if (was_occupied == is_occupied) {
+    return;
+  }
+  // A leaf that flips back has no change left, unless it was created.
+  octomap::KeyBoolMap::iterator it = changed_keys.find(key);
+  if (it == changed_keys.end()) {
+    changed_keys.insert(std::make_pair(key, false));
+  } else if (!it->second) {
+    changed_keys.erase(it);
+  }
+}
+
+void PooledOcTree::copyNodeRecurs(const PooledOcTree& rhs,
+                                  const PooledOcTreeNode* src,
+                                  PooledOcTreeNode* dst) {
+  dst->setLogOdds(src->getLogOdds());
+  dst->has_unknown_ = src->has_unknown_;
+  if (!rhs.nodeHasChildren(src)) {
+    return;
+  }
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (rhs.nodeChildExists(src, i)) {
+      copyNodeRecurs(rhs, rhs.getNodeChild(src, i), createNodeChild(dst, i));
+    }
+  }
+}
+
+}  // namespace volumetric_mapping
@@ -0,0 +1,314 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/tiled_map_storage.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <glog/logging.h>
+
+namespace volumetric_mapping {
+
+namespace {
+
+const char kMagic[8] = {'O', 'C', 'T', 'T', 'I', 'L', 'E', '1'};
+
+std::string indexPath(const std::string& directory) {
+  return directory + "/tiles.idx";
+}
+
+std::string dataPath(const std::string& directory) {
+  return directory + "/tiles.dat";
+}
+
+bool entryCodeLess(const TiledMapStorage::TileEntry& lhs,
+                   const TiledMapStorage::TileEntry& rhs) {
+  return lhs.code < rhs.code;
+}
+
+}  // namespace
+
+TiledMapStorage::TiledMapStorage()
+    : resolution_(0.0),
+      tree_depth_(0),
+      tile_levels_(0),
+      index_data_(NULL),
+      index_size_(0),
+      entries_(NULL),
+      num_entries_(0),
+      data_fd_(-1) {
+  static_assert(sizeof(TileEntry) == 24, "Unexpected padding in TileEntry.");
+  static_assert(sizeof(Header) == 32, "Unexpected padding in Header.");
+}
+
+TiledMapStorage::~TiledMapStorage() { close(); }
+
+bool TiledMapStorage::open(const std::string& directory) {
+  close();
+  const std::string index_path = indexPath(directory);
+  const int index_fd = ::open(index_path.c_str(), O_RDONLY);
+  if (index_fd < 0) {
+    LOG(ERROR) << "Could not open " << index_path << ": " << strerror(errno);
+    return false;
+  }
+  struct stat index_stat;
+  if (fstat(index_fd, &index_stat) != 0 ||
+      static_cast<size_t>(index_stat.st_size) < sizeof(Header)) {
+    LOG(ERROR) << index_path << " is not a tile index.";
+    ::close(index_fd);
+    return false;
+  }
+  index_size_ = index_stat.st_size;
+  index_data_ = mmap(NULL, index_size_, PROT_READ, MAP_SHARED, index_fd, 0);
+  // The mapping stays valid without the descriptor.
+  ::close(index_fd);
+  if (index_data_ == MAP_FAILED) {
+    LOG(ERROR) << "Could not map " << index_path << ": " << strerror(errno);
+    index_data_ = NULL;
+    index_size_ = 0;
+    return false;
+  }
+
+  Header header;
+  memcpy(&header, index_data_, sizeof(Header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      index_size_ !=
+          sizeof(Header) + header.num_entries * sizeof(TileEntry)) {
+    LOG(ERROR) << index_path << " is not a tile index.";
+    close();
+    return false;
+  }
+
+  const std::string data_path = dataPath(directory);
+  data_fd_ = ::open(data_path.c_str(), O_RDONLY);
+  if (data_fd_ < 0) {
+    LOG(ERROR) << "Could not open " << data_path << ": " << strerror(errno);
+    close();
+    return false;
+  }
+
+  directory_ = directory;
+  resolution_ = header.resolution;
+  tree_depth_ = header.tree_depth;
+  tile_levels_ = header.tile_levels;
+  num_entries_ = header.num_entries;
+  entries_ = reinterpret_cast<const TileEntry*>(
+      static_cast<const char*>(index_data_) + sizeof(Header));
+  return true;
+}
+
+void TiledMapStorage::close() {
+  if (index_data_ != NULL) {
+    munmap(index_data_, index_size_);
+  }
+  if (data_fd_ >= 0) {
+    ::close(data_fd_);
+  }
+  index_data_ = NULL;
+  index_size_ = 0;
+  entries_ = NULL;
+  num_entries_ = 0;
+  data_fd_ = -1;
+}
+
+bool TiledMapStorage::create(const std::string& directory, double resolution,
+                             unsigned int tree_depth, unsigned int tile_levels,
+                             std::vector<Tile>* tiles) {
+  CHECK_NOTNULL(tiles);
+  CHECK_LE(tile_levels, tree_depth);
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    LOG(ERROR) << "Could not create " << directory << ": " << strerror(errno);
+    return false;
+  }
+  close();
+  if (!appendData(directory, true, tiles)) {
+    return false;
+  }
+  std::vector<TileEntry> entries;
+  entries.reserve(tiles->size());
+  for (const Tile& tile : *tiles) {
+    entries.push_back(tile.entry);
+  }
+  return writeIndex(directory, resolution, tree_depth, tile_levels,
+                    &entries) &&
+         open(directory);
+}
+
+bool TiledMapStorage::update(const std::vector<size_t>& removed_entries,
+                             std::vector<Tile>* tiles) {
+  CHECK_NOTNULL(tiles);
+  CHECK(isOpen());
+  if (!appendData(directory_, false, tiles)) {
+    return false;
+  }
+  std::vector<bool> removed(num_entries_, false);
+  for (const size_t index : removed_entries) {
+    CHECK_LT(index, num_entries_);
+    removed[index] = true;
+  }
+  std::vector<TileEntry> entries;
+  entries.reserve(num_entries_ + tiles->size());
+  for (size_t i = 0; i < num_entries_; ++i) {
+    if (!removed[i]) {
+      entries.push_back(entries_[i]);
+    }
+  }
+  for (const Tile& tile : *tiles) {
+    entries.push_back(tile.entry);
+  }
+  // Copy, as open() replaces the members.
+  const std::string directory = directory_;
+  return writeIndex(directory, resolution_, tree_depth_, tile_levels_,
+                    &entries) &&
+         open(directory);
+}
+
+uint64_t TiledMapStorage::getNumCodes(const TileEntry& entry) const {
+  return uint64_t(1) << (3 * (tree_depth_ - tile_levels_ - entry.depth));
+}
+
+bool TiledMapStorage::findEntry(uint64_t code, size_t* index) const {
+  CHECK_NOTNULL(index);
+  size_t begin, end;
+  findEntries(code, code, &begin, &end);
+  if (begin == end) {
+    return false;
+  }
+  *index = begin;
+  return true;
+}
+
+void TiledMapStorage::findEntries(uint64_t min_code, uint64_t max_code,
+                                  size_t* begin, size_t* end) const {
+  CHECK_NOTNULL(begin);
+  CHECK_NOTNULL(end);
+  TileEntry key;
+  key.code = max_code;
+  const TileEntry* last = std::upper_bound(entries_, entries_ + num_entries_,
+                                           key, entryCodeLess);
+  key.code = min_code;
+  const TileEntry* first =
+      std::lower_bound(entries_, entries_ + num_entries_, key, entryCodeLess);
+  // Entries don't overlap, so only the one before can reach into the range.
+  if (first != entries_) {
+    const TileEntry& previous = *(first - 1);
+    if (previous.code + getNumCodes(previous) > min_code) {
+      --first;
+    }
+  }
+  *begin = first - entries_;
+  *end = std::max(first, last) - entries_;
+}
+
+bool TiledMapStorage::readTile(size_t index, std::string* data) const {
+  CHECK_NOTNULL(data);
+  CHECK_LT(index, num_entries_);
+  const TileEntry& entry = entries_[index];
+  data->resize(entry.size);
+  size_t num_read = 0;
+  while (num_read < entry.size) {
+    const ssize_t result =
+        pread(data_fd_, &(*data)[num_read], entry.size - num_read,
+              entry.offset + num_read);
+    if (result <= 0) {
+      LOG(ERROR) << "Could not read tile " << entry.code << " from "
+                 << dataPath(directory_) << ".";
+      return false;
+    }
+    num_read += result;
+  }
+  return true;
+}
+
+bool TiledMapStorage::writeIndex(const std::string& directory,
+                                 double resolution, unsigned int tree_depth,
+                                 unsigned int tile_levels,
+                                 std::vector<TileEntry>* entries) const {
+  std::sort(entries->begin(), entries->end(), entryCodeLess);
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.resolution = resolution;
+  header.tree_depth = tree_depth;
+  header.tile_levels = tile_levels;
+  header.num_entries = entries->size();
+
+  // Readers that mapped the old index keep seeing it until they reopen.
+  const std::string index_path = indexPath(directory);
+  const std::string temporary_path = index_path + ".tmp";
+  {
+    std::ofstream stream(temporary_path.c_str(),
+                         std::ios::binary | std::ios::trunc);
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    stream.write(reinterpret_cast<const char*>(entries->data()),
+                 entries->size() * sizeof(TileEntry));
+    if (!stream) {
+      LOG(ERROR) << "Could not write " << temporary_path << ".";
+      return false;
+    }
+  }
+  if (rename(temporary_path.c_str(), index_path.c_str()) != 0) {
+    LOG(ERROR) << "Could not replace " << index_path << ": "
+               << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool TiledMapStorage::appendData(const std::string& directory, bool truncate,
+                                 std::vector<Tile>* tiles) {
+  const std::string data_path = dataPath(directory);
+  std::ofstream stream(
+      data_path.c_str(),
+      std::ios::binary | (truncate ? std::ios::trunc : std::ios::app));
+  stream.seekp(0, std::ios::end);
+  uint64_t offset = stream.tellp();
+  for (Tile& tile : *tiles) {
+    tile.entry.offset = offset;
+    tile.entry.size = tile.data.size();
+    stream.write(tile.data.data(), tile.data.size());
+    offset += tile.data.size();
+  }
+  stream.flush();
+  if (!stream) {
+    LOG(ERROR) << "Could not write " << data_path << ".";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace volumetric_mapping
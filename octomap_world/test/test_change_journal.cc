@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstdint>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <octomap/octomap.h>
+
+#include "octomap_world/change_journal.h"
+
+namespace volumetric_mapping {
+
+namespace {
+
+octomap::OcTreeKey makeKey(int i) {
+  return octomap::OcTreeKey(32768 + i, 32768 - i, 32768 + 2 * i);
+}
+
+// Checks that the changes are the ones of the keys from first_key on, with
+// even keys occupied, as appended by appendChanges().
+void expectChanges(const std::vector<ChangeJournal::Change>& changes,
+                   int first_key, int num_keys) {
+  ASSERT_EQ(static_cast<size_t>(num_keys), changes.size());
+  for (int i = 0; i < num_keys; ++i) {
+    EXPECT_TRUE(changes[i].key == makeKey(first_key + i)) << "change " << i;
+    EXPECT_EQ((first_key + i) % 2 == 0, changes[i].occupied) << "change " << i;
+  }
+}
+
+void appendChanges(int first_key, int num_keys, ChangeJournal* journal) {
+  for (int i = first_key; i < first_key + num_keys; ++i) {
+    journal->append(makeKey(i), i % 2 == 0);
+  }
+}
+
+}  // namespace
+
+TEST(ChangeJournalTest, KeepsTheLatestChanges) {
+  ChangeJournal journal(4);
+  appendChanges(0, 6, &journal);
+  EXPECT_EQ(6u, journal.getVersion());
+  EXPECT_EQ(2u, journal.getOldestVersion());
+
+  std::vector<ChangeJournal::Change> changes;
+  uint64_t next_version = 0;
+  EXPECT_TRUE(journal.getChangesSince(3, &changes, &next_version));
+  expectChanges(changes, 3, 3);
+  EXPECT_EQ(6u, next_version);
+
+  // Overwritten changes are lost, and the rest is returned.
+  changes.clear();
+  EXPECT_FALSE(journal.getChangesSince(1, &changes, &next_version));
+  expectChanges(changes, 2, 4);
+
+  changes.clear();
+  EXPECT_TRUE(journal.getChangesSince(6, &changes, &next_version));
+  EXPECT_TRUE(changes.empty());
+  // Versions newer than the journal, e.g. of a previous map, are lost too.
+  EXPECT_FALSE(journal.getChangesSince(7, &changes, &next_version));
+  expectChanges(changes, 2, 4);
+}
+
+TEST(ChangeJournalTest, InvalidateLosesChanges) {
+  ChangeJournal journal(100);
+  std::vector<ChangeJournal::Change> changes;
+  appendChanges(0, 3, &journal);
+  EXPECT_TRUE(journal.getChangesForConsumer("behind", &changes));
+  EXPECT_TRUE(journal.getChangesForConsumer("up_to_date", &changes));
+  appendChanges(3, 2, &journal);
+  changes.clear();
+  EXPECT_TRUE(journal.getChangesForConsumer("up_to_date", &changes));
+  expectChanges(changes, 3, 2);
+
+  journal.invalidate();
+  appendChanges(5, 1, &journal);
+  // Up to date or not, all have to read the whole map again, and only get
+  // the changes after it was replaced.
+  for (const char* consumer : {"behind", "up_to_date"}) {
+    changes.clear();
+    EXPECT_FALSE(journal.getChangesForConsumer(consumer, &changes))
+        << consumer;
+    expectChanges(changes, 5, 1);
+    changes.clear();
+    EXPECT_TRUE(journal.getChangesForConsumer(consumer, &changes)) << consumer;
+    EXPECT_TRUE(changes.empty()) << consumer;
+  }
+
+  // Even without new changes.
+  journal.invalidate();
+  EXPECT_FALSE(journal.getChangesForConsumer("up_to_date", &changes));
+  EXPECT_TRUE(changes.empty());
+}
+
+TEST(ChangeJournalTest, NewConsumersStartAtTheBeginning) {
+  ChangeJournal journal(4);
+  std::vector<ChangeJournal::Change> changes;
+  appendChanges(0, 3, &journal);
+  EXPECT_TRUE(journal.getChangesForConsumer("first", &changes));
+  expectChanges(changes, 0, 3);
+
+  // Reading doesn't take the changes away from other consumers.
+  changes.clear();
+  EXPECT_TRUE(journal.getChangesForConsumer("second", &changes));
+  expectChanges(changes, 0, 3);
+
+  // Once the journal wrapped, a new consumer missed the first changes.
+  appendChanges(3, 2, &journal);
+  changes.clear();
+  EXPECT_FALSE(journal.getChangesForConsumer("third", &changes));
+  expectChanges(changes, 1, 4);
+  changes.clear();
+  EXPECT_TRUE(journal.getChangesForConsumer("first", &changes));
+  expectChanges(changes, 3, 2);
+
+  // A removed consumer starts over.
+  journal.removeConsumer("first");
+  changes.clear();
+  EXPECT_FALSE(journal.getChangesForConsumer("first", &changes));
+  expectChanges(changes, 1, 4);
+}
+
+TEST(ChangeJournalTest, ZeroCapacityLosesAllChanges) {
+  ChangeJournal journal;
+  std::vector<ChangeJournal::Change> changes;
+  EXPECT_TRUE(journal.getChangesForConsumer("consumer", &changes));
+  appendChanges(0, 3, &journal);
+  EXPECT_FALSE(journal.getChangesForConsumer("consumer", &changes));
+  EXPECT_TRUE(changes.empty());
+}
+
+}  // namespace volumetric_mapping
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
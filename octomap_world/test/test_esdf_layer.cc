@@ -0,0 +1,213 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <Eigen/Core>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <octomap/octomap.h>
+
+#include "octomap_world/esdf_layer.h"
+
+namespace volumetric_mapping {
+
+namespace {
+
+const double kResolution = 0.1;
+const double kMaxDistance = 1.0;
+const int kCenter = 32768;
+
+octomap::OcTreeKey makeKey(int x, int y, int z) {
+  return octomap::OcTreeKey(kCenter + x, kCenter + y, kCenter + z);
+}
+
+int squaredDistance(const octomap::OcTreeKey& a, const octomap::OcTreeKey& b) {
+  int distance_sq = 0;
+  for (int i = 0; i < 3; ++i) {
+    distance_sq += (a[i] - b[i]) * (a[i] - b[i]);
+  }
+  return distance_sq;
+}
+
+// Distance to the closest of the obstacles, capped like the layer does.
+double getBruteForceDistance(const octomap::OcTreeKey& key,
+                             const std::vector<octomap::OcTreeKey>& obstacles) {
+  int min_distance_sq = std::numeric_limits<int>::max();
+  for (const octomap::OcTreeKey& obstacle : obstacles) {
+    min_distance_sq = std::min(min_distance_sq, squaredDistance(key, obstacle));
+  }
+  return std::min(kMaxDistance, std::sqrt(min_distance_sq) * kResolution);
+}
+
+}  // namespace
+
+TEST(EsdfLayerTest, SingleObstacle) {
+  EsdfLayer layer(kResolution, kMaxDistance);
+  const octomap::OcTreeKey obstacle = makeKey(0, 0, 0);
+  layer.setOccupied(obstacle);
+  layer.update();
+  EXPECT_EQ(1u, layer.getNumObstacles());
+  EXPECT_TRUE(layer.isOccupied(obstacle));
+
+  const int max_distance_sq = 100;
+  for (int x = -12; x <= 12; ++x) {
+    for (int y = -12; y <= 12; ++y) {
+      for (int z = -12; z <= 12; ++z) {
+        const octomap::OcTreeKey key = makeKey(x, y, z);
+        const int distance_sq = x * x + y * y + z * z;
+        octomap::OcTreeKey obstacle_key;
+        if (distance_sq <= max_distance_sq) {
+          EXPECT_NEAR(std::sqrt(distance_sq) * kResolution,
+                      layer.getDistance(key), 1e-9);
+          ASSERT_TRUE(layer.getClosestObstacle(key, &obstacle_key));
+          EXPECT_TRUE(obstacle_key == obstacle);
+        } else {
+          EXPECT_EQ(kMaxDistance, layer.getDistance(key));
+          EXPECT_FALSE(layer.getClosestObstacle(key, &obstacle_key));
+        }
+      }
+    }
+  }
+
+  Eigen::Vector3d gradient;
+  EXPECT_NEAR(0.5, layer.getDistanceAndGradient(makeKey(5, 0, 0), &gradient),
+              1e-9);
+  EXPECT_NEAR(0.0, (gradient - Eigen::Vector3d::UnitX()).norm(), 1e-9);
+
+  // Removing the obstacle removes the whole field around it.
+  layer.setFree(obstacle);
+  layer.update();
+  EXPECT_EQ(0u, layer.getNumObstacles());
+  EXPECT_EQ(0u, layer.getNumVoxels());
+  EXPECT_EQ(kMaxDistance, layer.getDistance(makeKey(1, 0, 0)));
+}
+
+// Brushfire only passes obstacles on to neighbors, so a distance can be a bit
+// longer than the true one, but never shorter, and always to an obstacle.
+TEST(EsdfLayerTest, IncrementalUpdatesMatchBruteForce) {
+  const int half_size = 10;
+  std::mt19937 random(0);
+  std::uniform_int_distribution<int> offset(-half_size, half_size);
+  EsdfLayer layer(kResolution, kMaxDistance);
+  std::vector<octomap::OcTreeKey> obstacles;
+
+  for (int round = 0; round < 5; ++round) {
+    // Free some of the obstacles and add new ones.
+    std::shuffle(obstacles.begin(), obstacles.end(), random);
+    const size_t num_freed = obstacles.size() / 3;
+    for (size_t i = 0; i < num_freed; ++i) {
+      layer.setFree(obstacles.back());
+      obstacles.pop_back();
+    }
+    for (int i = 0; i < 20; ++i) {
+      const octomap::OcTreeKey key =
+          makeKey(offset(random), offset(random), offset(random));
+      if (!layer.isOccupied(key)) {
+        layer.setOccupied(key);
+        obstacles.push_back(key);
+      }
+    }
+    layer.update();
+    ASSERT_EQ(obstacles.size(), layer.getNumObstacles());
+
+    for (int x = -half_size - 5; x <= half_size + 5; ++x) {
+      for (int y = -half_size - 5; y <= half_size + 5; ++y) {
+        for (int z = -half_size - 5; z <= half_size + 5; ++z) {
+          const octomap::OcTreeKey key = makeKey(x, y, z);
+          const double expected = getBruteForceDistance(key, obstacles);
+          const double distance = layer.getDistance(key);
+          EXPECT_GE(distance, expected - 1e-9);
+          EXPECT_LE(distance, expected + kResolution);
+          octomap::OcTreeKey obstacle_key;
+          if (layer.getClosestObstacle(key, &obstacle_key)) {
+            EXPECT_TRUE(layer.isOccupied(obstacle_key));
+            EXPECT_NEAR(std::sqrt(squaredDistance(key, obstacle_key)) *
+                            kResolution,
+                        distance, 1e-9);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Distances outside of a box only depend on its surface.
+TEST(EsdfLayerTest, BoxSurfaceMatchesFilledBox) {
+  const octomap::OcTreeKey min_key = makeKey(-3, -2, -4);
+  const octomap::OcTreeKey max_key = makeKey(4, 2, 1);
+  EsdfLayer surface_layer(kResolution, kMaxDistance);
+  EsdfLayer filled_layer(kResolution, kMaxDistance);
+  surface_layer.setOccupiedBoxSurface(min_key, max_key);
+  for (int x = min_key[0]; x <= max_key[0]; ++x) {
+    for (int y = min_key[1]; y <= max_key[1]; ++y) {
+      for (int z = min_key[2]; z <= max_key[2]; ++z) {
+        filled_layer.setOccupied(octomap::OcTreeKey(x, y, z));
+      }
+    }
+  }
+  surface_layer.update();
+  filled_layer.update();
+  EXPECT_LT(surface_layer.getNumObstacles(), filled_layer.getNumObstacles());
+
+  for (int x = min_key[0] - 12; x <= max_key[0] + 12; ++x) {
+    for (int y = min_key[1] - 12; y <= max_key[1] + 12; ++y) {
+      for (int z = min_key[2] - 12; z <= max_key[2] + 12; ++z) {
+        if (x >= min_key[0] && x <= max_key[0] && y >= min_key[1] &&
+            y <= max_key[1] && z >= min_key[2] && z <= max_key[2]) {
+          continue;
+        }
+        const octomap::OcTreeKey key(x, y, z);
+        EXPECT_NEAR(filled_layer.getDistance(key),
+                    surface_layer.getDistance(key), 1e-9);
+      }
+    }
+  }
+
+  surface_layer.setBoxFree(min_key, max_key);
+  filled_layer.setBoxFree(min_key, max_key);
+  surface_layer.update();
+  filled_layer.update();
+  EXPECT_EQ(0u, surface_layer.getNumObstacles());
+  EXPECT_EQ(0u, filled_layer.getNumObstacles());
+  EXPECT_EQ(0u, filled_layer.getNumVoxels());
+  EXPECT_EQ(kMaxDistance, surface_layer.getDistance(min_key));
+}
+
+}  // namespace volumetric_mapping
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,155 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstdint>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <octomap/octomap.h>
+
+#include "octomap_world/key_batch.h"
+
+namespace volumetric_mapping {
+
+namespace {
+
+const int kTreeDepth = 16;
+
+// Random keys in a box of the given size, so that there are duplicates.
+octomap::OcTreeKey makeRandomKey(int box_size, std::mt19937* random) {
+  std::uniform_int_distribution<int> offset(0, box_size - 1);
+  return octomap::OcTreeKey(32768 + offset(*random), 32000 + offset(*random),
+                            33000 + offset(*random));
+}
+
+// Adds random free and occupied keys to the batch, and the codes it should
+// end up with to the sets.
+void addRandomKeys(size_t num_keys, int box_size, unsigned int seed,
+                   KeyBatch* batch, std::set<uint64_t>* free_codes,
+                   std::set<uint64_t>* occupied_codes) {
+  std::mt19937 random(seed);
+  for (size_t i = 0; i < num_keys; ++i) {
+    const octomap::OcTreeKey key = makeRandomKey(box_size, &random);
+    if (i % 4 == 0) {
+      batch->addOccupiedKey(key);
+      occupied_codes->insert(KeyBatch::mortonEncode(key));
+    } else {
+      batch->addFreeKey(key);
+      free_codes->insert(KeyBatch::mortonEncode(key));
+    }
+  }
+}
+
+void expectFinalized(const KeyBatch& batch,
+                     const std::set<uint64_t>& free_codes,
+                     const std::set<uint64_t>& occupied_codes) {
+  std::vector<uint64_t> expected_free_codes;
+  for (uint64_t code : free_codes) {
+    if (occupied_codes.count(code) == 0) {
+      expected_free_codes.push_back(code);
+    }
+  }
+  EXPECT_EQ(expected_free_codes, batch.getFreeCodes());
+  EXPECT_EQ(std::vector<uint64_t>(occupied_codes.begin(),
+                                  occupied_codes.end()),
+            batch.getOccupiedCodes());
+}
+
+}  // namespace
+
+TEST(KeyBatchTest, MortonCodesRoundTrip) {
+  EXPECT_EQ(0u, KeyBatch::mortonEncode(octomap::OcTreeKey(0, 0, 0)));
+  EXPECT_EQ(1u, KeyBatch::mortonEncode(octomap::OcTreeKey(1, 0, 0)));
+  EXPECT_EQ(2u, KeyBatch::mortonEncode(octomap::OcTreeKey(0, 1, 0)));
+  EXPECT_EQ(4u, KeyBatch::mortonEncode(octomap::OcTreeKey(0, 0, 1)));
+  EXPECT_EQ(8u, KeyBatch::mortonEncode(octomap::OcTreeKey(2, 0, 0)));
+  EXPECT_EQ((1ull << 48) - 1,
+            KeyBatch::mortonEncode(octomap::OcTreeKey(0xffff, 0xffff, 0xffff)));
+
+  std::mt19937 random(0);
+  std::uniform_int_distribution<int> key_value(0, 0xffff);
+  for (int i = 0; i < 10000; ++i) {
+    const octomap::OcTreeKey key(key_value(random), key_value(random),
+                                 key_value(random));
+    const uint64_t code = KeyBatch::mortonEncode(key);
+    EXPECT_TRUE(key == KeyBatch::mortonDecode(code)) << "code " << code;
+    // Every three bits are the child index on the way down the tree, so
+    // sorting by code visits the keys depth first.
+    for (int level = 0; level < kTreeDepth; ++level) {
+      EXPECT_EQ(octomap::computeChildIdx(key, level),
+                (code >> (3 * level)) & 7)
+          << "code " << code << " level " << level;
+    }
+  }
+}
+
+// Small batches are sorted by comparison, big ones by radix sort, over keys
+// that share their upper bits or not.
+TEST(KeyBatchTest, FinalizeSortsAndDeduplicates) {
+  for (size_t num_keys : {10, 200, 5000, 100000}) {
+    for (int box_size : {4, 64, 30000}) {
+      KeyBatch batch;
+      std::set<uint64_t> free_codes, occupied_codes;
+      addRandomKeys(num_keys, box_size, num_keys + box_size, &batch,
+                    &free_codes, &occupied_codes);
+      EXPECT_EQ(num_keys, batch.numFreeKeys() + batch.numOccupiedKeys());
+      batch.finalize();
+      expectFinalized(batch, free_codes, occupied_codes);
+    }
+  }
+}
+
+TEST(KeyBatchTest, AppendedBatchesAreFinalizedTogether) {
+  KeyBatch batch, other_batch;
+  std::set<uint64_t> free_codes, occupied_codes;
+  addRandomKeys(3000, 16, 0, &batch, &free_codes, &occupied_codes);
+  batch.finalize();
+  addRandomKeys(3000, 16, 1, &other_batch, &free_codes, &occupied_codes);
+  batch.append(other_batch);
+  batch.finalize();
+  expectFinalized(batch, free_codes, occupied_codes);
+
+  for (size_t i = 0; i < batch.numFreeKeys(); ++i) {
+    EXPECT_EQ(batch.getFreeCodes()[i],
+              KeyBatch::mortonEncode(batch.getFreeKey(i)));
+  }
+  batch.clear();
+  EXPECT_TRUE(batch.empty());
+}
+
+}  // namespace volumetric_mapping
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,131 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "octomap_world/pooled_octree.h"
+
+namespace volumetric_mapping {
+
+namespace {
+
+const size_t kObjectSize = 64;
+// Enough for a few slabs.
+const size_t kNumObjects = 5000;
+
+}  // namespace
+
+TEST(NodePoolTest, ReusesFreedObjects) {
+  NodePool pool(kObjectSize);
+  void* object = pool.allocate();
+  pool.deallocate(object);
+  EXPECT_EQ(object, pool.allocate());
+  NodePoolStats stats = pool.getStats();
+  EXPECT_EQ(1u, stats.num_slabs);
+  EXPECT_EQ(1u, stats.num_used);
+  EXPECT_EQ(0u, stats.num_free);
+  pool.deallocate(object);
+}
+
+// Trimming returns the slabs of the freed objects and keeps the ones in use
+// intact.
+TEST(NodePoolTest, TrimFreesEmptySlabs) {
+  NodePool pool(kObjectSize);
+  std::vector<void*> objects;
+  std::set<void*> distinct_objects;
+  for (size_t i = 0; i < kNumObjects; ++i) {
+    objects.push_back(pool.allocate());
+    distinct_objects.insert(objects.back());
+  }
+  EXPECT_EQ(kNumObjects, distinct_objects.size());
+  NodePoolStats stats = pool.getStats();
+  const size_t num_slabs = stats.num_slabs;
+  EXPECT_GT(num_slabs, 2u);
+  EXPECT_EQ(kNumObjects, stats.num_used);
+
+  void* kept_object = objects.front();
+  char pattern[kObjectSize];
+  for (size_t i = 0; i < kObjectSize; ++i) {
+    pattern[i] = static_cast<char>(i);
+  }
+  memcpy(kept_object, pattern, kObjectSize);
+  for (size_t i = 1; i < kNumObjects; ++i) {
+    pool.deallocate(objects[i]);
+  }
+  stats = pool.getStats();
+  EXPECT_EQ(num_slabs, stats.num_slabs);
+  EXPECT_EQ(1u, stats.num_used);
+  EXPECT_EQ(kNumObjects - 1, stats.num_free);
+  EXPECT_EQ(kNumObjects, stats.max_num_used);
+
+  pool.trim();
+  stats = pool.getStats();
+  EXPECT_EQ(1u, stats.num_slabs);
+  EXPECT_EQ(1u, stats.num_used);
+  // Only the free objects of the kept slab are left.
+  EXPECT_LT(stats.num_free, kNumObjects - 1);
+  EXPECT_EQ(0, memcmp(kept_object, pattern, kObjectSize));
+
+  // The pool still works after trimming, without handing out the kept
+  // object.
+  std::vector<void*> new_objects;
+  for (size_t i = 0; i < kNumObjects; ++i) {
+    new_objects.push_back(pool.allocate());
+    EXPECT_NE(kept_object, new_objects.back());
+    memset(new_objects.back(), 0, kObjectSize);
+  }
+  EXPECT_EQ(0, memcmp(kept_object, pattern, kObjectSize));
+  for (void* object : new_objects) {
+    pool.deallocate(object);
+  }
+  pool.deallocate(kept_object);
+
+  pool.trim();
+  stats = pool.getStats();
+  EXPECT_EQ(0u, stats.num_slabs);
+  EXPECT_EQ(0u, stats.allocated_bytes);
+  EXPECT_EQ(0u, stats.num_used);
+  EXPECT_EQ(0u, stats.num_free);
+  void* object = pool.allocate();
+  EXPECT_NE(static_cast<void*>(NULL), object);
+  pool.deallocate(object);
+}
+
+}  // namespace volumetric_mapping
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
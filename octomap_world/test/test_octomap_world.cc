@@ -0,0 +1,159 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <random>
+#include <vector>
+
+#include <Eigen/Core>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "octomap_world/octomap_world.h"
+
+namespace volumetric_mapping {
+
+namespace {
+
+// Random free space with random occupied boxes in it, from single voxels to
+// boxes that make coarse nodes. Applied to both worlds alike.
+void makeRandomMap(unsigned int seed, std::vector<OctomapWorld*> worlds) {
+  std::mt19937 random(seed);
+  std::uniform_real_distribution<double> position(-3.0, 3.0);
+  std::uniform_real_distribution<double> size(0.05, 1.5);
+  for (OctomapWorld* world : worlds) {
+    world->setFree(Eigen::Vector3d::Zero(), Eigen::Vector3d::Constant(6.0));
+  }
+  for (int i = 0; i < 40; ++i) {
+    const Eigen::Vector3d center(position(random), position(random),
+                                 position(random));
+    const Eigen::Vector3d box_size(size(random), size(random), size(random));
+    for (OctomapWorld* world : worlds) {
+      world->setOccupied(center, box_size);
+    }
+  }
+}
+
+OctomapParameters getParameters(bool use_esdf) {
+  OctomapParameters params;
+  params.resolution = 0.1;
+  params.treat_unknown_as_occupied = false;
+  params.use_esdf = use_esdf;
+  params.esdf_max_distance = 2.0;
+  return params;
+}
+
+}  // namespace
+
+// With unknown space as free, robot boxes far from obstacles in the distance
+// field are reported free without a tree query. That shortcut has to agree
+// with the tree query everywhere.
+TEST(OctomapWorldTest, EsdfCollisionShortcutMatchesTreeQuery) {
+  for (unsigned int seed = 0; seed < 5; ++seed) {
+    OctomapWorld world_with_esdf(getParameters(true));
+    OctomapWorld world(getParameters(false));
+    makeRandomMap(seed, {&world_with_esdf, &world});
+
+    std::mt19937 random(seed + 100);
+    std::uniform_real_distribution<double> position(-4.0, 4.0);
+    std::uniform_real_distribution<double> size(0.05, 2.0);
+    for (int i = 0; i < 2000; ++i) {
+      const Eigen::Vector3d robot_size(size(random), size(random),
+                                       size(random));
+      const Eigen::Vector3d robot_position(position(random), position(random),
+                                           position(random));
+      world_with_esdf.setRobotSize(robot_size);
+      world.setRobotSize(robot_size);
+      ASSERT_EQ(world.getCellStatusBoundingBox(robot_position, robot_size) ==
+                    OctomapWorld::CellStatus::kOccupied,
+                world_with_esdf.checkCollisionWithRobot(robot_position))
+          << "seed " << seed << " position " << robot_position.transpose()
+          << " size " << robot_size.transpose();
+    }
+  }
+}
+
+// The batch check reuses the boxes of overlapping poses and spreads the paths
+// over threads, and has to find the same first collision as checking every
+// pose on its own.
+TEST(OctomapWorldTest, PathsCollisionCheckMatchesPoseChecks) {
+  for (int num_threads : {1, 4}) {
+    for (bool use_esdf : {false, true}) {
+      OctomapParameters params = getParameters(use_esdf);
+      params.num_collision_check_threads = num_threads;
+      OctomapWorld world(params);
+      makeRandomMap(num_threads, {&world});
+      world.setRobotSize(Eigen::Vector3d(0.6, 0.4, 0.3));
+
+      std::mt19937 random(num_threads + 200);
+      std::uniform_real_distribution<double> position(-4.0, 4.0);
+      std::normal_distribution<double> direction(0.0, 1.0);
+      std::vector<std::vector<Eigen::Vector3d> > paths(200);
+      for (std::vector<Eigen::Vector3d>& path : paths) {
+        const Eigen::Vector3d start(position(random), position(random),
+                                    position(random));
+        const Eigen::Vector3d step =
+            0.03 * Eigen::Vector3d(direction(random), direction(random),
+                                   direction(random))
+                       .normalized();
+        for (int i = 0; i < 60; ++i) {
+          path.push_back(start + i * step);
+        }
+      }
+
+      std::vector<size_t> collision_indices;
+      world.checkPathsForCollisionsWithRobot(paths, &collision_indices);
+      ASSERT_EQ(paths.size(), collision_indices.size());
+      size_t num_collisions = 0;
+      for (size_t i = 0; i < paths.size(); ++i) {
+        size_t collision_index = paths[i].size();
+        for (size_t j = 0; j < paths[i].size(); ++j) {
+          if (world.checkCollisionWithRobot(paths[i][j])) {
+            collision_index = j;
+            ++num_collisions;
+            break;
+          }
+        }
+        EXPECT_EQ(collision_index, collision_indices[i])
+            << "path " << i << " threads " << num_threads << " esdf "
+            << use_esdf;
+      }
+      // Both outcomes have to be covered.
+      EXPECT_GT(num_collisions, 0u);
+      EXPECT_LT(num_collisions, paths.size());
+    }
+  }
+}
+
+}  // namespace volumetric_mapping
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,164 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <thread>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "octomap_world/transform_buffer.h"
+
+namespace volumetric_mapping {
+
+namespace {
+
+typedef TransformBuffer::Transformation Transformation;
+
+Transformation makeTransform(const Eigen::Vector3d& position) {
+  return Transformation(Eigen::Quaterniond::Identity(), position);
+}
+
+}  // namespace
+
+// Once full, every push replaces the oldest transform, and one slot is kept
+// free for the next push.
+TEST(TransformBufferTest, WrapsAround) {
+  TransformBuffer buffer(4);
+  for (int64_t i = 1; i <= 10; ++i) {
+    EXPECT_TRUE(buffer.push(100 * i, makeTransform(Eigen::Vector3d(i, 0, 0))));
+  }
+  int64_t oldest_ns = 0, newest_ns = 0;
+  ASSERT_TRUE(buffer.getTimeRange(&oldest_ns, &newest_ns));
+  EXPECT_EQ(800, oldest_ns);
+  EXPECT_EQ(1000, newest_ns);
+
+  Transformation transform;
+  ASSERT_TRUE(buffer.lookup(850, 0, &transform));
+  EXPECT_NEAR(8.5, transform.getPosition().x(), 1e-9);
+  ASSERT_TRUE(buffer.lookup(1000, 0, &transform));
+  EXPECT_NEAR(10.0, transform.getPosition().x(), 1e-9);
+
+  // Overwritten and future transforms only match within tolerance.
+  EXPECT_FALSE(buffer.lookup(700, 0, &transform));
+  ASSERT_TRUE(buffer.lookup(700, 100, &transform));
+  EXPECT_NEAR(8.0, transform.getPosition().x(), 1e-9);
+  EXPECT_FALSE(buffer.lookup(1050, 0, &transform));
+  ASSERT_TRUE(buffer.lookup(1050, 50, &transform));
+  EXPECT_NEAR(10.0, transform.getPosition().x(), 1e-9);
+}
+
+TEST(TransformBufferTest, RejectsOldTransforms) {
+  TransformBuffer buffer(4);
+  Transformation transform;
+  EXPECT_FALSE(buffer.lookup(0, 1000, &transform));
+  EXPECT_TRUE(buffer.push(100, makeTransform(Eigen::Vector3d(1, 0, 0))));
+  EXPECT_FALSE(buffer.push(100, makeTransform(Eigen::Vector3d(2, 0, 0))));
+  EXPECT_FALSE(buffer.push(50, makeTransform(Eigen::Vector3d(3, 0, 0))));
+  ASSERT_TRUE(buffer.lookup(100, 0, &transform));
+  EXPECT_NEAR(1.0, transform.getPosition().x(), 1e-9);
+}
+
+TEST(TransformBufferTest, InterpolatesRotationBySlerp) {
+  TransformBuffer buffer(8);
+  const Eigen::Vector3d position(1.0, 2.0, 3.0);
+  buffer.push(0, makeTransform(Eigen::Vector3d::Zero()));
+  buffer.push(100, Transformation(Eigen::Quaterniond(Eigen::AngleAxisd(
+                                      M_PI / 2.0, Eigen::Vector3d::UnitZ())),
+                                  position));
+
+  for (int64_t timestamp_ns : {25, 50, 75}) {
+    const double t = timestamp_ns / 100.0;
+    Transformation transform;
+    ASSERT_TRUE(buffer.lookup(timestamp_ns, 0, &transform));
+    const Eigen::Quaterniond expected(
+        Eigen::AngleAxisd(t * M_PI / 2.0, Eigen::Vector3d::UnitZ()));
+    EXPECT_NEAR(0.0,
+                transform.getRotation().toImplementation().angularDistance(
+                    expected),
+                1e-9)
+        << "t " << t;
+    EXPECT_NEAR(0.0, (transform.getPosition() - t * position).norm(), 1e-9)
+        << "t " << t;
+  }
+}
+
+// The producer laps a reader on a small buffer much faster than it can search
+// it. A lookup may fail then, but never returns a mix of two transforms.
+TEST(TransformBufferTest, ProducerLapsReader) {
+  TransformBuffer buffer(8);
+  const int64_t num_transforms = 1000000;
+  // Position (t, 2 t, 0) at time t.
+  buffer.push(0, makeTransform(Eigen::Vector3d::Zero()));
+  std::atomic<bool> done(false);
+  std::thread producer([&buffer, &done, num_transforms]() {
+    for (int64_t t = 1; t < num_transforms; ++t) {
+      buffer.push(t, makeTransform(Eigen::Vector3d(t, 2 * t, 0)));
+    }
+    done = true;
+  });
+
+  std::mt19937 random(0);
+  size_t num_found = 0;
+  while (!done) {
+    int64_t oldest_ns = 0, newest_ns = 0;
+    if (!buffer.getTimeRange(&oldest_ns, &newest_ns)) {
+      continue;
+    }
+    EXPECT_LE(oldest_ns, newest_ns);
+    const int64_t timestamp_ns = std::uniform_int_distribution<int64_t>(
+        oldest_ns, newest_ns)(random);
+    Transformation transform;
+    if (buffer.lookup(timestamp_ns, 0, &transform)) {
+      ++num_found;
+      const Eigen::Vector3d& position = transform.getPosition();
+      EXPECT_NEAR(static_cast<double>(timestamp_ns), position.x(), 1e-6);
+      EXPECT_NEAR(2.0 * timestamp_ns, position.y(), 1e-6);
+    }
+  }
+  producer.join();
+  LOG(INFO) << num_found << " lookups succeeded while the producer ran.";
+
+  Transformation transform;
+  ASSERT_TRUE(buffer.lookup(num_transforms - 2, 0, &transform));
+  EXPECT_NEAR(num_transforms - 2.0, transform.getPosition().x(), 1e-6);
+}
+
+}  // namespace volumetric_mapping
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -32,6 +32,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <vector>
 
+#include <opencv2/core/core.hpp>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
 namespace volumetric_mapping {
 
 // A base class for weighing functions: each weighing function should take in
@@ -54,6 +58,34 @@ class PointWeighing {
                                            double d) const {
     return 1.0;
   }
+
+  // Batch versions, called once per cloud or disparity image by the world.
+  // The default implementations call the per-point functions above; weighing
+  // functions that care about insertion rate should override these with a
+  // loop that can be inlined (or cv::Mat arithmetic) instead.
+  // weights has the same size as the cloud, with weights for invalid (NaN)
+  // points being ignored.
+  virtual void computeWeightsForPoints(
+      const pcl::PointCloud<pcl::PointXYZ>& cloud,
+      std::vector<double>* weights) const {
+    weights->resize(cloud.size());
+    for (size_t i = 0; i < cloud.size(); ++i) {
+      (*weights)[i] =
+          computeWeightForPoint(cloud[i].x, cloud[i].y, cloud[i].z);
+    }
+  }
+  // disparity is CV_32F; weights is filled as CV_32F of the same size.
+  virtual void computeWeightsForDisparities(const cv::Mat& disparity,
+                                            cv::Mat* weights) const {
+    weights->create(disparity.rows, disparity.cols, CV_32F);
+    for (int v = 0; v < disparity.rows; ++v) {
+      const float* disparity_row = disparity.ptr<float>(v);
+      float* weight_row = weights->ptr<float>(v);
+      for (int u = 0; u < disparity.cols; ++u) {
+        weight_row[u] = computeWeightForDisparity(u, v, disparity_row[u]);
+      }
+    }
+  }
 };
 
 }  // namespace volumetric_mapping
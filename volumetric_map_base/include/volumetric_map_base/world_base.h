@@ -30,6 +30,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef VOLUMETRIC_MAP_BASE_WORLD_BASE_H_
 #define VOLUMETRIC_MAP_BASE_WORLD_BASE_H_
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
 #include <kindr/minimal/quat-transformation.h>
 #include <opencv2/opencv.hpp>
 #include <pcl/point_types.h>
@@ -84,7 +89,8 @@ class WorldBase {
       const sensor_msgs::CameraInfo& right_camera) const;
 
   // Calls insertPointcloudImpl() or insertPointcloudIntoMapWithWeightsImpl(),
-  // depending if points are to be weighted.
+  // depending if points are to be weighted. Unweighted PointCloud2 messages go
+  // to insertPointcloud2IntoMapImpl() instead, without conversion to PCL.
   void insertPointcloud(
       const Transformation& T_G_sensor,
       const sensor_msgs::PointCloud2::ConstPtr& pointcloud_sensor);
@@ -153,6 +159,24 @@ class WorldBase {
       size_t* collision_index) {
     return false;
   }
+  // Checks many paths (each assumed to be time-ordered) for collision, e.g.
+  // the candidates of a sampling-based planner. Sets the collision index of
+  // every path to its earliest collision, or to the size of the path if it is
+  // collision-free. Returns true if any of the paths collides.
+  virtual bool checkPathsForCollisionsWithRobot(
+      const std::vector<std::vector<Eigen::Vector3d> >& paths,
+      std::vector<size_t>* collision_indices) {
+    CHECK_NOTNULL(collision_indices);
+    collision_indices->resize(paths.size());
+    bool any_collision = false;
+    for (size_t i = 0; i < paths.size(); ++i) {
+      (*collision_indices)[i] = paths[i].size();
+      if (checkPathForCollisionsWithRobot(paths[i], &(*collision_indices)[i])) {
+        any_collision = true;
+      }
+    }
+    return any_collision;
+  }
 
   virtual Eigen::Vector3d getMapCenter() const {
     return Eigen::Vector3d::Zero();
@@ -217,6 +241,59 @@ class WorldBase {
       const std::vector<double>& weights) {
     LOG(ERROR) << "Calling unimplemented disparity insertion!";
   }
+  // Inheriting classes can override this to read the points straight from the
+  // message (see forEachPointInWorldFrame()). By default converts to PCL and
+  // calls insertPointcloudIntoMapImpl().
+  virtual void insertPointcloud2IntoMapImpl(
+      const Transformation& T_G_sensor,
+      const sensor_msgs::PointCloud2& pointcloud_sensor);
+
+  // Calls point_function(x, y, z) with every finite point of the cloud in the
+  // world frame, reading the coordinates straight from the data buffer
+  // through the field offsets. Returns false, without calling point_function,
+  // if the cloud has no float32 x, y and z fields in host byte order.
+  template <typename PointFunction>
+  static bool forEachPointInWorldFrame(
+      const Transformation& T_G_sensor,
+      const sensor_msgs::PointCloud2& pointcloud_sensor,
+      const PointFunction& point_function);
+  // Byte offsets of the x, y and z fields, if they can be read directly.
+  static bool getXYZFieldOffsets(const sensor_msgs::PointCloud2& pointcloud,
+                                 size_t offsets[3]);
+
+  // Inheriting classes can override this to reproject the disparities
+  // themselves (see forEachDisparityPointInWorldFrame()). Q is already
+  // adjusted to the size of the disparity image. By default projects the image
+  // to CV_32FC3 and calls insertProjectedDisparityIntoMapImpl().
+  virtual void insertDisparityIntoMapImpl(const Transformation& sensor_to_world,
+                                          const cv::Mat& disparity,
+                                          const Eigen::Matrix4d& Q);
+
+  // Calls point_function(u, v, x, y, z) for every pixel with a valid
+  // disparity in front of the camera, with the point in the world frame. Only
+  // every stride-th row and column is used. Q and sensor_to_world are
+  // combined once per frame, and each row is reprojected incrementally, so
+  // invalid pixels cost no more than a comparison. Returns false, without
+  // calling point_function, if the disparity image is not CV_32FC1.
+  template <typename PointFunction>
+  static bool forEachDisparityPointInWorldFrame(
+      const Transformation& sensor_to_world, const cv::Mat& disparity,
+      const Eigen::Matrix4d& Q, int stride,
+      const PointFunction& point_function);
+
+  // Adjusts Q_full for a downsampled disparity image.
+  Eigen::Matrix4d getDisparityQ(const Eigen::Matrix4d& Q_full,
+                                const Eigen::Vector2d& full_image_size,
+                                int disparity_cols) const;
+
+  // Projects the disparity image to 3D points in the sensor frame (CV_32FC3),
+  // adjusting Q_full for downsampled disparity images. Used by
+  // insertDisparityImage(); exposed for pipelines that want to project
+  // separately from inserting.
+  void projectDisparityImage(const cv::Mat& disparity,
+                             const Eigen::Matrix4d& Q_full,
+                             const Eigen::Vector2d& full_image_size,
+                             cv::Mat* projected_points) const;
 
   // Generate Q matrix from parameters.
   Eigen::Matrix4d generateQ(double Tx, double left_cx, double left_cy,
@@ -234,5 +311,92 @@ class WorldBase {
   std::shared_ptr<PointWeighing> point_weighing_;
 };
 
+template <typename PointFunction>
+bool WorldBase::forEachDisparityPointInWorldFrame(
+    const Transformation& sensor_to_world, const cv::Mat& disparity,
+    const Eigen::Matrix4d& Q, int stride,
+    const PointFunction& point_function) {
+  if (disparity.type() != CV_32FC1) {
+    return false;
+  }
+  stride = std::max(stride, 1);
+
+  // Like cv::reprojectImageTo3D() with handleMissingValues, the smallest
+  // disparity in the image marks missing values.
+  double min_disparity = 0.0;
+  cv::minMaxIdx(disparity, &min_disparity);
+  const float missing_disparity = static_cast<float>(min_disparity);
+
+  // Homogeneous world point for pixel (u, v) and disparity d:
+  // M * [u v d 1]^T, with the depth and scale rows of Q kept separately for
+  // the checks in the sensor frame.
+  const Eigen::Matrix4d M = sensor_to_world.getTransformationMatrix() * Q;
+  const Eigen::Vector4d M_u = M.col(0) * stride;
+  const Eigen::Vector4d M_d = M.col(2);
+  const Eigen::Vector2d Q_u(Q(2, 0) * stride, Q(3, 0) * stride);
+  const Eigen::Vector2d Q_d(Q(2, 2), Q(3, 2));
+
+  for (int v = 0; v < disparity.rows; v += stride) {
+    const float* row_pointer = disparity.ptr<float>(v);
+    const Eigen::Vector4d M_row = M.col(1) * v + M.col(3);
+    const Eigen::Vector2d Q_row(Q(2, 1) * v + Q(2, 3), Q(3, 1) * v + Q(3, 3));
+    // The u terms are accumulated while walking the row.
+    Eigen::Vector4d M_row_u = M_row;
+    Eigen::Vector2d Q_row_u = Q_row;
+    for (int u = 0; u < disparity.cols;
+         u += stride, M_row_u += M_u, Q_row_u += Q_u) {
+      const float d = row_pointer[u];
+      if (!std::isfinite(d) ||
+          std::fabs(d - missing_disparity) <= FLT_EPSILON) {
+        continue;
+      }
+      // Zero scale (zero disparity) maps to infinity, negative depth is
+      // behind the camera.
+      const Eigen::Vector2d depth_scale = Q_row_u + Q_d * d;
+      if (depth_scale[1] == 0.0 || depth_scale[0] / depth_scale[1] < 0.0) {
+        continue;
+      }
+      const Eigen::Vector4d point_G = M_row_u + M_d * d;
+      const double inverse_scale = 1.0 / point_G[3];
+      point_function(u, v, point_G[0] * inverse_scale,
+                     point_G[1] * inverse_scale, point_G[2] * inverse_scale);
+    }
+  }
+  return true;
+}
+
+template <typename PointFunction>
+bool WorldBase::forEachPointInWorldFrame(
+    const Transformation& T_G_sensor,
+    const sensor_msgs::PointCloud2& pointcloud_sensor,
+    const PointFunction& point_function) {
+  size_t offsets[3];
+  if (!getXYZFieldOffsets(pointcloud_sensor, offsets)) {
+    return false;
+  }
+  const Eigen::Matrix3d R_G_sensor = T_G_sensor.getRotationMatrix();
+  const Eigen::Vector3d t_G_sensor = T_G_sensor.getPosition();
+
+  const uint8_t* data = pointcloud_sensor.data.data();
+  for (uint32_t row = 0; row < pointcloud_sensor.height; ++row) {
+    const uint8_t* point_data = data + row * pointcloud_sensor.row_step;
+    for (uint32_t col = 0; col < pointcloud_sensor.width;
+         ++col, point_data += pointcloud_sensor.point_step) {
+      // The buffer gives no alignment guarantees.
+      float x, y, z;
+      memcpy(&x, point_data + offsets[0], sizeof(float));
+      memcpy(&y, point_data + offsets[1], sizeof(float));
+      memcpy(&z, point_data + offsets[2], sizeof(float));
+      if (!std::isfinite(x) || !std::isfinite(y) || !std::isfinite(z)) {
+        continue;
+      }
+      const Eigen::Vector3d point_G =
+          R_G_sensor * Eigen::Vector3d(x, y, z) + t_G_sensor;
+      point_function(point_G.x(), point_G.y(), point_G.z());
+    }
+  }
+  return true;
+}
+
 }  // namespace volumetric_mapping
 #endif  // VOLUMETRIC_MAP_BASE_WORLD_BASE_H_
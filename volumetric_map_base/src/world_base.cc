@@ -52,8 +52,52 @@ void WorldBase::insertDisparityImage(const Transformation& sensor_to_world,
                                      const cv::Mat& disparity,
                                      const Eigen::Matrix4d& Q_full,
                                      const Eigen::Vector2d& full_image_size) {
+  // Call the implementation function of the inheriting class.
+  if (!isPointWeighingSet()) {
+    insertDisparityIntoMapImpl(
+        sensor_to_world, disparity,
+        getDisparityQ(Q_full, full_image_size, disparity.cols));
+  } else {
+    cv::Mat reprojected_disparities;
+    projectDisparityImage(disparity, Q_full, full_image_size,
+                          &reprojected_disparities);
+    cv::Mat weights;
+    computeWeights(disparity, &weights);
+    insertProjectedDisparityIntoMapWithWeightsImpl(
+        sensor_to_world, reprojected_disparities, weights);
+  }
+}
+
+void WorldBase::insertDisparityIntoMapImpl(
+    const Transformation& sensor_to_world, const cv::Mat& disparity,
+    const Eigen::Matrix4d& Q) {
+  cv::Mat reprojected_disparities(disparity.size(), CV_32FC3);
+  cv::Mat Q_cv;
+  cv::eigen2cv(Q, Q_cv);
+  cv::reprojectImageTo3D(disparity, reprojected_disparities, Q_cv, true);
+  insertProjectedDisparityIntoMapImpl(sensor_to_world, reprojected_disparities);
+}
+
+void WorldBase::projectDisparityImage(const cv::Mat& disparity,
+                                      const Eigen::Matrix4d& Q_full,
+                                      const Eigen::Vector2d& full_image_size,
+                                      cv::Mat* projected_points) const {
+  CHECK_NOTNULL(projected_points);
+  const Eigen::Matrix4d Q =
+      getDisparityQ(Q_full, full_image_size, disparity.cols);
+
+  projected_points->create(disparity.size(), CV_32FC3);
+  cv::Mat Q_cv;
+  cv::eigen2cv(Q, Q_cv);
+
+  cv::reprojectImageTo3D(disparity, *projected_points, Q_cv, true);
+}
+
+Eigen::Matrix4d WorldBase::getDisparityQ(const Eigen::Matrix4d& Q_full,
+                                         const Eigen::Vector2d& full_image_size,
+                                         int disparity_cols) const {
   // Figure out the downsampling of the image.
-  double downsampling_factor = full_image_size.x() / disparity.cols;
+  double downsampling_factor = full_image_size.x() / disparity_cols;
   Eigen::Matrix4d Q = Q_full;
   if (fabs(downsampling_factor - 1.0) > 1e-6) {
     // c{x,y} and f{x,y} are scaled by the downsampling factor then.
@@ -67,23 +111,7 @@ void WorldBase::insertDisparityImage(const Transformation& sensor_to_world,
     Q(3, 2) /= downsampling_factor;
     Q(3, 3) /= downsampling_factor;
   }
-
-  cv::Mat reprojected_disparities(disparity.size(), CV_32FC3);
-  cv::Mat Q_cv;
-  cv::eigen2cv(Q, Q_cv);
-
-  cv::reprojectImageTo3D(disparity, reprojected_disparities, Q_cv, true);
-
-  // Call the implementation function of the inheriting class.
-  if (!isPointWeighingSet()) {
-    insertProjectedDisparityIntoMapImpl(sensor_to_world,
-                                        reprojected_disparities);
-  } else {
-    cv::Mat weights;
-    computeWeights(disparity, &weights);
-    insertProjectedDisparityIntoMapWithWeightsImpl(
-        sensor_to_world, reprojected_disparities, weights);
-  }
+  return Q;
 }
 
 // Helper functions to compute the Q matrix for given UNRECTIFIED camera
@@ -182,6 +210,10 @@ Eigen::Matrix4d WorldBase::generateQ(double Tx, double left_cx, double left_cy,
 void WorldBase::insertPointcloud(
     const Transformation& T_G_sensor,
     const sensor_msgs::PointCloud2::ConstPtr& pointcloud_sensor) {
+  if (!isPointWeighingSet()) {
+    insertPointcloud2IntoMapImpl(T_G_sensor, *pointcloud_sensor);
+    return;
+  }
   pcl::PointCloud<pcl::PointXYZ>::Ptr pointcloud_sensor_pcl(
       new pcl::PointCloud<pcl::PointXYZ>);
   pcl::fromROSMsg(*pointcloud_sensor, *pointcloud_sensor_pcl);
@@ -212,39 +244,61 @@ void WorldBase::insertPointcloud(
   }
 }
 
+void WorldBase::insertPointcloud2IntoMapImpl(
+    const Transformation& T_G_sensor,
+    const sensor_msgs::PointCloud2& pointcloud_sensor) {
+  pcl::PointCloud<pcl::PointXYZ>::Ptr pointcloud_sensor_pcl(
+      new pcl::PointCloud<pcl::PointXYZ>);
+  pcl::fromROSMsg(pointcloud_sensor, *pointcloud_sensor_pcl);
+  insertPointcloudIntoMapImpl(T_G_sensor, pointcloud_sensor_pcl);
+}
+
+bool WorldBase::getXYZFieldOffsets(const sensor_msgs::PointCloud2& pointcloud,
+                                   size_t offsets[3]) {
+  // Byte swapping is left to the PCL conversion.
+  if (pointcloud.is_bigendian) {
+    return false;
+  }
+  const char* names[3] = {"x", "y", "z"};
+  for (size_t i = 0; i < 3; ++i) {
+    bool found = false;
+    for (const sensor_msgs::PointField& field : pointcloud.fields) {
+      if (field.name == names[i]) {
+        if (field.datatype != sensor_msgs::PointField::FLOAT32 ||
+            field.offset + sizeof(float) > pointcloud.point_step) {
+          return false;
+        }
+        offsets[i] = field.offset;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      return false;
+    }
+  }
+  return pointcloud.row_step >=
+             static_cast<size_t>(pointcloud.width) * pointcloud.point_step &&
+         pointcloud.data.size() >=
+             static_cast<size_t>(pointcloud.height) * pointcloud.row_step;
+}
+
 void WorldBase::computeWeights(const cv::Mat& disparity,
                                cv::Mat* weights) const {
-  *weights = cv::Mat::ones(disparity.rows, disparity.cols, CV_32F);
-
   if (!point_weighing_) {
+    *weights = cv::Mat::ones(disparity.rows, disparity.cols, CV_32F);
     return;
   }
-
-  for (int v = 0; v < disparity.rows; ++v) {
-    // Disparity is 32f.
-    const float* row_pointer = disparity.ptr<float>(v);
-    for (int u = 0; u < disparity.cols; ++u) {
-      weights->at<float>(v, u) =
-          point_weighing_->computeWeightForDisparity(u, v, row_pointer[u]);
-    }
-  }
+  point_weighing_->computeWeightsForDisparities(disparity, weights);
 }
 
 void WorldBase::computeWeights(const pcl::PointCloud<pcl::PointXYZ>::Ptr& cloud,
                                std::vector<double>* weights) const {
-  weights->resize(cloud->size(), 1.0);
-
   if (!point_weighing_) {
+    weights->assign(cloud->size(), 1.0);
     return;
   }
-
-  unsigned int index = 0;
-  for (pcl::PointCloud<pcl::PointXYZ>::const_iterator it = cloud->begin();
-       it != cloud->end(); ++it) {
-    (*weights)[index] =
-        point_weighing_->computeWeightForPoint(it->x, it->y, it->z);
-    index++;
-  }
+  point_weighing_->computeWeightsForPoints(*cloud, weights);
 }
 
 }  // namespace volumetric_mapping